@@ -0,0 +1,997 @@
+/*===========================================================================*/
+/* A benchmark of each stage of plotting: compiling expressions, evaluating  */
+/* them node by node, rendering plots into memory and encoding PNGs.         */
+/*                                                                           */
+/* Every measurement is repeated, doubling the count, until it takes at     */
+/* least the minimum time, and is reported per unit of work: ns per compile, */
+/* per evaluation or per pixel, with the matching rate per second.  --json   */
+/* prints the same results as one JSON object for regression tracking.      */
+/* --check instead renders plots that have tripped up the interval bounds   */
+/* with and without culling, and samples expressions whose bounds have been  */
+/* wrong over a box, and compiles each builtin on its own, and fails if a    */
+/* plot comes out differently, a value falls outside its bounds or a         */
+/* builtin is not found.                                                     */
+/*===========================================================================*/
+#define _POSIX_C_SOURCE 200809L
+
+/*===========================================================================*/
+/* Includes                                                                  */
+/*===========================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <png.h>
+#include <zlib.h>
+#include "tinyexpr.h"
+#include "jit.h"
+#include "idat.h"
+#include "plot.h"
+
+/*===========================================================================*/
+/* Constants                                                                 */
+/*===========================================================================*/
+#define MIN_SECONDS 0.1            /* shortest run timed per measurement     */
+#define QUICK_SECONDS 0.01         /* and with --quick                       */
+#define EVAL_POINTS 1024           /* points per batch and JIT evaluation    */
+#define EVAL_MODES 5
+#define WIDE_VARIABLES 256         /* variables given to the "wide" compiles */
+#define CHECK_SIZE 64              /* width and height of --check plots      */
+#define CHECK_STEPS 16             /* samples across each side of a box      */
+#define CALL_BYTES 32              /* longest call in builtinCalls           */
+
+/* evaluation modes */
+#define MODE_TREE    0             /* te_eval on the parse tree              */
+#define MODE_PROGRAM 1             /* te_program_eval_frame, one point       */
+#define MODE_BATCH   2             /* te_eval_batch_frame                    */
+#define MODE_JIT     3             /* runJit                                 */
+#define MODE_FLOAT   4             /* te_eval_batch_float                    */
+
+/*===========================================================================*/
+/* Type definitions                                                          */
+/*===========================================================================*/
+/* runs the work being timed reps times */
+typedef void (*BenchFunction)(void *context, long int reps);
+
+/*===========================================================================*/
+/* Structure definitions                                                     */
+/*===========================================================================*/
+struct benchoptions_struct
+   {
+      int         json;            /* print JSON rather than a table   */
+      int         jit;             /* render through native code       */
+      int         single;          /* render f(x,y) in single precision */
+      int         threads;         /* rendering threads, 0 per processor */
+      int         check;           /* compare culled and unculled plots */
+      double      minSeconds;
+      int         sizeCount;       /* resolutions rendered             */
+   };
+typedef struct benchoptions_struct BENCHOPTIONS;
+
+/* one expression of the corpus, or of the per-node set */
+struct benchexpr_struct
+   {
+      const char       *name;
+      const char       *expression;
+   };
+typedef struct benchexpr_struct BENCHEXPR;
+
+/* a plot culling must not change, over x from 0 to 1 */
+struct cullcheck_struct
+   {
+      const char       *expression;
+      double            yMin;
+      double            yMax;
+      double            zMin;      /* f(x,y) colour range, culled     */
+      double            zMax;      /* only when fixed                 */
+   };
+typedef struct cullcheck_struct CULLCHECK;
+
+/* an expression whose bounds over a box must hold each value in it */
+struct boundscheck_struct
+   {
+      const char       *expression;
+      double            xMin;
+      double            xMax;
+      double            yMin;
+      double            yMax;
+   };
+typedef struct boundscheck_struct BOUNDSCHECK;
+
+struct compilebench_struct
+   {
+      const char       *expression;
+      int               program;   /* te_compile_frame, not te_compile */
+      const te_variable *vars;     /* x and y among others             */
+      int               varCount;
+   };
+typedef struct compilebench_struct COMPILEBENCH;
+
+struct evalbench_struct
+   {
+      int               mode;
+      double            x;         /* bound to x in the parse tree     */
+      te_expr          *tree;
+      te_program       *program;
+      JIT              *native;
+      double           *xs;        /* EVAL_POINTS inputs and results   */
+      double           *out;
+      float            *xf;        /* the same as floats               */
+      float            *outf;
+   };
+typedef struct evalbench_struct EVALBENCH;
+
+struct renderbench_struct
+   {
+      const char       *expression;
+      PLOTOPTIONS       options;
+      PLOTSINK          sink;
+      int               status;
+   };
+typedef struct renderbench_struct RENDERBENCH;
+
+struct encodebench_struct
+   {
+      png_byte        **rows;
+      int               width;
+      int               height;
+      int               level;     /* zlib settings, -1 for default    */
+      int               strategy;
+      int               filters;
+      THREADPOOL       *pool;      /* deflate in bands on it, or NULL  */
+      size_t            bytes;     /* size of the last PNG             */
+   };
+typedef struct encodebench_struct ENCODEBENCH;
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+void   parseArguments (int,char **,BENCHOPTIONS *);
+double measure        (BenchFunction,void *,double);
+double now            (void);
+void   report         (BENCHOPTIONS *,const char *,const char *,const char *,
+                       int,double,const char *,long int);
+void   printJsonString(const char *);
+void   benchCompile   (BENCHOPTIONS *);
+void   compileStages  (BENCHOPTIONS *,const char *,const char *,
+                       const te_variable *,const te_variable *);
+void   runCompile     (void *,long int);
+void   benchEval      (BENCHOPTIONS *);
+void   runEval        (void *,long int);
+void   benchRender    (BENCHOPTIONS *,THREADPOOL *);
+void   runRender      (void *,long int);
+void   benchEncode    (BENCHOPTIONS *,THREADPOOL *);
+void   runEncode      (void *,long int);
+int    checkCulling   (BENCHOPTIONS *,THREADPOOL *);
+int    checkBounds    (void);
+int    checkBuiltins  (void);
+double checkSample    (double,double,int);
+void   discardPng     (png_structp,png_bytep,png_size_t);
+void   flushPng       (png_structp);
+
+/*===========================================================================*/
+/* Global variables                                                          */
+/*===========================================================================*/
+/* representative plots: f(x) curves, then f(x,y) surfaces */
+static const BENCHEXPR corpus[] = {
+   {"line",      "x"},
+   {"parabola",  "x^2"},
+   {"sine",      "sin(10*x)/2 + 0.5"},
+   {"decay",     "sqrt(x)*exp(-x)"},
+   {"steps",     "floor(10*x)/10"},
+   {"pole",      "abs(x-0.5)^-2/100"},
+   {"product",   "x*y"},
+   {"waves",     "sin(10*x)*cos(10*y)"},
+   {"cone",      "sqrt((x-0.5)^2 + (y-0.5)^2)"},
+   {"rational",  "x*y + y*y - x/(y+1)"},
+   {"gaussian",  "exp(-10*((x-0.5)^2 + (y-0.5)^2))"},
+   {NULL,        NULL}
+};
+
+/* a call of every builtin, for name lookup; --check compiles each one */
+static const char builtinCalls[] =
+   "abs(x)+acos(x)+asin(x)+atan(x)+atan2(x,y)+ceil(x)+cos(x)+cosh(x)+e+exp(x)"
+   "+fac(x)+floor(x)+ln(x)+log(x)+log10(x)+ncr(x,y)+npr(x,y)+pi+pow(x,y)"
+   "+sin(x)+sinh(x)+sqrt(x)+tan(x)+tanh(x)";
+
+/* one expression for each kind of node, each applied to x */
+static const BENCHEXPR nodes[] = {
+   {"variable",  "x"},
+   {"add",       "x+x"},
+   {"sub",       "x-x"},
+   {"mul",       "x*x"},
+   {"div",       "x/x"},
+   {"mod",       "x%0.3"},
+   {"pow",       "x^x"},
+   {"neg",       "-x"},
+   {"abs",       "abs(x)"},
+   {"sqrt",      "sqrt(x)"},
+   {"floor",     "floor(x)"},
+   {"sin",       "sin(x)"},
+   {"exp",       "exp(x)"},
+   {"ln",        "ln(x)"},
+   {"function1", "atan(x)"},
+   {"function2", "atan2(x,x)"},
+   {NULL,        NULL}
+};
+
+/* large, infinite and negative exponents of negative bases, and surfaces */
+static const CULLCHECK cullChecks[] = {
+   {"(x-1)^1e16",          -0.5, 0.5,  0,    0},
+   {"(x-1)^1e14",          -0.5, 0.5,  0,    0},
+   {"((x-1)^2)^5e15",      -0.5, 0.5,  0,    0},
+   {"(x-1)^(1e16+1)",      -0.5, 0.5,  0,    0},
+   {"(x-1)^-1e16",         -0.5, 0.5,  0,    0},
+   {"(2*x-1.5)^(1/0)",     -0.5, 1.5,  0,    0},
+   {"(2*x-1.5)^(-1/0)",    -0.5, 1.5,  0,    0},
+   {"(x-y)^1e16",           0,   1,    0,    1},
+   {"sin(10*x)*cos(10*y)",  0,   1,   -0.5,  0.5},
+   {NULL,                   0,   0,    0,    0}
+};
+
+static const BOUNDSCHECK boundsChecks[] = {
+   {"exp(-1e15*x)",               0.5,    1,    0,    1},
+   {"1/exp(-1e100*x)",            0.5,    1,    0,    1},
+   {"1e-300^((y^y/(1+e))^3.7)",   0,      1,    0,    5},
+   {"x^0.5",                     -1/0.0, -1/0.0, 0,   1},
+   {"x^0.5",                     -1/0.0,  2,    0,    1},
+   {"x^-0.5",                    -1/0.0, -1,    0,    1},
+   {NULL,                         0,      0,    0,    0}
+};
+
+static const char *const modeNames[EVAL_MODES] = {"tree", "program", "batch",
+                                                  "jit", "float"};
+static const char *const encodeModes[] = {"default", "fast", "bands"};
+static const int sizes[] = {100, 300, 1000};
+
+static volatile double benchSink; /* results are summed here so that the   */
+                                  /* work cannot be optimized away         */
+static int    firstResult = 1;    /* no JSON result printed yet            */
+
+/*===========================================================================*/
+/* main function                                                             */
+/*===========================================================================*/
+int main ( int      argc,
+           char   **argv )
+{
+   BENCHOPTIONS  options;
+   THREADPOOL   *pool;
+   int           failed;
+
+   parseArguments(argc,argv,&options);
+   pool = createThreadPool(options.threads);
+   if ( !pool ){
+     fprintf(stderr, "Fatal error: Failed to start %d threads.\n",
+             options.threads);
+     return 1;
+   }
+
+   if ( options.check ){
+     failed = checkCulling(&options,pool) + checkBounds() + checkBuiltins();
+     destroyThreadPool(pool);
+     return failed ? 1 : 0;
+   }
+
+   if ( options.json )
+      printf("{\"threads\": %d, \"jit\": %d, \"float\": %d, \"results\": [",
+             threadPoolSize(pool), options.jit && jitSupported(),
+             options.single);
+   else
+      printf("%-8s %-10s %-9s %6s %14s %16s\n", "stage", "name", "mode",
+             "size", "ns", "per second");
+
+   benchCompile(&options);
+   benchEval(&options);
+   benchRender(&options,pool);
+   benchEncode(&options,pool);
+
+   if ( options.json )
+      printf("\n]}\n");
+   destroyThreadPool(pool);
+   return 0;
+}
+
+/*===========================================================================*/
+/* Function: parseArguments                                                  */
+/* Read the command line: [--json] [--jit] [--float] [--quick] [--check]    */
+/* [--threads N].                                                            */
+/*===========================================================================*/
+void parseArguments ( int             argc,
+                      char          **argv,
+                      BENCHOPTIONS   *options )
+{
+   int         i;
+   char       *end;
+
+   options->json       = 0;
+   options->jit        = 0;
+   options->single     = 0;
+   options->threads    = 1;
+   options->check      = 0;
+   options->minSeconds = MIN_SECONDS;
+   options->sizeCount  = sizeof(sizes)/sizeof(sizes[0]);
+
+   for (i=1; i<argc; i++){
+     if ( strcmp(argv[i], "--json") == 0 )
+        options->json = 1;
+     else if ( strcmp(argv[i], "--jit") == 0 )
+        options->jit = 1;
+     else if ( strcmp(argv[i], "--float") == 0 )
+        options->single = 1;
+     else if ( strcmp(argv[i], "--check") == 0 )
+        options->check = 1;
+     else if ( strcmp(argv[i], "--quick") == 0 ){
+       options->minSeconds = QUICK_SECONDS;
+       options->sizeCount  = 2;
+     }
+     else if ( strcmp(argv[i], "--threads") == 0 && i+1 < argc ){
+       options->threads = strtol(argv[++i], &end, 10);
+       if ( *end != '\0' || options->threads < 0 ){
+         fprintf(stderr, "Error: Invalid thread count \"%s\".\n", argv[i]);
+         exit(1);
+       }
+     }
+     else {
+       fprintf(stderr, "Usage: %s [--json] [--jit] [--float] [--quick]"
+                       " [--check] [--threads N]\n", argv[0]);
+       exit(1);
+     }
+   }
+}
+
+/*===========================================================================*/
+/* Function: measure                                                         */
+/* Seconds per repetition of fn, timed over a run of at least minSeconds     */
+/* after one untimed warm-up run.                                           */
+/*===========================================================================*/
+double measure ( BenchFunction    fn,
+                 void            *context,
+                 double           minSeconds )
+{
+   long int    reps = 1;
+   double      start;
+   double      elapsed;
+
+   fn(context, 1);
+   for (;;){
+     start = now();
+     fn(context, reps);
+     elapsed = now() - start;
+     if ( elapsed >= minSeconds )
+        return elapsed / reps;
+     reps *= 2;
+   }
+}
+
+/*===========================================================================*/
+/* Function: now                                                             */
+/* A monotonic clock, in seconds.                                            */
+/*===========================================================================*/
+double now ( void )
+{
+   struct timespec   ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/*===========================================================================*/
+/* Function: report                                                          */
+/* Print one result: seconds per unit of work, as ns and as a rate.  bytes  */
+/* is the size of the output where there is one, otherwise negative.        */
+/*===========================================================================*/
+void report ( BENCHOPTIONS   *options,
+              const char     *stage,
+              const char     *name,
+              const char     *mode,
+              int             size,
+              double          seconds,
+              const char     *unit,
+              long int        bytes )
+{
+   if ( !options->json ){
+     printf("%-8s %-10s %-9s %6d %11.1f ns %12.0f %s/s\n", stage, name, mode,
+            size, seconds*1e9, 1/seconds, unit);
+     fflush(stdout);
+     return;
+   }
+
+   printf("%s\n  {\"stage\": \"%s\", \"name\": ", firstResult ? "" : ",",
+          stage);
+   printJsonString(name);
+   printf(", \"mode\": \"%s\", \"size\": %d, \"ns\": %.2f, \"unit\": \"%s\","
+          " \"per_second\": %.1f", mode, size, seconds*1e9, unit, 1/seconds);
+   if ( bytes >= 0 )
+      printf(", \"bytes\": %ld", bytes);
+   printf("}");
+   firstResult = 0;
+}
+
+/*===========================================================================*/
+/* Function: printJsonString                                                 */
+/* Print s as a quoted JSON string.                                          */
+/*===========================================================================*/
+void printJsonString ( const char   *s )
+{
+   putchar('"');
+   for (; *s; s++){
+     if ( *s == '"' || *s == '\\' )
+        putchar('\\');
+     putchar(*s);
+   }
+   putchar('"');
+}
+
+/*===========================================================================*/
+/* Function: benchCompile                                                    */
+/* Time te_compile, which builds the parse tree, and te_compile_frame, which */
+/* also flattens and optimizes it, over the corpus and a call of every       */
+/* builtin; then te_compile again with x and y last of WIDE_VARIABLES.       */
+/*===========================================================================*/
+void benchCompile ( BENCHOPTIONS   *options )
+{
+   static te_variable   wide[WIDE_VARIABLES];
+   static char          names[WIDE_VARIABLES][8];
+   te_variable          vars[2];
+   int                  k;
+
+   memset(vars, 0, sizeof(vars));
+   vars[0].name = "x";
+   vars[1].name = "y";
+   memset(wide, 0, sizeof(wide));
+   for (k=0; k<WIDE_VARIABLES-2; k++){
+     sprintf(names[k], "v%d", k);
+     wide[k].name = names[k];
+   }
+   wide[WIDE_VARIABLES-2] = vars[0];
+   wide[WIDE_VARIABLES-1] = vars[1];
+
+   for (k=0; corpus[k].name; k++)
+      compileStages(options,corpus[k].name,corpus[k].expression,vars,wide);
+   compileStages(options,"builtins",builtinCalls,vars,wide);
+}
+
+/*===========================================================================*/
+/* Function: compileStages                                                   */
+/* Time one expression compiled as a tree and as a program with x and y,     */
+/* and as a tree with the wide variable list.                                */
+/*===========================================================================*/
+void compileStages ( BENCHOPTIONS        *options,
+                     const char          *name,
+                     const char          *expression,
+                     const te_variable   *vars,
+                     const te_variable   *wide )
+{
+   COMPILEBENCH   bench;
+
+   bench.expression = expression;
+   bench.vars       = vars;
+   bench.varCount   = 2;
+   bench.program    = 0;
+   report(options,"compile",name,"tree",0,
+          measure(runCompile,&bench,options->minSeconds),"compile",-1);
+   bench.program    = 1;
+   report(options,"compile",name,"program",0,
+          measure(runCompile,&bench,options->minSeconds),"compile",-1);
+   bench.vars       = wide;
+   bench.varCount   = WIDE_VARIABLES;
+   bench.program    = 0;
+   report(options,"compile",name,"wide",0,
+          measure(runCompile,&bench,options->minSeconds),"compile",-1);
+}
+
+/*===========================================================================*/
+/* Function: runCompile                                                      */
+/* Compile and free the expression reps times.                               */
+/*===========================================================================*/
+void runCompile ( void       *context,
+                  long int    reps )
+{
+   COMPILEBENCH  *bench = (COMPILEBENCH *)context;
+   te_expr       *tree;
+   te_program    *program;
+   int            error;
+   long int       r;
+
+   for (r=0; r<reps; r++){
+     if ( bench->program ){
+       program = te_compile_frame(bench->expression, bench->vars,
+                                  bench->varCount, &error);
+       te_program_free(program);
+     }
+     else {
+       tree = te_compile(bench->expression, bench->vars, bench->varCount,
+                         &error);
+       te_free(tree);
+     }
+   }
+}
+
+/*===========================================================================*/
+/* Function: benchEval                                                       */
+/* Time each kind of node through each evaluator: per point for the tree     */
+/* and the scalar program, and per point of EVAL_POINTS for the batch,      */
+/* native and single precision kernels.  x runs over (0,1], which every     */
+/* node accepts.                                                             */
+/*===========================================================================*/
+void benchEval ( BENCHOPTIONS   *options )
+{
+   EVALBENCH     bench;
+   te_variable   treeVars[1];
+   te_variable   frameVars[1];
+   int           error;
+   int           mode;
+   int           k;
+
+   bench.xs  = (double *)malloc(sizeof(double)*EVAL_POINTS);
+   bench.out = (double *)malloc(sizeof(double)*EVAL_POINTS);
+   bench.xf  = (float *)malloc(sizeof(float)*EVAL_POINTS);
+   bench.outf = (float *)malloc(sizeof(float)*EVAL_POINTS);
+   if ( !bench.xs || !bench.out || !bench.xf || !bench.outf ){
+     fprintf(stderr, "Fatal error: Failed to allocate evaluation buffers.\n");
+     exit(1);
+   }
+   for (k=0; k<EVAL_POINTS; k++){
+     bench.xs[k] = (k + 1.0)/EVAL_POINTS;
+     bench.xf[k] = (float)bench.xs[k];
+   }
+
+   treeVars[0].name = "x"; treeVars[0].address = &bench.x;
+   treeVars[0].type = 0;   treeVars[0].context = NULL;
+   frameVars[0] = treeVars[0];
+   frameVars[0].address = NULL;
+
+   for (k=0; nodes[k].name; k++){
+     bench.tree    = te_compile(nodes[k].expression, treeVars, 1, &error);
+     bench.program = te_compile_frame(nodes[k].expression, frameVars, 1,
+                                      &error);
+     bench.native  = bench.program ? compileJit(bench.program, 1) : NULL;
+     if ( !bench.tree || !bench.program ){
+       fprintf(stderr, "Fatal error: \"%s\" does not compile.\n",
+               nodes[k].expression);
+       exit(1);
+     }
+
+     for (mode=0; mode<EVAL_MODES; mode++){
+       if ( mode == MODE_JIT && !bench.native )
+          continue;
+       bench.mode = mode;
+       report(options,"eval",nodes[k].name,modeNames[mode],0,
+              measure(runEval,&bench,options->minSeconds) /
+              (mode >= MODE_BATCH ? EVAL_POINTS : 1),"eval",-1);
+     }
+
+     te_free(bench.tree);
+     te_program_free(bench.program);
+     destroyJit(bench.native);
+   }
+
+   free(bench.xs);
+   free(bench.out);
+   free(bench.xf);
+   free(bench.outf);
+}
+
+/*===========================================================================*/
+/* Function: runEval                                                         */
+/* Evaluate reps times: one point for the tree and the program, EVAL_POINTS  */
+/* for the batch, the native code and the single precision batch.            */
+/*===========================================================================*/
+void runEval ( void       *context,
+               long int    reps )
+{
+   EVALBENCH       *bench = (EVALBENCH *)context;
+   double           frame[1];
+   double           sum = 0;
+   const double    *columns[1];
+   const float     *narrowColumns[1];
+   long int         r;
+
+   columns[0] = bench->xs;
+   narrowColumns[0] = bench->xf;
+   for (r=0; r<reps; r++){
+     switch ( bench->mode ){
+       case MODE_TREE:
+         bench->x = bench->xs[r % EVAL_POINTS];
+         sum += te_eval(bench->tree);
+         break;
+       case MODE_PROGRAM:
+         frame[0] = bench->xs[r % EVAL_POINTS];
+         sum += te_program_eval_frame(bench->program, frame);
+         break;
+       case MODE_BATCH:
+         frame[0] = 0;
+         te_eval_batch_frame(bench->program, frame, columns, bench->out,
+                             EVAL_POINTS);
+         sum += bench->out[r % EVAL_POINTS];
+         break;
+       case MODE_JIT:
+         frame[0] = 0;
+         runJit(bench->native, frame, columns, bench->out, EVAL_POINTS);
+         sum += bench->out[r % EVAL_POINTS];
+         break;
+       case MODE_FLOAT:
+         frame[0] = 0;
+         te_eval_batch_float(bench->program, frame, narrowColumns, bench->outf,
+                             EVAL_POINTS);
+         sum += bench->outf[r % EVAL_POINTS];
+         break;
+     }
+   }
+   benchSink += sum;
+}
+
+/*===========================================================================*/
+/* Function: benchRender                                                     */
+/* Time plotRender into caller-owned pixels, which is everything but the    */
+/* encode, for the corpus at each resolution.                                */
+/*===========================================================================*/
+void benchRender ( BENCHOPTIONS   *options,
+                   THREADPOOL     *pool )
+{
+   RENDERBENCH   bench;
+   unsigned char *pixels;
+   double        seconds;
+   int           s;
+   int           k;
+
+   for (s=0; s<options->sizeCount; s++){
+     plotDefaults(&bench.options);
+     bench.options.width  = sizes[s];
+     bench.options.height = sizes[s];
+     bench.options.jit    = options->jit;
+     bench.options.single = options->single;
+     bench.options.pool   = pool;
+
+     bench.sink.kind   = PLOT_SINK_PIXELS;
+     bench.sink.stride = plotRowBytes("x*y", &bench.options);
+     pixels = (unsigned char *)malloc(bench.sink.stride*sizes[s]);
+     if ( !pixels ){
+       fprintf(stderr, "Fatal error: Failed to allocate %dx%d image.\n",
+               sizes[s], sizes[s]);
+       exit(1);
+     }
+     bench.sink.pixels = pixels;
+
+     for (k=0; corpus[k].name; k++){
+       bench.expression = corpus[k].expression;
+       seconds = measure(runRender,&bench,options->minSeconds);
+       if ( bench.status != PLOT_OK ){
+         fprintf(stderr, "Fatal error: %s: %s.\n", corpus[k].expression,
+                 plotErrorString(bench.status));
+         exit(1);
+       }
+       report(options,"render",corpus[k].name,
+              options->jit && jitSupported() ? "jit" : "program",sizes[s],
+              seconds/((double)sizes[s]*sizes[s]),"pixel",-1);
+     }
+     free(pixels);
+   }
+}
+
+/*===========================================================================*/
+/* Function: runRender                                                       */
+/* Render the plot reps times.                                               */
+/*===========================================================================*/
+void runRender ( void       *context,
+                 long int    reps )
+{
+   RENDERBENCH  *bench = (RENDERBENCH *)context;
+   long int      r;
+
+   for (r=0; r<reps; r++)
+      bench->status = plotRender(bench->expression,&bench->options,
+                                 &bench->sink);
+}
+
+/*===========================================================================*/
+/* Function: benchEncode                                                     */
+/* Time libpng encoding a rendered f(x,y) plot at each resolution, with the */
+/* default encoder settings and with those of --fast, and the default ones */
+/* again deflating in bands on the pool.                                     */
+/*===========================================================================*/
+void benchEncode ( BENCHOPTIONS   *options,
+                   THREADPOOL     *pool )
+{
+   ENCODEBENCH   bench;
+   PLOTOPTIONS   plot;
+   PLOTSINK      sink;
+   unsigned char *pixels;
+   double        seconds;
+   long int      i;
+   int           s;
+   int           mode;
+
+   for (s=0; s<options->sizeCount; s++){
+     plotDefaults(&plot);
+     plot.width  = sizes[s];
+     plot.height = sizes[s];
+
+     sink.kind   = PLOT_SINK_PIXELS;
+     sink.stride = plotRowBytes("x*y", &plot);
+     pixels      = (unsigned char *)malloc(sink.stride*sizes[s]);
+     bench.rows  = (png_byte **)malloc(sizeof(png_byte *)*sizes[s]);
+     if ( !pixels || !bench.rows ){
+       fprintf(stderr, "Fatal error: Failed to allocate %dx%d image.\n",
+               sizes[s], sizes[s]);
+       exit(1);
+     }
+     sink.pixels = pixels;
+     plotRender("sin(10*x)*cos(10*y)", &plot, &sink);
+     for (i=0; i<sizes[s]; i++)
+        bench.rows[i] = pixels + i*sink.stride;
+
+     bench.width  = sizes[s];
+     bench.height = sizes[s];
+     for (mode=0; mode<3; mode++){
+       bench.level    = mode == 1 ? 1 : -1;
+       bench.strategy = mode == 1 ? Z_RLE : -1;
+       bench.filters  = mode == 1 ? PNG_FILTER_UP : -1;
+       bench.pool     = mode == 2 ? pool : NULL;
+       seconds = measure(runEncode,&bench,options->minSeconds);
+       report(options,"encode","waves",encodeModes[mode],sizes[s],
+              seconds/((double)sizes[s]*sizes[s]),"pixel",
+              (long int)bench.bytes);
+     }
+
+     free(bench.rows);
+     free(pixels);
+   }
+}
+
+/*===========================================================================*/
+/* Function: runEncode                                                       */
+/* Encode the image as an RGB PNG reps times, discarding the output.  With  */
+/* a pool, the image data is deflated in bands by compressIdat and written */
+/* as plotRender writes it.                                                  */
+/*===========================================================================*/
+void runEncode ( void       *context,
+                 long int    reps )
+{
+   ENCODEBENCH  *bench = (ENCODEBENCH *)context;
+   png_structp   pngPtr;
+   png_infop     infoPtr;
+   IDAT          idat;
+   volatile long int r;            /* kept across the setjmp              */
+   long int      b;
+
+   for (r=0; r<reps; r++){
+     pngPtr  = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
+                                       NULL);
+     infoPtr = pngPtr ? png_create_info_struct(pngPtr) : NULL;
+     if ( !infoPtr || setjmp(png_jmpbuf(pngPtr)) ){
+       fprintf(stderr, "Fatal error: PNG encoding failed.\n");
+       exit(1);
+     }
+
+     bench->bytes = 0;
+     png_set_write_fn(pngPtr, &bench->bytes, discardPng, flushPng);
+     if ( bench->level >= 0 )
+        png_set_compression_level(pngPtr, bench->level);
+     if ( bench->strategy >= 0 )
+        png_set_compression_strategy(pngPtr, bench->strategy);
+     if ( bench->filters >= 0 )
+        png_set_filter(pngPtr, PNG_FILTER_TYPE_BASE, bench->filters);
+     png_set_IHDR(pngPtr, infoPtr, bench->width, bench->height, 8,
+                  PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                  PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+     png_write_info(pngPtr, infoPtr);
+     if ( bench->pool ){
+       if ( !compressIdat(&idat, bench->rows, bench->height,
+                          (size_t)3*bench->width, 3, PNG_ALL_FILTERS,
+                          bench->level, Z_FILTERED, bench->pool) ){
+         fprintf(stderr, "Fatal error: PNG encoding failed.\n");
+         exit(1);
+       }
+       for (b=0; b<idat.bands; b++)
+          png_write_chunk(pngPtr, (png_const_bytep)"IDAT", idat.data[b],
+                          idat.lengths[b]);
+       png_write_chunk(pngPtr, (png_const_bytep)"IEND", NULL, 0);
+       freeIdat(&idat);
+     }
+     else {
+       png_write_image(pngPtr, bench->rows);
+       png_write_end(pngPtr, NULL);
+     }
+     png_destroy_write_struct(&pngPtr, &infoPtr);
+   }
+}
+
+/*===========================================================================*/
+/* Function: checkCulling                                                    */
+/* Render each of cullChecks with culling and without, printing whether the */
+/* pixels match.  Returns the number that did not, or failed to render.     */
+/*===========================================================================*/
+int checkCulling ( BENCHOPTIONS   *options,
+                   THREADPOOL     *pool )
+{
+   PLOTOPTIONS    plot;
+   PLOTSINK       sink;
+   unsigned char *pixels[2];
+   size_t         bytes;
+   int            status[2];
+   int            failed = 0;
+   int            k;
+   int            c;
+
+   plotDefaults(&plot);
+   plot.width   = CHECK_SIZE;
+   plot.height  = CHECK_SIZE;
+   plot.jit     = options->jit;
+   plot.pool    = pool;
+   sink.kind    = PLOT_SINK_PIXELS;
+   sink.stride  = plotRowBytes("x*y", &plot);
+   bytes        = sink.stride*CHECK_SIZE;
+   pixels[0]    = (unsigned char *)malloc(bytes);
+   pixels[1]    = (unsigned char *)malloc(bytes);
+   if ( !pixels[0] || !pixels[1] ){
+     fprintf(stderr, "Fatal error: Failed to allocate %dx%d image.\n",
+             CHECK_SIZE, CHECK_SIZE);
+     exit(1);
+   }
+
+   for (k=0; cullChecks[k].expression; k++){
+     plot.yMin = cullChecks[k].yMin;
+     plot.yMax = cullChecks[k].yMax;
+     plot.zMin = cullChecks[k].zMin;
+     plot.zMax = cullChecks[k].zMax;
+     for (c=0; c<2; c++){
+       plot.cull   = c;
+       sink.pixels = pixels[c];
+       memset(pixels[c], 0, bytes);
+       status[c] = plotRender(cullChecks[k].expression,&plot,&sink);
+     }
+     if ( status[0] != PLOT_OK || status[1] != PLOT_OK ||
+          memcmp(pixels[0], pixels[1], bytes) != 0 ){
+       printf("check    %-22s differs with culling\n",
+              cullChecks[k].expression);
+       failed++;
+     }
+     else
+        printf("check    %-22s ok\n", cullChecks[k].expression);
+   }
+
+   free(pixels[0]);
+   free(pixels[1]);
+   return failed;
+}
+
+/*===========================================================================*/
+/* Function: checkBounds                                                     */
+/* Evaluate each of boundsChecks at a grid of points over its box, corners   */
+/* included, and count the expressions with a value outside the bounds       */
+/* te_program_bounds gives for the box.                                      */
+/*===========================================================================*/
+int checkBounds ( void )
+{
+   te_variable   vars[2];
+   te_program   *program;
+   te_interval   box[2];
+   te_interval   bounds;
+   double        frame[2];
+   double        value;
+   int           outside;
+   int           failed = 0;
+   int           error;
+   int           k;
+   int           i;
+   int           j;
+
+   memset(vars, 0, sizeof(vars));
+   vars[0].name = "x";
+   vars[1].name = "y";
+
+   for (k=0; boundsChecks[k].expression; k++){
+     program = te_compile_frame(boundsChecks[k].expression, vars, 2, &error);
+     if ( !program ){
+       printf("check    %-22s does not compile\n",
+              boundsChecks[k].expression);
+       failed++;
+       continue;
+     }
+     box[0].lo  = boundsChecks[k].xMin;
+     box[0].hi  = boundsChecks[k].xMax;
+     box[0].nan = 0;
+     box[1].lo  = boundsChecks[k].yMin;
+     box[1].hi  = boundsChecks[k].yMax;
+     box[1].nan = 0;
+     bounds  = te_program_bounds(program, box);
+     outside = 0;
+     for (i=0; i<=CHECK_STEPS; i++)
+        for (j=0; j<=CHECK_STEPS; j++){
+          frame[0] = checkSample(box[0].lo,box[0].hi,i);
+          frame[1] = checkSample(box[1].lo,box[1].hi,j);
+          if ( frame[0] != frame[0] || frame[1] != frame[1] )
+             continue;
+          value = te_program_eval_frame(program, frame);
+          if ( value != value ? !bounds.nan :
+               !(value >= bounds.lo && value <= bounds.hi) )
+             outside++;
+        }
+     te_program_free(program);
+
+     if ( outside ){
+       printf("check    %-22s has %d values outside [%g, %g]\n",
+              boundsChecks[k].expression, outside, bounds.lo, bounds.hi);
+       failed++;
+     }
+     else
+        printf("check    %-22s ok\n", boundsChecks[k].expression);
+   }
+   return failed;
+}
+
+/*===========================================================================*/
+/* Function: checkBuiltins                                                   */
+/* Compile each call in builtinCalls by itself, so that a name the builtin   */
+/* hash in tinyexpr.c no longer finds fails here.  Returns the number that   */
+/* do not compile.                                                           */
+/*===========================================================================*/
+int checkBuiltins ( void )
+{
+   te_variable   vars[2];
+   te_expr      *n;
+   char          call[CALL_BYTES];
+   const char   *start = builtinCalls;
+   const char   *next;
+   size_t        length;
+   int           failed = 0;
+   int           error;
+
+   memset(vars, 0, sizeof(vars));
+   vars[0].name = "x";
+   vars[1].name = "y";
+
+   for (; *start; start=*next ? next + 1 : next){
+     next   = start + strcspn(start, "+");
+     length = next - start < CALL_BYTES ? (size_t)(next - start) : CALL_BYTES - 1;
+     memcpy(call, start, length);
+     call[length] = '\0';
+
+     n = te_compile(call, vars, 2, &error);
+     if ( !n ){
+       printf("check    %-22s is not found\n", call);
+       failed++;
+     }
+     te_free(n);
+   }
+   if ( !failed )
+      printf("check    %-22s ok\n", "builtins");
+   return failed;
+}
+
+/*===========================================================================*/
+/* Function: checkSample                                                     */
+/* Sample i of CHECK_STEPS+1 from lo to hi; NaN between infinite ends.       */
+/*===========================================================================*/
+double checkSample ( double   lo,
+                     double   hi,
+                     int      i )
+{
+   if ( i == 0 )
+      return lo;
+   if ( i == CHECK_STEPS )
+      return hi;
+   return lo + (hi - lo)*i/CHECK_STEPS;
+}
+
+/*===========================================================================*/
+/* Function: discardPng                                                      */
+/* libpng write callback: count the bytes and drop them.                     */
+/*===========================================================================*/
+void discardPng ( png_structp    pngPtr,
+                  png_bytep      data,
+                  png_size_t     length )
+{
+   (void)data;
+   *(size_t *)png_get_io_ptr(pngPtr) += length;
+}
+
+/*===========================================================================*/
+/* Function: flushPng                                                        */
+/* libpng flush callback: nothing to flush.                                  */
+/*===========================================================================*/
+void flushPng ( png_structp   pngPtr )
+{
+   (void)pngPtr;
+}
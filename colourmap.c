@@ -0,0 +1,105 @@
+/*===========================================================================*/
+/* The colour maps f(x,y) plots are coloured with, as 256 entry tables.      */
+/*                                                                           */
+/* Each map is a list of colour stops, with the table interpolated linearly  */
+/* between them, so a map is cheap to describe and the plot needs only one   */
+/* table lookup per pixel.                                                   */
+/*===========================================================================*/
+#define _POSIX_C_SOURCE 200809L
+
+/*===========================================================================*/
+/* Includes                                                                  */
+/*===========================================================================*/
+#include <math.h>
+#include "colourmap.h"
+
+/*===========================================================================*/
+/* Constants                                                                 */
+/*===========================================================================*/
+#define MAX_STOPS 9
+
+/*===========================================================================*/
+/* Structure definitions                                                     */
+/*===========================================================================*/
+/* the colour a map takes at a point from 0 (smallest value) to 1 (largest) */
+struct colourstop_struct
+   {
+      double            at;
+      unsigned char     red;
+      unsigned char     green;
+      unsigned char     blue;
+   };
+typedef struct colourstop_struct COLOURSTOP;
+
+/* a map's stops, the first at 0 and the last at 1 */
+struct stoplist_struct
+   {
+      int               count;
+      COLOURSTOP        stops[MAX_STOPS];
+   };
+typedef struct stoplist_struct STOPLIST;
+
+/*===========================================================================*/
+/* Global variables                                                          */
+/*===========================================================================*/
+/* indexed by COLOURMAP_*; viridis is sampled from matplotlib's at 1/8 steps */
+static const STOPLIST maps[COLOURMAP_COUNT] = {
+   {2, {{0, 255, 0, 0}, {1, 0, 0, 255}}},
+   {2, {{0, 0, 0, 0}, {1, 255, 255, 255}}},
+   {4, {{0, 0, 0, 0}, {1.0/3, 255, 0, 0}, {2.0/3, 255, 255, 0},
+        {1, 255, 255, 255}}},
+   {9, {{0, 68, 1, 84}, {0.125, 71, 44, 122}, {0.25, 59, 81, 139},
+        {0.375, 44, 113, 142}, {0.5, 33, 144, 141}, {0.625, 39, 173, 129},
+        {0.75, 92, 200, 99}, {0.875, 170, 220, 50}, {1, 253, 231, 37}}}
+};
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+static unsigned char blend (unsigned char,unsigned char,double);
+
+/*===========================================================================*/
+/* Function: makeColourMap                                                   */
+/* Fills table with the COLOUR_LEVELS colours of a COLOURMAP_* map, entry k  */
+/* being its colour at k/(COLOUR_LEVELS-1).  Returns 0 if there is no such   */
+/* map.                                                                      */
+/*===========================================================================*/
+int makeColourMap ( COLOURMAP   *table,
+                    int          map )
+{
+   const STOPLIST   *list;
+   const COLOURSTOP *from;
+   const COLOURSTOP *to;
+   double            at;
+   double            t;
+   int               k;
+   int               s = 0;
+
+   if ( map < 0 || map >= COLOURMAP_COUNT )
+      return 0;
+
+   list = &maps[map];
+   for (k=0; k<COLOUR_LEVELS; k++){
+     at = (double)k/(COLOUR_LEVELS - 1);
+     while ( s+2 < list->count && at > list->stops[s+1].at )
+        s++;
+     from = &list->stops[s];
+     to   = &list->stops[s+1];
+     t    = (at - from->at)/(to->at - from->at);
+     table->rgb[3*k]   = blend(from->red, to->red, t);
+     table->rgb[3*k+1] = blend(from->green, to->green, t);
+     table->rgb[3*k+2] = blend(from->blue, to->blue, t);
+   }
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: blend                                                           */
+/* The channel value t of the way from a to b, rounded to the nearest.       */
+/*===========================================================================*/
+static unsigned char blend ( unsigned char   a,
+                             unsigned char   b,
+                             double          t )
+{
+   return (unsigned char)floor(a + (b - a)*t + 0.5);
+}
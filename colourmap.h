@@ -0,0 +1,34 @@
+/*===========================================================================*/
+/* The colour maps f(x,y) plots are coloured with, as 256 entry tables.      */
+/*===========================================================================*/
+#ifndef COLOURMAP_H
+#define COLOURMAP_H
+
+/*===========================================================================*/
+/* Constants                                                                 */
+/*===========================================================================*/
+#define COLOUR_LEVELS     256 /* entries in a table, and in the PNG palette */
+
+/* the maps, from the colour of the smallest value to that of the largest */
+#define COLOURMAP_REDBLUE   0 /* red to blue, the default                  */
+#define COLOURMAP_GREY      1 /* black to white                            */
+#define COLOURMAP_HEAT      2 /* black through red and yellow to white     */
+#define COLOURMAP_VIRIDIS   3 /* purple through blue and green to yellow   */
+#define COLOURMAP_COUNT     4
+
+/*===========================================================================*/
+/* Structure definitions                                                     */
+/*===========================================================================*/
+/* entry k is the red, green and blue of rgb[3k] to rgb[3k+2] */
+struct colourmap_struct
+   {
+      unsigned char     rgb[3*COLOUR_LEVELS];
+   };
+typedef struct colourmap_struct COLOURMAP;
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+int     makeColourMap    (COLOURMAP *,int);
+
+#endif
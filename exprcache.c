@@ -0,0 +1,368 @@
+/*===========================================================================*/
+/* A bounded cache of compiled expressions, shared between plots.            */
+/*                                                                           */
+/* Entries are keyed by the variable table and the expression text with      */
+/* runs of whitespace made one space and dropped between symbols, so         */
+/* "x +  1" and "x + 1" share a program, and so do "-(-x)" and "- ( -x)".    */
+/* The least recently used entry is dropped once the cache is full; a        */
+/* program still held by a caller is freed when its last holder releases     */
+/* it.  Every operation takes the cache's lock, compiling included, so two   */
+/* threads asking for the same new expression compile it only once.          */
+/*===========================================================================*/
+#define _POSIX_C_SOURCE 200809L
+
+/*===========================================================================*/
+/* Includes                                                                  */
+/*===========================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include "exprcache.h"
+
+/*===========================================================================*/
+/* Constants                                                                 */
+/*===========================================================================*/
+#define KEY_FIELD_BYTES 64         /* room for a variable's type and pointers */
+
+/*===========================================================================*/
+/* Structure definitions                                                     */
+/*===========================================================================*/
+struct cachedexpr_struct
+   {
+      te_program       *program;
+      char             *key;
+      unsigned long int hash;
+      int               users;      /* callers holding the program         */
+      int               cached;     /* still reachable from the cache      */
+      CACHEDEXPR       *chain;      /* next entry in the same bucket       */
+      CACHEDEXPR       *newer;      /* neighbours in order of last use     */
+      CACHEDEXPR       *older;
+   };
+
+struct exprcache_struct
+   {
+      pthread_mutex_t   lock;
+      CACHEDEXPR      **buckets;
+      int               bucketCount;
+      int               entries;
+      int               capacity;
+      CACHEDEXPR       *newest;
+      CACHEDEXPR       *oldest;
+      unsigned long int hits;
+      unsigned long int misses;
+   };
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+static char             *makeKey    (const char *,const te_variable *,int);
+static unsigned long int hashKey    (const char *);
+static int               isWordChar (int);
+static void              unlinkExpr (EXPRCACHE *,CACHEDEXPR *);
+static void              pushNewest (EXPRCACHE *,CACHEDEXPR *);
+static void              freeExpr   (CACHEDEXPR *);
+
+/*===========================================================================*/
+/* Function: createExprCache                                                 */
+/* Create a cache holding at most capacity programs.  Returns NULL if memory */
+/* runs out.                                                                 */
+/*===========================================================================*/
+EXPRCACHE *createExprCache ( int   capacity )
+{
+   EXPRCACHE   *cache;
+
+   if ( capacity < 1 )
+      capacity = 1;
+
+   cache = (EXPRCACHE *)calloc(1, sizeof(EXPRCACHE));
+   if ( !cache )
+      return NULL;
+
+   cache->capacity    = capacity;
+   cache->bucketCount = 2*capacity;
+   cache->buckets = (CACHEDEXPR **)calloc(cache->bucketCount,
+                                          sizeof(CACHEDEXPR *));
+   if ( !cache->buckets || pthread_mutex_init(&cache->lock, NULL) != 0 ){
+     free(cache->buckets);
+     free(cache);
+     return NULL;
+   }
+   return cache;
+}
+
+/*===========================================================================*/
+/* Function: destroyExprCache                                                */
+/* Free the cache and its programs.  Every acquired program must have been  */
+/* released first.  Safe to call on NULL.                                    */
+/*===========================================================================*/
+void destroyExprCache ( EXPRCACHE   *cache )
+{
+   CACHEDEXPR  *entry;
+   CACHEDEXPR  *older;
+
+   if ( !cache )
+      return;
+
+   for (entry=cache->newest; entry; entry=older){
+     older = entry->older;
+     freeExpr(entry);
+   }
+   pthread_mutex_destroy(&cache->lock);
+   free(cache->buckets);
+   free(cache);
+}
+
+/*===========================================================================*/
+/* Function: acquireExpr                                                     */
+/* The program for expression over the given variable table, compiling it  */
+/* on a miss.  Returns NULL, with the error position in error, if it does    */
+/* not compile; failures are not cached.  Release it with releaseExpr.      */
+/*===========================================================================*/
+CACHEDEXPR *acquireExpr ( EXPRCACHE           *cache,
+                          const char          *expression,
+                          const te_variable   *variables,
+                          int                  count,
+                          int                 *error )
+{
+   CACHEDEXPR         *entry;
+   CACHEDEXPR        **bucket = NULL;
+   char               *key;
+   unsigned long int   hash;
+
+   *error = 0;
+   key = makeKey(expression, variables, count);
+   entry = (CACHEDEXPR *)calloc(1, sizeof(CACHEDEXPR));
+   if ( !key || !entry ){
+     free(key);
+     free(entry);
+     *error = -1;
+     return NULL;
+   }
+   hash = hashKey(key);
+
+   if ( cache ){
+     pthread_mutex_lock(&cache->lock);
+     bucket = &cache->buckets[hash % cache->bucketCount];
+     for (entry->chain=*bucket; entry->chain; entry->chain=entry->chain->chain)
+        if ( entry->chain->hash == hash &&
+             strcmp(entry->chain->key, key) == 0 )
+           break;
+
+     if ( entry->chain ){
+       /* a hit: move it to the front and hand it out */
+       CACHEDEXPR  *found = entry->chain;
+
+       free(entry);
+       free(key);
+       entry = found;
+       unlinkExpr(cache, entry);
+       pushNewest(cache, entry);
+       entry->users++;
+       cache->hits++;
+       pthread_mutex_unlock(&cache->lock);
+       return entry;
+     }
+     cache->misses++;
+   }
+
+   entry->program = te_compile_frame(expression, variables, count, error);
+   entry->key     = key;
+   entry->hash    = hash;
+   entry->users   = 1;
+   if ( !entry->program ){
+     if ( cache )
+        pthread_mutex_unlock(&cache->lock);
+     freeExpr(entry);
+     return NULL;
+   }
+
+   if ( cache ){
+     entry->cached = 1;
+     entry->chain  = *bucket;
+     *bucket       = entry;
+     pushNewest(cache, entry);
+     if ( ++cache->entries > cache->capacity ){
+       /* drop the least recently used; its holders keep it alive */
+       CACHEDEXPR  *oldest = cache->oldest;
+
+       for (bucket=&cache->buckets[oldest->hash % cache->bucketCount];
+            *bucket != oldest; bucket=&(*bucket)->chain)
+          ;
+       *bucket = oldest->chain;
+       unlinkExpr(cache, oldest);
+       oldest->cached = 0;
+       cache->entries--;
+       if ( oldest->users == 0 )
+          freeExpr(oldest);
+     }
+     pthread_mutex_unlock(&cache->lock);
+   }
+   return entry;
+}
+
+/*===========================================================================*/
+/* Function: cachedProgram                                                   */
+/* The compiled program of an acquired entry.                                */
+/*===========================================================================*/
+const te_program *cachedProgram ( const CACHEDEXPR   *entry )
+{
+   return entry->program;
+}
+
+/*===========================================================================*/
+/* Function: releaseExpr                                                     */
+/* Give back a program from acquireExpr with the same cache.  Safe to call  */
+/* on NULL.                                                                  */
+/*===========================================================================*/
+void releaseExpr ( EXPRCACHE    *cache,
+                   CACHEDEXPR   *entry )
+{
+   int   unused;
+
+   if ( !entry )
+      return;
+
+   if ( cache )
+      pthread_mutex_lock(&cache->lock);
+   unused = --entry->users == 0 && !entry->cached;
+   if ( cache )
+      pthread_mutex_unlock(&cache->lock);
+
+   if ( unused )
+      freeExpr(entry);
+}
+
+/*===========================================================================*/
+/* Function: exprCacheCounts                                                 */
+/* The number of lookups that found a program, and that had to compile one. */
+/*===========================================================================*/
+void exprCacheCounts ( EXPRCACHE           *cache,
+                       unsigned long int   *hits,
+                       unsigned long int   *misses )
+{
+   *hits   = 0;
+   *misses = 0;
+   if ( !cache )
+      return;
+
+   pthread_mutex_lock(&cache->lock);
+   *hits   = cache->hits;
+   *misses = cache->misses;
+   pthread_mutex_unlock(&cache->lock);
+}
+
+/*===========================================================================*/
+/* Function: makeKey                                                         */
+/* Each variable's name, type and pointers, one per line, then the          */
+/* expression.  A run of whitespace in the expression is kept as one space  */
+/* wherever a name or number character is next to it on either side, since */
+/* taking it out there can change the parse: "1e +5" is 1 then the name e, */
+/* but "1e+5" is one number.  Elsewhere, and at the ends, it is dropped.     */
+/*===========================================================================*/
+static char *makeKey ( const char          *expression,
+                       const te_variable   *variables,
+                       int                  count )
+{
+   char       *key;
+   size_t      size = strlen(expression) + 1;
+   size_t      length = 0;
+   size_t      start;
+   const char *s;
+   int         i;
+
+   for (i=0; i<count; i++)
+      size += strlen(variables[i].name) + KEY_FIELD_BYTES;
+   key = (char *)malloc(size);
+   if ( !key )
+      return NULL;
+
+   for (i=0; i<count; i++)
+      length += sprintf(key + length, "%s %d %p %p\n", variables[i].name,
+                        variables[i].type, variables[i].address,
+                        variables[i].context);
+
+   start = length;
+   for (s=expression; *s; s++){
+     if ( !isspace((unsigned char)*s) ){
+       key[length++] = *s;
+       continue;
+     }
+     while ( isspace((unsigned char)s[1]) )
+        s++;
+     if ( length > start && s[1] != '\0' &&
+          (isWordChar(key[length-1]) || isWordChar(s[1])) )
+        key[length++] = ' ';
+   }
+   key[length] = '\0';
+   return key;
+}
+
+/*===========================================================================*/
+/* Function: hashKey                                                         */
+/* FNV-1a hash of a key.                                                     */
+/*===========================================================================*/
+static unsigned long int hashKey ( const char   *key )
+{
+   unsigned long int   hash = 2166136261UL;
+
+   for (; *key; key++)
+      hash = ((hash ^ (unsigned char)*key) * 16777619UL) & 0xFFFFFFFFUL;
+   return hash;
+}
+
+/*===========================================================================*/
+/* Function: isWordChar                                                      */
+/* Nonzero for characters that can make up a name or a number.              */
+/*===========================================================================*/
+static int isWordChar ( int   c )
+{
+   return isalnum((unsigned char)c) || c == '_' || c == '.';
+}
+
+/*===========================================================================*/
+/* Function: unlinkExpr                                                      */
+/* Take an entry out of the order of last use.                               */
+/*===========================================================================*/
+static void unlinkExpr ( EXPRCACHE    *cache,
+                         CACHEDEXPR   *entry )
+{
+   if ( entry->newer )
+      entry->newer->older = entry->older;
+   else
+      cache->newest = entry->older;
+   if ( entry->older )
+      entry->older->newer = entry->newer;
+   else
+      cache->oldest = entry->newer;
+   entry->newer = NULL;
+   entry->older = NULL;
+}
+
+/*===========================================================================*/
+/* Function: pushNewest                                                      */
+/* Put an entry at the front of the order of last use.                       */
+/*===========================================================================*/
+static void pushNewest ( EXPRCACHE    *cache,
+                         CACHEDEXPR   *entry )
+{
+   entry->newer = NULL;
+   entry->older = cache->newest;
+   if ( cache->newest )
+      cache->newest->newer = entry;
+   else
+      cache->oldest = entry;
+   cache->newest = entry;
+}
+
+/*===========================================================================*/
+/* Function: freeExpr                                                        */
+/* Free an entry and its program.                                            */
+/*===========================================================================*/
+static void freeExpr ( CACHEDEXPR   *entry )
+{
+   te_program_free(entry->program);
+   free(entry->key);
+   free(entry);
+}
@@ -0,0 +1,31 @@
+/*===========================================================================*/
+/* A bounded cache of compiled expressions, shared between plots.            */
+/*===========================================================================*/
+#ifndef EXPRCACHE_H
+#define EXPRCACHE_H
+
+#include "tinyexpr.h"
+
+/*===========================================================================*/
+/* Type definitions                                                          */
+/*===========================================================================*/
+typedef struct exprcache_struct EXPRCACHE;
+
+/* one compiled program, held until released */
+typedef struct cachedexpr_struct CACHEDEXPR;
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+/* Programs are compiled with te_compile_frame, so one cached program may be */
+/* evaluated from any number of threads.  A NULL cache compiles every time.  */
+EXPRCACHE        *createExprCache  (int);
+void              destroyExprCache (EXPRCACHE *);
+CACHEDEXPR       *acquireExpr      (EXPRCACHE *,const char *,
+                                    const te_variable *,int,int *);
+const te_program *cachedProgram    (const CACHEDEXPR *);
+void              releaseExpr      (EXPRCACHE *,CACHEDEXPR *);
+void              exprCacheCounts  (EXPRCACHE *,unsigned long int *,
+                                    unsigned long int *);
+
+#endif
@@ -0,0 +1,729 @@
+/*===========================================================================*/
+/* OpenCL kernels for compiled expressions, used by --gpu for the f(x,y)    */
+/* grid.                                                                     */
+/*                                                                           */
+/* A te_program is lowered to the source of an OpenCL C kernel with one    */
+/* work item per point of the grid, each running the program's             */
+/* instructions as straight-line code from x, y and t and writing its value */
+/* into the tiled z grid, NaN in the padding of the edge tiles.  A second   */
+/* kernel reduces the grid to the min and max of its values and a count of */
+/* those that are NaN or infinite, RANGE_ITEMS strided runs of it, which    */
+/* the host folds together.                                                  */
+/*                                                                           */
+/* Evaluation is in double where the device has cl_khr_fp64 and float      */
+/* elsewhere, or when asked; the device's sin, exp and the rest are its     */
+/* own, so values agree with the interpreter's to a few ulp rather than     */
+/* exactly.  Programs calling fac, ncr, npr or the caller's own functions   */
+/* have no kernel.                                                           */
+/*                                                                           */
+/* OpenCL is loaded when a GPU is first compiled, so the build needs no     */
+/* OpenCL headers or library.  Where there is no OpenCL device, on targets  */
+/* without dlopen, or when built with -DGPU_DISABLE, compileGpu returns     */
+/* NULL and callers keep evaluating on the processor.                        */
+/*===========================================================================*/
+#define _POSIX_C_SOURCE 200809L
+
+/*===========================================================================*/
+/* Includes                                                                  */
+/*===========================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <float.h>
+#include "gpu.h"
+
+#if defined(__unix__) && defined(__LP64__) && !defined(GPU_DISABLE)
+#define GPU_OPENCL
+#include <dlfcn.h>
+#endif
+
+/*===========================================================================*/
+/* Constants                                                                 */
+/*===========================================================================*/
+#define GPU_MAX_PLATFORMS 8        /* OpenCL platforms searched for a device */
+#define RANGE_ITEMS 1024           /* work items reducing the grid's range   */
+#define LINE_BYTES 256             /* longest line of kernel source          */
+
+/* the OpenCL 1.2 values used here, from cl.h */
+#define CL_SUCCESS 0
+#define CL_TRUE 1
+#define CL_DEVICE_TYPE_GPU (1UL << 2)
+#define CL_DEVICE_TYPE_ALL 0xFFFFFFFFUL
+#define CL_DEVICE_DOUBLE_FP_CONFIG 0x1032
+#define CL_MEM_READ_WRITE (1UL << 0)
+#define CL_MEM_READ_ONLY (1UL << 2)
+#define CL_MEM_COPY_HOST_PTR (1UL << 5)
+
+/*===========================================================================*/
+/* Structure definitions                                                     */
+/*===========================================================================*/
+/* OpenCL's integer types and handles, as cl.h has them on LP64 targets */
+typedef int CLINT;
+typedef unsigned int CLUINT;
+typedef unsigned long int CLBITS;
+typedef void *CLHANDLE;
+
+/* the OpenCL entry points, looked up in the library */
+struct opencl_struct
+   {
+      void             *library;
+      CLINT           (*getPlatformIDs)(CLUINT,CLHANDLE *,CLUINT *);
+      CLINT           (*getDeviceIDs)(CLHANDLE,CLBITS,CLUINT,CLHANDLE *,
+                                      CLUINT *);
+      CLINT           (*getDeviceInfo)(CLHANDLE,CLUINT,size_t,void *,
+                                       size_t *);
+      CLHANDLE        (*createContext)(const void *,CLUINT,const CLHANDLE *,
+                                       void *,void *,CLINT *);
+      CLHANDLE        (*createCommandQueue)(CLHANDLE,CLHANDLE,CLBITS,CLINT *);
+      CLHANDLE        (*createProgramWithSource)(CLHANDLE,CLUINT,
+                                                 const char **,
+                                                 const size_t *,CLINT *);
+      CLINT           (*buildProgram)(CLHANDLE,CLUINT,const CLHANDLE *,
+                                      const char *,void *,void *);
+      CLHANDLE        (*createKernel)(CLHANDLE,const char *,CLINT *);
+      CLHANDLE        (*createBuffer)(CLHANDLE,CLBITS,size_t,void *,CLINT *);
+      CLINT           (*setKernelArg)(CLHANDLE,CLUINT,size_t,const void *);
+      CLINT           (*enqueueNDRangeKernel)(CLHANDLE,CLHANDLE,CLUINT,
+                                              const size_t *,const size_t *,
+                                              const size_t *,CLUINT,
+                                              const CLHANDLE *,CLHANDLE *);
+      CLINT           (*enqueueReadBuffer)(CLHANDLE,CLHANDLE,CLUINT,size_t,
+                                           size_t,void *,CLUINT,
+                                           const CLHANDLE *,CLHANDLE *);
+      CLINT           (*releaseMemObject)(CLHANDLE);
+      CLINT           (*releaseKernel)(CLHANDLE);
+      CLINT           (*releaseProgram)(CLHANDLE);
+      CLINT           (*releaseCommandQueue)(CLHANDLE);
+      CLINT           (*releaseContext)(CLHANDLE);
+   };
+typedef struct opencl_struct OPENCL;
+
+struct gpu_struct
+   {
+      OPENCL            cl;
+      CLHANDLE          device;
+      CLHANDLE          context;
+      CLHANDLE          queue;
+      CLHANDLE          program;
+      CLHANDLE          surface;   /* evaluates the grid               */
+      CLHANDLE          range;     /* reduces it                       */
+      int               fp64;      /* reals are doubles, else floats   */
+   };
+
+/* kernel source being written, or only measured while text is NULL */
+struct source_struct
+   {
+      char             *text;
+      size_t            length;
+      int               fp64;      /* reals are doubles, else floats   */
+   };
+typedef struct source_struct SOURCE;
+
+/* the calls kernels can make, by the C functions tinyexpr binds them to */
+struct gpucall_struct
+   {
+      const void       *function;
+      int               arity;
+      const char       *name;
+   };
+typedef struct gpucall_struct GPUCALL;
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+static int    emitKernels   (SOURCE *,const te_program *,int);
+static int    emitInstr     (SOURCE *,const te_instr *);
+static void   emit          (SOURCE *,const char *, ...);
+static void   emitText      (SOURCE *,const char *);
+static const char *callName (const te_instr *);
+#ifdef GPU_OPENCL
+static int    openOpenCL    (OPENCL *,CLHANDLE *,int *);
+static int    loadSymbol    (void *,const char *,void *);
+static CLHANDLE makeBuffer  (GPU *,size_t,const void *);
+#endif
+
+/*===========================================================================*/
+/* Global variables                                                          */
+/*===========================================================================*/
+static const GPUCALL gpuCalls[] = {
+   {(const void *)fabs,  1, "fabs"},
+   {(const void *)acos,  1, "acos"},
+   {(const void *)asin,  1, "asin"},
+   {(const void *)atan,  1, "atan"},
+   {(const void *)ceil,  1, "ceil"},
+   {(const void *)cos,   1, "cos"},
+   {(const void *)cosh,  1, "cosh"},
+   {(const void *)exp,   1, "exp"},
+   {(const void *)floor, 1, "floor"},
+   {(const void *)log,   1, "log"},
+   {(const void *)log10, 1, "log10"},
+   {(const void *)sin,   1, "sin"},
+   {(const void *)sinh,  1, "sinh"},
+   {(const void *)sqrt,  1, "sqrt"},
+   {(const void *)tan,   1, "tan"},
+   {(const void *)tanh,  1, "tanh"},
+   {(const void *)atan2, 2, "atan2"},
+   {(const void *)pow,   2, "pow"},
+   {NULL,                0, NULL}
+};
+
+/* what the instructions below TE_OP_FUNCTION0 compute, %1 and %2 being    */
+/* their operands                                                            */
+static const char *const gpuOps[TE_OP_LOG10 + 1] = {
+   NULL, NULL,
+   "%1 + %2", "%1 - %2", "%1 * %2", "%1 / %2", "fmod(%1, %2)",
+   "pow(%1, %2)", "-%1",
+   "fabs(%1)", "sqrt(%1)", "floor(%1)", "ceil(%1)", "sin(%1)", "cos(%1)",
+   "tan(%1)", "exp(%1)", "log(%1)", "log10(%1)"
+};
+
+/* the surface kernel around the program's instructions, and the range    */
+/* kernel; cells are found in the tiled grid as ZGRID_TILE_ROW finds them */
+static const char surfaceHead[] =
+   "__kernel void surface(__global const real *xs, __global const real *ys,\n"
+   "                      const real t, const int columns, const int rows,\n"
+   "                      const int tileColumns, __global float *z)\n"
+   "{\n"
+   "   const int j = get_global_id(0);\n"
+   "   const int i = get_global_id(1);\n"
+   "   float v = NAN;\n"
+   "   if ( j < columns && i < rows ){\n"
+   "      const real x = xs[j];\n"
+   "      const real y = ys[i];\n";
+static const char surfaceTail[] =
+   "   }\n"
+   "   z[((long)((i / TILE)*tileColumns + j / TILE)*TILE + i % TILE)*TILE +\n"
+   "     j % TILE] = v;\n"
+   "}\n\n";
+static const char rangeKernel[] =
+   "__kernel void range(__global const float *z, const int columns,\n"
+   "                    const int rows, const int tileColumns,\n"
+   "                    __global float *lows, __global float *highs,\n"
+   "                    __global uint *bad)\n"
+   "{\n"
+   "   const long cells = (long)rows*columns;\n"
+   "   float lo = INFINITY;\n"
+   "   float hi = -INFINITY;\n"
+   "   float v;\n"
+   "   uint n = 0;\n"
+   "   long k;\n"
+   "   int i;\n"
+   "   int j;\n"
+   "   for (k=get_global_id(0); k<cells; k+=get_global_size(0)){\n"
+   "      i = k / columns;\n"
+   "      j = k % columns;\n"
+   "      v = z[((long)((i / TILE)*tileColumns + j / TILE)*TILE + i % TILE)*\n"
+   "            TILE + j % TILE];\n"
+   "      if ( v != v || isinf(v) )\n"
+   "         n++;\n"
+   "      if ( v == v ){\n"
+   "         lo = fmin(lo, v);\n"
+   "         hi = fmax(hi, v);\n"
+   "      }\n"
+   "   }\n"
+   "   lows[get_global_id(0)]  = lo;\n"
+   "   highs[get_global_id(0)] = hi;\n"
+   "   bad[get_global_id(0)]   = n;\n"
+   "}\n";
+
+/*===========================================================================*/
+/* Function: gpuSupported                                                    */
+/* Nonzero if an OpenCL device can be found to run kernels on.               */
+/*===========================================================================*/
+int gpuSupported ( void )
+{
+#ifdef GPU_OPENCL
+   OPENCL      cl;
+   CLHANDLE    device;
+   int         fp64;
+
+   if ( !openOpenCL(&cl, &device, &fp64) )
+      return 0;
+   dlclose(cl.library);
+   return 1;
+#else
+   return 0;
+#endif
+}
+
+/*===========================================================================*/
+/* Function: compileGpu                                                      */
+/* Build the program's kernels for the first OpenCL GPU, or failing that   */
+/* the first OpenCL device, evaluating in float if single is set or the     */
+/* device has no doubles.  Returns NULL if there is no device, the program */
+/* has no kernel or it does not build.                                       */
+/*===========================================================================*/
+GPU *compileGpu ( const te_program   *program,
+                  int                 single )
+{
+#ifdef GPU_OPENCL
+   GPU         *gpu;
+   char        *source;
+   const char  *text;
+   CLINT        err;
+
+   if ( !program )
+      return NULL;
+   gpu = (GPU *)calloc(1, sizeof(GPU));
+   if ( !gpu )
+      return NULL;
+   if ( !openOpenCL(&gpu->cl, &gpu->device, &gpu->fp64) ){
+     free(gpu);
+     return NULL;
+   }
+   gpu->fp64 = gpu->fp64 && !single;
+
+   source = gpuKernelSource(program, gpu->fp64);
+   text   = source;
+   if ( source )
+      gpu->context = gpu->cl.createContext(NULL, 1, &gpu->device, NULL, NULL,
+                                           &err);
+   if ( gpu->context )
+      gpu->queue = gpu->cl.createCommandQueue(gpu->context, gpu->device, 0,
+                                              &err);
+   if ( gpu->queue )
+      gpu->program = gpu->cl.createProgramWithSource(gpu->context, 1, &text,
+                                                     NULL, &err);
+   if ( gpu->program &&
+        gpu->cl.buildProgram(gpu->program, 1, &gpu->device, NULL, NULL,
+                             NULL) == CL_SUCCESS ){
+     gpu->surface = gpu->cl.createKernel(gpu->program, "surface", &err);
+     gpu->range   = gpu->cl.createKernel(gpu->program, "range", &err);
+   }
+   free(source);
+
+   if ( !gpu->surface || !gpu->range ){
+     destroyGpu(gpu);
+     return NULL;
+   }
+   return gpu;
+#else
+   (void)program;
+   (void)single;
+   return NULL;
+#endif
+}
+
+/*===========================================================================*/
+/* Function: runGpu                                                          */
+/* Evaluates rows rows of the grid, y from ys, into the first of zValues'   */
+/* tile rows, and its range into range.  Returns 0 if the device fails, in  */
+/* which case the grid is left to be evaluated on the processor.             */
+/*===========================================================================*/
+int runGpu ( GPU             *gpu,
+             const double    *xs,
+             const double    *ys,
+             long int         rows,
+             double           t,
+             ZGRID           *zValues,
+             GPURANGE        *range )
+{
+#ifdef GPU_OPENCL
+   OPENCL     *cl = &gpu->cl;
+   CLHANDLE    buffers[6];
+   CLINT       sizes[3];
+   float       lows[RANGE_ITEMS];
+   float       highs[RANGE_ITEMS];
+   CLUINT      bad[RANGE_ITEMS];
+   float      *narrow = NULL;
+   size_t      global[2];
+   size_t      items = RANGE_ITEMS;
+   size_t      real = gpu->fp64 ? sizeof(double) : sizeof(float);
+   size_t      cells;
+   float       tf = (float)t;
+   long int    columns = zValues->columns;
+   long int    k;
+   int         ok = 1;
+
+   sizes[0] = (CLINT)columns;
+   sizes[1] = (CLINT)rows;
+   sizes[2] = (CLINT)zValues->tileColumns;
+   global[0] = (size_t)zValues->tileColumns*TILE_SIZE;
+   global[1] = (size_t)((rows + TILE_SIZE - 1)/TILE_SIZE)*TILE_SIZE;
+   cells     = global[0]*global[1];
+
+   /* float devices are given float coordinates */
+   if ( !gpu->fp64 ){
+     narrow = (float *)malloc(sizeof(float)*(columns + rows));
+     if ( !narrow )
+        return 0;
+     for (k=0; k<columns; k++)
+        narrow[k] = (float)xs[k];
+     for (k=0; k<rows; k++)
+        narrow[columns + k] = (float)ys[k];
+   }
+   memset(buffers, 0, sizeof(buffers));
+   buffers[0] = makeBuffer(gpu, real*columns, narrow ? (void *)narrow :
+                                                       (const void *)xs);
+   buffers[1] = makeBuffer(gpu, real*rows, narrow ? (void *)(narrow + columns) :
+                                                    (const void *)ys);
+   buffers[2] = makeBuffer(gpu, sizeof(float)*cells, NULL);
+   buffers[3] = makeBuffer(gpu, sizeof(lows), NULL);
+   buffers[4] = makeBuffer(gpu, sizeof(highs), NULL);
+   buffers[5] = makeBuffer(gpu, sizeof(bad), NULL);
+   free(narrow);
+   for (k=0; k<6; k++)
+      ok = ok && buffers[k];
+
+   if ( ok ){
+     ok = cl->setKernelArg(gpu->surface, 0, sizeof(CLHANDLE), &buffers[0]) ||
+          cl->setKernelArg(gpu->surface, 1, sizeof(CLHANDLE), &buffers[1]) ||
+          cl->setKernelArg(gpu->surface, 2, real,
+                           gpu->fp64 ? (const void *)&t : (const void *)&tf) ||
+          cl->setKernelArg(gpu->surface, 3, sizeof(CLINT), &sizes[0]) ||
+          cl->setKernelArg(gpu->surface, 4, sizeof(CLINT), &sizes[1]) ||
+          cl->setKernelArg(gpu->surface, 5, sizeof(CLINT), &sizes[2]) ||
+          cl->setKernelArg(gpu->surface, 6, sizeof(CLHANDLE), &buffers[2]) ||
+          cl->setKernelArg(gpu->range, 0, sizeof(CLHANDLE), &buffers[2]) ||
+          cl->setKernelArg(gpu->range, 1, sizeof(CLINT), &sizes[0]) ||
+          cl->setKernelArg(gpu->range, 2, sizeof(CLINT), &sizes[1]) ||
+          cl->setKernelArg(gpu->range, 3, sizeof(CLINT), &sizes[2]) ||
+          cl->setKernelArg(gpu->range, 4, sizeof(CLHANDLE), &buffers[3]) ||
+          cl->setKernelArg(gpu->range, 5, sizeof(CLHANDLE), &buffers[4]) ||
+          cl->setKernelArg(gpu->range, 6, sizeof(CLHANDLE), &buffers[5]) ?
+          0 : 1;
+   }
+
+   /* the queue runs in order, so the range follows the grid */
+   if ( ok )
+      ok = cl->enqueueNDRangeKernel(gpu->queue, gpu->surface, 2, NULL, global,
+                                    NULL, 0, NULL, NULL) == CL_SUCCESS &&
+           cl->enqueueNDRangeKernel(gpu->queue, gpu->range, 1, NULL, &items,
+                                    NULL, 0, NULL, NULL) == CL_SUCCESS &&
+           cl->enqueueReadBuffer(gpu->queue, buffers[2], CL_TRUE, 0,
+                                 sizeof(float)*cells, zValues->values, 0,
+                                 NULL, NULL) == CL_SUCCESS &&
+           cl->enqueueReadBuffer(gpu->queue, buffers[3], CL_TRUE, 0,
+                                 sizeof(lows), lows, 0, NULL,
+                                 NULL) == CL_SUCCESS &&
+           cl->enqueueReadBuffer(gpu->queue, buffers[4], CL_TRUE, 0,
+                                 sizeof(highs), highs, 0, NULL,
+                                 NULL) == CL_SUCCESS &&
+           cl->enqueueReadBuffer(gpu->queue, buffers[5], CL_TRUE, 0,
+                                 sizeof(bad), bad, 0, NULL,
+                                 NULL) == CL_SUCCESS;
+
+   for (k=0; k<6; k++)
+      if ( buffers[k] )
+         cl->releaseMemObject(buffers[k]);
+   if ( !ok )
+      return 0;
+
+   /* a run that saw no value has its low above its high */
+   range->seen      = 0;
+   range->nonFinite = 0;
+   for (k=0; k<RANGE_ITEMS; k++){
+     range->nonFinite += bad[k];
+     if ( lows[k] > highs[k] )
+        continue;
+     if ( !range->seen || lows[k] < range->min )
+        range->min = lows[k];
+     if ( !range->seen || highs[k] > range->max )
+        range->max = highs[k];
+     range->seen = 1;
+   }
+   return 1;
+#else
+   (void)gpu; (void)xs; (void)ys; (void)rows; (void)t; (void)zValues;
+   (void)range;
+   return 0;
+#endif
+}
+
+/*===========================================================================*/
+/* Function: destroyGpu                                                      */
+/* Release the kernels and the device.  This is safe to call on NULL.        */
+/*===========================================================================*/
+void destroyGpu ( GPU   *gpu )
+{
+#ifdef GPU_OPENCL
+   if ( !gpu )
+      return;
+   if ( gpu->surface )
+      gpu->cl.releaseKernel(gpu->surface);
+   if ( gpu->range )
+      gpu->cl.releaseKernel(gpu->range);
+   if ( gpu->program )
+      gpu->cl.releaseProgram(gpu->program);
+   if ( gpu->queue )
+      gpu->cl.releaseCommandQueue(gpu->queue);
+   if ( gpu->context )
+      gpu->cl.releaseContext(gpu->context);
+   dlclose(gpu->cl.library);
+#endif
+   free(gpu);
+}
+
+/*===========================================================================*/
+/* Function: gpuKernelSource                                                 */
+/* The OpenCL C source of the program's surface and range kernels, in       */
+/* double if fp64 is set and float otherwise.  Returns NULL if the program */
+/* makes a call no kernel can or memory runs out; the caller frees it.     */
+/*===========================================================================*/
+char *gpuKernelSource ( const te_program   *program,
+                        int                 fp64 )
+{
+   SOURCE      source;
+
+   /* one pass to size the source, one to write it */
+   source.text   = NULL;
+   source.length = 0;
+   if ( !emitKernels(&source, program, fp64) )
+      return NULL;
+   source.text   = (char *)malloc(source.length + 1);
+   if ( !source.text )
+      return NULL;
+   source.length = 0;
+   emitKernels(&source, program, fp64);
+   return source.text;
+}
+
+/*===========================================================================*/
+/* Function: emitKernels                                                     */
+/* Write both kernels.  Returns 0 if an instruction cannot be lowered.       */
+/*===========================================================================*/
+static int emitKernels ( SOURCE              *source,
+                         const te_program    *program,
+                         int                  fp64 )
+{
+   int         i;
+
+   source->fp64 = fp64;
+   if ( fp64 )
+      emitText(source, "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n"
+                       "typedef double real;\n");
+   else
+      emitText(source, "typedef float real;\n");
+   emit(source, "#define TILE %d\n\n", TILE_SIZE);
+
+   emitText(source, surfaceHead);
+   for (i=0; i<program->registers; i++)
+      emit(source, "      real r%d;\n", i);
+   for (i=0; i<program->length; i++)
+      if ( !emitInstr(source, &program->code[i]) )
+         return 0;
+   emit(source, "      v = (float)r%d;\n", program->result);
+   emitText(source, surfaceTail);
+   emitText(source, rangeKernel);
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: emitInstr                                                       */
+/* Write one instruction as an assignment to its register.  Returns 0 if it */
+/* reads a variable other than x, y and t or makes a call no kernel can.    */
+/*===========================================================================*/
+static int emitInstr ( SOURCE           *source,
+                       const te_instr   *ip )
+{
+   const char  *form;
+   const char  *name;
+   char         number[LINE_BYTES];
+
+   if ( ip->op == TE_OP_CONSTANT ){
+     /* a floating literal, so that -0 keeps its sign */
+     if ( ip->value != ip->value )
+        strcpy(number, "NAN");
+     else if ( fabs(ip->value) > (source->fp64 ? DBL_MAX : FLT_MAX) )
+        strcpy(number, ip->value < 0 ? "-INFINITY" : "INFINITY");
+     else {
+       sprintf(number, source->fp64 ? "%.17g" : "%.9g", ip->value);
+       if ( !strpbrk(number, ".e") )
+          strcat(number, ".0");
+       if ( !source->fp64 )
+          strcat(number, "f");
+     }
+     emit(source, "      r%d = %s;\n", ip->dst, number);
+     return 1;
+   }
+   if ( ip->op == TE_OP_VARIABLE ){
+     if ( ip->a < 0 || ip->a > 2 )
+        return 0;
+     emit(source, "      r%d = %c;\n", ip->dst, "xyt"[ip->a]);
+     return 1;
+   }
+   if ( ip->op <= TE_OP_LOG10 ){
+     /* %1 and %2 are filled in from the operands */
+     emit(source, "      r%d = ", ip->dst);
+     for (form=gpuOps[ip->op]; *form; form++){
+       if ( form[0] == '%' && form[1] == '1' )
+          emit(source, "r%d", ip->a);
+       else if ( form[0] == '%' && form[1] == '2' )
+          emit(source, "r%d", ip->b);
+       else {
+         emit(source, "%c", form[0]);
+         continue;
+       }
+       form++;
+     }
+     emit(source, ";\n");
+     return 1;
+   }
+
+   name = callName(ip);
+   if ( !name )
+      return 0;
+   if ( ip->op == TE_OP_FUNCTION1 )
+      emit(source, "      r%d = %s(r%d);\n", ip->dst, name, ip->a);
+   else
+      emit(source, "      r%d = %s(r%d, r%d);\n", ip->dst, name, ip->a, ip->b);
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: emit                                                            */
+/* Append printf-style text, no longer than a LINE_BYTES line, to the       */
+/* source, or count it while measuring.                                      */
+/*===========================================================================*/
+static void emit ( SOURCE       *source,
+                   const char   *format, ... )
+{
+   char        line[LINE_BYTES];
+   va_list     args;
+   int         length;
+
+   va_start(args, format);
+   length = vsprintf(source->text ? source->text + source->length : line,
+                     format, args);
+   va_end(args);
+   source->length += length;
+}
+
+/*===========================================================================*/
+/* Function: emitText                                                        */
+/* Append text to the source as it is, or count it while measuring.         */
+/*===========================================================================*/
+static void emitText ( SOURCE       *source,
+                       const char   *text )
+{
+   size_t      length = strlen(text);
+
+   if ( source->text )
+      memcpy(source->text + source->length, text, length + 1);
+   source->length += length;
+}
+
+/*===========================================================================*/
+/* Function: callName                                                        */
+/* The OpenCL builtin a pure one or two argument call maps to, or NULL.      */
+/*===========================================================================*/
+static const char *callName ( const te_instr   *ip )
+{
+   const GPUCALL  *call;
+   int             arity;
+
+   if ( !ip->pure || (ip->op != TE_OP_FUNCTION1 && ip->op != TE_OP_FUNCTION2) )
+      return NULL;
+   arity = ip->op - TE_OP_FUNCTION0;
+   for (call=gpuCalls; call->name; call++)
+      if ( call->function == ip->function && call->arity == arity )
+         return call->name;
+   return NULL;
+}
+
+#ifdef GPU_OPENCL
+/*===========================================================================*/
+/* Function: openOpenCL                                                      */
+/* Load the OpenCL library and find a device, a GPU if there is one, noting */
+/* whether it has doubles.  Returns 0, with the library closed, if there is  */
+/* none.                                                                     */
+/*===========================================================================*/
+static int openOpenCL ( OPENCL     *cl,
+                        CLHANDLE   *device,
+                        int        *fp64 )
+{
+   CLHANDLE    platforms[GPU_MAX_PLATFORMS];
+   CLUINT      count = 0;
+   CLUINT      found = 0;
+   CLUINT      k;
+   CLBITS      config = 0;
+   int         pass;
+
+   memset(cl, 0, sizeof(OPENCL));
+   cl->library = dlopen("libOpenCL.so.1", RTLD_NOW | RTLD_LOCAL);
+   if ( !cl->library )
+      cl->library = dlopen("libOpenCL.so", RTLD_NOW | RTLD_LOCAL);
+   if ( !cl->library )
+      return 0;
+
+   if ( !loadSymbol(cl->library, "clGetPlatformIDs", &cl->getPlatformIDs) ||
+        !loadSymbol(cl->library, "clGetDeviceIDs", &cl->getDeviceIDs) ||
+        !loadSymbol(cl->library, "clGetDeviceInfo", &cl->getDeviceInfo) ||
+        !loadSymbol(cl->library, "clCreateContext", &cl->createContext) ||
+        !loadSymbol(cl->library, "clCreateCommandQueue",
+                    &cl->createCommandQueue) ||
+        !loadSymbol(cl->library, "clCreateProgramWithSource",
+                    &cl->createProgramWithSource) ||
+        !loadSymbol(cl->library, "clBuildProgram", &cl->buildProgram) ||
+        !loadSymbol(cl->library, "clCreateKernel", &cl->createKernel) ||
+        !loadSymbol(cl->library, "clCreateBuffer", &cl->createBuffer) ||
+        !loadSymbol(cl->library, "clSetKernelArg", &cl->setKernelArg) ||
+        !loadSymbol(cl->library, "clEnqueueNDRangeKernel",
+                    &cl->enqueueNDRangeKernel) ||
+        !loadSymbol(cl->library, "clEnqueueReadBuffer",
+                    &cl->enqueueReadBuffer) ||
+        !loadSymbol(cl->library, "clReleaseMemObject", &cl->releaseMemObject) ||
+        !loadSymbol(cl->library, "clReleaseKernel", &cl->releaseKernel) ||
+        !loadSymbol(cl->library, "clReleaseProgram", &cl->releaseProgram) ||
+        !loadSymbol(cl->library, "clReleaseCommandQueue",
+                    &cl->releaseCommandQueue) ||
+        !loadSymbol(cl->library, "clReleaseContext", &cl->releaseContext) ||
+        cl->getPlatformIDs(GPU_MAX_PLATFORMS, platforms, &count) != CL_SUCCESS ){
+     dlclose(cl->library);
+     return 0;
+   }
+   if ( count > GPU_MAX_PLATFORMS )
+      count = GPU_MAX_PLATFORMS;
+
+   /* a GPU on any platform, then any device at all */
+   for (pass=0; pass<2 && !found; pass++)
+      for (k=0; k<count && !found; k++)
+         if ( cl->getDeviceIDs(platforms[k], pass ? CL_DEVICE_TYPE_ALL :
+                               CL_DEVICE_TYPE_GPU, 1, device,
+                               &found) != CL_SUCCESS )
+            found = 0;
+   if ( !found ){
+     dlclose(cl->library);
+     return 0;
+   }
+
+   *fp64 = cl->getDeviceInfo(*device, CL_DEVICE_DOUBLE_FP_CONFIG,
+                             sizeof(config), &config, NULL) == CL_SUCCESS &&
+           config != 0;
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: loadSymbol                                                      */
+/* Look name up in the library and store it in the function pointer at     */
+/* field.  Returns 0 if it is missing.                                       */
+/*===========================================================================*/
+static int loadSymbol ( void         *library,
+                        const char   *name,
+                        void         *field )
+{
+   void       *symbol = dlsym(library, name);
+
+   /* POSIX has function and object pointers the same size */
+   memcpy(field, &symbol, sizeof(symbol));
+   return symbol != NULL;
+}
+
+/*===========================================================================*/
+/* Function: makeBuffer                                                      */
+/* A device buffer of bytes, copied from data unless it is NULL.  Returns   */
+/* NULL on failure.                                                          */
+/*===========================================================================*/
+static CLHANDLE makeBuffer ( GPU          *gpu,
+                             size_t        bytes,
+                             const void   *data )
+{
+   CLINT       err;
+
+   return gpu->cl.createBuffer(gpu->context, data ? CL_MEM_READ_ONLY |
+                               CL_MEM_COPY_HOST_PTR : CL_MEM_READ_WRITE,
+                               bytes, (void *)data, &err);
+}
+#endif
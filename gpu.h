@@ -0,0 +1,40 @@
+/*===========================================================================*/
+/* OpenCL kernels for compiled expressions, used by --gpu for the f(x,y)    */
+/* grid.                                                                     */
+/*===========================================================================*/
+#ifndef GPU_H
+#define GPU_H
+
+#include "tinyexpr.h"
+#include "imagebuffer.h"
+
+/*===========================================================================*/
+/* Structure definitions                                                     */
+/*===========================================================================*/
+typedef struct gpu_struct GPU;
+
+/* the colour range of a grid runGpu has evaluated, and its NaN and        */
+/* infinite values; seen is 0 if every value was NaN                        */
+struct gpurange_struct
+   {
+      float             min;
+      float             max;
+      int               seen;
+      unsigned long int nonFinite;
+   };
+typedef struct gpurange_struct GPURANGE;
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+/* Programs are of frame slots x, y and t, 0 to 2.  runGpu evaluates rows   */
+/* grid rows into the tiled z grid, x from xs by column and y from ys by    */
+/* row, the columns being those of the grid.                                 */
+int     gpuSupported    (void);
+GPU    *compileGpu      (const te_program *,int);
+int     runGpu          (GPU *,const double *,const double *,long int,double,
+                         ZGRID *,GPURANGE *);
+void    destroyGpu      (GPU *);
+char   *gpuKernelSource (const te_program *,int);
+
+#endif
@@ -0,0 +1,240 @@
+/*===========================================================================*/
+/* Plot values written as little-endian float32 files, raw or NumPy .npy,  */
+/* through a memory map.                                                     */
+/*                                                                           */
+/* The file is sized and mapped before anything is evaluated, so the values */
+/* go straight into the page cache with no buffer of their own.  Its blocks */
+/* are reserved first where the file system can, so a full disk is an error */
+/* here rather than a SIGBUS later.  A .npy file is version 1.0, its header */
+/* padded to 64 bytes so that the values are aligned.  The view and range  */
+/* of the values go in a JSON file named after the data file, as .npy       */
+/* headers may hold no keys but their own.                                   */
+/*===========================================================================*/
+#define _POSIX_C_SOURCE 200809L
+
+/*===========================================================================*/
+/* Includes                                                                  */
+/*===========================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "gridfile.h"
+
+/*===========================================================================*/
+/* Constants                                                                 */
+/*===========================================================================*/
+#define NPY_ALIGN 64               /* .npy header rounded up to this         */
+#define NPY_HEADER_BYTES 128       /* room for the longest header            */
+#define NPY_PREAMBLE 10            /* magic, version and header length       */
+#define INFO_SUFFIX ".json"
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+static size_t npyHeader     (unsigned char *,long int,long int);
+static int    writeInfo     (const GRIDFILE *,const GRIDINFO *);
+static void   printValue    (FILE *,int,float);
+static int    littleEndian  (void);
+
+/*===========================================================================*/
+/* Function: openGridFile                                                    */
+/* Create fileName in the format, sized for its values, and map it.  Returns */
+/* 0, with no file left behind, if it cannot be made.                        */
+/*===========================================================================*/
+int openGridFile ( GRIDFILE     *file,
+                   const char   *fileName,
+                   int           format,
+                   long int      rows,
+                   long int      columns )
+{
+   unsigned char   header[NPY_HEADER_BYTES];
+   size_t          headerBytes = 0;
+   int             err;
+
+   file->fileName = fileName;
+   file->format   = format;
+   file->rows     = rows;
+   file->columns  = columns;
+   file->count    = (size_t)(rows ? rows : 1)*columns;
+   if ( format == GRID_NPY )
+      headerBytes = npyHeader(header,rows,columns);
+   file->bytes    = headerBytes + sizeof(float)*file->count;
+
+   file->fd = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0666);
+   if ( file->fd < 0 )
+      return 0;
+   if ( ftruncate(file->fd, (off_t)file->bytes) != 0 ){
+     close(file->fd);
+     remove(fileName);
+     return 0;
+   }
+
+   /* file systems without fallocate are left to fill in blocks as written */
+   err = posix_fallocate(file->fd, 0, (off_t)file->bytes);
+   if ( err != 0 && err != EINVAL && err != EOPNOTSUPP ){
+     close(file->fd);
+     remove(fileName);
+     return 0;
+   }
+
+   file->map = (unsigned char *)mmap(NULL, file->bytes, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED, file->fd, 0);
+   if ( file->map == (unsigned char *)MAP_FAILED ){
+     close(file->fd);
+     remove(fileName);
+     return 0;
+   }
+   memcpy(file->map, header, headerBytes);
+   file->values = (float *)(file->map + headerBytes);
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: closeGridFile                                                   */
+/* Put the values in little-endian order, unmap and close the file and      */
+/* write the info beside it.  With no info, or if any of that fails, the    */
+/* files are removed and 0 is returned.                                      */
+/*===========================================================================*/
+int closeGridFile ( GRIDFILE         *file,
+                    const GRIDINFO   *info )
+{
+   unsigned char  *bytes;
+   unsigned char   swap;
+   size_t          k;
+   int             ok = info != NULL;
+
+   if ( ok && !littleEndian() )
+      for (k=0; k<file->count; k++){
+        bytes    = (unsigned char *)&file->values[k];
+        swap     = bytes[0];
+        bytes[0] = bytes[3];
+        bytes[3] = swap;
+        swap     = bytes[1];
+        bytes[1] = bytes[2];
+        bytes[2] = swap;
+      }
+
+   if ( munmap(file->map, file->bytes) != 0 )
+      ok = 0;
+   if ( close(file->fd) != 0 )
+      ok = 0;
+   if ( ok )
+      ok = writeInfo(file,info);
+   if ( !ok )
+      remove(file->fileName);
+   return ok;
+}
+
+/*===========================================================================*/
+/* Function: npyHeader                                                       */
+/* Write the .npy header of a float32 array of rows by columns, or of       */
+/* columns when rows is 0, into header.  Returns its length.                */
+/*===========================================================================*/
+static size_t npyHeader ( unsigned char   *header,
+                          long int         rows,
+                          long int         columns )
+{
+   char        *text = (char *)header + NPY_PREAMBLE;
+   size_t       length;
+   size_t       total;
+
+   if ( rows )
+      sprintf(text, "{'descr': '<f4', 'fortran_order': False, "
+                    "'shape': (%ld, %ld), }", rows, columns);
+   else
+      sprintf(text, "{'descr': '<f4', 'fortran_order': False, "
+                    "'shape': (%ld,), }", columns);
+
+   /* padded with spaces and ended with a newline */
+   length = strlen(text);
+   total  = (NPY_PREAMBLE + length + 1 + NPY_ALIGN - 1)/NPY_ALIGN*NPY_ALIGN;
+   memset(text + length, ' ', total - NPY_PREAMBLE - length - 1);
+   header[total - 1] = '\n';
+
+   memcpy(header, "\223NUMPY", 6);
+   header[6] = 1;
+   header[7] = 0;
+   header[8] = (unsigned char)((total - NPY_PREAMBLE) & 0xFF);
+   header[9] = (unsigned char)((total - NPY_PREAMBLE) >> 8);
+   return total;
+}
+
+/*===========================================================================*/
+/* Function: writeInfo                                                       */
+/* Write the file's shape and the info, as one JSON object, to the file's   */
+/* name with INFO_SUFFIX added.  Returns 0 on failure.                      */
+/*===========================================================================*/
+static int writeInfo ( const GRIDFILE   *file,
+                       const GRIDINFO   *info )
+{
+   FILE       *fp;
+   char       *name;
+   int         ok;
+
+   name = (char *)malloc(strlen(file->fileName) + sizeof(INFO_SUFFIX));
+   if ( !name )
+      return 0;
+   sprintf(name, "%s%s", file->fileName, INFO_SUFFIX);
+   fp = fopen(name, "w");
+   if ( !fp ){
+     free(name);
+     return 0;
+   }
+
+   fprintf(fp, "{\"format\": \"%s\", \"dtype\": \"<f4\", ",
+           file->format == GRID_NPY ? "npy" : "raw");
+   if ( file->rows )
+      fprintf(fp, "\"shape\": [%ld, %ld], \"rows\": \"top first\", ",
+              file->rows, file->columns);
+   else
+      fprintf(fp, "\"shape\": [%ld], ", file->columns);
+   fprintf(fp, "\"width\": %ld, \"height\": %ld, ", info->width,
+           info->height);
+   fprintf(fp, "\"x\": [%.17g, %.17g], \"y\": [%.17g, %.17g], \"t\": %.17g, ",
+           info->xMin, info->xMax, info->yMin, info->yMax, info->t);
+   fprintf(fp, "\"min\": ");
+   printValue(fp,info->seen,info->min);
+   fprintf(fp, ", \"max\": ");
+   printValue(fp,info->seen,info->max);
+   fprintf(fp, ", \"nonFinite\": %lu}\n", info->nonFinite);
+
+   ok = !ferror(fp);
+   if ( fclose(fp) != 0 )
+      ok = 0;
+   if ( !ok )
+      remove(name);
+   free(name);
+   return ok;
+}
+
+/*===========================================================================*/
+/* Function: printValue                                                      */
+/* Print a float as JSON, which has no infinities: null where there is no  */
+/* value or it is infinite.                                                  */
+/*===========================================================================*/
+static void printValue ( FILE    *fp,
+                         int      seen,
+                         float    value )
+{
+   if ( seen && value - value == 0 )
+      fprintf(fp, "%.9g", value);
+   else
+      fprintf(fp, "null");
+}
+
+/*===========================================================================*/
+/* Function: littleEndian                                                    */
+/* 1 if floats are stored least significant byte first.                     */
+/*===========================================================================*/
+static int littleEndian ( void )
+{
+   float           one = 1;
+   unsigned char   bytes[sizeof(float)];
+
+   memcpy(bytes, &one, sizeof(float));
+   return bytes[0] == 0;
+}
@@ -0,0 +1,60 @@
+/*===========================================================================*/
+/* Plot values written as little-endian float32 files, raw or NumPy .npy,  */
+/* through a memory map, with their ranges in a JSON file beside them.      */
+/*===========================================================================*/
+#ifndef GRIDFILE_H
+#define GRIDFILE_H
+
+#include <stddef.h>
+
+/*===========================================================================*/
+/* Constants                                                                 */
+/*===========================================================================*/
+#define GRID_RAW 0                 /* the values and nothing else            */
+#define GRID_NPY 1                 /* after a .npy header                    */
+
+/*===========================================================================*/
+/* Structure definitions                                                     */
+/*===========================================================================*/
+/* a file being filled in; values points into the mapped file */
+struct gridfile_struct
+   {
+      const char       *fileName;
+      int               format;    /* GRID_RAW or GRID_NPY            */
+      long int          rows;      /* 0 for a row of columns values   */
+      long int          columns;
+      int               fd;
+      unsigned char    *map;
+      size_t            bytes;     /* the whole file                  */
+      float            *values;
+      size_t            count;
+   };
+typedef struct gridfile_struct GRIDFILE;
+
+/* what the JSON file records of the values and the view they cover */
+struct gridinfo_struct
+   {
+      long int          width;     /* of the image the values are of  */
+      long int          height;
+      double            xMin;
+      double            xMax;
+      double            yMin;
+      double            yMax;
+      double            t;
+      int               seen;      /* set if min and max hold a value,*/
+      float             min;       /* which may be infinite           */
+      float             max;
+      unsigned long int nonFinite; /* NaN and infinite values         */
+   };
+typedef struct gridinfo_struct GRIDINFO;
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+/* Files hold rows by columns values a row at a time, or a row of columns   */
+/* values when rows is 0.  closeGridFile removes the file when it is given */
+/* no info.                                                                  */
+int     openGridFile  (GRIDFILE *,const char *,int,long int,long int);
+int     closeGridFile (GRIDFILE *,const GRIDINFO *);
+
+#endif
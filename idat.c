@@ -0,0 +1,386 @@
+/*===========================================================================*/
+/* The IDAT data of a PNG, filtered and deflated a band of rows at a time   */
+/* on a thread pool.                                                         */
+/*                                                                           */
+/* As in pigz, every band but the last is ended with a sync flush, which    */
+/* leaves the deflate stream on a byte boundary, so the bands' raw deflate  */
+/* data joined in order is one valid stream.  Each band is primed with the  */
+/* 32 KiB of filtered data before it as its dictionary, so matches across   */
+/* the seams are still found, and the bands' Adler-32 checksums are         */
+/* combined into the stream's.  Rows are filtered as libpng filters them,   */
+/* the adaptive choice being the filter with the smallest sum of absolute   */
+/* differences.                                                              */
+/*===========================================================================*/
+#define _POSIX_C_SOURCE 200809L
+
+/*===========================================================================*/
+/* Includes                                                                  */
+/*===========================================================================*/
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <png.h>
+#include <zlib.h>
+#include "idat.h"
+
+/*===========================================================================*/
+/* Constants                                                                 */
+/*===========================================================================*/
+#define WINDOW_BYTES 32768         /* deflate window, primed from the band   */
+#define WINDOW_BITS -15            /* before; raw deflate, the 32 KiB window */
+#define MEMORY_LEVEL 8             /* zlib's and libpng's default            */
+#define FLUSH_BYTES 16             /* room for a sync flush's empty block    */
+#define FILTER_TYPES 5
+
+/*===========================================================================*/
+/* Structure definitions                                                     */
+/*===========================================================================*/
+/* the image being compressed; each task fills in one band */
+struct idatjob_struct
+   {
+      unsigned char   **rows;
+      long int          height;
+      size_t            rowBytes;
+      int               pixelBytes;  /* filter distance, at least 1      */
+      int               filters;     /* PNG_FILTER_* mask                */
+      int               level;
+      int               strategy;
+      long int          bandRows;
+      const unsigned char *zero;     /* the row above the first          */
+      unsigned char    *filtered;    /* height rows of rowBytes+1        */
+      unsigned long int *adlers;     /* of each band's filtered bytes    */
+      unsigned char    *failed;      /* per band, set if memory ran out  */
+      IDAT             *idat;
+   };
+typedef struct idatjob_struct IDATJOB;
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+static void   filterBand   (void *,long int,int);
+static void   deflateBand  (void *,long int,int);
+static void   filterRow    (unsigned char *,int,const unsigned char *,
+                            const unsigned char *,size_t,int);
+static unsigned long int rowCost (const unsigned char *,size_t);
+static size_t bandLength   (const IDATJOB *,long int);
+
+/*===========================================================================*/
+/* Function: compressIdat                                                    */
+/* Filters and deflates the height rows of rowBytes bytes into idat, one    */
+/* task per band of about IDAT_BAND_BYTES, on the pool.  filters is a mask  */
+/* of PNG_FILTER_* to choose from per row, pixelBytes the distance sub,     */
+/* avg and paeth look back and level and strategy are zlib's.  Returns 0,   */
+/* with nothing allocated, if memory runs out.                               */
+/*===========================================================================*/
+int compressIdat ( IDAT            *idat,
+                   unsigned char  **rows,
+                   long int         height,
+                   size_t           rowBytes,
+                   int              pixelBytes,
+                   int              filters,
+                   int              level,
+                   int              strategy,
+                   THREADPOOL      *pool )
+{
+   IDATJOB            job;
+   unsigned long int  adler;
+   unsigned char     *end;
+   unsigned int       header;
+   long int           b;
+   int                ok;
+
+   job.rows       = rows;
+   job.height     = height;
+   job.rowBytes   = rowBytes;
+   job.pixelBytes = pixelBytes < 1 ? 1 : pixelBytes;
+   job.filters    = filters & PNG_ALL_FILTERS ? filters : PNG_FILTER_NONE;
+   job.level      = level < 0 ? 6 : level;
+   job.strategy   = strategy;
+   job.bandRows   = IDAT_BAND_BYTES/(rowBytes + 1);
+   if ( job.bandRows < 1 )
+      job.bandRows = 1;
+   job.idat       = idat;
+
+   idat->bands    = (height + job.bandRows - 1)/job.bandRows;
+   idat->data     = (unsigned char **)calloc(idat->bands,
+                                             sizeof(unsigned char *));
+   idat->lengths  = (size_t *)calloc(idat->bands, sizeof(size_t));
+   job.adlers     = (unsigned long int *)malloc(sizeof(unsigned long int)*
+                                               idat->bands);
+   job.failed     = (unsigned char *)calloc(idat->bands, 1);
+   job.zero       = (unsigned char *)calloc(rowBytes, 1);
+   job.filtered   = (unsigned char *)malloc((rowBytes + 1)*height);
+   ok = idat->data && idat->lengths && job.adlers && job.failed && job.zero &&
+        job.filtered;
+
+   /* bands are deflated once every band before them is filtered */
+   if ( ok )
+      runParallel(pool, idat->bands, filterBand, &job);
+   if ( ok )
+      runParallel(pool, idat->bands, deflateBand, &job);
+   for (b=0; ok && b<idat->bands; b++)
+      ok = !job.failed[b];
+
+   if ( ok ){
+     /* the zlib header, with the level flags zlib itself would give */
+     header = 0x7800;
+     if ( job.strategy < Z_HUFFMAN_ONLY && job.level >= 2 )
+        header |= (job.level < 6 ? 1 : job.level == 6 ? 2 : 3) << 6;
+     header += 31 - header % 31;
+     idat->data[0][0] = (unsigned char)(header >> 8);
+     idat->data[0][1] = (unsigned char)(header & 0xff);
+
+     adler = job.adlers[0];
+     for (b=1; b<idat->bands; b++)
+        adler = adler32_combine(adler, job.adlers[b], bandLength(&job,b));
+     end = idat->data[idat->bands-1] + idat->lengths[idat->bands-1];
+     end[0] = (unsigned char)(adler >> 24);
+     end[1] = (unsigned char)(adler >> 16);
+     end[2] = (unsigned char)(adler >> 8);
+     end[3] = (unsigned char)adler;
+     idat->lengths[idat->bands-1] += 4;
+   }
+
+   free(job.adlers);
+   free(job.failed);
+   free((unsigned char *)job.zero);
+   free(job.filtered);
+   if ( !ok )
+      freeIdat(idat);
+   return ok;
+}
+
+/*===========================================================================*/
+/* Function: freeIdat                                                        */
+/* Free the bands.                                                           */
+/*===========================================================================*/
+void freeIdat ( IDAT   *idat )
+{
+   long int    b;
+
+   if ( idat->data )
+      for (b=0; b<idat->bands; b++)
+         free(idat->data[b]);
+   free(idat->data);
+   free(idat->lengths);
+   idat->data    = NULL;
+   idat->lengths = NULL;
+   idat->bands   = 0;
+}
+
+/*===========================================================================*/
+/* Function: filterBand                                                      */
+/* Parallel task: filters the rows of one band, each with the filter from   */
+/* the mask that leaves the smallest sum of absolute differences.           */
+/*===========================================================================*/
+static void filterBand ( void       *context,
+                         long int    band,
+                         int         worker )
+{
+   static const int   masks[FILTER_TYPES] = {
+      PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG,
+      PNG_FILTER_PAETH
+   };
+   IDATJOB              *job    = (IDATJOB *)context;
+   size_t                stride = job->rowBytes + 1;
+   const unsigned char  *prior;
+   unsigned char        *out;
+   unsigned char        *trial = NULL;
+   unsigned long int     cost;
+   unsigned long int     best;
+   long int              i;
+   long int              last;
+   int                   type;
+   int                   only = 0;
+   int                   choices = 0;
+
+   (void)worker;
+   for (type=0; type<FILTER_TYPES; type++)
+      if ( job->filters & masks[type] ){
+        only = type;
+        choices++;
+      }
+   if ( choices > 1 ){
+     trial = (unsigned char *)malloc(stride);
+     if ( !trial ){
+       job->failed[band] = 1;
+       return;
+     }
+   }
+
+   last = (band + 1)*job->bandRows;
+   if ( last > job->height )
+      last = job->height;
+   for (i=band*job->bandRows; i<last; i++){
+     prior = i > 0 ? job->rows[i-1] : job->zero;
+     out   = job->filtered + i*stride;
+     if ( choices == 1 ){
+       filterRow(out,only,job->rows[i],prior,job->rowBytes,job->pixelBytes);
+       continue;
+     }
+     best = ULONG_MAX;
+     for (type=0; type<FILTER_TYPES; type++)
+        if ( job->filters & masks[type] ){
+          filterRow(trial,type,job->rows[i],prior,job->rowBytes,
+                    job->pixelBytes);
+          cost = rowCost(trial,job->rowBytes);
+          if ( cost < best ){
+            memcpy(out, trial, stride);
+            best = cost;
+          }
+        }
+   }
+   free(trial);
+}
+
+/*===========================================================================*/
+/* Function: deflateBand                                                     */
+/* Parallel task: deflates one band of filtered rows, after the 32 KiB      */
+/* before it, ending with a sync flush unless it is the last.  Room is left */
+/* for the zlib header before the first band and the checksum after the     */
+/* last.                                                                     */
+/*===========================================================================*/
+static void deflateBand ( void       *context,
+                          long int    band,
+                          int         worker )
+{
+   IDATJOB        *job    = (IDATJOB *)context;
+   IDAT           *idat   = job->idat;
+   size_t          stride = job->rowBytes + 1;
+   size_t          start  = band*job->bandRows*stride;
+   size_t          length = bandLength(job,band);
+   size_t          window = start < WINDOW_BYTES ? start : WINDOW_BYTES;
+   size_t          header = band == 0 ? 2 : 0;
+   size_t          space;
+   int             last   = band == idat->bands - 1;
+   int             result;
+   z_stream        stream;
+   unsigned char  *out;
+
+   (void)worker;
+   job->adlers[band] = adler32(adler32(0L, Z_NULL, 0),
+                               job->filtered + start, length);
+
+   memset(&stream, 0, sizeof(stream));
+   if ( deflateInit2(&stream, job->level, Z_DEFLATED, WINDOW_BITS,
+                     MEMORY_LEVEL, job->strategy) != Z_OK ){
+     job->failed[band] = 1;
+     return;
+   }
+   if ( window > 0 )
+      deflateSetDictionary(&stream, job->filtered + start - window, window);
+
+   space = header + deflateBound(&stream, length) + FLUSH_BYTES;
+   out   = (unsigned char *)malloc(space + (last ? 4 : 0));
+   if ( out ){
+     stream.next_in   = job->filtered + start;
+     stream.avail_in  = length;
+     stream.next_out  = out + header;
+     stream.avail_out = space - header;
+     result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+     if ( (last ? result != Z_STREAM_END : result != Z_OK) ||
+          stream.avail_in != 0 || stream.avail_out == 0 ){
+       free(out);
+       out = NULL;
+     }
+   }
+   if ( out ){
+     idat->data[band]    = out;
+     idat->lengths[band] = space - stream.avail_out;
+   }
+   else
+      job->failed[band] = 1;
+   deflateEnd(&stream);
+}
+
+/*===========================================================================*/
+/* Function: filterRow                                                       */
+/* Writes row, after the PNG filter type byte (0 none to 4 paeth), as that  */
+/* filter leaves it: each byte less its prediction from the byte pixelBytes */
+/* to the left, the one above in prior and the one above that.              */
+/*===========================================================================*/
+static void filterRow ( unsigned char         *out,
+                        int                    type,
+                        const unsigned char   *row,
+                        const unsigned char   *prior,
+                        size_t                 n,
+                        int                    pixelBytes )
+{
+   size_t      k;
+   size_t      lead = (size_t)pixelBytes < n ? (size_t)pixelBytes : n;
+   int         a;
+   int         b;
+   int         c;
+   int         p;
+   int         pa;
+   int         pb;
+   int         pc;
+
+   out[0] = (unsigned char)type;
+   out++;
+   switch ( type ){
+     case 0:
+       memcpy(out, row, n);
+       break;
+     case 1:
+       memcpy(out, row, lead);
+       for (k=lead; k<n; k++)
+          out[k] = (unsigned char)(row[k] - row[k-pixelBytes]);
+       break;
+     case 2:
+       for (k=0; k<n; k++)
+          out[k] = (unsigned char)(row[k] - prior[k]);
+       break;
+     case 3:
+       for (k=0; k<lead; k++)
+          out[k] = (unsigned char)(row[k] - (prior[k] >> 1));
+       for (k=lead; k<n; k++)
+          out[k] = (unsigned char)(row[k] - ((row[k-pixelBytes] + prior[k]) >> 1));
+       break;
+     default:
+       for (k=0; k<lead; k++)
+          out[k] = (unsigned char)(row[k] - prior[k]);
+       for (k=lead; k<n; k++){
+         a  = row[k-pixelBytes];
+         b  = prior[k];
+         c  = prior[k-pixelBytes];
+         p  = a + b - c;
+         pa = abs(p - a);
+         pb = abs(p - b);
+         pc = abs(p - c);
+         out[k] = (unsigned char)(row[k] - (pa <= pb && pa <= pc ? a :
+                                            pb <= pc ? b : c));
+       }
+       break;
+   }
+}
+
+/*===========================================================================*/
+/* Function: rowCost                                                         */
+/* The sum of a filtered row's bytes taken as signed differences, libpng's  */
+/* measure for choosing a filter.                                            */
+/*===========================================================================*/
+static unsigned long int rowCost ( const unsigned char   *filtered,
+                                   size_t                 n )
+{
+   unsigned long int   sum = 0;
+   size_t              k;
+
+   for (k=1; k<=n; k++)
+      sum += filtered[k] < 128 ? filtered[k] : 256 - filtered[k];
+   return sum;
+}
+
+/*===========================================================================*/
+/* Function: bandLength                                                      */
+/* Filtered bytes in a band; the last may be short.                          */
+/*===========================================================================*/
+static size_t bandLength ( const IDATJOB   *job,
+                           long int         band )
+{
+   long int    rows = job->height - band*job->bandRows;
+
+   if ( rows > job->bandRows )
+      rows = job->bandRows;
+   return rows*(job->rowBytes + 1);
+}
@@ -0,0 +1,37 @@
+/*===========================================================================*/
+/* The IDAT data of a PNG, filtered and deflated a band of rows at a time   */
+/* on a thread pool.                                                         */
+/*===========================================================================*/
+#ifndef IDAT_H
+#define IDAT_H
+
+#include <stddef.h>
+#include "threadpool.h"
+
+/*===========================================================================*/
+/* Constants                                                                 */
+/*===========================================================================*/
+#define IDAT_BAND_BYTES 262144     /* filtered bytes deflated per task       */
+
+/*===========================================================================*/
+/* Structure definitions                                                     */
+/*===========================================================================*/
+/* one zlib stream in pieces, a band of rows each: the first starts with   */
+/* the zlib header and the last ends with the Adler-32 checksum, so written */
+/* out in order, as one IDAT chunk each, they make a PNG's image data       */
+struct idat_struct
+   {
+      long int          bands;
+      unsigned char   **data;
+      size_t           *lengths;
+   };
+typedef struct idat_struct IDAT;
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+int     compressIdat (IDAT *,unsigned char **,long int,size_t,int,int,
+                      int,int,THREADPOOL *);
+void    freeIdat     (IDAT *);
+
+#endif
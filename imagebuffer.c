@@ -0,0 +1,163 @@
+/*===========================================================================*/
+/* Heap storage for images and the f(x,y) grid of z values.                  */
+/*                                                                           */
+/* Every buffer is aligned to a cache line.  Images are a single block with  */
+/* row pointers into it, as libpng wants; the z grid is stored as square     */
+/* tiles so that evaluating and colouring a tile stays within a few pages.   */
+/*===========================================================================*/
+#define _POSIX_C_SOURCE 200809L
+
+/*===========================================================================*/
+/* Includes                                                                  */
+/*===========================================================================*/
+#include <stdlib.h>
+#include "imagebuffer.h"
+
+/*===========================================================================*/
+/* Function: alignedAlloc                                                    */
+/* Allocate size bytes aligned to CACHE_LINE.  Returns NULL on failure.      */
+/*===========================================================================*/
+void *alignedAlloc ( size_t   size )
+{
+   void   *block;
+
+   if ( posix_memalign(&block, CACHE_LINE, size ? size : 1) != 0 )
+      return NULL;
+   return block;
+}
+
+/*===========================================================================*/
+/* Function: alignedFree                                                     */
+/* Free a block from alignedAlloc.  Safe to call on NULL.                    */
+/*===========================================================================*/
+void alignedFree ( void   *block )
+{
+   free(block);
+}
+
+/*===========================================================================*/
+/* Function: createImageBuffer                                               */
+/* Allocate height rows of rowBytes each, padding every row to a whole       */
+/* number of cache lines.  Returns 0 on failure, leaving nothing allocated.  */
+/*===========================================================================*/
+int createImageBuffer ( IMAGEBUFFER   *image,
+                        long int       height,
+                        size_t         rowBytes )
+{
+   image->pixels     = NULL;
+   image->rows       = NULL;
+   image->pixelSpace = 0;
+   image->rowSpace   = 0;
+   if ( !resizeImageBuffer(image, height, rowBytes) ){
+     destroyImageBuffer(image);
+     return 0;
+   }
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: resizeImageBuffer                                               */
+/* Reshape a buffer for a new image, keeping its memory when it is already   */
+/* large enough.  Returns 0 on failure, leaving the buffer as it was.        */
+/*===========================================================================*/
+int resizeImageBuffer ( IMAGEBUFFER   *image,
+                        long int       height,
+                        size_t         rowBytes )
+{
+   long int         y;
+   size_t           stride = (rowBytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+   unsigned char   *pixels;
+   unsigned char  **rows;
+
+   if ( height > image->rowSpace || !image->rows ){
+     rows = (unsigned char **)realloc(image->rows,
+                                      sizeof(unsigned char *)*(height ? height : 1));
+     if ( !rows )
+        return 0;
+     image->rows     = rows;
+     image->rowSpace = height;
+   }
+
+   if ( stride*height > image->pixelSpace ){
+     pixels = (unsigned char *)alignedAlloc(stride*height);
+     if ( !pixels )
+        return 0;
+     alignedFree(image->pixels);
+     image->pixels     = pixels;
+     image->pixelSpace = stride*height;
+   }
+
+   image->height   = height;
+   image->rowBytes = rowBytes;
+   for (y=0; y<height; y++)
+      image->rows[y] = image->pixels + y*stride;
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: destroyImageBuffer                                              */
+/* Free the memory used to store the image.                                  */
+/*===========================================================================*/
+void destroyImageBuffer ( IMAGEBUFFER   *image )
+{
+   alignedFree(image->pixels);
+   free(image->rows);
+   image->pixels     = NULL;
+   image->rows       = NULL;
+   image->pixelSpace = 0;
+   image->rowSpace   = 0;
+}
+
+/*===========================================================================*/
+/* Function: createZGrid                                                     */
+/* Allocate a tiled grid of rows by columns z values.  Returns 0 on failure. */
+/*===========================================================================*/
+int createZGrid ( ZGRID      *grid,
+                  long int    rows,
+                  long int    columns )
+{
+   grid->rows        = rows;
+   grid->columns     = columns;
+   grid->tileRows    = (rows + TILE_SIZE - 1) / TILE_SIZE;
+   grid->tileColumns = (columns + TILE_SIZE - 1) / TILE_SIZE;
+   grid->tileRowStep = grid->tileColumns*TILE_SIZE*TILE_SIZE;
+   grid->tileStep    = TILE_SIZE*TILE_SIZE;
+   grid->rowStep     = TILE_SIZE;
+   grid->mapped      = 0;
+   grid->values      = (float *)alignedAlloc(sizeof(float)*TILE_SIZE*TILE_SIZE
+                                             *grid->tileRows*grid->tileColumns);
+   return grid->values != NULL;
+}
+
+/*===========================================================================*/
+/* Function: mapZGrid                                                        */
+/* Lay a grid of rows by columns z values over values, which holds them a   */
+/* row at a time, the last row first, as an image's rows are held.  The     */
+/* values stay the caller's; destroyZGrid leaves them alone.                 */
+/*===========================================================================*/
+void mapZGrid ( ZGRID      *grid,
+                float      *values,
+                long int    rows,
+                long int    columns )
+{
+   grid->rows        = rows;
+   grid->columns     = columns;
+   grid->tileRows    = (rows + TILE_SIZE - 1) / TILE_SIZE;
+   grid->tileColumns = (columns + TILE_SIZE - 1) / TILE_SIZE;
+   grid->tileRowStep = -TILE_SIZE*columns;
+   grid->tileStep    = TILE_SIZE;
+   grid->rowStep     = -columns;
+   grid->mapped      = 1;
+   grid->values      = values + (rows - 1)*columns;
+}
+
+/*===========================================================================*/
+/* Function: destroyZGrid                                                    */
+/* Free the grid.                                                            */
+/*===========================================================================*/
+void destroyZGrid ( ZGRID   *grid )
+{
+   if ( !grid->mapped )
+      alignedFree(grid->values);
+   grid->values = NULL;
+}
@@ -0,0 +1,67 @@
+/*===========================================================================*/
+/* Heap storage for images and the f(x,y) grid of z values.                  */
+/*===========================================================================*/
+#ifndef IMAGEBUFFER_H
+#define IMAGEBUFFER_H
+
+#include <stddef.h>
+
+/*===========================================================================*/
+/* Constants                                                                 */
+/*===========================================================================*/
+#define CACHE_LINE 64              /* alignment of every buffer              */
+#define TILE_SIZE  64              /* z grid tiles are TILE_SIZE square      */
+
+/*===========================================================================*/
+/* Structure definitions                                                     */
+/*===========================================================================*/
+/* one contiguous block of pixels with a pointer to the start of each row */
+struct imagebuffer_struct
+   {
+      unsigned char    *pixels;
+      unsigned char   **rows;
+      size_t            rowBytes;
+      long int          height;
+      size_t            pixelSpace;  /* bytes allocated for pixels */
+      long int          rowSpace;    /* row pointers allocated     */
+   };
+typedef struct imagebuffer_struct IMAGEBUFFER;
+
+/* z values stored tile by tile; each tile is TILE_SIZE rows of TILE_SIZE   */
+/* values, so a tile is one contiguous block and edge tiles are padded.    */
+/* A mapped grid instead lies over rows of someone else's values, and only */
+/* its real rows and columns may be touched.                               */
+struct zgrid_struct
+   {
+      float            *values;
+      long int          rows;
+      long int          columns;
+      long int          tileRows;
+      long int          tileColumns;
+      long int          tileRowStep;  /* values from tile row to tile row */
+      long int          tileStep;     /* from tile to tile along a row    */
+      long int          rowStep;      /* from row to row within a tile    */
+      int               mapped;       /* set by mapZGrid                  */
+   };
+typedef struct zgrid_struct ZGRID;
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+void   *alignedAlloc       (size_t);
+void    alignedFree        (void *);
+
+int     createImageBuffer  (IMAGEBUFFER *,long int,size_t);
+int     resizeImageBuffer  (IMAGEBUFFER *,long int,size_t);
+void    destroyImageBuffer (IMAGEBUFFER *);
+
+int     createZGrid        (ZGRID *,long int,long int);
+void    mapZGrid           (ZGRID *,float *,long int,long int);
+void    destroyZGrid       (ZGRID *);
+
+/* start of row r (0..TILE_SIZE-1) within the tile at (tileRow,tileColumn) */
+#define ZGRID_TILE_ROW(g,tileRow,tileColumn,r) \
+   ((g)->values + (long int)(tileRow)*(g)->tileRowStep + \
+    (long int)(tileColumn)*(g)->tileStep + (long int)(r)*(g)->rowStep)
+
+#endif
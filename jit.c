@@ -0,0 +1,1187 @@
+/*===========================================================================*/
+/* Native code for compiled expressions, used by --jit.                      */
+/*                                                                           */
+/* A te_program is lowered to x86-64 kernels that evaluate it over a range   */
+/* of points:                                                                */
+/*                                                                           */
+/*    void kernel(const double *frame, const double *const *columns,         */
+/*                double *out, size_t first, size_t end);                    */
+/*                                                                           */
+/* Instructions that depend only on frame variables run once per call,       */
+/* ahead of the loop over the points.  Where the processor has AVX2 the      */
+/* points are then taken JIT_BLOCK at a time; within a block each run of     */
+/* arithmetic instructions is one loop, four points a step, that keeps its   */
+/* intermediate values in ymm registers.  Transcendental builtins run over   */
+/* the whole block through the interpreter's vector kernels, and the other   */
+/* calls one point at a time.  Whatever is left over, or everything when     */
+/* AVX2 is missing, is taken one point at a time in SSE2 scalars.  Either    */
+/* way results match te_eval_batch_frame exactly.                            */
+/*                                                                           */
+/* On other targets, or when built with -DJIT_DISABLE, compileJit returns    */
+/* NULL and callers keep using the interpreter.                              */
+/*===========================================================================*/
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+/*===========================================================================*/
+/* Includes                                                                  */
+/*===========================================================================*/
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "jit.h"
+
+#if defined(__x86_64__) && defined(__unix__) && defined(__GNUC__) && \
+    !defined(JIT_DISABLE)
+#define JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+/*===========================================================================*/
+/* Constants                                                                 */
+/*===========================================================================*/
+#define JIT_MAX_ARITY 7            /* most operands an instruction reads     */
+#define JIT_BLOCK 64               /* points per block in the AVX2 kernel    */
+#define JIT_MAX_FRAME (1L << 18)   /* stack bytes the AVX2 kernel may use    */
+#define JIT_LOCAL_COLUMNS 16       /* columns runJit and evalJit keep on the */
+                                   /* stack                                  */
+
+/* a string literal of machine code and its length, zero bytes included */
+#define BYTES(s) s, sizeof(s) - 1
+
+/* x86-64 registers used in memory operands, and the ymm scratch pair */
+#define RAX 0
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define SCRATCH0 14
+#define SCRATCH1 15
+
+/* kinds of instruction in the AVX2 kernel */
+#define RUN_INLINE  0              /* a vector instruction or two            */
+#define RUN_BLOCK   1              /* te_eval_builtin over the block         */
+#define RUN_POINTS  2              /* a C call per point                     */
+
+/*===========================================================================*/
+/* Structure definitions                                                     */
+/*===========================================================================*/
+typedef void (*KERNEL)(const double *,const double *const *,double *,
+                       size_t,size_t);
+
+struct jit_struct
+   {
+      void             *code;      /* mapped executable pages             */
+      size_t            size;
+      KERNEL            wide;      /* JIT_BLOCK points a step, or NULL    */
+      KERNEL            narrow;    /* one point a step                    */
+      unsigned long int varying;   /* variables read from columns         */
+      int               pad;       /* pure, so a partial block may be     */
+                                   /* evaluated as a full one             */
+      int               variables; /* te_program slots                    */
+   };
+
+#ifdef JIT_X86_64
+/* machine code being written; with code NULL only the length is counted */
+struct emitter_struct
+   {
+      unsigned char    *code;
+      size_t            length;
+   };
+typedef struct emitter_struct EMITTER;
+
+/* a register, or the memory at [base + index + disp] */
+struct operand_struct
+   {
+      int               reg;       /* -1 for a memory operand             */
+      int               base;
+      int               index;     /* -1 for none                         */
+      long int          disp;
+   };
+typedef struct operand_struct OPERAND;
+
+/* where each instruction of the program reads and writes its values */
+struct layout_struct
+   {
+      const te_program *program;
+      void             *block;     /* one allocation holding the arrays   */
+      char             *uniform;   /* run once, before the point loop     */
+      char             *outside;   /* read outside its own run, or result */
+      long int         *values;    /* JIT_MAX_ARITY operand writers each  */
+      long int         *slots;     /* JIT_MAX_ARITY operand slots each    */
+      long int         *targets;   /* slot each instruction writes        */
+      long int         *lastUse;   /* last reader within its own run      */
+      long int          result;    /* instruction computing the result    */
+      long int          resultSlot;
+      long int          slotCount;
+   };
+typedef struct layout_struct LAYOUT;
+
+/* the AVX2 kernel's stack frame, and the ymm registers of the current run */
+struct wide_struct
+   {
+      const LAYOUT     *layout;
+      long int          blockBase;  /* block-wide register slots          */
+      long int          constBase;  /* sign mask, abs mask, NaN           */
+      long int          frameBytes;
+      int              *holder;     /* ymm holding each value, or -1      */
+      int               free[SCRATCH0];
+   };
+typedef struct wide_struct WIDE;
+#endif
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+#ifdef JIT_X86_64
+static int   readOperands    (const te_program *,const te_instr *,int *);
+static int   planLayout      (const te_program *,unsigned long int,LAYOUT *);
+static int   runKind         (const te_instr *);
+static void  emitNarrow      (EMITTER *,const LAYOUT *);
+static void  emitInstruction (EMITTER *,const LAYOUT *,long int);
+static void  emitCall        (EMITTER *,const void *,const void *,
+                              const long int *,int,long int);
+static void  emitBuiltin     (EMITTER *,int,long int,long int,long int);
+static void  emitWide        (EMITTER *,WIDE *);
+static void  emitInlineRun   (EMITTER *,WIDE *,long int,long int);
+static void  emitInlineOp    (EMITTER *,WIDE *,long int);
+static int   fetchValue      (EMITTER *,WIDE *,long int,int);
+static void  emitPointCall   (EMITTER *,WIDE *,long int);
+static OPERAND wideSlot      (const WIDE *,long int);
+static OPERAND memory        (int,int,long int);
+static OPERAND ymm           (int);
+static void  emitVex         (EMITTER *,int,int,int,int,int,const OPERAND *);
+static void  emitSse         (EMITTER *,int,int,int,const OPERAND *);
+static void  emitModrm       (EMITTER *,int,const OPERAND *);
+static void  emitStack       (EMITTER *,const char *,size_t,int,long int);
+static void  emitBytes       (EMITTER *,const char *,size_t);
+static void  emitWord        (EMITTER *,long int);
+static void  emitQuad        (EMITTER *,const void *);
+#endif
+
+/*===========================================================================*/
+/* Function: jitSupported                                                    */
+/* Nonzero if compileJit can produce native code on this build.              */
+/*===========================================================================*/
+int jitSupported ( void )
+{
+#ifdef JIT_X86_64
+   return 1;
+#else
+   return 0;
+#endif
+}
+
+/*===========================================================================*/
+/* Function: compileJit                                                      */
+/* Translate the program to native code.  Bit i of varying is set when       */
+/* variable i is given per point in the columns passed to runJit.  Returns   */
+/* NULL if native code is not supported here or memory runs out.             */
+/*===========================================================================*/
+JIT *compileJit ( const te_program   *program,
+                  unsigned long int   varying )
+{
+#ifdef JIT_X86_64
+   JIT         *jit;
+   LAYOUT       layout;
+   WIDE         wide;
+   EMITTER      emitter;
+   void        *pages;
+   size_t       narrow = 0;
+   int          i;
+
+   if ( !program || !planLayout(program, varying, &layout) )
+      return NULL;
+
+   /* the AVX2 kernel only where it is supported and its frame is modest */
+   __builtin_cpu_init();
+   wide.layout     = &layout;
+   wide.blockBase  = 8L*layout.slotCount;
+   wide.constBase  = wide.blockBase + 8L*JIT_BLOCK*program->registers;
+   wide.frameBytes = wide.constBase + 3*32;
+   wide.frameBytes += wide.frameBytes % 16 ? 0 : 8;
+   wide.holder     = NULL;
+   if ( __builtin_cpu_supports("avx2") && wide.frameBytes <= JIT_MAX_FRAME ){
+     wide.holder = (int *)malloc(sizeof(int)*program->length);
+     if ( !wide.holder ){
+       free(layout.block);
+       return NULL;
+     }
+   }
+
+   /* one pass to size the code, one to write it */
+   for (i=0; i<2; i++){
+     if ( i == 1 ){
+       pages = mmap(NULL, emitter.length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+       if ( pages == MAP_FAILED )
+          break;
+       emitter.code = (unsigned char *)pages;
+     }
+     else
+       emitter.code = NULL;
+     emitter.length = 0;
+     if ( wide.holder )
+        emitWide(&emitter, &wide);
+     narrow = emitter.length;
+     emitNarrow(&emitter, &layout);
+   }
+   free(layout.block);
+   jit = i == 2 ? (JIT *)malloc(sizeof(JIT)) : NULL;
+
+   if ( !jit || mprotect(pages, emitter.length, PROT_READ | PROT_EXEC) != 0 ){
+     if ( i == 2 )
+        munmap(pages, emitter.length);
+     free(wide.holder);
+     free(jit);
+     return NULL;
+   }
+
+   /* the kernels' addresses become function pointers through their bytes */
+   jit->code      = pages;
+   jit->size      = emitter.length;
+   jit->varying   = varying;
+   jit->pad       = wide.holder != NULL;
+   for (i=0; i<program->length; i++)
+      if ( !program->code[i].pure )
+         jit->pad = 0;
+   jit->variables = program->slots;
+   jit->wide      = NULL;
+   if ( wide.holder )
+      memcpy(&jit->wide, &pages, sizeof(jit->wide));
+   pages = (unsigned char *)pages + narrow;
+   memcpy(&jit->narrow, &pages, sizeof(jit->narrow));
+   free(wide.holder);
+   return jit;
+#else
+   (void)program;
+   (void)varying;
+   return NULL;
+#endif
+}
+
+/*===========================================================================*/
+/* Function: runJit                                                          */
+/* Evaluate at n points into out.  columns[i] holds the n values of each     */
+/* varying variable i; every other variable is read from frame[i].  Like     */
+/* te_eval_batch_frame, this may be called from any number of threads.       */
+/* A last partial block of a pure program is copied out to a full one, since */
+/* one point at a time the builtins cost several times as much.              */
+/*===========================================================================*/
+void runJit ( const JIT             *jit,
+              const double          *frame,
+              const double *const   *columns,
+              double                *out,
+              size_t                 n )
+{
+   double          pad[JIT_LOCAL_COLUMNS][JIT_BLOCK];
+   double          padOut[JIT_BLOCK];
+   const double   *padColumns[JIT_LOCAL_COLUMNS];
+   size_t          split = jit->wide ? n - n % JIT_BLOCK : 0;
+   size_t          k;
+   int             i;
+
+   if ( split > 0 )
+      jit->wide(frame, columns, out, 0, split);
+   if ( split == n )
+      return;
+
+   if ( !jit->pad || jit->variables > JIT_LOCAL_COLUMNS ){
+     jit->narrow(frame, columns, out, split, n);
+     return;
+   }
+
+   for (i=0; i<jit->variables; i++){
+     padColumns[i] = NULL;
+     if ( i >= (int)(8*sizeof(jit->varying)) || !(jit->varying >> i & 1) )
+        continue;
+     for (k=0; k<JIT_BLOCK; k++)
+        pad[i][k] = columns[i][k < n - split ? split + k : n - 1];
+     padColumns[i] = pad[i];
+   }
+   jit->wide(frame, padColumns, padOut, 0, JIT_BLOCK);
+   memcpy(out + split, padOut, sizeof(double)*(n - split));
+}
+
+/*===========================================================================*/
+/* Function: evalJit                                                         */
+/* Evaluate once, reading every variable, varying or not, from frame.        */
+/*===========================================================================*/
+double evalJit ( const JIT      *jit,
+                 const double   *frame )
+{
+   const double    *local[JIT_LOCAL_COLUMNS];
+   const double   **columns = local;
+   double           result;
+   int              i;
+
+   /* the kernel is handed columns even when it has none to read */
+   local[0] = NULL;
+   if ( jit->variables > JIT_LOCAL_COLUMNS ){
+     columns = (const double **)malloc(sizeof(double *)*jit->variables);
+     if ( !columns )
+        return NAN;
+   }
+   for (i=0; i<jit->variables; i++)
+      columns[i] = frame + i;
+
+   jit->narrow(frame, columns, &result, 0, 1);
+
+   if ( columns != local )
+      free(columns);
+   return result;
+}
+
+/*===========================================================================*/
+/* Function: destroyJit                                                      */
+/* Unmap the code and free the handle.  Safe to call on NULL.                */
+/*===========================================================================*/
+void destroyJit ( JIT   *jit )
+{
+   if ( !jit )
+      return;
+#ifdef JIT_X86_64
+   munmap(jit->code, jit->size);
+#endif
+   free(jit);
+}
+
+#ifdef JIT_X86_64
+/*===========================================================================*/
+/* Function: readOperands                                                    */
+/* Store the registers the instruction reads in regs; returns how many.      */
+/*===========================================================================*/
+static int readOperands ( const te_program   *program,
+                          const te_instr     *ip,
+                          int                *regs )
+{
+   int   arity;
+   int   i;
+
+   switch ( ip->op ){
+     case TE_OP_CONSTANT: case TE_OP_VARIABLE:
+        return 0;
+     case TE_OP_ADD: case TE_OP_SUB: case TE_OP_MUL: case TE_OP_DIV:
+     case TE_OP_MOD: case TE_OP_POW:
+        regs[0] = ip->a;
+        regs[1] = ip->b;
+        return 2;
+   }
+   if ( ip->op < TE_OP_FUNCTION0 ){
+     regs[0] = ip->a;
+     return 1;
+   }
+
+   arity = (ip->op - TE_OP_FUNCTION0) & 7;
+   for (i=0; i<arity; i++)
+      regs[i] = arity > 2 ? program->args[ip->a + i] : (i ? ip->b : ip->a);
+   return arity;
+}
+
+/*===========================================================================*/
+/* Function: planLayout                                                      */
+/* Decide which instructions run before the point loop and which stack slot */
+/* every value lives in.  Program registers keep slots 0..registers-1; each */
+/* instruction run ahead of the loop gets a slot of its own after those, so */
+/* that no register reuse inside the loop can overwrite it.  Also notes, for */
+/* the AVX2 kernel, which values are read outside the run of inline          */
+/* instructions that computes them.  Returns 0 if memory runs out.           */
+/*===========================================================================*/
+static int planLayout ( const te_program    *program,
+                        unsigned long int    varying,
+                        LAYOUT              *layout )
+{
+   const te_instr  *ip;
+   long int        *writer;
+   long int        *run;
+   long int         length = program->length;
+   long int         i;
+   long int         v;
+   int              regs[JIT_MAX_ARITY];
+   int              count;
+   int              j;
+
+   layout->program = program;
+   layout->block   = malloc(sizeof(long int)*((2*JIT_MAX_ARITY + 3)*length
+                                              + program->registers)
+                            + 2*length);
+   if ( !layout->block )
+      return 0;
+   layout->values  = (long int *)layout->block;
+   layout->slots   = layout->values + JIT_MAX_ARITY*length;
+   layout->targets = layout->slots + JIT_MAX_ARITY*length;
+   layout->lastUse = layout->targets + length;
+   run             = layout->lastUse + length;
+   writer          = run + length;
+   layout->uniform = (char *)(writer + program->registers);
+   layout->outside = layout->uniform + length;
+
+   for (i=0; i<program->registers; i++)
+      writer[i] = -1;
+
+   for (i=0; i<length; i++){
+     ip = program->code + i;
+     count = readOperands(program, ip, regs);
+
+     if ( ip->op == TE_OP_VARIABLE )
+        layout->uniform[i] = !(ip->a >= 0 && ip->a < (int)(8*sizeof(varying))
+                               && (varying >> ip->a & 1));
+     else
+        layout->uniform[i] = (char)(ip->pure != 0);
+
+     for (j=0; j<count; j++){
+       v = writer[regs[j]];
+       if ( v < 0 || !layout->uniform[v] )
+          layout->uniform[i] = 0;
+       layout->values[JIT_MAX_ARITY*i + j] = v;
+       layout->slots[JIT_MAX_ARITY*i + j]  = v < 0 ? regs[j]
+                                                   : layout->targets[v];
+     }
+
+     layout->targets[i] = layout->uniform[i] ? program->registers + i
+                                             : ip->dst;
+     writer[ip->dst] = i;
+   }
+
+   layout->result     = writer[program->result];
+   layout->resultSlot = layout->result < 0 ? program->result
+                        : layout->targets[layout->result];
+   layout->slotCount  = program->registers + length;
+
+   /* runs: consecutive per-point instructions of the same inline kind */
+   for (i=0, v=-1; i<length; i++){
+     if ( layout->uniform[i] )
+        continue;
+     if ( runKind(program->code + i) != RUN_INLINE || v < 0 ||
+          runKind(program->code + v) != RUN_INLINE )
+        v = i;
+     run[i] = v;
+   }
+
+   for (i=0; i<length; i++){
+     layout->lastUse[i] = -1;
+     layout->outside[i] = (char)(i == layout->result);
+   }
+   for (i=0; i<length; i++){
+     if ( layout->uniform[i] )
+        continue;
+     count = readOperands(program, program->code + i, regs);
+     for (j=0; j<count; j++){
+       v = layout->values[JIT_MAX_ARITY*i + j];
+       if ( v < 0 || layout->uniform[v] )
+          continue;
+       if ( run[v] == run[i] && runKind(program->code + i) == RUN_INLINE )
+          layout->lastUse[v] = i;
+       else
+          layout->outside[v] = 1;
+     }
+   }
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: runKind                                                         */
+/* How the AVX2 kernel evaluates a per-point instruction.                    */
+/*===========================================================================*/
+static int runKind ( const te_instr   *ip )
+{
+   switch ( ip->op ){
+     case TE_OP_SIN: case TE_OP_COS: case TE_OP_TAN:
+     case TE_OP_EXP: case TE_OP_LN: case TE_OP_LOG10:
+        return RUN_BLOCK;
+     case TE_OP_MOD: case TE_OP_POW:
+        return RUN_POINTS;
+   }
+   return ip->op >= TE_OP_FUNCTION0 ? RUN_POINTS : RUN_INLINE;
+}
+
+/*===========================================================================*/
+/* Function: emitNarrow                                                      */
+/* The SSE2 kernel: save the callee-saved registers it uses (rbx = frame,    */
+/* r12 = columns, r13 = out, r14 = end, r15 = point), run the uniform        */
+/* instructions, then loop over the points one at a time.  Slot s is         */
+/* [rsp+8s].                                                                 */
+/*===========================================================================*/
+static void emitNarrow ( EMITTER        *e,
+                         const LAYOUT   *layout )
+{
+   const te_program  *program = layout->program;
+   EMITTER            patch;
+   long int           frameBytes;
+   long int           i;
+   size_t             exit;
+   size_t             top;
+
+   /* six pushes and the return address leave rsp 8 off 16-byte alignment */
+   frameBytes = 8L*layout->slotCount;
+   frameBytes += frameBytes % 16 ? 0 : 8;
+
+   emitBytes(e, BYTES("\x55\x48\x89\xE5\x53\x41\x54\x41\x55\x41\x56\x41\x57"));
+   emitBytes(e, BYTES("\x48\x81\xEC"));             /* sub rsp,frameBytes */
+   emitWord(e, frameBytes);
+   emitBytes(e, BYTES("\x48\x89\xFB\x49\x89\xF4\x49\x89\xD5"
+                      "\x49\x89\xCF\x4D\x89\xC6"));
+
+   for (i=0; i<program->length; i++)
+      if ( layout->uniform[i] )
+         emitInstruction(e, layout, i);
+
+   top = e->length;
+   emitBytes(e, BYTES("\x4D\x39\xF7\x0F\x83"));     /* cmp r15,r14; jae   */
+   exit = e->length;
+   emitWord(e, 0);
+
+   for (i=0; i<program->length; i++)
+      if ( !layout->uniform[i] )
+         emitInstruction(e, layout, i);
+   emitStack(e, BYTES("\xF2\x0F\x10"), 0, 8L*layout->resultSlot);
+   emitBytes(e, BYTES("\xF2\x43\x0F\x11\x44\xFD\x00"));   /* out[r15]     */
+   emitBytes(e, BYTES("\x49\x83\xC7\x01\xE9"));     /* ++r15; jmp top     */
+   emitWord(e, (long int)top - (long int)(e->length + 4));
+
+   /* patch the loop exit now that its target is known */
+   patch.code   = e->code;
+   patch.length = exit;
+   emitWord(&patch, (long int)e->length - (long int)(exit + 4));
+
+   emitBytes(e, BYTES("\x48\x81\xC4"));             /* add rsp,frameBytes */
+   emitWord(e, frameBytes);
+   emitBytes(e, BYTES("\x41\x5F\x41\x5E\x41\x5D\x41\x5C\x5B\x5D\xC3"));
+}
+
+/*===========================================================================*/
+/* Function: emitInstruction                                                 */
+/* One program instruction in SSE2 scalars, reading and writing the slots    */
+/* [rsp+8s] through xmm0 and xmm1.                                           */
+/*===========================================================================*/
+static void emitInstruction ( EMITTER        *e,
+                              const LAYOUT   *layout,
+                              long int        i )
+{
+   const te_instr    *ip = layout->program->code + i;
+   const long int    *from = layout->slots + JIT_MAX_ARITY*i;
+   long int           to = layout->targets[i];
+   unsigned long int  mask;
+   double             nan = NAN;
+   double           (*unary)(double) = NULL;
+   double           (*binary)(double,double) = NULL;
+
+   switch ( ip->op ){
+     case TE_OP_CONSTANT:
+        emitBytes(e, BYTES("\x48\xB8"));            /* mov rax,value      */
+        emitQuad(e, &ip->value);
+        emitStack(e, BYTES("\x48\x89"), 0, 8L*to);  /* mov [slot],rax     */
+        return;
+
+     case TE_OP_VARIABLE:
+        if ( !layout->uniform[i] ){
+          /* mov rax,[r12+8a]; movsd xmm0,[rax+8*r15] */
+          emitBytes(e, BYTES("\x49\x8B\x84\x24"));
+          emitWord(e, 8L*ip->a);
+          emitBytes(e, BYTES("\xF2\x42\x0F\x10\x04\xF8"));
+        }
+        else if ( ip->a >= 0 ){
+          emitBytes(e, BYTES("\xF2\x0F\x10\x83"));  /* movsd xmm0,[rbx+8a] */
+          emitWord(e, 8L*ip->a);
+        }
+        else {
+          emitBytes(e, BYTES("\x48\xB8"));          /* mov rax,bound      */
+          emitQuad(e, &ip->bound);
+          emitBytes(e, BYTES("\xF2\x0F\x10\x00"));  /* movsd xmm0,[rax]   */
+        }
+        break;
+
+     case TE_OP_ADD: case TE_OP_SUB: case TE_OP_MUL: case TE_OP_DIV:
+        emitStack(e, BYTES("\xF2\x0F\x10"), 0, 8L*from[0]);
+        emitStack(e, ip->op == TE_OP_ADD ? "\xF2\x0F\x58" :
+                     ip->op == TE_OP_SUB ? "\xF2\x0F\x5C" :
+                     ip->op == TE_OP_MUL ? "\xF2\x0F\x59" : "\xF2\x0F\x5E",
+                  3, 0, 8L*from[1]);
+        break;
+
+     case TE_OP_NEG: case TE_OP_ABS:
+        mask = ip->op == TE_OP_NEG ? 1UL << 63 : ~(1UL << 63);
+        emitStack(e, BYTES("\xF2\x0F\x10"), 0, 8L*from[0]);
+        emitBytes(e, BYTES("\x48\xB8"));
+        emitQuad(e, &mask);
+        emitBytes(e, BYTES("\x66\x48\x0F\x6E\xC8"));  /* movq xmm1,rax    */
+        if ( ip->op == TE_OP_NEG )
+           emitBytes(e, BYTES("\x66\x0F\x57\xC1"));  /* xorpd xmm0,xmm1   */
+        else
+           emitBytes(e, BYTES("\x66\x0F\x54\xC1"));  /* andpd xmm0,xmm1   */
+        break;
+
+     case TE_OP_SQRT:
+        emitStack(e, BYTES("\xF2\x0F\x51"), 0, 8L*from[0]);
+        break;
+
+     case TE_OP_MOD:   binary = fmod;  break;
+     case TE_OP_POW:   binary = pow;   break;
+     case TE_OP_FLOOR: unary  = floor; break;
+     case TE_OP_CEIL:  unary  = ceil;  break;
+     case TE_OP_SIN:   unary  = sin;   break;
+     case TE_OP_COS:   unary  = cos;   break;
+     case TE_OP_TAN:   unary  = tan;   break;
+     case TE_OP_EXP:   unary  = exp;   break;
+     case TE_OP_LN:    unary  = log;   break;
+     case TE_OP_LOG10: unary  = log10; break;
+
+     default:
+        if ( ip->op >= TE_OP_FUNCTION0 && ip->op <= TE_OP_CLOSURE7 ){
+          emitCall(e, &ip->function,
+                   ip->op >= TE_OP_CLOSURE0 ? &ip->context : NULL,
+                   from, (ip->op - TE_OP_FUNCTION0) & 7, to);
+          return;
+        }
+        emitBytes(e, BYTES("\x48\xB8"));
+        emitQuad(e, &nan);
+        emitStack(e, BYTES("\x48\x89"), 0, 8L*to);
+        return;
+   }
+
+   /* the interpreter's batch kernels, hoisted or not, as its batches use */
+   if ( unary && runKind(ip) == RUN_BLOCK )
+      emitBuiltin(e, ip->op, 8L*from[0], 8L*to, 1);
+   else if ( unary )
+      emitCall(e, &unary, NULL, from, 1, to);
+   else if ( binary )
+      emitCall(e, &binary, NULL, from, 2, to);
+   else
+      emitStack(e, BYTES("\xF2\x0F\x11"), 0, 8L*to);
+}
+
+/*===========================================================================*/
+/* Function: emitCall                                                        */
+/* Call the C function whose pointer is stored at function, passing the      */
+/* arity operand slots in xmm0 upwards and, for closures, the context in     */
+/* rdi, and store the result in slot to.                                     */
+/*===========================================================================*/
+static void emitCall ( EMITTER          *e,
+                       const void       *function,
+                       const void       *context,
+                       const long int   *from,
+                       int               arity,
+                       long int          to )
+{
+   int   k;
+
+   for (k=0; k<arity; k++)
+      emitStack(e, BYTES("\xF2\x0F\x10"), k, 8L*from[k]);
+   if ( context ){
+     emitBytes(e, BYTES("\x48\xBF"));               /* mov rdi,context    */
+     emitQuad(e, context);
+   }
+   emitBytes(e, BYTES("\x48\xB8"));                 /* mov rax,function   */
+   emitQuad(e, function);
+   emitBytes(e, BYTES("\xFF\xD0"));                 /* call rax           */
+   emitStack(e, BYTES("\xF2\x0F\x11"), 0, 8L*to);
+}
+
+/*===========================================================================*/
+/* Function: emitBuiltin                                                     */
+/* Call te_eval_builtin(op, [rsp+to], [rsp+from], count).                    */
+/*===========================================================================*/
+static void emitBuiltin ( EMITTER    *e,
+                          int         op,
+                          long int    from,
+                          long int    to,
+                          long int    count )
+{
+   void   (*builtin)(int,double *,const double *,size_t) = te_eval_builtin;
+
+   emitBytes(e, BYTES("\xBF"));                     /* mov edi,op         */
+   emitWord(e, op);
+   emitBytes(e, BYTES("\x48\x8D\xB4\x24"));         /* lea rsi,[rsp+to]   */
+   emitWord(e, to);
+   emitBytes(e, BYTES("\x48\x8D\x94\x24"));         /* lea rdx,[rsp+from] */
+   emitWord(e, from);
+   emitBytes(e, BYTES("\xB9"));                     /* mov ecx,count      */
+   emitWord(e, count);
+   emitBytes(e, BYTES("\x48\xB8"));                 /* mov rax,builtin    */
+   emitQuad(e, &builtin);
+   emitBytes(e, BYTES("\xFF\xD0"));                 /* call rax           */
+}
+
+/*===========================================================================*/
+/* Function: emitWide                                                        */
+/* The AVX2 kernel.  Its frame holds the scalar slots of the SSE2 kernel,   */
+/* where the uniform instructions leave their values, then JIT_BLOCK values */
+/* for every program register, then three broadcast constants.  rbp steps    */
+/* through a block, in bytes, while r15 is the block's first point.          */
+/*===========================================================================*/
+static void emitWide ( EMITTER   *e,
+                       WIDE      *w )
+{
+   const LAYOUT      *layout = w->layout;
+   const te_program  *program = layout->program;
+   EMITTER            patch;
+   OPERAND            at;
+   unsigned long int  constants[3];
+   double             nan = NAN;
+   long int           i;
+   long int           end;
+   size_t             exit;
+   size_t             top;
+   size_t             loop;
+   int                k;
+
+   constants[0] = 1UL << 63;
+   constants[1] = ~(1UL << 63);
+   memcpy(&constants[2], &nan, sizeof(nan));
+
+   emitBytes(e, BYTES("\x55\x53\x41\x54\x41\x55\x41\x56\x41\x57"));
+   emitBytes(e, BYTES("\x48\x81\xEC"));             /* sub rsp,frameBytes */
+   emitWord(e, w->frameBytes);
+   emitBytes(e, BYTES("\x48\x89\xFB\x49\x89\xF4\x49\x89\xD5"
+                      "\x49\x89\xCF\x4D\x89\xC6"));
+
+   for (k=0; k<3; k++){
+     emitBytes(e, BYTES("\x48\xB8"));               /* mov rax,constant   */
+     emitQuad(e, &constants[k]);
+     at = ymm(RAX);
+     emitVex(e, 1, 0, 0, 0x6E, 0, &at);             /* vmovq xmm0,rax     */
+     at = ymm(0);
+     emitVex(e, 2, 0, 1, 0x19, 0, &at);             /* vbroadcastsd ymm0  */
+     at = memory(RSP, -1, w->constBase + 32L*k);
+     emitVex(e, 1, 0, 1, 0x11, 0, &at);             /* vmovupd [c],ymm0   */
+   }
+
+   for (i=0; i<program->length; i++){
+     w->holder[i] = -1;
+     if ( layout->uniform[i] )
+        emitInstruction(e, layout, i);
+   }
+
+   top = e->length;
+   emitBytes(e, BYTES("\x4D\x39\xF7\x0F\x83"));     /* cmp r15,r14; jae   */
+   exit = e->length;
+   emitWord(e, 0);
+
+   for (i=0; i<program->length; i=end){
+     if ( layout->uniform[i] ){
+       end = i + 1;
+       continue;
+     }
+
+     switch ( runKind(program->code + i) ){
+       case RUN_INLINE:
+          for (end=i+1; end<program->length; end++)
+             if ( !layout->uniform[end] &&
+                  runKind(program->code + end) != RUN_INLINE )
+                break;
+          emitInlineRun(e, w, i, end);
+          break;
+
+       case RUN_BLOCK:
+          emitBytes(e, BYTES("\xC5\xF8\x77"));      /* vzeroupper         */
+          emitBuiltin(e, program->code[i].op,
+                      wideSlot(w, layout->slots[JIT_MAX_ARITY*i]).disp,
+                      wideSlot(w, layout->targets[i]).disp, JIT_BLOCK);
+          end = i + 1;
+          break;
+
+       default:
+          emitPointCall(e, w, i);
+          end = i + 1;
+          break;
+     }
+   }
+
+   /* out[r15 + block] = result */
+   emitBytes(e, BYTES("\x4B\x8D\x44\xFD\x00\x31\xED"));  /* lea rax; ebp=0 */
+   loop = e->length;
+   at = layout->result >= 0 && layout->uniform[layout->result]
+        ? memory(RSP, -1, 8L*layout->resultSlot)
+        : wideSlot(w, layout->resultSlot);
+   emitVex(e, at.index < 0 ? 2 : 1, 0, 1, at.index < 0 ? 0x19 : 0x10, 0, &at);
+   at = memory(RAX, RBP, 0);
+   emitVex(e, 1, 0, 1, 0x11, 0, &at);               /* vmovupd [rax+rbp]  */
+   emitBytes(e, BYTES("\x48\x83\xC5\x20\x48\x81\xFD"));  /* rbp += 32; cmp */
+   emitWord(e, 8L*JIT_BLOCK);
+   emitBytes(e, BYTES("\x0F\x82"));                 /* jb loop            */
+   emitWord(e, (long int)loop - (long int)(e->length + 4));
+
+   emitBytes(e, BYTES("\x49\x81\xC7"));             /* add r15,JIT_BLOCK  */
+   emitWord(e, JIT_BLOCK);
+   emitBytes(e, BYTES("\xE9"));                     /* jmp top            */
+   emitWord(e, (long int)top - (long int)(e->length + 4));
+
+   patch.code   = e->code;
+   patch.length = exit;
+   emitWord(&patch, (long int)e->length - (long int)(exit + 4));
+
+   emitBytes(e, BYTES("\xC5\xF8\x77\x48\x81\xC4"));  /* vzeroupper; add rsp */
+   emitWord(e, w->frameBytes);
+   emitBytes(e, BYTES("\x41\x5F\x41\x5E\x41\x5D\x41\x5C\x5B\x5D\xC3"));
+}
+
+/*===========================================================================*/
+/* Function: emitInlineRun                                                   */
+/* Instructions first..end-1 (skipping uniform ones) as one loop over the    */
+/* block, four points a step.  A value lives in a ymm register from its      */
+/* instruction to its last reader in the run, and is stored to its slot     */
+/* only if something outside the run reads it, or no register was free.    */
+/*===========================================================================*/
+static void emitInlineRun ( EMITTER    *e,
+                            WIDE       *w,
+                            long int    first,
+                            long int    end )
+{
+   long int   i;
+   size_t     loop;
+   int        k;
+
+   for (k=0; k<SCRATCH0; k++)
+      w->free[k] = 1;
+   for (i=first; i<end; i++)
+      w->holder[i] = -1;
+
+   emitBytes(e, BYTES("\x31\xED"));                 /* xor ebp,ebp        */
+   loop = e->length;
+   for (i=first; i<end; i++)
+      if ( !w->layout->uniform[i] )
+         emitInlineOp(e, w, i);
+   emitBytes(e, BYTES("\x48\x83\xC5\x20\x48\x81\xFD"));  /* rbp += 32; cmp */
+   emitWord(e, 8L*JIT_BLOCK);
+   emitBytes(e, BYTES("\x0F\x82"));                 /* jb loop            */
+   emitWord(e, (long int)loop - (long int)(e->length + 4));
+
+   /* later runs find these values in their slots */
+   for (i=first; i<end; i++)
+      w->holder[i] = -1;
+}
+
+/*===========================================================================*/
+/* Function: emitInlineOp                                                  */
+/* One instruction of an inline run, on four points.                         */
+/*===========================================================================*/
+static void emitInlineOp ( EMITTER    *e,
+                           WIDE       *w,
+                           long int    i )
+{
+   const LAYOUT     *layout = w->layout;
+   const te_instr   *ip = layout->program->code + i;
+   const long int   *values = layout->values + JIT_MAX_ARITY*i;
+   OPERAND           at;
+   OPERAND           src;
+   int               a = -1;
+   int               b = -1;
+   int               d = SCRATCH1;
+   int               n;
+   int               k;
+
+   /* operands, then free the registers of those read for the last time */
+   n = ip->op == TE_OP_VARIABLE ? 0 :
+       ip->op >= TE_OP_ADD && ip->op <= TE_OP_DIV ? 2 : 1;
+   if ( n > 0 )
+      a = fetchValue(e, w, values[0], SCRATCH0);
+   if ( n > 1 )
+      b = values[1] == values[0] ? a : fetchValue(e, w, values[1], SCRATCH1);
+   for (k=0; k<n; k++)
+      if ( values[k] >= 0 && layout->lastUse[values[k]] == i &&
+           w->holder[values[k]] >= 0 ){
+        w->free[w->holder[values[k]]] = 1;
+        w->holder[values[k]] = -1;
+      }
+
+   if ( layout->lastUse[i] > i )
+      for (k=0; k<SCRATCH0; k++)
+         if ( w->free[k] ){
+           w->free[k] = 0;
+           w->holder[i] = d = k;
+           break;
+         }
+
+   switch ( ip->op ){
+     case TE_OP_VARIABLE:
+        /* mov rax,[r12+8a]; lea rax,[rax+8*r15]; vmovupd d,[rax+rbp] */
+        emitBytes(e, BYTES("\x49\x8B\x84\x24"));
+        emitWord(e, 8L*ip->a);
+        emitBytes(e, BYTES("\x4A\x8D\x04\xF8"));
+        at = memory(RAX, RBP, 0);
+        emitVex(e, 1, 0, 1, 0x10, d, &at);
+        break;
+
+     case TE_OP_ADD: case TE_OP_SUB: case TE_OP_MUL: case TE_OP_DIV:
+        src = ymm(b);
+        emitVex(e, 1, a, 1, ip->op == TE_OP_ADD ? 0x58 :
+                             ip->op == TE_OP_SUB ? 0x5C :
+                             ip->op == TE_OP_MUL ? 0x59 : 0x5E, d, &src);
+        break;
+
+     case TE_OP_NEG: case TE_OP_ABS:
+        at = memory(RSP, -1, w->constBase + (ip->op == TE_OP_NEG ? 0 : 32));
+        emitVex(e, 1, a, 1, ip->op == TE_OP_NEG ? 0x57 : 0x54, d, &at);
+        break;
+
+     case TE_OP_SQRT:
+        src = ymm(a);
+        emitVex(e, 1, 0, 1, 0x51, d, &src);
+        break;
+
+     case TE_OP_FLOOR: case TE_OP_CEIL:
+        /* vroundpd d,a,imm: round down or up, exceptions suppressed */
+        src = ymm(a);
+        emitVex(e, 3, 0, 1, 0x09, d, &src);
+        emitBytes(e, ip->op == TE_OP_FLOOR ? "\x09" : "\x0A", 1);
+        break;
+
+     default:
+        at = memory(RSP, -1, w->constBase + 64);
+        emitVex(e, 1, 0, 1, 0x10, d, &at);
+        break;
+   }
+
+   /* keep a copy in the slot when it is read elsewhere or was not kept */
+   if ( layout->outside[i] || (d == SCRATCH1 && layout->lastUse[i] > i) ){
+     at = wideSlot(w, layout->targets[i]);
+     emitVex(e, 1, 0, 1, 0x11, d, &at);
+   }
+}
+
+/*===========================================================================*/
+/* Function: fetchValue                                                      */
+/* The ymm register holding instruction v's value for the current four       */
+/* points, loading it into scratch first if it is not held in one.  Uniform  */
+/* values are broadcast from their scalar slot.                              */
+/*===========================================================================*/
+static int fetchValue ( EMITTER    *e,
+                        WIDE       *w,
+                        long int    v,
+                        int         scratch )
+{
+   const LAYOUT  *layout = w->layout;
+   OPERAND        at;
+
+   if ( v >= 0 && w->holder[v] >= 0 && !layout->uniform[v] )
+      return w->holder[v];
+
+   if ( v >= 0 && layout->uniform[v] ){
+     at = memory(RSP, -1, 8L*layout->targets[v]);
+     emitVex(e, 2, 0, 1, 0x19, scratch, &at);       /* vbroadcastsd       */
+   }
+   else {
+     at = wideSlot(w, v >= 0 ? layout->targets[v] : 0);
+     emitVex(e, 1, 0, 1, 0x10, scratch, &at);       /* vmovupd            */
+   }
+   return scratch;
+}
+
+/*===========================================================================*/
+/* Function: emitPointCall                                                   */
+/* A call instruction as a loop over the block, one C call per point.  rbp   */
+/* is callee-saved, so it survives the calls.                                */
+/*===========================================================================*/
+static void emitPointCall ( EMITTER    *e,
+                            WIDE       *w,
+                            long int    i )
+{
+   const LAYOUT     *layout = w->layout;
+   const te_instr   *ip = layout->program->code + i;
+   const long int   *values = layout->values + JIT_MAX_ARITY*i;
+   const long int   *from = layout->slots + JIT_MAX_ARITY*i;
+   double          (*binary)(double,double) = ip->op == TE_OP_MOD ? fmod : pow;
+   const void       *function = &ip->function;
+   OPERAND           at;
+   size_t            loop;
+   int               arity = 2;
+   int               k;
+
+   if ( ip->op == TE_OP_MOD || ip->op == TE_OP_POW )
+      function = &binary;
+   else
+      arity = (ip->op - TE_OP_FUNCTION0) & 7;
+
+   emitBytes(e, BYTES("\xC5\xF8\x77\x31\xED"));     /* vzeroupper; ebp=0  */
+   loop = e->length;
+   for (k=0; k<arity; k++){
+     at = values[k] >= 0 && layout->uniform[values[k]]
+          ? memory(RSP, -1, 8L*from[k]) : wideSlot(w, from[k]);
+     emitSse(e, 0xF2, 0x10, k, &at);                /* movsd xmmk,arg     */
+   }
+   if ( ip->op >= TE_OP_CLOSURE0 ){
+     emitBytes(e, BYTES("\x48\xBF"));               /* mov rdi,context    */
+     emitQuad(e, &ip->context);
+   }
+   emitBytes(e, BYTES("\x48\xB8"));                 /* mov rax,function   */
+   emitQuad(e, function);
+   emitBytes(e, BYTES("\xFF\xD0"));                 /* call rax           */
+   at = wideSlot(w, layout->targets[i]);
+   emitSse(e, 0xF2, 0x11, 0, &at);                  /* movsd [to],xmm0    */
+   emitBytes(e, BYTES("\x48\x83\xC5\x08\x48\x81\xFD"));  /* rbp += 8; cmp  */
+   emitWord(e, 8L*JIT_BLOCK);
+   emitBytes(e, BYTES("\x0F\x82"));                 /* jb loop            */
+   emitWord(e, (long int)loop - (long int)(e->length + 4));
+}
+
+/*===========================================================================*/
+/* Function: wideSlot                                                        */
+/* The current point's place in a block-wide register slot: [rsp+rbp+disp].  */
+/*===========================================================================*/
+static OPERAND wideSlot ( const WIDE   *w,
+                          long int      slot )
+{
+   return memory(RSP, RBP, w->blockBase + 8L*JIT_BLOCK*slot);
+}
+
+/*===========================================================================*/
+/* Function: memory                                                          */
+/* The operand [base + index + disp].                                        */
+/*===========================================================================*/
+static OPERAND memory ( int        base,
+                        int        index,
+                        long int   disp )
+{
+   OPERAND   at;
+
+   at.reg   = -1;
+   at.base  = base;
+   at.index = index;
+   at.disp  = disp;
+   return at;
+}
+
+/*===========================================================================*/
+/* Function: ymm                                                             */
+/* A register operand: ymm (or xmm, or a general register) number reg.       */
+/*===========================================================================*/
+static OPERAND ymm ( int   reg )
+{
+   OPERAND   at;
+
+   at.reg   = reg;
+   at.base  = 0;
+   at.index = -1;
+   at.disp  = 0;
+   return at;
+}
+
+/*===========================================================================*/
+/* Function: emitVex                                                         */
+/* A three-byte VEX instruction with the 66 prefix: map 1, 2 or 3 for the    */
+/* 0F, 0F38 or 0F3A opcode tables, vvvv the first source (0 when unused),    */
+/* L 1 for 256 bits, reg the destination and rm the last source.  The        */
+/* vmovq form (map 1, L 0, opcode 6E) sets W.                                */
+/*===========================================================================*/
+static void emitVex ( EMITTER         *e,
+                      int              map,
+                      int              vvvv,
+                      int              l,
+                      int              opcode,
+                      int              reg,
+                      const OPERAND   *rm )
+{
+   char   prefix[4];
+   int    b = rm->reg >= 0 ? rm->reg >> 3 : 0;
+
+   prefix[0] = (char)0xC4;
+   prefix[1] = (char)((!(reg >> 3)) << 7 | 1 << 6 | (!b) << 5 | map);
+   prefix[2] = (char)((map == 1 && l == 0 && opcode == 0x6E) << 7 |
+                      (~vvvv & 15) << 3 | l << 2 | 1);
+   prefix[3] = (char)opcode;
+   emitBytes(e, prefix, 4);
+   emitModrm(e, reg, rm);
+}
+
+/*===========================================================================*/
+/* Function: emitSse                                                         */
+/* A legacy SSE instruction: prefix, 0F, opcode, then xmm reg and rm.        */
+/*===========================================================================*/
+static void emitSse ( EMITTER         *e,
+                      int              prefix,
+                      int              opcode,
+                      int              reg,
+                      const OPERAND   *rm )
+{
+   char   bytes[3];
+
+   bytes[0] = (char)prefix;
+   bytes[1] = 0x0F;
+   bytes[2] = (char)opcode;
+   emitBytes(e, bytes, 3);
+   emitModrm(e, reg, rm);
+}
+
+/*===========================================================================*/
+/* Function: emitModrm                                                       */
+/* The ModRM byte, and SIB and 32-bit displacement for memory, joining reg   */
+/* to rm.  Memory operands use only the low eight general registers.         */
+/*===========================================================================*/
+static void emitModrm ( EMITTER         *e,
+                        int              reg,
+                        const OPERAND   *rm )
+{
+   char   bytes[2];
+
+   if ( rm->reg >= 0 ){
+     bytes[0] = (char)(0xC0 | (reg & 7) << 3 | (rm->reg & 7));
+     emitBytes(e, bytes, 1);
+     return;
+   }
+
+   if ( rm->index < 0 && rm->base != RSP ){
+     bytes[0] = (char)(0x80 | (reg & 7) << 3 | rm->base);
+     emitBytes(e, bytes, 1);
+   }
+   else {
+     bytes[0] = (char)(0x84 | (reg & 7) << 3);
+     bytes[1] = (char)((rm->index < 0 ? RSP : rm->index) << 3 | rm->base);
+     emitBytes(e, bytes, 2);
+   }
+   emitWord(e, rm->disp);
+}
+
+/*===========================================================================*/
+/* Function: emitStack                                                       */
+/* An opcode, given as its bytes, with register reg and [rsp+offset].        */
+/*===========================================================================*/
+static void emitStack ( EMITTER      *e,
+                        const char   *opcode,
+                        size_t        length,
+                        int           reg,
+                        long int      offset )
+{
+   OPERAND   at = memory(RSP, -1, offset);
+
+   emitBytes(e, opcode, length);
+   emitModrm(e, reg, &at);
+}
+
+/*===========================================================================*/
+/* Function: emitBytes                                                       */
+/* Append length bytes of machine code.                                      */
+/*===========================================================================*/
+static void emitBytes ( EMITTER      *e,
+                        const char   *bytes,
+                        size_t        length )
+{
+   if ( e->code )
+      memcpy(e->code + e->length, bytes, length);
+   e->length += length;
+}
+
+/*===========================================================================*/
+/* Function: emitWord                                                        */
+/* Append a 32-bit little-endian immediate or displacement.                  */
+/*===========================================================================*/
+static void emitWord ( EMITTER    *e,
+                       long int    value )
+{
+   char   bytes[4];
+
+   bytes[0] = (char)(value & 0xFF);
+   bytes[1] = (char)(value >> 8 & 0xFF);
+   bytes[2] = (char)(value >> 16 & 0xFF);
+   bytes[3] = (char)(value >> 24 & 0xFF);
+   emitBytes(e, bytes, 4);
+}
+
+/*===========================================================================*/
+/* Function: emitQuad                                                        */
+/* Append the 8 bytes stored at value: a double, a mask or a pointer.        */
+/*===========================================================================*/
+static void emitQuad ( EMITTER      *e,
+                       const void   *value )
+{
+   emitBytes(e, (const char *)value, 8);
+}
+#endif
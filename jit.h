@@ -0,0 +1,28 @@
+/*===========================================================================*/
+/* Native code for compiled expressions, used by --jit.                      */
+/*===========================================================================*/
+#ifndef JIT_H
+#define JIT_H
+
+#include <stddef.h>
+#include "tinyexpr.h"
+
+/*===========================================================================*/
+/* Type definitions                                                          */
+/*===========================================================================*/
+typedef struct jit_struct JIT;
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+/* varying has bit i set when variable i will be passed in columns; every    */
+/* other variable is read from the frame, and work depending only on them    */
+/* is done once per call rather than once per point.                         */
+int     jitSupported (void);
+JIT    *compileJit   (const te_program *,unsigned long int);
+void    runJit       (const JIT *,const double *,const double *const *,
+                      double *,size_t);
+double  evalJit      (const JIT *,const double *);
+void    destroyJit   (JIT *);
+
+#endif
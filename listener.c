@@ -0,0 +1,164 @@
+/*===========================================================================*/
+/* Listening sockets for the --serve render server.                          */
+/*                                                                           */
+/* A Unix socket is used for local clients, and TCP where the clients are    */
+/* elsewhere.  A stale Unix socket left by an earlier server is replaced;    */
+/* any other file at the path is left alone and the listen fails.            */
+/*===========================================================================*/
+#define _POSIX_C_SOURCE 200809L
+
+/*===========================================================================*/
+/* Includes                                                                  */
+/*===========================================================================*/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "listener.h"
+
+/*===========================================================================*/
+/* Constants                                                                 */
+/*===========================================================================*/
+#define LISTEN_BACKLOG 64          /* connections queued before accept       */
+#define MAX_HOST_NAME 256
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+static int listenUnix (const char *);
+static int listenTcp  (const char *);
+
+/*===========================================================================*/
+/* Function: openListener                                                    */
+/* Bind and listen on the address.  Returns the socket, or -1 with errno     */
+/* set.                                                                      */
+/*===========================================================================*/
+int openListener ( const char   *address )
+{
+   if ( strncmp(address, "unix:", 5) == 0 )
+      return listenUnix(address + 5);
+   if ( strchr(address, '/') != NULL )
+      return listenUnix(address);
+   return listenTcp(address);
+}
+
+/*===========================================================================*/
+/* Function: sendAll                                                         */
+/* Write all length bytes to the socket.  Returns 0 if the client has gone.  */
+/*===========================================================================*/
+int sendAll ( int          socket,
+              const void  *bytes,
+              size_t       length )
+{
+   const char  *next = (const char *)bytes;
+   ssize_t      sent;
+
+   while ( length > 0 ){
+     sent = write(socket, next, length);
+     if ( sent < 0 && errno == EINTR )
+        continue;
+     if ( sent <= 0 )
+        return 0;
+     next   += sent;
+     length -= sent;
+   }
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: listenUnix                                                      */
+/* Listen on a Unix socket at path.                                          */
+/*===========================================================================*/
+static int listenUnix ( const char   *path )
+{
+   struct sockaddr_un   name;
+   struct stat          info;
+   int                  fd;
+   int                  saved;
+
+   if ( strlen(path) >= sizeof(name.sun_path) ){
+     errno = ENAMETOOLONG;
+     return -1;
+   }
+   memset(&name, 0, sizeof(name));
+   name.sun_family = AF_UNIX;
+   strcpy(name.sun_path, path);
+
+   if ( stat(path, &info) == 0 && S_ISSOCK(info.st_mode) )
+      unlink(path);
+
+   fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if ( fd < 0 )
+      return -1;
+   if ( bind(fd, (struct sockaddr *)&name, sizeof(name)) != 0 ||
+        listen(fd, LISTEN_BACKLOG) != 0 ){
+     saved = errno;
+     close(fd);
+     errno = saved;
+     return -1;
+   }
+   return fd;
+}
+
+/*===========================================================================*/
+/* Function: listenTcp                                                       */
+/* Listen on "[host:]port"; with no host, on every interface.                */
+/*===========================================================================*/
+static int listenTcp ( const char   *address )
+{
+   struct addrinfo    hints;
+   struct addrinfo   *found;
+   struct addrinfo   *a;
+   char               host[MAX_HOST_NAME];
+   const char        *port = strrchr(address, ':');
+   int                fd = -1;
+   int                saved = EADDRNOTAVAIL;
+   int                reuse = 1;
+
+   if ( port == NULL )
+      port = address;
+   else if ( port - address >= MAX_HOST_NAME ){
+     errno = ENAMETOOLONG;
+     return -1;
+   }
+   else {
+     memcpy(host, address, port - address);
+     host[port - address] = '\0';
+     port++;
+   }
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family   = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_flags    = AI_PASSIVE;
+   if ( getaddrinfo(port == address || host[0] == '\0' ? NULL : host, port,
+                    &hints, &found) != 0 ){
+     errno = EADDRNOTAVAIL;
+     return -1;
+   }
+
+   for (a=found; a; a=a->ai_next){
+     fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+     if ( fd < 0 ){
+       saved = errno;
+       continue;
+     }
+     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+     if ( bind(fd, a->ai_addr, a->ai_addrlen) == 0 &&
+          listen(fd, LISTEN_BACKLOG) == 0 )
+        break;
+     saved = errno;
+     close(fd);
+     fd = -1;
+   }
+   freeaddrinfo(found);
+
+   if ( fd < 0 )
+      errno = saved;
+   return fd;
+}
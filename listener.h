@@ -0,0 +1,17 @@
+/*===========================================================================*/
+/* Listening sockets for the --serve render server.                          */
+/*===========================================================================*/
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <stddef.h>
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+/* The address is a Unix socket path (anything containing a '/', or with a  */
+/* "unix:" prefix) or a TCP "[host:]port".  Both return -1 with errno set.   */
+int openListener (const char *);
+int sendAll      (int,const void *,size_t);
+
+#endif
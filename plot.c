@@ -0,0 +1,2210 @@
+/*===========================================================================*/
+/* libplot: the renderer behind plotPNG.                                     */
+/*                                                                           */
+/* A plot is rendered into pixel rows the caller owns, or encoded as a PNG   */
+/* that is written to a file or handed to a callback as it is made, so no    */
+/* temporary file is needed.  Nothing here prints or exits: every failure,   */
+/* libpng's included, frees what the render held and comes back to the      */
+/* caller as a PLOT_ERROR_* code.                                            */
+/*===========================================================================*/
+#define _POSIX_C_SOURCE 200809L
+
+/*===========================================================================*/
+/* Includes                                                                  */
+/*===========================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <png.h>
+#include <zlib.h>
+#include <math.h>
+#include <pthread.h>
+#include "tinyexpr.h"
+#include "jit.h"
+#include "gpu.h"
+#include "viewport.h"
+#include "idat.h"
+#include "gridfile.h"
+#include "plot.h"
+
+/*===========================================================================*/
+/* Constants                                                                 */
+/*===========================================================================*/
+#define STREAM_BAND_ROWS TILE_SIZE /* grid rows held in memory by --stream   */
+#define STREAM_RANGE_STRIDE 4      /* grid sampling used for --stream range  */
+#define CURVE_MAX_DEPTH 8          /* f(x) refines down to 1/256 pixel       */
+#define CULL_MIN_BLOCK 8           /* f(x,y) blocks below this are evaluated */
+#define FLOAT_ONE_BITS 0x3f800000U /* IEEE single 1.0 and +infinity          */
+#define FLOAT_INFINITY_BITS 0x7f800000U
+#define PLOT_VARIABLES 3           /* x, y and t: frame slots 0, 1 and 2     */
+#define T_SLOT 2                   /* the frame slot of t                    */
+
+/*===========================================================================*/
+/* Structure definitions                                                     */
+/*===========================================================================*/
+struct png_struct
+   {
+      short int   imgWidth;
+      short int   imgHeight;
+      png_byte    colourType;
+      png_byte    bitDepth;
+      int         compression;     /* zlib level 0-9, -1 for default    */
+      int         strategy;        /* zlib strategy, -1 for default     */
+      int         filters;         /* PNG_FILTER_* mask, -1 for default */
+      int         surface;         /* f(x,y) rather than f(x)           */
+      VIEWPORT    view;            /* ranges and pixel coordinates      */
+      const char *expression;      /* what cached tiles are kept under  */
+      TILECACHE  *tiles;           /* f(x,y) tiles to reuse, or NULL    */
+      int         fixedRange;      /* colour from zMin to zMax, rather  */
+      float       zMin;            /* than the image's own range        */
+      float       zMax;
+      int         single;          /* f(x,y) in single precision        */
+      int         cull;            /* skip what the bounds rule out     */
+      double      t;               /* the value given to t              */
+      GPU        *gpu;             /* f(x,y) kernels, or NULL           */
+      COLOURMAP   colours;         /* f(x,y) colour of each index       */
+      PLOTSTATS   stats;           /* this render's timings and counts  */
+   };
+typedef struct png_struct PNG;
+
+/* a PNG being encoded into a sink */
+struct pngwriter_struct
+   {
+      png_structp       pngPtr;
+      png_infop         infoPtr;
+      FILE             *fp;        /* PLOT_SINK_FILE only             */
+      const PLOTSINK   *sink;
+      int               status;    /* why the last write failed       */
+      unsigned long int bytes;     /* written so far                  */
+      PLOTSTATS        *stats;     /* encode and finish times         */
+      const PNG        *png;       /* the image's format and settings */
+      THREADPOOL       *pool;      /* deflates the image, or NULL     */
+      int               ended;     /* IEND written by writeIdat       */
+   };
+typedef struct pngwriter_struct PNGWRITER;
+
+/* per-thread scratch space and running min/max for the f(x,y) grid */
+struct worker_struct
+   {
+      double     *zs;              /* one tile row of results   */
+      float       max;
+      float       min;
+      int         seen;            /* set once max and min hold a value */
+      unsigned long int evaluations;
+      unsigned long int nonFinite; /* NaN and infinite results   */
+   };
+typedef struct worker_struct WORKER;
+
+/* the f(x,y) grid being evaluated; only the band fields change per call */
+struct surface_struct
+   {
+      const te_program *program;
+      const JIT        *native;    /* program as native code, or NULL */
+      GPU              *gpu;       /* program as OpenCL, or NULL      */
+      const double     *xs;        /* x coordinate of each column     */
+      const double     *ys;        /* y coordinate of each grid row   */
+      int               single;    /* evaluate in single precision,   */
+      const float      *xf;        /* from xs as floats               */
+      double            t;         /* the same at every point         */
+      long int          rows;
+      long int          columns;
+      int               threads;
+      WORKER           *workers;   /* one per thread                  */
+      PLOTSTATS        *stats;     /* evaluation time and counts      */
+      const unsigned char *reused; /* per tile, set if already filled */
+      int               cull;      /* fill blocks of one colour from  */
+      float             zMax;      /* their bounds, colouring from    */
+      float             zMin;      /* zMin to zMax                    */
+
+      long int          firstRow;  /* band of rows being evaluated    */
+      long int          rowCount;
+      ZGRID            *zValues;   /* rowCount*columns results        */
+   };
+typedef struct surface_struct SURFACE;
+
+/* pixel coordinates of the f(x) curve that land inside the image */
+struct curve_struct
+   {
+      long int          points;
+      long int          space;     /* points allocated                */
+      short int        *columns;
+      short int        *rows;      /* image row, 0 at the top         */
+      int               failed;    /* set if the points outgrew memory */
+   };
+typedef struct curve_struct CURVE;
+
+/* an animation frame, encoded on a thread of its own */
+struct framejob_struct
+   {
+      PNG               png;
+      IMAGEBUFFER       image;     /* its pixels, unless streamed     */
+      const PLOTSINK   *sink;      /* NULL while there is no frame    */
+      int               status;
+      int               running;   /* set while thread is encoding it */
+      pthread_t         thread;
+   };
+typedef struct framejob_struct FRAMEJOB;
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+static int    checkOptions        (const PLOTOPTIONS *);
+static int    checkSink           (const char *,const PLOTOPTIONS *,
+                                   const PLOTSINK *);
+static int    startPlot           (PNG *,const char *,const PLOTOPTIONS *,
+                                   double,CACHEDEXPR **,JIT **);
+static void   finishPlot          (PNG *,const PLOTOPTIONS *,CACHEDEXPR *,
+                                   JIT *);
+static void   describePlot        (PNG *,const char *,const PLOTOPTIONS *);
+static size_t rowBytes            (const PNG *);
+static int    renderPng           (PNG *,const PLOTOPTIONS *,const PLOTSINK *,
+                                   const te_program *,const JIT *);
+static int    drawPixels          (PNG *,const PLOTSINK *,const te_program *,
+                                   const JIT *,THREADPOOL *);
+static short int pixelValues      (const PNG *);
+static int    renderGrid          (PNG *,const PLOTSINK *,const te_program *,
+                                   const JIT *,THREADPOOL *);
+static void   curveValues         (PNG *,const te_program *,const JIT *,
+                                   double *,float *,GRIDINFO *);
+static void  *encodeFrame         (void *);
+static int    finishFrame         (FRAMEJOB *,PLOTSTATS *);
+static int    makeImageData       (PNG *,short int,png_byte **,
+                                   const te_program *,const JIT *,THREADPOOL *);
+static int    makeTiledSurface    (PNG *,short int,png_byte **,
+                                   const te_program *,const JIT *,THREADPOOL *,
+                                   int,long int,long int);
+static int    streamCurve         (PNG *,PNGWRITER *,png_byte *,
+                                   const te_program *,const JIT *);
+static int    streamSurface       (PNG *,PNGWRITER *,png_byte *,
+                                   const te_program *,const JIT *,THREADPOOL *);
+static int    computeCurve        (PNG *,const te_program *,const JIT *,
+                                   CURVE *);
+static void   refineCurve         (PNG *,const te_program *,const JIT *,
+                                   CURVE *,double,double,double,double,int);
+static void   drawCurveSegment    (PNG *,CURVE *,double,double,double,double);
+static void   addCurvePoint       (PNG *,CURVE *,double,double);
+static int    prepareSurface      (PNG *,const te_program *,const JIT *,
+                                   THREADPOOL *,short int,SURFACE *);
+static void   narrowSurface       (SURFACE *);
+static int    allocateSurface     (PNG *,const te_program *,const JIT *,
+                                   THREADPOOL *,long int,long int,SURFACE *);
+static void   evaluateSurfaceRows (SURFACE *,THREADPOOL *,long int,long int,
+                                   ZGRID *);
+static void   evaluateSurface     (void *,long int,int);
+static void   cullBlock           (SURFACE *,WORKER *,long int,long int,
+                                   long int,long int,long int,long int);
+static void   evaluateBlock       (SURFACE *,WORKER *,long int,long int,
+                                   long int,long int,long int,long int);
+static int    surfaceRange        (SURFACE *,float *,float *);
+static void   regionRange         (const ZGRID *,long int,long int,long int,
+                                   long int,float *,float *);
+static void   freeSurface         (SURFACE *);
+static int    colourIndex         (float,float,float);
+static void   colourSurfaceRow    (png_byte *,const COLOURMAP *,const ZGRID *,
+                                   long int,long int,
+                                   long int,short int,float,float);
+static void   clearCurveRow       (png_byte *,PNG *,short int);
+static void   plotCurvePoint      (png_byte *,short int,PNG *,short int);
+static void   setPalette          (PNG *,png_structp *,png_infop *);
+static int    openPng             (PNGWRITER *,const PLOTSINK *,PNG *);
+static int    writePngRow         (PNGWRITER *,png_byte *);
+static int    writePngImage       (PNGWRITER *,png_byte **);
+static int    writeIdat           (PNGWRITER *,const IDAT *);
+static int    endPng              (PNGWRITER *);
+static int    closePng            (PNGWRITER *,int);
+static int    pngFailure          (PNGWRITER *);
+static void   writeSinkPng        (png_structp,png_bytep,png_size_t);
+static void   flushSinkPng        (png_structp);
+static void   pngError            (png_structp,png_const_charp);
+static void   pngWarning          (png_structp,png_const_charp);
+static double plotClock           (void);
+static long int floorDivide       (long int,long int);
+
+/*===========================================================================*/
+/* Function: plotDefaults                                                    */
+/* A 300x300 RGB plot of the unit square with libpng's encoder settings,   */
+/* evaluated on the calling thread and compiled afresh.                      */
+/*===========================================================================*/
+void plotDefaults ( PLOTOPTIONS   *options )
+{
+   options->width       = 300;   /* pixels */
+   options->height      = 300;   /* pixels */
+   options->xMin        = 0;
+   options->xMax        = 1;
+   options->yMin        = 0;
+   options->yMax        = 1;
+   options->zMin        = 0;
+   options->zMax        = 0;
+   options->t           = 0;
+   options->colourMap   = COLOURMAP_REDBLUE;
+   options->palette     = 0;
+   options->stream      = 0;
+   options->jit         = 0;
+   options->gpu         = 0;
+   options->single      = 0;
+   options->cull        = 1;
+   options->compression = -1;
+   options->strategy    = -1;
+   options->filters     = -1;
+   options->pool        = NULL;
+   options->cache       = NULL;
+   options->tiles       = NULL;
+   options->image       = NULL;
+   options->stats       = NULL;
+}
+
+/*===========================================================================*/
+/* Function: plotRender                                                      */
+/* Plots expression, f(x) or f(x,y), over the x and y ranges of the options */
+/* into the sink.  Where native code is unavailable, jit quietly uses the    */
+/* interpreter.  Returns PLOT_OK or the PLOT_ERROR_* code saying why nothing */
+/* (or, for a stream sink, only part of a PNG) was written.  A file left     */
+/* half written is removed.                                                  */
+/*===========================================================================*/
+int plotRender ( const char          *expression,
+                 const PLOTOPTIONS   *options,
+                 const PLOTSINK      *sink )
+{
+   PNG                pngData;
+   CACHEDEXPR        *entry;
+   const te_program  *n;
+   JIT               *native;
+   int                status;
+   double             start = plotClock();
+
+   if ( !expression || !options || !sink )
+      return PLOT_ERROR_ARGUMENT;
+   status = checkOptions(options);
+   if ( status == PLOT_OK )
+      status = checkSink(expression,options,sink);
+   if ( status == PLOT_OK )
+      status = startPlot(&pngData,expression,options,start,&entry,&native);
+   if ( status != PLOT_OK )
+      return status;
+   n = cachedProgram(entry);
+
+   if ( sink->kind == PLOT_SINK_PIXELS )
+      status = drawPixels(&pngData,sink,n,native,options->pool);
+   else if ( sink->kind == PLOT_SINK_RAW || sink->kind == PLOT_SINK_NPY )
+      status = renderGrid(&pngData,sink,n,native,options->pool);
+   else
+      status = renderPng(&pngData,options,sink,n,native);
+
+   finishPlot(&pngData,options,entry,native);
+   pngData.stats.totalSeconds = plotClock() - start;
+   if ( options->stats )
+      plotAddStats(options->stats,&pngData.stats);
+   return status;
+}
+
+/*===========================================================================*/
+/* Function: plotAnimate                                                     */
+/* Plots frames frames of expression into sinks[0] to sinks[frames-1], t    */
+/* running in equal steps from tMin in the first to tMax in the last, in    */
+/* place of options->t.  The expression is compiled once, and each frame is */
+/* encoded on a thread of its own while the next is evaluated.  Returns     */
+/* PLOT_OK, or the code of the first frame that failed; no frames are       */
+/* rendered after it.                                                        */
+/*===========================================================================*/
+int plotAnimate ( const char          *expression,
+                  const PLOTOPTIONS   *options,
+                  const PLOTSINK      *sinks,
+                  long int             frames,
+                  double               tMin,
+                  double               tMax )
+{
+   PNG                base;
+   FRAMEJOB           jobs[2];
+   FRAMEJOB          *job;
+   PLOTSTATS          total;
+   CACHEDEXPR        *entry;
+   const te_program  *n;
+   JIT               *native;
+   long int           k;
+   int                status;
+   int                finished;
+   double             start = plotClock();
+
+   if ( !expression || !options || !sinks || frames < 1 )
+      return PLOT_ERROR_ARGUMENT;
+   status = checkOptions(options);
+   if ( status == PLOT_OK && (tMin - tMin != 0 || tMax - tMax != 0) )
+      status = PLOT_ERROR_RANGE;
+   for (k=0; k<frames && status == PLOT_OK; k++)
+      status = checkSink(expression,options,&sinks[k]);
+   if ( status == PLOT_OK )
+      status = startPlot(&base,expression,options,start,&entry,&native);
+   if ( status != PLOT_OK )
+      return status;
+   n = cachedProgram(entry);
+
+   /* two frames in flight: one being evaluated, the one before encoded */
+   memset(jobs, 0, sizeof(jobs));
+   memset(&total, 0, sizeof(total));
+   if ( !options->stream &&
+        (!createImageBuffer(&jobs[0].image,base.imgHeight,rowBytes(&base)) ||
+         !createImageBuffer(&jobs[1].image,base.imgHeight,rowBytes(&base))) )
+      status = PLOT_ERROR_MEMORY;
+
+   for (k=0; k<frames && status == PLOT_OK; k++){
+     job = &jobs[k & 1];
+     job->png    = base;
+     job->png.t  = frames > 1 ? tMin + (tMax - tMin)*k/(frames - 1) : tMin;
+     job->sink   = &sinks[k];
+     memset(&job->png.stats, 0, sizeof(PLOTSTATS));
+
+     if ( job->sink->kind == PLOT_SINK_PIXELS )
+        job->status = drawPixels(&job->png,job->sink,n,native,options->pool);
+     else if ( job->sink->kind == PLOT_SINK_RAW ||
+               job->sink->kind == PLOT_SINK_NPY )
+        job->status = renderGrid(&job->png,job->sink,n,native,options->pool);
+     else if ( options->stream )
+        job->status = renderPng(&job->png,options,job->sink,n,native);
+     else
+        job->status = makeImageData(&job->png,pixelValues(&job->png),
+                                    job->image.rows,n,native,options->pool);
+
+     /* the frame before must be written before this one starts */
+     status = finishFrame(&jobs[(k + 1) & 1],&total);
+
+     if ( status == PLOT_OK && job->status == PLOT_OK &&
+          (job->sink->kind == PLOT_SINK_FILE ||
+           job->sink->kind == PLOT_SINK_STREAM) && !options->stream ){
+       job->running = pthread_create(&job->thread, NULL, encodeFrame, job) == 0;
+       if ( !job->running )
+          encodeFrame(job);
+     }
+     if ( !job->running ){
+       finished = finishFrame(job,&total);
+       if ( status == PLOT_OK )
+          status = finished;
+     }
+   }
+
+   for (k=0; k<2; k++){
+     finished = finishFrame(&jobs[k],&total);
+     if ( status == PLOT_OK )
+        status = finished;
+     destroyImageBuffer(&jobs[k].image);
+   }
+
+   finishPlot(&base,options,entry,native);
+   base.stats.totalSeconds = plotClock() - start;
+   if ( options->stats ){
+     plotAddStats(options->stats,&base.stats);
+     plotAddStats(options->stats,&total);
+   }
+   return status;
+}
+
+/*===========================================================================*/
+/* Function: plotRowBytes                                                    */
+/* The bytes in one row of the plot's pixels.                                */
+/*===========================================================================*/
+size_t plotRowBytes ( const char          *expression,
+                      const PLOTOPTIONS   *options )
+{
+   PNG         pngData;
+
+   describePlot(&pngData,expression,options);
+   return rowBytes(&pngData);
+}
+
+/*===========================================================================*/
+/* Function: plotErrorString                                                 */
+/* A description of a plotRender result, in lower case for use mid-sentence.*/
+/*===========================================================================*/
+const char *plotErrorString ( int   status )
+{
+   switch ( status ){
+     case PLOT_OK:               return "success";
+     case PLOT_ERROR_MEMORY:     return "out of memory";
+     case PLOT_ERROR_EXPRESSION: return "expression does not compile";
+     case PLOT_ERROR_SIZE:       return "width and height must be from 1 to"
+                                        " 32767";
+     case PLOT_ERROR_OUTPUT:     return "output could not be written";
+     case PLOT_ERROR_ARGUMENT:   return "invalid plot arguments";
+     case PLOT_ERROR_RANGE:      return "x, y and z ranges must be finite,"
+                                        " each maximum above its minimum";
+   }
+   return "unknown error";
+}
+
+/*===========================================================================*/
+/* Function: plotAddStats                                                    */
+/* Add the timings and counts of one render to a running total.             */
+/*===========================================================================*/
+void plotAddStats ( PLOTSTATS         *total,
+                    const PLOTSTATS   *render )
+{
+   total->compileSeconds  += render->compileSeconds;
+   total->evaluateSeconds += render->evaluateSeconds;
+   total->colourSeconds   += render->colourSeconds;
+   total->encodeSeconds   += render->encodeSeconds;
+   total->finishSeconds   += render->finishSeconds;
+   total->totalSeconds    += render->totalSeconds;
+   total->evaluations     += render->evaluations;
+   total->nonFinite       += render->nonFinite;
+   total->bytes           += render->bytes;
+   total->tilesReused     += render->tilesReused;
+}
+
+/*===========================================================================*/
+/* Function: checkOptions                                                    */
+/* PLOT_OK if the options describe a plot that can be drawn, or the code    */
+/* of the first thing wrong with them.                                       */
+/*===========================================================================*/
+static int checkOptions ( const PLOTOPTIONS   *options )
+{
+   if ( options->width < 1 || options->width > PLOT_MAX_SIZE ||
+        options->height < 1 || options->height > PLOT_MAX_SIZE )
+      return PLOT_ERROR_SIZE;
+   if ( !validRange(options->xMin,options->xMax) ||
+        !validRange(options->yMin,options->yMax) ||
+        (options->zMin != options->zMax &&
+         !validRange(options->zMin,options->zMax)) ||
+        options->t - options->t != 0 )
+      return PLOT_ERROR_RANGE;
+   if ( options->colourMap < 0 || options->colourMap >= COLOURMAP_COUNT )
+      return PLOT_ERROR_ARGUMENT;
+   return PLOT_OK;
+}
+
+/*===========================================================================*/
+/* Function: checkSink                                                       */
+/* PLOT_OK if the sink has what its kind needs, else PLOT_ERROR_ARGUMENT.   */
+/*===========================================================================*/
+static int checkSink ( const char          *expression,
+                       const PLOTOPTIONS   *options,
+                       const PLOTSINK      *sink )
+{
+   switch ( sink->kind ){
+     case PLOT_SINK_FILE:
+     case PLOT_SINK_RAW:
+     case PLOT_SINK_NPY:
+       return sink->fileName ? PLOT_OK : PLOT_ERROR_ARGUMENT;
+     case PLOT_SINK_STREAM:
+       return sink->write ? PLOT_OK : PLOT_ERROR_ARGUMENT;
+     case PLOT_SINK_PIXELS:
+       if ( !sink->pixels || sink->stride < plotRowBytes(expression,options) )
+          return PLOT_ERROR_ARGUMENT;
+       return PLOT_OK;
+   }
+   return PLOT_ERROR_ARGUMENT;
+}
+
+/*===========================================================================*/
+/* Function: startPlot                                                       */
+/* Describes the plot, sets up its viewport and compiles the expression,    */
+/* x, y and t being frame slots 0, 1 and 2, into the entry and, if asked,   */
+/* native code and, for f(x,y), OpenCL kernels; start is when the render    */
+/* began.  Tiles of expressions that read t are not cached, as they change  */
+/* with it.  On failure nothing is left held, and the time spent is added   */
+/* to the caller's stats.                                                    */
+/*===========================================================================*/
+static int startPlot ( PNG                 *pngData,
+                       const char          *expression,
+                       const PLOTOPTIONS   *options,
+                       double               start,
+                       CACHEDEXPR         **entry,
+                       JIT                **native )
+{
+   te_variable        vars[] = {{"x", 0, TE_VARIABLE, 0},
+                               {"y", 0, TE_VARIABLE, 0},
+                               {"t", 0, TE_VARIABLE, 0}};
+   const te_program  *n;
+   int                err;
+   int                k;
+
+   describePlot(pngData,expression,options);
+   makeColourMap(&pngData->colours,options->colourMap);
+   if ( !createViewport(&pngData->view,options->width,options->height,
+                        options->xMin,options->xMax,
+                        options->yMin,options->yMax) )
+      return PLOT_ERROR_MEMORY;
+   *entry = acquireExpr(options->cache, expression, vars, PLOT_VARIABLES, &err);
+   if ( !*entry ){
+     destroyViewport(&pngData->view);
+     if ( options->stats )
+        options->stats->compileSeconds += plotClock() - start;
+     return err < 0 ? PLOT_ERROR_MEMORY : PLOT_ERROR_EXPRESSION;
+   }
+   n = cachedProgram(*entry);
+
+   for (k=0; k<n->length; k++)
+      if ( n->code[k].op == TE_OP_VARIABLE && n->code[k].a == T_SLOT )
+         pngData->tiles = NULL;
+
+   /* x varies along every batch, y being fixed per f(x,y) grid row */
+   *native = options->jit ? compileJit(n, 1) : NULL;
+   if ( options->gpu && pngData->surface )
+      pngData->gpu = compileGpu(n, options->single);
+   pngData->stats.compileSeconds = plotClock() - start;
+   return PLOT_OK;
+}
+
+/*===========================================================================*/
+/* Function: finishPlot                                                      */
+/* Lets go of what startPlot set up.                                         */
+/*===========================================================================*/
+static void finishPlot ( PNG                 *pngData,
+                         const PLOTOPTIONS   *options,
+                         CACHEDEXPR          *entry,
+                         JIT                 *native )
+{
+   destroyJit(native);
+   destroyGpu(pngData->gpu);
+   releaseExpr(options->cache,entry);
+   destroyViewport(&pngData->view);
+}
+
+/*===========================================================================*/
+/* Function: describePlot                                                    */
+/* Fill in the image format of a plot.  Palette output is 1-bit for f(x)     */
+/* and an 8-bit gradient for f(x,y).                                         */
+/*===========================================================================*/
+static void describePlot ( PNG                 *pngData,
+                           const char          *expression,
+                           const PLOTOPTIONS   *options )
+{
+   pngData->imgWidth    = options->width;
+   pngData->imgHeight   = options->height;
+   pngData->colourType  = PNG_COLOR_TYPE_RGB;
+   pngData->bitDepth    = 8;
+   pngData->compression = options->compression;
+   pngData->strategy    = options->strategy;
+   pngData->filters     = options->filters;
+   pngData->surface     = strchr(expression, 'y') != NULL;
+   pngData->expression  = expression;
+   pngData->tiles       = options->tiles;
+   pngData->fixedRange  = options->zMin != options->zMax;
+   pngData->cull        = options->cull;
+   pngData->zMin        = options->zMin;
+   pngData->zMax        = options->zMax;
+   pngData->single      = options->single;
+   pngData->t           = options->t;
+   pngData->gpu         = NULL;
+   memset(&pngData->stats, 0, sizeof(PLOTSTATS));
+
+   if ( options->palette ){
+     pngData->colourType = PNG_COLOR_TYPE_PALETTE;
+     pngData->bitDepth   = pngData->surface ? 8 : 1;
+   }
+}
+
+/*===========================================================================*/
+/* Function: rowBytes                                                        */
+/* The bytes in one image row: an RGB triple or packed palette indices.      */
+/*===========================================================================*/
+static size_t rowBytes ( const PNG   *pngData )
+{
+   if ( pngData->colourType == PNG_COLOR_TYPE_PALETTE )
+      return ((size_t)pngData->imgWidth*pngData->bitDepth + 7)/8;
+   return (size_t)pngData->imgWidth*3;
+}
+
+/*===========================================================================*/
+/* Function: renderPng                                                       */
+/* Encodes the plot into a PNG file or stream sink.  The whole image is made */
+/* in options->image, or in a buffer of its own when that is NULL, unless    */
+/* the options ask for it to be streamed a band of rows at a time.           */
+/*===========================================================================*/
+static int renderPng ( PNG                 *pngData,
+                       const PLOTOPTIONS   *options,
+                       const PLOTSINK      *sink,
+                       const te_program    *n,
+                       const JIT           *native )
+{
+   PNGWRITER     writer;
+   IMAGEBUFFER   own;
+   IMAGEBUFFER  *image = options->image;
+   png_byte     *row;
+   short int     valuesPerPixel;
+   int           status;
+
+   status = openPng(&writer,sink,pngData);
+   if ( status != PLOT_OK )
+      return status;
+   writer.pool    = options->pool;
+   valuesPerPixel = png_get_channels(writer.pngPtr,writer.infoPtr);
+
+   if ( options->stream ){
+     row = (png_byte *)malloc(rowBytes(pngData));
+     if ( !row )
+        status = PLOT_ERROR_MEMORY;
+     else if ( pngData->surface )
+        status = streamSurface(pngData,&writer,row,n,native,options->pool);
+     else
+        status = streamCurve(pngData,&writer,row,n,native);
+     free(row);
+   }
+   else {
+     if ( image == NULL ){
+       image = &own;
+       if ( !createImageBuffer(image,pngData->imgHeight,rowBytes(pngData)) )
+          image = NULL;
+     }
+     else if ( !resizeImageBuffer(image,pngData->imgHeight,rowBytes(pngData)) )
+        image = NULL;
+
+     if ( image == NULL )
+        status = PLOT_ERROR_MEMORY;
+     else {
+       status = makeImageData(pngData,valuesPerPixel,image->rows,n,native,
+                              options->pool);
+       if ( status == PLOT_OK && !writePngImage(&writer,image->rows) )
+          status = pngFailure(&writer);
+       if ( image == &own )
+          destroyImageBuffer(&own);
+     }
+   }
+
+   return closePng(&writer,status);
+}
+
+/*===========================================================================*/
+/* Function: drawPixels                                                      */
+/* Draws the plot straight into the rows of a PLOT_SINK_PIXELS sink.         */
+/*===========================================================================*/
+static int drawPixels ( PNG                *pngData,
+                        const PLOTSINK     *sink,
+                        const te_program   *n,
+                        const JIT          *native,
+                        THREADPOOL         *pool )
+{
+   png_byte  **rows;
+   long int    i;
+   int         status;
+
+   rows = (png_byte **)malloc(sizeof(png_byte *)*pngData->imgHeight);
+   if ( !rows )
+      return PLOT_ERROR_MEMORY;
+   for (i=0; i<pngData->imgHeight; i++)
+      rows[i] = sink->pixels + i*sink->stride;
+   status = makeImageData(pngData,pixelValues(pngData),rows,n,native,pool);
+   free(rows);
+   return status;
+}
+
+/*===========================================================================*/
+/* Function: pixelValues                                                     */
+/* The bytes of an RGB pixel, or the one palette index.                      */
+/*===========================================================================*/
+static short int pixelValues ( const PNG   *pngData )
+{
+   return pngData->colourType == PNG_COLOR_TYPE_PALETTE ? 1 : 3;
+}
+
+/*===========================================================================*/
+/* Function: renderGrid                                                      */
+/* Writes the plot's values, rather than its image, into the float32 file  */
+/* of a PLOT_SINK_RAW or PLOT_SINK_NPY sink.  f(x,y) is evaluated straight  */
+/* into the mapped file, every point of it as z-range culling would fill   */
+/* blocks with their bounds.                                                 */
+/*===========================================================================*/
+static int renderGrid ( PNG                *pngData,
+                        const PLOTSINK     *sink,
+                        const te_program   *n,
+                        const JIT          *native,
+                        THREADPOOL         *pool )
+{
+   GRIDFILE    file;
+   GRIDINFO    info;
+   ZGRID       grid;
+   SURFACE     surface;
+   double     *zs;
+   double      start = plotClock();
+   int         ok;
+
+   if ( !openGridFile(&file,sink->fileName,
+                      sink->kind == PLOT_SINK_NPY ? GRID_NPY : GRID_RAW,
+                      pngData->surface ? pngData->imgHeight : 0,
+                      pngData->imgWidth) )
+      return PLOT_ERROR_OUTPUT;
+   pngData->stats.encodeSeconds += plotClock() - start;
+
+   info.width     = pngData->imgWidth;
+   info.height    = pngData->imgHeight;
+   info.xMin      = pngData->view.xMin;
+   info.xMax      = pngData->view.xMax;
+   info.yMin      = pngData->view.yMin;
+   info.yMax      = pngData->view.yMax;
+   info.t         = pngData->t;
+   info.nonFinite = 0;
+
+   if ( pngData->surface ){
+     if ( !prepareSurface(pngData,n,native,pool,1,&surface) ){
+       closeGridFile(&file,NULL);
+       return PLOT_ERROR_MEMORY;
+     }
+     surface.cull = 0;
+     mapZGrid(&grid,file.values,surface.rows,surface.columns);
+     evaluateSurfaceRows(&surface,pool,0,surface.rows,&grid);
+     info.seen = surfaceRange(&surface,&info.max,&info.min);
+     freeSurface(&surface);
+     info.nonFinite = pngData->stats.nonFinite;
+   }
+   else {
+     zs = (double *)malloc(sizeof(double)*pngData->imgWidth);
+     if ( !zs ){
+       closeGridFile(&file,NULL);
+       return PLOT_ERROR_MEMORY;
+     }
+     curveValues(pngData,n,native,zs,file.values,&info);
+     free(zs);
+   }
+
+   start = plotClock();
+   ok = closeGridFile(&file,&info);
+   pngData->stats.finishSeconds += plotClock() - start;
+   if ( !ok )
+      return PLOT_ERROR_OUTPUT;
+   pngData->stats.bytes += file.bytes;
+   return PLOT_OK;
+}
+
+/*===========================================================================*/
+/* Function: curveValues                                                     */
+/* Evaluates f(x) at the left of every pixel column into zs, as floats into */
+/* values, and their range and NaN and infinite count into info.             */
+/*===========================================================================*/
+static void curveValues ( PNG                *pngData,
+                          const te_program   *n,
+                          const JIT          *native,
+                          double             *zs,
+                          float              *values,
+                          GRIDINFO           *info )
+{
+   long int      k;
+   double        frame[PLOT_VARIABLES];
+   double        start = plotClock();
+   const double *columns[PLOT_VARIABLES];
+
+   columns[0]      = pngData->view.columnX;
+   columns[1]      = NULL;
+   columns[T_SLOT] = NULL;
+   frame[0]        = 0;
+   frame[1]        = 0;
+   frame[T_SLOT]   = pngData->t;
+   if ( native )
+      runJit(native, frame, columns, zs, pngData->imgWidth);
+   else
+      te_eval_batch_frame(n, frame, columns, zs, pngData->imgWidth);
+
+   info->seen = 0;
+   for (k=0; k<pngData->imgWidth; k++){
+     values[k] = zs[k];
+     if ( values[k] - values[k] != 0 )
+        info->nonFinite++;
+     if ( values[k] != values[k] )
+        continue;
+     if ( !info->seen || values[k] > info->max )
+        info->max = values[k];
+     if ( !info->seen || values[k] < info->min )
+        info->min = values[k];
+     info->seen = 1;
+   }
+   pngData->stats.evaluations += pngData->imgWidth;
+   pngData->stats.nonFinite   += info->nonFinite;
+   pngData->stats.evaluateSeconds += plotClock() - start;
+}
+
+/*===========================================================================*/
+/* Function: encodeFrame                                                     */
+/* Thread body: encodes an animation frame's image into its sink, leaving    */
+/* the result in the job's status.                                           */
+/*===========================================================================*/
+static void *encodeFrame ( void   *context )
+{
+   FRAMEJOB    *job = (FRAMEJOB *)context;
+   PNGWRITER    writer;
+
+   job->status = openPng(&writer,job->sink,&job->png);
+   if ( job->status == PLOT_OK ){
+     if ( !writePngImage(&writer,job->image.rows) )
+        job->status = pngFailure(&writer);
+     job->status = closePng(&writer,job->status);
+   }
+   return NULL;
+}
+
+/*===========================================================================*/
+/* Function: finishFrame                                                     */
+/* Waits for a frame's encoding to finish, if it is still going, and adds   */
+/* its stats to total.  Returns its status, PLOT_OK for a job with no frame.*/
+/*===========================================================================*/
+static int finishFrame ( FRAMEJOB    *job,
+                         PLOTSTATS   *total )
+{
+   if ( !job->sink )
+      return PLOT_OK;
+   if ( job->running )
+      pthread_join(job->thread, NULL);
+   job->running = 0;
+   job->sink    = NULL;
+   plotAddStats(total,&job->png.stats);
+   return job->status;
+}
+
+/*===========================================================================*/
+/* Function: makeImageData                                                   */
+/* Puts data into the pixel rows to construct the image of the program.      */
+/*===========================================================================*/
+static int makeImageData ( PNG                *pngData,
+                           short int           valuesPerPixel,
+                           png_byte          **rows,
+                           const te_program   *n,
+                           const JIT          *native,
+                           THREADPOOL         *pool )
+{
+   /* for iteration */
+   long int    i;
+   long int    k;
+
+   /* for calculations */
+   ZGRID       z_values;
+   float       max;
+   float       min;
+
+   /* for plotting */
+   CURVE       curve;
+   SURFACE     surface;
+   double      start;
+   int         level;
+   long int    column;
+   long int    row;
+
+   /* plotting the expression */
+   if ( !pngData->surface ){                    /* if its of the form f(x) */
+     /* calculating y values */
+     if ( !computeCurve(pngData,n,native,&curve) )
+        return PLOT_ERROR_MEMORY;
+
+     /* colouring background white, then plotting the curve over it */
+     start = plotClock();
+     for ( i=0; i<pngData->imgHeight; i++ )
+        clearCurveRow(rows[i],pngData,valuesPerPixel);
+     for (k=0; k<curve.points; k++)
+        plotCurvePoint(rows[curve.rows[k]],curve.columns[k],pngData,
+                       valuesPerPixel);
+     free(curve.columns);
+     free(curve.rows);
+     pngData->stats.colourSeconds += plotClock() - start;
+   }
+
+   else if ( pngData->tiles &&
+             viewportLevel(&pngData->view,&level,&column,&row) ){
+     /* on a tile grid, so evaluating only the tiles not already cached */
+     return makeTiledSurface(pngData,valuesPerPixel,rows,n,native,pool,level,
+                             column,row);
+   }
+
+   else {                                   /* else its of the form f(x,y) */
+     /* calculating z values */
+     if ( !prepareSurface(pngData,n,native,pool,1,&surface) )
+        return PLOT_ERROR_MEMORY;
+     if ( !createZGrid(&z_values,surface.rows,surface.columns) ){
+       freeSurface(&surface);
+       return PLOT_ERROR_MEMORY;
+     }
+     evaluateSurfaceRows(&surface,pool,0,surface.rows,&z_values);
+
+     /* plotting colours */
+     start = plotClock();
+     surfaceRange(&surface,&max,&min);
+     freeSurface(&surface);
+     if ( pngData->fixedRange ){
+       max = pngData->zMax;
+       min = pngData->zMin;
+     }
+     for (i=0; i<surface.rows; i++)
+        colourSurfaceRow(rows[(surface.rows-1)-i],&pngData->colours,&z_values,
+                         i,0,surface.columns,valuesPerPixel,max,min);
+     destroyZGrid(&z_values);
+     pngData->stats.colourSeconds += plotClock() - start;
+   }
+
+   return PLOT_OK;
+}
+
+/*===========================================================================*/
+/* Function: makeTiledSurface                                                */
+/* Makes an f(x,y) image whose viewport is on the pixel grid of level, with  */
+/* its bottom left pixel at (column,row) on that grid.  The grid is cut into */
+/* TILE_SIZE square tiles; those the image overlaps are taken from the tile  */
+/* cache where it has them and evaluated and cached where it does not, so    */
+/* the image is the same as makeImageData would make.  The colour range is   */
+/* that of the pixels shown, unless the options fix it.                      */
+/*===========================================================================*/
+static int makeTiledSurface ( PNG                *pngData,
+                              short int           valuesPerPixel,
+                              png_byte          **rows,
+                              const te_program   *n,
+                              const JIT          *native,
+                              THREADPOOL         *pool,
+                              int                 level,
+                              long int            column,
+                              long int            row )
+{
+   long int        tx0 = floorDivide(column, TILE_SIZE);
+   long int        ty0 = floorDivide(row, TILE_SIZE);
+   long int        left = column - tx0*TILE_SIZE;
+   long int        bottom = row - ty0*TILE_SIZE;
+   long int        tileColumns;
+   long int        tileRows;
+   long int        tr;
+   long int        tc;
+   long int        i;
+   unsigned char  *reused;
+   ZGRID           region;
+   SURFACE         surface;
+   float           max;
+   float           min;
+   double          start;
+
+   tileColumns = floorDivide(column + pngData->imgWidth - 1, TILE_SIZE) - tx0 + 1;
+   tileRows    = floorDivide(row + pngData->imgHeight - 1, TILE_SIZE) - ty0 + 1;
+   if ( !allocateSurface(pngData,n,native,pool,tileRows*TILE_SIZE,
+                         tileColumns*TILE_SIZE,&surface) )
+      return PLOT_ERROR_MEMORY;
+   reused = (unsigned char *)calloc(tileRows*tileColumns, 1);
+   if ( !reused || !createZGrid(&region,surface.rows,surface.columns) ){
+     free(reused);
+     freeSurface(&surface);
+     return PLOT_ERROR_MEMORY;
+   }
+
+   /* the coordinates of whole tiles, the same whichever view asks for them */
+   for (i=0; i<surface.columns; i++)
+      ((double *)surface.xs)[i] = ldexp((double)(tx0*TILE_SIZE + i), -level);
+   for (i=0; i<surface.rows; i++)
+      ((double *)surface.ys)[i] = ldexp((double)(ty0*TILE_SIZE + i), -level);
+   narrowSurface(&surface);
+
+   start = plotClock();
+   for (tr=0; tr<tileRows; tr++)
+      for (tc=0; tc<tileColumns; tc++){
+        reused[tr*tileColumns + tc] =
+           findTile(pngData->tiles,pngData->expression,surface.single,level,
+                    tx0+tc,ty0+tr,ZGRID_TILE_ROW(&region,tr,tc,0));
+        pngData->stats.tilesReused += reused[tr*tileColumns + tc];
+      }
+   pngData->stats.evaluateSeconds += plotClock() - start;
+
+   surface.reused = reused;
+   evaluateSurfaceRows(&surface,pool,0,surface.rows,&region);
+
+   start = plotClock();
+   for (tr=0; tr<tileRows; tr++)
+      for (tc=0; tc<tileColumns; tc++)
+         if ( !reused[tr*tileColumns + tc] )
+            storeTile(pngData->tiles,pngData->expression,surface.single,level,
+                      tx0+tc,ty0+tr,ZGRID_TILE_ROW(&region,tr,tc,0));
+   freeSurface(&surface);
+   free(reused);
+   pngData->stats.evaluateSeconds += plotClock() - start;
+
+   /* plotting colours from the part of the region in view */
+   start = plotClock();
+   if ( pngData->fixedRange ){
+     max = pngData->zMax;
+     min = pngData->zMin;
+   }
+   else
+      regionRange(&region,bottom,pngData->imgHeight,left,pngData->imgWidth,
+                  &max,&min);
+   for (i=0; i<pngData->imgHeight; i++)
+      colourSurfaceRow(rows[(pngData->imgHeight-1)-i],&pngData->colours,
+                       &region,bottom+i,left,pngData->imgWidth,valuesPerPixel,
+                       max,min);
+   destroyZGrid(&region);
+   pngData->stats.colourSeconds += plotClock() - start;
+   return PLOT_OK;
+}
+
+/*===========================================================================*/
+/* Function: streamCurve                                                     */
+/* Writes an f(x) plot a row at a time with png_write_row, using row as the  */
+/* one image row held in memory.                                             */
+/*===========================================================================*/
+static int streamCurve ( PNG                *pngData,
+                         PNGWRITER          *writer,
+                         png_byte           *row,
+                         const te_program   *n,
+                         const JIT          *native )
+{
+   long int    k;
+   long int    r;
+   long int   *rowStart;
+   short int  *rowColumns;
+   short int   valuesPerPixel = png_get_channels(writer->pngPtr,
+                                                 writer->infoPtr);
+   CURVE       curve;
+   int         status = PLOT_OK;
+   double      start;
+   double      encoded;
+
+   /* bucketing the plotted points by image row */
+   if ( !computeCurve(pngData,n,native,&curve) )
+      return PLOT_ERROR_MEMORY;
+   start   = plotClock();
+   encoded = pngData->stats.encodeSeconds;
+   rowStart   = (long int *)calloc(pngData->imgHeight+1, sizeof(long int));
+   rowColumns = (short int *)malloc(sizeof(short int)*(curve.points+1));
+
+   if ( !rowStart || !rowColumns )
+      status = PLOT_ERROR_MEMORY;
+   else {
+     for (k=0; k<curve.points; k++)
+        rowStart[curve.rows[k]+1]++;
+     for (r=0; r<pngData->imgHeight; r++)
+        rowStart[r+1] += rowStart[r];
+     for (k=0; k<curve.points; k++)
+        rowColumns[rowStart[curve.rows[k]]++] = curve.columns[k];
+     for (r=pngData->imgHeight; r>0; r--)
+        rowStart[r] = rowStart[r-1];
+     rowStart[0] = 0;
+
+     for (r=0; r<pngData->imgHeight && status == PLOT_OK; r++){
+       clearCurveRow(row,pngData,valuesPerPixel);
+       for (k=rowStart[r]; k<rowStart[r+1]; k++)
+          plotCurvePoint(row,rowColumns[k],pngData,valuesPerPixel);
+       if ( !writePngRow(writer,row) )
+          status = pngFailure(writer);
+     }
+   }
+
+   free(rowStart);
+   free(rowColumns);
+   free(curve.columns);
+   free(curve.rows);
+
+   /* the rows were written as they were coloured */
+   pngData->stats.colourSeconds += plotClock() - start -
+                                   (pngData->stats.encodeSeconds - encoded);
+   return status;
+}
+
+/*===========================================================================*/
+/* Function: streamSurface                                                   */
+/* Writes an f(x,y) plot a band of rows at a time, so that only a band of    */
+/* the grid is ever held in memory.  Unless the options fix it, the colour  */
+/* range is taken from a first pass over every STREAM_RANGE_STRIDE-th row    */
+/* and column of the grid; values outside it are clamped to the end colours. */
+/*===========================================================================*/
+static int streamSurface ( PNG                *pngData,
+                           PNGWRITER          *writer,
+                           png_byte           *row,
+                           const te_program   *n,
+                           const JIT          *native,
+                           THREADPOOL         *pool )
+{
+   long int    i;
+   long int    r;
+   long int    first;
+   long int    last;
+   ZGRID       zBand;
+   float       max;
+   float       min;
+   short int   valuesPerPixel = png_get_channels(writer->pngPtr,
+                                                 writer->infoPtr);
+   SURFACE     surface;
+   int         status = PLOT_OK;
+   double      start;
+   double      spent;
+
+   /* estimating the colour range from a sparse sample of the grid */
+   max = pngData->zMax;
+   min = pngData->zMin;
+   if ( !pngData->fixedRange ){
+     if ( !prepareSurface(pngData,n,native,pool,STREAM_RANGE_STRIDE,&surface) )
+        return PLOT_ERROR_MEMORY;
+     if ( !createZGrid(&zBand,STREAM_BAND_ROWS,surface.columns) ){
+       freeSurface(&surface);
+       return PLOT_ERROR_MEMORY;
+     }
+     for (i=0; i<surface.rows; i+=STREAM_BAND_ROWS)
+        evaluateSurfaceRows(&surface,pool,i,
+                            surface.rows-i < STREAM_BAND_ROWS ?
+                            surface.rows-i : STREAM_BAND_ROWS,&zBand);
+     start = plotClock();
+     surfaceRange(&surface,&max,&min);
+     freeSurface(&surface);
+     destroyZGrid(&zBand);
+     pngData->stats.colourSeconds += plotClock() - start;
+   }
+
+   /* evaluating, colouring and writing bands of rows, top row first */
+   if ( !prepareSurface(pngData,n,native,pool,1,&surface) )
+      return PLOT_ERROR_MEMORY;
+   if ( !createZGrid(&zBand,STREAM_BAND_ROWS,surface.columns) ){
+     freeSurface(&surface);
+     return PLOT_ERROR_MEMORY;
+   }
+   start = plotClock();
+   spent = pngData->stats.evaluateSeconds + pngData->stats.encodeSeconds;
+
+   for (r=0; r<surface.rows && status == PLOT_OK; r+=STREAM_BAND_ROWS){
+     last  = surface.rows - r;
+     first = last - STREAM_BAND_ROWS < 0 ? 0 : last - STREAM_BAND_ROWS;
+     evaluateSurfaceRows(&surface,pool,first,last-first,&zBand);
+
+     for (i=last-1; i>=first && status == PLOT_OK; i--){
+       colourSurfaceRow(row,&pngData->colours,&zBand,i-first,0,surface.columns,
+                        valuesPerPixel,max,min);
+       if ( !writePngRow(writer,row) )
+          status = pngFailure(writer);
+     }
+   }
+
+   freeSurface(&surface);
+   destroyZGrid(&zBand);
+
+   /* colouring is what the bands took beyond evaluating and writing them */
+   pngData->stats.colourSeconds += plotClock() - start -
+                                   (pngData->stats.evaluateSeconds +
+                                    pngData->stats.encodeSeconds - spent);
+   return status;
+}
+
+/*===========================================================================*/
+/* Function: computeCurve                                                    */
+/* Samples f(x) at every pixel column edge, then refines each interval between   */
+/* samples where the curve moves more than a pixel or bends away from the    */
+/* chord, and records the pixels of the line joining the samples.  Returns   */
+/* 0, with nothing left allocated, if memory runs out.                       */
+/*===========================================================================*/
+static int computeCurve ( PNG               *pngData,
+                          const te_program  *n,
+                          const JIT         *native,
+                          CURVE             *curve )
+{
+   long int    k;
+   long int    samples = pngData->imgWidth + 1;
+   const double *xs = pngData->view.columnX;
+   double     *zs;
+   double      frame[PLOT_VARIABLES];
+   double      start = plotClock();
+   const double *columns[PLOT_VARIABLES];
+
+   zs = (double *)malloc(sizeof(double)*samples);
+   curve->points  = 0;
+   curve->space   = 4*samples;
+   curve->columns = (short int *)malloc(sizeof(short int)*curve->space);
+   curve->rows    = (short int *)malloc(sizeof(short int)*curve->space);
+   curve->failed  = !zs || !curve->columns || !curve->rows;
+
+   if ( !curve->failed ){
+     /* calculating y values at every pixel column edge in one batch */
+     columns[0]      = xs;
+     columns[1]      = NULL;
+     columns[T_SLOT] = NULL;
+     frame[0]        = 0;
+     frame[1]        = 0;
+     frame[T_SLOT]   = pngData->t;
+     if ( native )
+        runJit(native, frame, columns, zs, samples);
+     else
+        te_eval_batch_frame(n, frame, columns, zs, samples);
+     pngData->stats.evaluations += samples;
+     for (k=0; k<samples; k++)
+        if ( zs[k] - zs[k] != 0 )
+           pngData->stats.nonFinite++;
+
+     for (k=0; k+1<samples && !curve->failed; k++)
+        refineCurve(pngData,n,native,curve,xs[k],zs[k],xs[k+1],zs[k+1],0);
+   }
+
+   free(zs);
+   pngData->stats.evaluateSeconds += plotClock() - start;
+   if ( curve->failed ){
+     free(curve->columns);
+     free(curve->rows);
+     return 0;
+   }
+   return 1;
+}
+/*===========================================================================*/
+/* Function: refineCurve                                                     */
+/* Draws f(x) between the samples (x0,y0) and (x1,y1), splitting the         */
+/* interval at its midpoint while the two halves are more than a pixel apart */
+/* or the midpoint is more than half a pixel off the chord.  An interval     */
+/* that is still too steep at CURVE_MAX_DEPTH is only joined up when the     */
+/* midpoint lies between its ends; otherwise it is taken as a discontinuity. */
+/* Intervals lying wholly off the image are dropped, as are those that are  */
+/* about to be split while an end is off the image or not finite, if the    */
+/* bounds of f(x) over them show the curve cannot come onto it.             */
+/*===========================================================================*/
+static void refineCurve ( PNG               *pngData,
+                          const te_program  *n,
+                          const JIT         *native,
+                          CURVE             *curve,
+                          double             x0,
+                          double             y0,
+                          double             x1,
+                          double             y1,
+                          int                depth )
+{
+   double      frame[PLOT_VARIABLES];
+   double      xm = (x0 + x1)/2;
+   double      ym;
+   double      gap;
+   double      bend;
+   int         finite0 = y0 - y0 == 0;
+   int         finite1 = y1 - y1 == 0;
+   VIEWPORT   *view = &pngData->view;
+   te_interval box[PLOT_VARIABLES];
+   te_interval bounds;
+
+   frame[0]      = xm;
+   frame[1]      = 0;
+   frame[T_SLOT] = pngData->t;
+   ym = native ? evalJit(native, frame) : te_program_eval_frame(n, frame);
+   pngData->stats.evaluations++;
+   if ( ym - ym != 0 )
+      pngData->stats.nonFinite++;
+
+   if ( finite0 && finite1 ){
+     /* wholly above or below the image: nothing to draw */
+     if ( (y0 >= view->yMax && ym >= view->yMax && y1 >= view->yMax) ||
+          (y0 < view->yMin && ym < view->yMin && y1 < view->yMin) )
+        return;
+
+     gap  = fabs(y1 - y0)*view->yScale;
+     bend = fabs(ym - (y0 + y1)/2)*view->yScale;
+     if ( gap <= 1 && bend <= 0.5 ){
+       drawCurveSegment(pngData,curve,x0,y0,x1,y1);
+       return;
+     }
+   }
+
+   if ( depth >= CURVE_MAX_DEPTH ){
+     if ( finite0 && finite1 && (ym - y0)*(y1 - ym) >= 0 )
+        drawCurveSegment(pngData,curve,x0,y0,x1,y1);
+     else {
+       if ( finite0 )
+          drawCurveSegment(pngData,curve,x0,y0,x0,y0);
+       if ( finite1 )
+          drawCurveSegment(pngData,curve,x1,y1,x1,y1);
+     }
+     return;
+   }
+
+   if ( pngData->cull && (!finite0 || !finite1 || y0 < view->yMin ||
+        y0 >= view->yMax || y1 < view->yMin || y1 >= view->yMax) ){
+     /* the ends of the drawn lines are clamped to a pixel beyond the image */
+     box[0].lo       = x0;
+     box[0].hi       = x1;
+     box[0].nan      = 0;
+     box[1].lo       = box[1].hi = 0;
+     box[1].nan      = 0;
+     box[T_SLOT].lo  = box[T_SLOT].hi = pngData->t;
+     box[T_SLOT].nan = 0;
+     bounds = te_program_bounds(n, box);
+     if ( bounds.lo > bounds.hi ||
+          (bounds.hi - view->yMin)*view->yScale < -1 ||
+          (bounds.lo - view->yMin)*view->yScale > pngData->imgHeight )
+        return;
+   }
+
+   refineCurve(pngData,n,native,curve,x0,y0,xm,ym,depth+1);
+   refineCurve(pngData,n,native,curve,xm,ym,x1,y1,depth+1);
+}
+
+/*===========================================================================*/
+/* Function: drawCurveSegment                                                */
+/* Records the pixels on the straight line from (x0,y0) to (x1,y1), given in */
+/* plot coordinates, stepping at most one pixel at a time.  The ends are     */
+/* clamped just outside the image first, so steep lines stay short.          */
+/*===========================================================================*/
+static void drawCurveSegment ( PNG      *pngData,
+                               CURVE    *curve,
+                               double    x0,
+                               double    y0,
+                               double    x1,
+                               double    y1 )
+{
+   VIEWPORT   *view = &pngData->view;
+   double      px0 = (x0 - view->xMin)*view->xScale;
+   double      px1 = (x1 - view->xMin)*view->xScale;
+   double      py0 = (y0 - view->yMin)*view->yScale;
+   double      py1 = (y1 - view->yMin)*view->yScale;
+   double      t;
+   long int    s;
+   long int    steps;
+
+   if ( py0 < -1 ) py0 = -1;
+   if ( py1 < -1 ) py1 = -1;
+   if ( py0 > pngData->imgHeight ) py0 = pngData->imgHeight;
+   if ( py1 > pngData->imgHeight ) py1 = pngData->imgHeight;
+
+   steps = ceil(fabs(px1 - px0) > fabs(py1 - py0) ? fabs(px1 - px0) :
+                                                    fabs(py1 - py0));
+   for (s=0; s<=steps; s++){
+     t = steps ? (double)s/steps : 0;
+     addCurvePoint(pngData,curve,px0 + (px1 - px0)*t,py0 + (py1 - py0)*t);
+   }
+}
+
+/*===========================================================================*/
+/* Function: addCurvePoint                                                   */
+/* Records the pixel holding the point (px,py), in pixels from the bottom    */
+/* left corner, if it lies inside the image and differs from the last one.  */
+/* Sets curve->failed if there is no memory for it.                          */
+/*===========================================================================*/
+static void addCurvePoint ( PNG      *pngData,
+                            CURVE    *curve,
+                            double    px,
+                            double    py )
+{
+   long int    column = floor(px);
+   long int    row = (pngData->imgHeight - 1) - (long int)floor(py);
+   short int  *grownColumns;
+   short int  *grownRows;
+
+   if ( curve->failed )
+      return;
+   if ( column < 0 || column >= pngData->imgWidth ||
+        row < 0 || row >= pngData->imgHeight )
+      return;
+   if ( curve->points > 0 && curve->columns[curve->points-1] == column &&
+        curve->rows[curve->points-1] == row )
+      return;
+
+   if ( curve->points == curve->space ){
+     grownColumns = (short int *)realloc(curve->columns,
+                                         sizeof(short int)*curve->space*2);
+     if ( grownColumns )
+        curve->columns = grownColumns;
+     grownRows = grownColumns ? (short int *)realloc(curve->rows,
+                                         sizeof(short int)*curve->space*2) : NULL;
+     if ( !grownRows ){
+       curve->failed = 1;
+       return;
+     }
+     curve->rows = grownRows;
+     curve->space *= 2;
+   }
+
+   curve->columns[curve->points] = column;
+   curve->rows[curve->points]    = row;
+   curve->points++;
+}
+
+
+/*===========================================================================*/
+/* Function: prepareSurface                                                  */
+/* Sets up the f(x,y) grid for evaluation, taking every stride-th row and    */
+/* column of the full grid (stride 1 is the full grid) from the viewport's   */
+/* tables, and the per-worker scratch space.  Grid row 0 is the bottom row  */
+/* of the image.  native, when not NULL, is used in place of the program.   */
+/* Returns 0, with nothing left allocated, if memory runs out.               */
+/*===========================================================================*/
+static int prepareSurface ( PNG               *pngData,
+                            const te_program  *n,
+                            const JIT         *native,
+                            THREADPOOL        *pool,
+                            short int          stride,
+                            SURFACE           *surface )
+{
+   long int    i;
+   long int    j;
+
+   if ( !allocateSurface(pngData,n,native,pool,
+                         (pngData->imgHeight + stride - 1)/stride,
+                         (pngData->imgWidth + stride - 1)/stride,surface) )
+      return 0;
+   surface->zMax = pngData->zMax;
+   surface->zMin = pngData->zMin;
+
+   /* the x coordinates are shared by every row of the grid */
+   for (j=0; j<surface->columns; j++)
+      ((double *)surface->xs)[j] = pngData->view.columnX[j*stride];
+   for (i=0; i<surface->rows; i++)
+      ((double *)surface->ys)[i] = pngData->view.rowY[i*stride];
+   narrowSurface(surface);
+
+   /* the bounds hold for double evaluation only */
+   surface->cull = pngData->cull && pngData->fixedRange && !surface->single;
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: narrowSurface                                                   */
+/* Fills in the float x coordinates of a single precision grid once xs and  */
+/* ys are set, or returns it to double if neighbouring columns or rows      */
+/* would round to the same float and draw as one.                            */
+/*===========================================================================*/
+static void narrowSurface ( SURFACE   *surface )
+{
+   long int    k;
+
+   if ( !surface->single )
+      return;
+
+   for (k=0; k<surface->columns; k++){
+     ((float *)surface->xf)[k] = (float)surface->xs[k];
+     if ( k > 0 && surface->xf[k] == surface->xf[k-1] )
+        surface->single = 0;
+   }
+   for (k=1; k<surface->rows; k++)
+      if ( (float)surface->ys[k] == (float)surface->ys[k-1] )
+         surface->single = 0;
+}
+
+/*===========================================================================*/
+/* Function: allocateSurface                                                 */
+/* Sets up a grid of rows by columns, leaving its coordinates to be filled  */
+/* in, and the per-worker scratch space.  Returns 0, with nothing left       */
+/* allocated, if memory runs out.                                            */
+/*===========================================================================*/
+static int allocateSurface ( PNG               *pngData,
+                             const te_program  *n,
+                             const JIT         *native,
+                             THREADPOOL        *pool,
+                             long int           rows,
+                             long int           columns,
+                             SURFACE           *surface )
+{
+   int         i;
+
+   surface->program  = n;
+   surface->native   = native;
+   surface->gpu      = pngData->gpu;
+   surface->stats    = &pngData->stats;
+   surface->reused   = NULL;
+   surface->cull     = 0;
+   surface->single   = pngData->single;
+   surface->t        = pngData->t;
+   surface->rows     = rows;
+   surface->columns  = columns;
+   surface->threads  = threadPoolSize(pool);
+   surface->xs = (double *)malloc(sizeof(double)*columns);
+   surface->ys = (double *)malloc(sizeof(double)*rows);
+   surface->xf = (float *)malloc(sizeof(float)*columns);
+   surface->workers = (WORKER *)calloc(surface->threads, sizeof(WORKER));
+   if ( !surface->xs || !surface->ys || !surface->xf || !surface->workers ){
+     freeSurface(surface);
+     return 0;
+   }
+
+   for (i=0; i<surface->threads; i++){
+     surface->workers[i].zs = (double *)alignedAlloc(sizeof(double)*TILE_SIZE);
+     if ( !surface->workers[i].zs ){
+       freeSurface(surface);
+       return 0;
+     }
+   }
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: evaluateSurfaceRows                                             */
+/* Evaluates count grid rows starting at first into zValues, on the GPU    */
+/* where there is one, no tiles are reused and the grid is tiled, otherwise */
+/* one tile per parallel task.  The GPU's range and counts go to the first  */
+/* worker.                                                                   */
+/*===========================================================================*/
+static void evaluateSurfaceRows ( SURFACE      *surface,
+                                  THREADPOOL   *pool,
+                                  long int      first,
+                                  long int      count,
+                                  ZGRID        *zValues )
+{
+   WORKER     *own = &surface->workers[0];
+   GPURANGE    range;
+   double      start = plotClock();
+
+   surface->firstRow = first;
+   surface->rowCount = count;
+   surface->zValues  = zValues;
+   if ( surface->gpu && !surface->reused && !zValues->mapped &&
+        runGpu(surface->gpu,surface->xs,surface->ys + first,count,surface->t,
+               zValues,&range) ){
+     if ( range.seen ){
+       if ( !own->seen || range.max > own->max )
+          own->max = range.max;
+       if ( !own->seen || range.min < own->min )
+          own->min = range.min;
+       own->seen = 1;
+     }
+     own->evaluations += count*surface->columns;
+     own->nonFinite   += range.nonFinite;
+     surface->stats->evaluateSeconds += plotClock() - start;
+     return;
+   }
+   runParallel(pool, (count + TILE_SIZE - 1)/TILE_SIZE * zValues->tileColumns,
+               evaluateSurface, surface);
+   surface->stats->evaluateSeconds += plotClock() - start;
+}
+
+/*===========================================================================*/
+/* Function: evaluateSurface                                                 */
+/* Parallel task: evaluates one tile of the f(x,y) grid and folds the        */
+/* results into the calling worker's max and min.  Tiles marked reused are   */
+/* left alone.                                                               */
+/*===========================================================================*/
+static void evaluateSurface ( void       *context,
+                              long int    task,
+                              int         worker )
+{
+   SURFACE    *surface = (SURFACE *)context;
+   WORKER     *own = &surface->workers[worker];
+   ZGRID      *grid = surface->zValues;
+   long int    tileRow = task / grid->tileColumns;
+   long int    tileColumn = task % grid->tileColumns;
+   long int    rows = surface->rowCount - tileRow*TILE_SIZE;
+   long int    width = surface->columns - tileColumn*TILE_SIZE;
+
+   if ( surface->reused && surface->reused[task] )
+      return;
+   if ( rows > TILE_SIZE )
+      rows = TILE_SIZE;
+   if ( width > TILE_SIZE )
+      width = TILE_SIZE;
+
+   if ( surface->cull )
+      cullBlock(surface,own,tileRow,tileColumn,0,rows,0,width);
+   else
+      evaluateBlock(surface,own,tileRow,tileColumn,0,rows,0,width);
+}
+
+/*===========================================================================*/
+/* Function: cullBlock                                                       */
+/* Fills rows r0 to r1 and columns c0 to c1 of a tile, quadtree fashion.  If */
+/* the bounds of f(x,y) over the block show every point in it takes the one */
+/* colour, and none is NaN, the block is filled with its lower bound;        */
+/* otherwise it is split into quarters, down to CULL_MIN_BLOCK, and the      */
+/* smallest blocks are evaluated.  The image is the same either way.         */
+/*===========================================================================*/
+static void cullBlock ( SURFACE    *surface,
+                        WORKER     *own,
+                        long int    tileRow,
+                        long int    tileColumn,
+                        long int    r0,
+                        long int    r1,
+                        long int    c0,
+                        long int    c1 )
+{
+   const double *xs = surface->xs + tileColumn*TILE_SIZE;
+   const double *ys = surface->ys + surface->firstRow + tileRow*TILE_SIZE;
+   long int    rm = (r0 + r1)/2;
+   long int    cm = (c0 + c1)/2;
+   long int    i;
+   long int    j;
+   float      *zRow;
+   float       lo;
+   float       hi;
+   te_interval box[PLOT_VARIABLES];
+   te_interval bounds;
+
+   box[0].lo       = xs[c0];
+   box[0].hi       = xs[c1-1];
+   box[0].nan      = 0;
+   box[1].lo       = ys[r0];
+   box[1].hi       = ys[r1-1];
+   box[1].nan      = 0;
+   box[T_SLOT].lo  = box[T_SLOT].hi = surface->t;
+   box[T_SLOT].nan = 0;
+   bounds = te_program_bounds(surface->program, box);
+   lo = bounds.lo;
+   hi = bounds.hi;
+
+   /* the colour index never falls as z rises */
+   if ( !bounds.nan && bounds.lo <= bounds.hi &&
+        colourIndex(lo,surface->zMin,surface->zMax - surface->zMin) ==
+        colourIndex(hi,surface->zMin,surface->zMax - surface->zMin) ){
+     for (i=r0; i<r1; i++){
+       zRow = ZGRID_TILE_ROW(surface->zValues,tileRow,tileColumn,i);
+       for (j=c0; j<c1; j++)
+          zRow[j] = lo;
+     }
+     return;
+   }
+
+   if ( r1 - r0 <= CULL_MIN_BLOCK && c1 - c0 <= CULL_MIN_BLOCK ){
+     evaluateBlock(surface,own,tileRow,tileColumn,r0,r1,c0,c1);
+     return;
+   }
+
+   /* splitting only the sides longer than the smallest block */
+   if ( r1 - r0 <= CULL_MIN_BLOCK )
+      rm = r1;
+   if ( c1 - c0 <= CULL_MIN_BLOCK )
+      cm = c1;
+   cullBlock(surface,own,tileRow,tileColumn,r0,rm,c0,cm);
+   if ( cm < c1 )
+      cullBlock(surface,own,tileRow,tileColumn,r0,rm,cm,c1);
+   if ( rm < r1 ){
+     cullBlock(surface,own,tileRow,tileColumn,rm,r1,c0,cm);
+     if ( cm < c1 )
+        cullBlock(surface,own,tileRow,tileColumn,rm,r1,cm,c1);
+   }
+}
+
+/*===========================================================================*/
+/* Function: evaluateBlock                                                   */
+/* Evaluates rows r0 to r1 and columns c0 to c1 of a tile of the f(x,y)      */
+/* grid, folding the results into the worker's max and min.  A single       */
+/* precision grid is evaluated by the interpreter straight into zValues.    */
+/*===========================================================================*/
+static void evaluateBlock ( SURFACE    *surface,
+                            WORKER     *own,
+                            long int    tileRow,
+                            long int    tileColumn,
+                            long int    r0,
+                            long int    r1,
+                            long int    c0,
+                            long int    c1 )
+{
+   long int    i;
+   long int    j;
+   float      *zRow;
+   double      result;
+   double      frame[PLOT_VARIABLES];
+   const double *columns[PLOT_VARIABLES];
+   const float  *narrowColumns[PLOT_VARIABLES];
+
+   own->evaluations += (r1 - r0)*(c1 - c0);
+
+   /* y is fixed along a row and passed in the frame; x varies by column */
+   columns[0]            = surface->xs + tileColumn*TILE_SIZE + c0;
+   columns[1]            = NULL;
+   columns[T_SLOT]       = NULL;
+   narrowColumns[0]      = surface->xf + tileColumn*TILE_SIZE + c0;
+   narrowColumns[1]      = NULL;
+   narrowColumns[T_SLOT] = NULL;
+   frame[0]              = 0;
+   frame[T_SLOT]         = surface->t;
+
+   for (i=r0; i<r1; i++){
+     frame[1] = surface->ys[surface->firstRow + tileRow*TILE_SIZE + i];
+     zRow = ZGRID_TILE_ROW(surface->zValues,tileRow,tileColumn,i) + c0;
+     if ( surface->single )
+        te_eval_batch_float(surface->program, frame, narrowColumns, zRow,
+                            c1 - c0);
+     else if ( surface->native )
+        runJit(surface->native, frame, columns, own->zs, c1 - c0);
+     else
+        te_eval_batch_frame(surface->program, frame, columns, own->zs, c1 - c0);
+
+     for (j=0; j<c1-c0; j++){
+       result = surface->single ? zRow[j] : own->zs[j];
+
+       if ( result - result != 0 )
+          own->nonFinite++;
+
+       /* updating max and min; NaN takes no part in the colour range */
+       if ( result == result ){
+         if ( !own->seen ){
+           own->max  = result;
+           own->min  = result;
+           own->seen = 1;
+         }
+         else if ( result > own->max ){
+           own->max = result;
+         } else if ( result < own->min ){
+           own->min = result;
+         }
+       }
+
+       zRow[j] = result;
+     }
+   }
+}
+
+/*===========================================================================*/
+/* Function: surfaceRange                                                    */
+/* Reduces the per-worker max and min of everything evaluated so far.       */
+/* Returns 0, leaving both 0, if every value was NaN.                        */
+/*===========================================================================*/
+static int surfaceRange ( SURFACE   *surface,
+                           float     *max,
+                           float     *min )
+{
+   int         k;
+   int         seen = 0;
+
+   *max = 0;
+   *min = 0;
+   for (k=0; k<surface->threads; k++){
+     if ( !surface->workers[k].seen )
+        continue;
+     if ( !seen || surface->workers[k].max > *max )
+        *max = surface->workers[k].max;
+     if ( !seen || surface->workers[k].min < *min )
+        *min = surface->workers[k].min;
+     seen = 1;
+   }
+   return seen;
+}
+
+/*===========================================================================*/
+/* Function: regionRange                                                     */
+/* The max and min of the z values in count rows from first and width       */
+/* columns from left of a grid, NaN taking no part.                          */
+/*===========================================================================*/
+static void regionRange ( const ZGRID   *zValues,
+                          long int       first,
+                          long int       count,
+                          long int       left,
+                          long int       width,
+                          float         *max,
+                          float         *min )
+{
+   long int     i;
+   long int     j;
+   int          seen = 0;
+   const float *zRow;
+   float        z;
+
+   *max = 0;
+   *min = 0;
+   for (i=first; i<first+count; i++)
+      for (j=left; j<left+width; j++){
+        zRow = ZGRID_TILE_ROW(zValues,i/TILE_SIZE,j/TILE_SIZE,i%TILE_SIZE);
+        z    = zRow[j%TILE_SIZE];
+        if ( z != z )
+           continue;
+        if ( !seen || z > *max )
+           *max = z;
+        if ( !seen || z < *min )
+           *min = z;
+        seen = 1;
+      }
+}
+
+/*===========================================================================*/
+/* Function: freeSurface                                                     */
+/* Free the grid coordinates and per-worker scratch space, adding up the    */
+/* workers' counts of evaluations and of NaN and infinite results.          */
+/*===========================================================================*/
+static void freeSurface ( SURFACE   *surface )
+{
+   int         k;
+
+   for (k=0; surface->workers && k<surface->threads; k++){
+     surface->stats->evaluations += surface->workers[k].evaluations;
+     surface->stats->nonFinite   += surface->workers[k].nonFinite;
+     alignedFree(surface->workers[k].zs);
+   }
+   free(surface->workers);
+   free((double *)surface->xs);
+   free((double *)surface->ys);
+   free((float *)surface->xf);
+}
+
+/*===========================================================================*/
+/* Function: colourIndex                                                     */
+/* The colour map entry for z, min taking the first and min + range the     */
+/* last; values beyond them are clamped, and NaN takes the first.            */
+/*===========================================================================*/
+static int colourIndex ( float   z,
+                         float   min,
+                         float   range )
+{
+   float           p = (z - min)/range;
+   unsigned int    bits;
+   unsigned int    clamped;
+
+   /* clamping on the bits, as a float compare would keep the row loops    */
+   /* from vectorizing: positive floats order as their bits do, and those  */
+   /* of negatives and NaN all lie above infinity's                        */
+   memcpy(&bits, &p, sizeof(p));
+   clamped  = bits > FLOAT_ONE_BITS ? FLOAT_ONE_BITS : bits;
+   clamped &= -(unsigned int)(bits <= FLOAT_INFINITY_BITS);
+   memcpy(&p, &clamped, sizeof(p));
+   return (int)((COLOUR_LEVELS - 1) * p);
+}
+
+/*===========================================================================*/
+/* Function: colourSurfaceRow                                                */
+/* Colours width z values of grid row i, from column left, with the colour  */
+/* map from min to max into an image row, in one pass a tile at a time:     */
+/* each value becomes an index, then the index a palette entry or an RGB    */
+/* triple from the table.  If max is not above min every value takes the    */
+/* first colour.                                                             */
+/*===========================================================================*/
+static void colourSurfaceRow ( png_byte          *row,
+                               const COLOURMAP   *colours,
+                               const ZGRID       *zValues,
+                               long int           i,
+                               long int           left,
+                               long int           width,
+                               short int          valuesPerPixel,
+                               float              max,
+                               float              min )
+{
+   long int     j;
+   long int     k;
+   long int     tile;
+   long int     count;
+   int          index[TILE_SIZE];
+   float        range = max > min ? max - min : 1;
+   const float *zRow;
+   const unsigned char *rgb;
+   png_byte    *ptr = row;
+
+   for (j=left; j<left+width; j+=count){
+     tile  = j/TILE_SIZE;
+     zRow  = ZGRID_TILE_ROW(zValues,i/TILE_SIZE,tile,i%TILE_SIZE) +
+             (j - tile*TILE_SIZE);
+     count = (tile+1)*TILE_SIZE < left+width ? (tile+1)*TILE_SIZE - j :
+                                               left+width - j;
+
+     if ( valuesPerPixel == 1 ){
+       for (k=0; k<count; k++)
+          ptr[k] = colourIndex(zRow[k],min,range);
+       ptr += count;
+     }
+     else {
+       for (k=0; k<count; k++)
+          index[k] = colourIndex(zRow[k],min,range);
+       for (k=0; k<count; k++, ptr+=3){
+         rgb    = colours->rgb + 3*index[k];
+         ptr[0] = rgb[0];
+         ptr[1] = rgb[1];
+         ptr[2] = rgb[2];
+       }
+     }
+   }
+}
+
+/*===========================================================================*/
+/* Function: clearCurveRow                                                   */
+/* Colours an f(x) image row white.                                          */
+/*===========================================================================*/
+static void clearCurveRow ( png_byte   *row,
+                            PNG        *pngData,
+                            short int   valuesPerPixel )
+{
+   if ( pngData->colourType == PNG_COLOR_TYPE_PALETTE )
+      memset(row, 0, (pngData->imgWidth*pngData->bitDepth + 7)/8);
+   else
+      memset(row, 255, pngData->imgWidth*valuesPerPixel);
+}
+
+/*===========================================================================*/
+/* Function: plotCurvePoint                                                  */
+/* Colours one f(x) point blue.  Palette rows pack 8/bitDepth pixels to a    */
+/* byte, leftmost pixel in the high bits.                                    */
+/*===========================================================================*/
+static void plotCurvePoint ( png_byte   *row,
+                             short int   column,
+                             PNG        *pngData,
+                             short int   valuesPerPixel )
+{
+   png_byte   *ptr;
+   int         perByte;
+
+   if ( pngData->colourType == PNG_COLOR_TYPE_PALETTE ){
+     perByte = 8/pngData->bitDepth;
+     row[column/perByte] |= 1 << ((perByte - 1 - column%perByte)*pngData->bitDepth);
+   }
+   else {
+     ptr = &(row[column*valuesPerPixel]);
+     ptr[0] = 0; ptr[1] = 0; ptr[2] = 255;
+   }
+}
+
+/*===========================================================================*/
+/* Function: setPalette                                                      */
+/* Write the palette for indexed output: white and blue for a 1-bit f(x)     */
+/* plot, or the colour map's 256 entries for an 8-bit f(x,y) plot.           */
+/*===========================================================================*/
+static void setPalette ( PNG           *pngData,
+                         png_structp   *pngPtr,
+                         png_infop     *infoPtr )
+{
+   png_color   palette[256];
+   int         k;
+
+   if ( pngData->bitDepth == 8 ){
+     for (k=0; k<COLOUR_LEVELS; k++){
+       palette[k].red   = pngData->colours.rgb[3*k];
+       palette[k].green = pngData->colours.rgb[3*k+1];
+       palette[k].blue  = pngData->colours.rgb[3*k+2];
+     }
+     png_set_PLTE(*pngPtr, *infoPtr, palette, COLOUR_LEVELS);
+   }
+   else {
+     palette[0].red = 255; palette[0].green = 255; palette[0].blue = 255;
+     palette[1].red = 0;   palette[1].green = 0;   palette[1].blue = 255;
+     png_set_PLTE(*pngPtr, *infoPtr, palette, 2);
+   }
+}
+
+/*===========================================================================*/
+/* Function: openPng                                                         */
+/* Start a PNG in the sink (creating the file for PLOT_SINK_FILE) and write  */
+/* its header.  Returns PLOT_OK, or the reason it could not be started.      */
+/*===========================================================================*/
+static int openPng ( PNGWRITER        *writer,
+                     const PLOTSINK   *sink,
+                     PNG              *pngData )
+{
+   double      start = plotClock();
+
+   memset(writer, 0, sizeof(PNGWRITER));
+   writer->sink   = sink;
+   writer->status = PLOT_OK;
+   writer->stats  = &pngData->stats;
+   writer->png    = pngData;
+
+   /* create file, unless the PNG goes to a stream */
+   if ( sink->kind == PLOT_SINK_FILE ){
+     writer->fp = fopen(sink->fileName, "wb");
+     if ( !writer->fp )
+        return PLOT_ERROR_OUTPUT;
+   }
+
+   /* initialize stuff; libpng reports errors by jumping back to here */
+   writer->pngPtr = png_create_write_struct(PNG_LIBPNG_VER_STRING, writer,
+                                            pngError, pngWarning);
+   if ( writer->pngPtr )
+      writer->infoPtr = png_create_info_struct(writer->pngPtr);
+   if ( !writer->infoPtr )
+      return closePng(writer,PLOT_ERROR_MEMORY);
+
+   if ( setjmp(png_jmpbuf(writer->pngPtr)) )
+      return closePng(writer,pngFailure(writer));
+
+   png_set_write_fn(writer->pngPtr, writer, writeSinkPng, flushSinkPng);
+
+   /* encoder settings; -1 leaves the libpng default */
+   if ( pngData->compression >= 0 )
+      png_set_compression_level(writer->pngPtr, pngData->compression);
+   if ( pngData->strategy >= 0 )
+      png_set_compression_strategy(writer->pngPtr, pngData->strategy);
+   if ( pngData->filters >= 0 )
+      png_set_filter(writer->pngPtr, PNG_FILTER_TYPE_BASE, pngData->filters);
+
+   /* write header */
+   png_set_IHDR(writer->pngPtr, writer->infoPtr, pngData->imgWidth,
+                pngData->imgHeight, pngData->bitDepth, pngData->colourType,
+                PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
+                PNG_FILTER_TYPE_BASE);
+
+   if ( pngData->colourType == PNG_COLOR_TYPE_PALETTE )
+      setPalette(pngData, &writer->pngPtr, &writer->infoPtr);
+
+   png_write_info(writer->pngPtr, writer->infoPtr);
+   writer->stats->encodeSeconds += plotClock() - start;
+   return PLOT_OK;
+}
+
+/*===========================================================================*/
+/* Function: writePngRow                                                     */
+/* Output the next image row.  Returns 0 on failure.                         */
+/*===========================================================================*/
+static int writePngRow ( PNGWRITER   *writer,
+                         png_byte    *row )
+{
+   double      start = plotClock();
+
+   if ( setjmp(png_jmpbuf(writer->pngPtr)) )
+      return 0;
+
+   png_write_row(writer->pngPtr, row);
+   writer->stats->encodeSeconds += plotClock() - start;
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: writePngImage                                                   */
+/* Output every image row.  With a pool of several threads, an image of     */
+/* two bands or more is filtered and deflated a band per task, with the     */
+/* settings libpng would use.  Returns 0 on failure.                         */
+/*===========================================================================*/
+static int writePngImage ( PNGWRITER   *writer,
+                           png_byte   **rows )
+{
+   const PNG  *png   = writer->png;
+   size_t      bytes = rowBytes(png);
+   IDAT        idat;
+   int         filters;
+   int         strategy;
+   int         written;
+   double      start = plotClock();
+
+   if ( threadPoolSize(writer->pool) > 1 &&
+        bytes*png->imgHeight >= 2*IDAT_BAND_BYTES ){
+     filters  = png->filters;
+     if ( filters < 0 )
+        filters = png->colourType == PNG_COLOR_TYPE_PALETTE ||
+                  png->bitDepth < 8 ? PNG_FILTER_NONE : PNG_ALL_FILTERS;
+     strategy = png->strategy;
+     if ( strategy < 0 )
+        strategy = filters != PNG_FILTER_NONE ? Z_FILTERED : Z_DEFAULT_STRATEGY;
+
+     if ( !compressIdat(&idat,rows,png->imgHeight,bytes,
+                        png->colourType == PNG_COLOR_TYPE_PALETTE ? 1 : 3,
+                        filters,png->compression,strategy,writer->pool) )
+        return 0;
+     written = writeIdat(writer,&idat);
+     freeIdat(&idat);
+     writer->stats->encodeSeconds += plotClock() - start;
+     return written;
+   }
+
+   if ( setjmp(png_jmpbuf(writer->pngPtr)) )
+      return 0;
+
+   png_write_image(writer->pngPtr, rows);
+   writer->stats->encodeSeconds += plotClock() - start;
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: writeIdat                                                       */
+/* Output deflated image data, an IDAT chunk per band, and the IEND chunk,  */
+/* which png_write_end cannot be left to write as libpng has not seen the   */
+/* image.  Returns 0 on failure.                                             */
+/*===========================================================================*/
+static int writeIdat ( PNGWRITER    *writer,
+                       const IDAT   *idat )
+{
+   long int    b;
+
+   if ( setjmp(png_jmpbuf(writer->pngPtr)) )
+      return 0;
+
+   for (b=0; b<idat->bands; b++)
+      png_write_chunk(writer->pngPtr, (png_const_bytep)"IDAT",
+                      idat->data[b], idat->lengths[b]);
+   png_write_chunk(writer->pngPtr, (png_const_bytep)"IEND", NULL, 0);
+   writer->ended = 1;
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: endPng                                                          */
+/* Output the end of the PNG.  Returns 0 on failure.                         */
+/*===========================================================================*/
+static int endPng ( PNGWRITER   *writer )
+{
+   if ( writer->ended )
+      return 1;
+   if ( setjmp(png_jmpbuf(writer->pngPtr)) )
+      return 0;
+
+   png_write_end(writer->pngPtr, NULL);
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: closePng                                                        */
+/* End the PNG if status is PLOT_OK, free the libpng structures and close    */
+/* the file, removing it if the PNG was not finished.  Returns status, or    */
+/* the reason the PNG could not be ended.                                    */
+/*===========================================================================*/
+static int closePng ( PNGWRITER   *writer,
+                      int          status )
+{
+   double      start = plotClock();
+
+   if ( status == PLOT_OK && !endPng(writer) )
+      status = pngFailure(writer);
+
+   if ( writer->pngPtr )
+      png_destroy_write_struct(&writer->pngPtr, &writer->infoPtr);
+
+   if ( writer->fp ){
+     if ( fclose(writer->fp) != 0 && status == PLOT_OK )
+        status = PLOT_ERROR_OUTPUT;
+     if ( status != PLOT_OK )
+        remove(writer->sink->fileName);
+     writer->fp = NULL;
+   }
+
+   writer->stats->finishSeconds += plotClock() - start;
+   writer->stats->bytes         += writer->bytes;
+   return status;
+}
+
+/*===========================================================================*/
+/* Function: pngFailure                                                      */
+/* The result for a libpng error: the sink's failure if a write was refused, */
+/* otherwise libpng has run out of memory.                                   */
+/*===========================================================================*/
+static int pngFailure ( PNGWRITER   *writer )
+{
+   return writer->status != PLOT_OK ? writer->status : PLOT_ERROR_MEMORY;
+}
+
+/*===========================================================================*/
+/* Function: writeSinkPng                                                    */
+/* libpng write callback: pass the bytes to the file or the stream sink.     */
+/*===========================================================================*/
+static void writeSinkPng ( png_structp    pngPtr,
+                           png_bytep      data,
+                           png_size_t     length )
+{
+   PNGWRITER  *writer = (PNGWRITER *)png_get_io_ptr(pngPtr);
+   int         written;
+
+   if ( writer->fp )
+      written = fwrite(data, 1, length, writer->fp) == length;
+   else
+      written = writer->sink->write(writer->sink->context, data, length);
+
+   if ( !written ){
+     writer->status = PLOT_ERROR_OUTPUT;
+     png_error(pngPtr, "output refused");
+   }
+   writer->bytes += length;
+}
+
+/*===========================================================================*/
+/* Function: flushSinkPng                                                    */
+/* libpng flush callback: files are flushed when they are closed.            */
+/*===========================================================================*/
+static void flushSinkPng ( png_structp   pngPtr )
+{
+   (void)pngPtr;
+}
+
+/*===========================================================================*/
+/* Function: pngError                                                        */
+/* libpng error callback: return to the caller's setjmp without printing.    */
+/*===========================================================================*/
+static void pngError ( png_structp       pngPtr,
+                       png_const_charp   message )
+{
+   (void)message;
+   png_longjmp(pngPtr, 1);
+}
+
+/*===========================================================================*/
+/* Function: pngWarning                                                      */
+/* libpng warning callback: a library does not print.                        */
+/*===========================================================================*/
+static void pngWarning ( png_structp       pngPtr,
+                         png_const_charp   message )
+{
+   (void)pngPtr;
+   (void)message;
+}
+
+/*===========================================================================*/
+/* Function: floorDivide                                                     */
+/* a/b rounded down, for b > 0.                                              */
+/*===========================================================================*/
+static long int floorDivide ( long int   a,
+                              long int   b )
+{
+   return a >= 0 ? a/b : -((-a + b - 1)/b);
+}
+
+/*===========================================================================*/
+/* Function: plotClock                                                       */
+/* A monotonic clock for the stage timings, in seconds.                      */
+/*===========================================================================*/
+static double plotClock ( void )
+{
+   struct timespec   ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec*1e-9;
+}
@@ -0,0 +1,126 @@
+/*===========================================================================*/
+/* libplot: renders plots of mathematical functions into memory, a PNG       */
+/* stream or a PNG file, for plotPNG and for programs that embed it.         */
+/*===========================================================================*/
+#ifndef PLOT_H
+#define PLOT_H
+
+#include <stddef.h>
+#include "threadpool.h"
+#include "imagebuffer.h"
+#include "exprcache.h"
+#include "tilecache.h"
+#include "colourmap.h"
+
+/*===========================================================================*/
+/* Constants                                                                 */
+/*===========================================================================*/
+/* results of plotRender */
+#define PLOT_OK                0
+#define PLOT_ERROR_MEMORY      1   /* an allocation failed                */
+#define PLOT_ERROR_EXPRESSION  2   /* the expression does not compile     */
+#define PLOT_ERROR_SIZE        3   /* width or height out of range        */
+#define PLOT_ERROR_OUTPUT      4   /* the file or the sink refused output */
+#define PLOT_ERROR_ARGUMENT    5   /* a missing pointer or an unknown sink */
+#define PLOT_ERROR_RANGE       6   /* an x or y range empty or not finite */
+
+/* kinds of sink */
+#define PLOT_SINK_FILE         0   /* a PNG file named fileName           */
+#define PLOT_SINK_STREAM       1   /* PNG bytes passed to write           */
+#define PLOT_SINK_PIXELS       2   /* raw rows written into pixels        */
+#define PLOT_SINK_RAW          3   /* float32 values in a file fileName   */
+#define PLOT_SINK_NPY          4   /* the same as a NumPy .npy file       */
+
+#define PLOT_MAX_SIZE      32767   /* largest width or height             */
+
+/*===========================================================================*/
+/* Type definitions                                                          */
+/*===========================================================================*/
+/* Receives the next length bytes of an encoded PNG; returns 0 to stop the   */
+/* render, which then fails with PLOT_ERROR_OUTPUT.                         */
+typedef int (*PlotWriteFunction)(void *context, const unsigned char *bytes,
+                                 size_t length);
+
+/*===========================================================================*/
+/* Structure definitions                                                     */
+/*===========================================================================*/
+/* where the time of a render went; plotRender adds to it, so one can sum   */
+/* several renders, and it must be zeroed before the first                  */
+struct plotstats_struct
+   {
+      double            compileSeconds;   /* parsing and compiling       */
+      double            evaluateSeconds;  /* evaluating the expression   */
+      double            colourSeconds;    /* normalizing and colouring   */
+      double            encodeSeconds;    /* header and image rows       */
+      double            finishSeconds;    /* PNG trailer, closing a file */
+      double            totalSeconds;
+      unsigned long int evaluations;      /* points evaluated            */
+      unsigned long int nonFinite;        /* of those, NaN or infinite   */
+      unsigned long int bytes;            /* PNG bytes written           */
+      unsigned long int tilesReused;      /* f(x,y) tiles from the cache */
+   };
+typedef struct plotstats_struct PLOTSTATS;
+
+/* what to draw and how to encode it; plotDefaults fills in every field */
+struct plotoptions_struct
+   {
+      int               width;
+      int               height;
+      double            xMin;         /* x across the image, left to     */
+      double            xMax;         /* right                           */
+      double            yMin;         /* y up the image, bottom to top   */
+      double            yMax;
+      double            zMin;         /* f(x,y) colour range, red to     */
+      double            zMax;         /* blue; equal for the image's own */
+      double            t;            /* the value of t                  */
+      int               colourMap;    /* COLOURMAP_* for f(x,y)          */
+      int               palette;      /* indexed colour                  */
+      int               stream;       /* encode a band of rows at a time */
+      int               jit;          /* evaluate through native code    */
+      int               gpu;          /* f(x,y) through OpenCL           */
+      int               single;       /* f(x,y) in single precision      */
+      int               cull;         /* use the bounds to skip work; 0  */
+                                      /* evaluates everything            */
+      int               compression;  /* zlib level 0-9, -1 for default  */
+      int               strategy;     /* zlib strategy, -1 for default   */
+      int               filters;      /* PNG_FILTER_* mask, -1 default   */
+      THREADPOOL       *pool;         /* NULL evaluates on the caller    */
+      EXPRCACHE        *cache;        /* NULL compiles every time        */
+      TILECACHE        *tiles;        /* f(x,y) tiles to reuse, or NULL  */
+      IMAGEBUFFER      *image;        /* pixels to reuse, or NULL        */
+      PLOTSTATS        *stats;        /* timings to add to, or NULL      */
+   };
+typedef struct plotoptions_struct PLOTOPTIONS;
+
+/* where a render goes; only the fields of the chosen kind are read */
+struct plotsink_struct
+   {
+      int               kind;
+      const char       *fileName;     /* PLOT_SINK_FILE, _RAW and _NPY   */
+      PlotWriteFunction write;        /* PLOT_SINK_STREAM                */
+      void             *context;
+      unsigned char    *pixels;       /* PLOT_SINK_PIXELS: height rows,  */
+      size_t            stride;       /* stride bytes apart, top first   */
+   };
+typedef struct plotsink_struct PLOTSINK;
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+/* Pixel rows are laid out as in the PNG: 8-bit RGB triples, or palette      */
+/* indices, 1-bit (white/blue) for f(x) and 8-bit (the colour map's 256     */
+/* entries, smallest value first) for f(x,y).                                */
+/* plotRowBytes gives the least stride for a PLOT_SINK_PIXELS buffer.        */
+/* PLOT_SINK_RAW and PLOT_SINK_NPY files hold the values themselves, little  */
+/* endian: f(x,y) at the bottom left of each pixel, top row first, or f(x)   */
+/* at the left of each column, with their view and range in a file named    */
+/* fileName followed by ".json".                                             */
+void        plotDefaults    (PLOTOPTIONS *);
+int         plotRender      (const char *,const PLOTOPTIONS *,const PLOTSINK *);
+int         plotAnimate     (const char *,const PLOTOPTIONS *,const PLOTSINK *,
+                             long int,double,double);
+size_t      plotRowBytes    (const char *,const PLOTOPTIONS *);
+const char *plotErrorString (int);
+void        plotAddStats    (PLOTSTATS *,const PLOTSTATS *);
+
+#endif
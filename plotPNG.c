@@ -3,39 +3,160 @@
 /* in files in the Portable Network Graphics (PNG) format.                   */
 /*===========================================================================*/
 
+#define _POSIX_C_SOURCE 200809L
+
 /*===========================================================================*/
 /* Includes                                                                  */
 /*===========================================================================*/
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <png.h>
-#include <math.h>
+#include <zlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
 #include "tinyexpr.h"
+#include "threadpool.h"
+#include "imagebuffer.h"
+#include "jit.h"
+#include "gpu.h"
+#include "exprcache.h"
+#include "listener.h"
+#include "viewport.h"
+#include "plot.h"
+
+/*===========================================================================*/
+/* Constants                                                                 */
+/*===========================================================================*/
+#define FAST_LEVEL 1               /* --fast: zlib level, strategy, filter   */
+#define FAST_STRATEGY Z_RLE
+#define FAST_FILTERS PNG_FILTER_UP
+#define BATCH_CACHE_SIZE 64        /* compiled expressions kept by --batch   */
+#define SERVE_CACHE_SIZE 256       /* and by --serve                         */
+#define RANGE_WORD_BYTES 128       /* longest MIN,MAX in a server request    */
+#define BATCH_TILE_CACHE_SIZE 1024 /* f(x,y) tiles kept by --batch (16 MiB)  */
+#define SERVE_TILE_CACHE_SIZE 1024 /* and by --serve                         */
+#define FRAME_DIGITS 4             /* least digits in a frame's file name    */
 
 /*===========================================================================*/
-/* Structure definition                                                      */
+/* Structure definitions                                                     */
 /*===========================================================================*/
-struct png_struct
+struct options_struct
+   {
+      int         threads;         /* 0 means one per processor */
+      int         stream;          /* write rows as they are made */
+      char       *batch;           /* manifest file, "-" for stdin */
+      char       *serve;           /* socket address for --serve   */
+      int         palette;         /* indexed colour output        */
+      int         jit;             /* native code for the expression */
+      int         gpu;             /* f(x,y) through OpenCL          */
+      int         single;          /* f(x,y) in single precision   */
+      int         stats;           /* report where the time went   */
+      long int    frames;          /* animation frames, 0 for none */
+      double      tMin;            /* t over the frames, the first */
+      double      tMax;            /* to the last                  */
+      long int    width;           /* image size for a single plot */
+      long int    height;
+      double      xMin;            /* the viewport, for every plot */
+      double      xMax;
+      double      yMin;
+      double      yMax;
+      double      zMin;            /* fixed colour range, or equal */
+      double      zMax;
+      int         colourMap;       /* COLOURMAP_* for f(x,y)       */
+      int         compression;     /* encoder settings, as in PNG  */
+      int         strategy;
+      int         filters;
+      char       *fileName;
+      char       *expression;
+   };
+typedef struct options_struct OPTIONS;
+
+/* one plot read from a batch manifest */
+struct job_struct
+   {
+      PLOTOPTIONS       plot;
+      char             *fileName;
+      char             *expression;
+      int               status;    /* plotRender result                */
+      PLOTSTATS         stats;
+   };
+typedef struct job_struct JOB;
+
+/* the jobs of a batch run and the buffers kept warm between them */
+struct batch_struct
+   {
+      JOB              *jobs;
+      long int          count;
+      int               stats;     /* report each job's stats         */
+      THREADPOOL       *pool;      /* NULL when jobs run side by side */
+      IMAGEBUFFER      *images;    /* one per worker, reused per job  */
+      EXPRCACHE        *cache;     /* programs shared between jobs    */
+      TILECACHE        *tiles;     /* z tiles shared between jobs     */
+   };
+typedef struct batch_struct BATCH;
+
+/* a PNG being written to memory by the render server */
+struct pngbuffer_struct
+   {
+      png_byte         *bytes;
+      size_t            length;
+      size_t            space;     /* bytes allocated                 */
+   };
+typedef struct pngbuffer_struct PNGBUFFER;
+
+/* the render server: renders take turns on the pool and the image buffer */
+struct server_struct
+   {
+      PLOTOPTIONS       defaults;  /* with the pool, cache and image  */
+      EXPRCACHE        *cache;
+      TILECACHE        *tiles;
+      IMAGEBUFFER       image;
+      int               stats;     /* report each request's stats     */
+      pthread_mutex_t   lock;      /* held for the length of a render */
+   };
+typedef struct server_struct SERVER;
+
+/* one connection to the render server, served by a thread of its own */
+struct client_struct
+   {
+      SERVER           *server;
+      int               socket;
+   };
+typedef struct client_struct CLIENT;
+
+/* a command line keyword and the library constant it stands for */
+struct keyword_struct
    {
-      short int   imgWidth;
-      short int   imgHeight;
-      png_byte    colourType;
-      png_byte    bitDepth;
+      const char       *name;
+      int               value;
    };
-typedef struct png_struct PNG;
+typedef struct keyword_struct KEYWORD;
 
 /*===========================================================================*/
 /* Function prototypes                                                       */
 /*===========================================================================*/
-void makeImageData       (PNG *,short int,png_bytep **, char[]);
-void allocateImageMemory (PNG *,png_bytep **,png_structp *,png_infop *);
-void freeImageMemory     (PNG *,png_bytep **);
-void writePngFileHeader  (FILE **,char *,PNG *,png_structp *,png_infop *);
-void writePngFileData    (png_structp *,png_infop *,png_bytep **);
-void writePngFileTrailer (FILE **,png_structp *);
+void parseArguments      (int,char **,OPTIONS *);
+int  lookupKeyword       (const KEYWORD *,const char *);
+int  parseRange          (const char *,double *,double *);
+char *parseViewport      (char *,PLOTOPTIONS *);
+int  runBatch            (OPTIONS *,PLOTOPTIONS *);
+void runAnimation        (OPTIONS *,PLOTOPTIONS *);
+char *frameFileName      (const char *,long int,long int);
+const char *outputExtension (const char *,int *);
+long int readManifest    (FILE *,PLOTOPTIONS *,EXPRCACHE *,JOB **,long int *);
+const char *checkJob     (const char *,long int,long int,char *,EXPRCACHE *);
+void renderJob           (void *,long int,int);
+void runServer           (OPTIONS *,PLOTOPTIONS *);
+void *serveClient        (void *);
+int  appendPng           (void *,const unsigned char *,size_t);
+void failRender          (int,const char *,const PLOTOPTIONS *);
+void printStats          (const char *,const PLOTSTATS *);
 void abortProgram        (const char *, ...);
 
 /*===========================================================================*/
@@ -44,310 +165,986 @@ void abortProgram        (const char *, ...);
 int main ( int      argc,
            char   **argv )
 {
-   FILE         *fp;
-   PNG           pngData;
-   png_structp   pngPtr;
-   png_infop     infoPtr;
-   png_bytep    *rowPointers;
+   PLOTOPTIONS   plot;
+   PLOTSINK      sink;
+   PLOTSTATS     stats;
+   OPTIONS       options;
+   THREADPOOL   *pool;
+   int           failed;
+   int           status;
+   int           kind = PLOT_SINK_FILE;
 
-   pngData.imgWidth   = 300;   /* pixels */
-   pngData.imgHeight  = 300;   /* pixels */
-   pngData.colourType = PNG_COLOR_TYPE_RGB;
-   pngData.bitDepth   = 8;
+   plotDefaults(&plot);
 
-   /* error trapping */
-   if ( argc != 3 ){
-     fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
-     abortProgram("Error: Incorrect number of arguments given.\nUsage:"
-                  " <program_name> <file_out> <math_expr>\n");
-   }
+   parseArguments(argc,argv,&options);
+   plot.width       = options.width;
+   plot.height      = options.height;
+   plot.xMin        = options.xMin;
+   plot.xMax        = options.xMax;
+   plot.yMin        = options.yMin;
+   plot.yMax        = options.yMax;
+   plot.zMin        = options.zMin;
+   plot.zMax        = options.zMax;
+   plot.colourMap   = options.colourMap;
+   plot.palette     = options.palette;
+   plot.stream      = options.stream;
+   plot.jit         = options.jit;
+   plot.gpu         = options.gpu;
+   plot.single      = options.single;
+   plot.compression = options.compression;
+   plot.strategy    = options.strategy;
+   plot.filters     = options.filters;
+   plot.t           = options.tMin;
 
-   if ( strstr(argv[1], ".png") == NULL ){
-     fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
-     abortProgram("Error: Invalid file name given in second argument.\nValid"
-                  " file names require the \".png\" extension.\ne.g."
-                  " \"file.png\" rather than \"file\"\n");
+   if ( options.jit && !jitSupported() )
+      fprintf(stderr, "Warning: --jit is not available on this system."
+                      " Falling back to the interpreter.\n");
+   if ( options.gpu && !gpuSupported() )
+      fprintf(stderr, "Warning: --gpu is not available on this system."
+                      " Falling back to the processor.\n");
+
+   if ( options.batch == NULL && options.serve == NULL ){
+     if ( outputExtension(options.fileName,&kind) == NULL ){
+       fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
+       abortProgram("Error: Invalid file name given in second argument.\nValid"
+                    " file names require the \".png\" extension, or \".npy\""
+                    " or \".raw\" for the values themselves.\ne.g."
+                    " \"file.png\" rather than \"file\"\n");
+     }
+
+     if ( strchr(options.expression, '=') != NULL ){
+       fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
+       abortProgram("Error: Invalid expression given in third argument.\n"
+                    "Expressions of the form y=f(x) or z=f(x,y) should be written"
+                    " f(x) or f(x,y) respectively.\ne.g. to plot y=x^2, provide"
+                    " \"x^2\" as third argument.\n");
+     }
+
+     if ( strchr(options.expression, 'y') != NULL && strchr(options.expression, 'x') == NULL ){
+       fprintf(stderr, "Warning: No x variable provided in third argument"
+                       " (expression). Will assume expression is of the form"
+                       " f(x,y).\nUnivariable expression should be given in terms"
+                       " of x. e.g. \"y^2\" should be written \"x^2\", else it"
+                       " will be treated as \"0*x + y^2\".\n\n");
+     }
    }
 
-   if ( strchr(argv[2], '=') != NULL ){
-     fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
-     abortProgram("Error: Invalid expression given in third argument.\n"
-                  "Expressions of the form y=f(x) or z=f(x,y) should be written"
-                  " f(x) or f(x,y) respectively.\ne.g. to plot y=x^2, provide"
-                  " \"x^2\" as third argument.\n");
+   pool = createThreadPool(options.threads);
+   if ( !pool )
+      abortProgram("Fatal error: Failed to start %d rendering threads.\n",
+                   options.threads);
+   plot.pool = pool;
+
+   if ( options.serve != NULL )
+      runServer(&options,&plot);
+
+   if ( options.batch != NULL ){
+     failed = runBatch(&options,&plot);
+     destroyThreadPool(pool);
+     return failed ? 1 : 0;
    }
 
-   if ( strchr(argv[2], 'y') != NULL && strchr(argv[2], 'x') == NULL ){
-     fprintf(stderr, "Warning: No x variable provided in third argument"
-                     " (expression). Will assume expression is of the form"
-                     " f(x,y).\nUnivariable expression should be given in terms"
-                     " of x. e.g. \"y^2\" should be written \"x^2\", else it"
-                     " will be treated as \"0*x + y^2\".\n\n");
+   if ( options.frames > 0 ){
+     runAnimation(&options,&plot);
+     destroyThreadPool(pool);
+     return 0;
    }
 
-   if ( pngData.imgHeight > 1400 || pngData.imgWidth > 1400 ){
-     fprintf(stderr, "Warning: Potential unexpected behaviour at dimensions"
-                     " greater than 1400.\nIf segmentation fault, try lowering"
-                     " resolution (hard-coded).\n\n");
+   sink.kind     = kind;
+   sink.fileName = options.fileName;
+   memset(&stats, 0, sizeof(stats));
+   if ( options.stats )
+      plot.stats = &stats;
+   status = plotRender(options.expression,&plot,&sink);
+   if ( status != PLOT_OK )
+      failRender(status,options.fileName,&plot);
+   fprintf(stdout, "File %s successfully created.\n", options.fileName);
+   if ( options.stats )
+      printStats(options.fileName,&stats);
+   destroyThreadPool(pool);
+   return 0;
+}
+
+/*===========================================================================*/
+/* Function: runAnimation                                                    */
+/* Renders the --frames numbered frames of the expression, t running over   */
+/* --t-range, and aborts if any fails.                                       */
+/*===========================================================================*/
+void runAnimation ( OPTIONS       *options,
+                    PLOTOPTIONS   *plot )
+{
+   PLOTSINK     *sinks;
+   PLOTSTATS     stats;
+   long int      k;
+   int           status;
+   int           kind = PLOT_SINK_FILE;
+
+   outputExtension(options->fileName,&kind);
+   sinks = (PLOTSINK *)calloc(options->frames, sizeof(PLOTSINK));
+   if ( !sinks )
+      abortProgram("Fatal error: Failed to allocate %ld frames.\n",
+                   options->frames);
+   for (k=0; k<options->frames; k++){
+     sinks[k].kind     = kind;
+     sinks[k].fileName = frameFileName(options->fileName,k,options->frames);
+     if ( !sinks[k].fileName )
+        abortProgram("Fatal error: Failed to allocate %ld frames.\n",
+                     options->frames);
    }
 
-   writePngFileHeader(&fp,argv[1],&pngData,&pngPtr,&infoPtr);
-   allocateImageMemory(&pngData,&rowPointers,&pngPtr,&infoPtr);
-   makeImageData(&pngData,png_get_channels(pngPtr,infoPtr),&rowPointers, argv[2]);
-   writePngFileData(&pngPtr,&infoPtr,&rowPointers);
-   writePngFileTrailer(&fp,&pngPtr);
-   freeImageMemory(&pngData,&rowPointers);
+   memset(&stats, 0, sizeof(stats));
+   if ( options->stats )
+      plot->stats = &stats;
+   status = plotAnimate(options->expression,plot,sinks,options->frames,
+                        options->tMin,options->tMax);
+   if ( status != PLOT_OK )
+      failRender(status,options->fileName,plot);
+   fprintf(stdout, "Files %s to %s successfully created.\n",
+           sinks[0].fileName, sinks[options->frames-1].fileName);
+   if ( options->stats )
+      printStats(options->fileName,&stats);
 
-   fprintf(stdout, "File %s successfully created.\n", argv[1]);
-   return 0;
+   for (k=0; k<options->frames; k++)
+      free((char *)sinks[k].fileName);
+   free(sinks);
 }
 
 /*===========================================================================*/
-/* Function: makeImageData                                                   */
-/* Puts data into the pixels to construct the image, based on the expression */
-/* given in the fourth parameter: "char expression[30]".                     */
+/* Function: frameFileName                                                   */
+/* The file name of frame k of frames: the number, zero padded to at least  */
+/* FRAME_DIGITS digits, put before the output extension of fileName, so     */
+/* that "wave.png" gives "wave0000.png" onwards.  Returns NULL if memory    */
+/* runs out; the caller frees the name.                                      */
 /*===========================================================================*/
-void makeImageData ( PNG          *pngData,
-                     short int     valuesPerPixel,
-                     png_bytep   **rowPointers,
-                     char          expression[30] )
+char *frameFileName ( const char   *fileName,
+                      long int      k,
+                      long int      frames )
 {
-   /* for evaluation */
-   double      x;
-   double      y;
+   const char  *extension;
+   char        *name;
+   int          digits = FRAME_DIGITS;
+   int          kind;
+   long int     last;
 
-   /* for iteration */
-   short int   i;
-   short int   j;
+   extension = outputExtension(fileName,&kind);
+   for (last=frames-1; last >= 10000L && digits < 20; last/=10)
+      digits++;
 
-   /* for calculations */
-   double      result;
-   float       z_values[pngData->imgWidth][pngData->imgHeight];
-   float       x_incr = 0;
-   float       y_incr = 0;
-   float       max = 0;
-   float       min = 0;
-   float       p;
-   char       *fxy_check = strchr(expression, 'y');
+   name = (char *)malloc(strlen(fileName) + digits + 1);
+   if ( name )
+      sprintf(name, "%.*s%0*ld%s", (int)(extension - fileName), fileName,
+              digits, k, extension);
+   return name;
+}
 
-   /* for plotting */
-   long int    x_pixel;
-   long int    y_pixel;
-   png_byte   *ptr;
+/*===========================================================================*/
+/* Function: outputExtension                                                 */
+/* The last output extension in fileName, setting kind to the sink it is    */
+/* written through: ".png" a PNG, ".npy" and ".raw" the values as float32.  */
+/* Returns NULL, leaving kind alone, if there is none.                       */
+/*===========================================================================*/
+const char *outputExtension ( const char   *fileName,
+                              int          *kind )
+{
+   static const KEYWORD extensions[] = {
+      {".png",     PLOT_SINK_FILE},
+      {".npy",     PLOT_SINK_NPY},
+      {".raw",     PLOT_SINK_RAW},
+      {NULL,       0}
+   };
+   const KEYWORD  *table;
+   const char     *found = NULL;
+   const char     *next;
 
-   /* for tinyexpr */
-   int         err;
-   te_expr    *n;
-   te_variable vars[] = {{"x", &x}, {"y", &y}};
+   for (table=extensions; table->name; table++)
+      for (next=strstr(fileName, table->name); next;
+           next=strstr(next + 1, table->name))
+         if ( !found || next > found ){
+           found = next;
+           *kind = table->value;
+         }
+   return found;
+}
 
-   n = te_compile(expression, vars, 2, &err);
+/*===========================================================================*/
+/* Function: runBatch                                                        */
+/* Renders every plot in the manifest.  With several threads and several     */
+/* jobs, whole jobs are spread over the pool and each runs single-threaded;  */
+/* otherwise the jobs run in turn and share the pool.  Returns the number of */
+/* manifest lines that were skipped or failed to render.                     */
+/*===========================================================================*/
+int runBatch ( OPTIONS       *options,
+               PLOTOPTIONS   *defaults )
+{
+   FILE        *manifest;
+   BATCH        batch;
+   THREADPOOL  *pool = defaults->pool;
+   PLOTSTATS    total;
+   long int     k;
+   long int     skipped;
+   long int     failed = 0;
+   unsigned long int hits;
+   unsigned long int misses;
+   int          workers = threadPoolSize(pool);
+   int          w;
 
+   if ( strcmp(options->batch, "-") == 0 )
+      manifest = stdin;
+   else if ( (manifest = fopen(options->batch, "r")) == NULL )
+      abortProgram("Error: Manifest %s could not be opened for reading.\n",
+                   options->batch);
 
-   /* error trapping */
-   if ( !n ){
-     fprintf(stdout, "Program aborted. See stderr for more information.\n");
-     abortProgram("Fatal error: Failed to compile math expression.\n\nProbably"
-                  " invalid expression given in third argument:\n\n"
-                  "     Expressions should be written in terms of x and y only."
-                  "\n     x should be used for univariable expressions, or both"
-                  " x and y for multivariate expressions.\n     e.g. \"k^2\" is"
-                  " invalid, and should be written \"x^2\".\n\n     Equations"
-                  " of the form y=f(x) or z=f(x,y) are invalid, and should be"
-                  " written f(x) or f(x,y) respectively.\n     e.g. \"y=x^2\""
-                  " is invalid, and should be written \"x^2\".\n");
+   batch.cache = createExprCache(BATCH_CACHE_SIZE);
+   batch.tiles = createTileCache(BATCH_TILE_CACHE_SIZE);
+   if ( !batch.cache || !batch.tiles )
+      abortProgram("Fatal error: Failed to allocate the batch caches.\n");
+   batch.count = readManifest(manifest,defaults,batch.cache,&batch.jobs,
+                              &skipped);
+   if ( manifest != stdin )
+      fclose(manifest);
+
+   batch.stats  = options->stats;
+   batch.pool   = (workers > 1 && batch.count > 1) ? NULL : pool;
+   batch.images = (IMAGEBUFFER *)calloc(workers, sizeof(IMAGEBUFFER));
+   if ( !batch.images )
+      abortProgram("Fatal error: Failed to allocate image buffers.\n");
+
+   if ( batch.pool == NULL )
+      runParallel(pool, batch.count, renderJob, &batch);
+   else
+      for (k=0; k<batch.count; k++)
+         renderJob(&batch, k, 0);
+
+   memset(&total, 0, sizeof(total));
+   for (k=0; k<batch.count; k++)
+      plotAddStats(&total, &batch.jobs[k].stats);
+   if ( options->stats ){
+     printStats("total",&total);
+     exprCacheCounts(batch.cache,&hits,&misses);
+     fprintf(stderr, "Stats: expression cache: %lu hits, %lu misses.\n",
+             hits, misses);
+     tileCacheCounts(batch.tiles,&hits,&misses);
+     fprintf(stderr, "Stats: tile cache: %lu hits, %lu misses.\n",
+             hits, misses);
    }
 
-   if ( fxy_check != NULL && pngData->imgHeight != pngData->imgWidth ){
-     abortProgram("Error: Invalid dimensions (hard-coded).\n\nExpressions of"
-                  " the form f(x,y) can only be written to PNG files with"
-                  " square dimension.\ne.g. 200x300 is invalid, but"
-                  " 300x300 or 200x200 are valid.\n");
+   for (w=0; w<workers; w++)
+      destroyImageBuffer(&batch.images[w]);
+   free(batch.images);
+   destroyExprCache(batch.cache);
+   destroyTileCache(batch.tiles);
+   for (k=0; k<batch.count; k++){
+     failed += batch.jobs[k].status != PLOT_OK;
+     free(batch.jobs[k].fileName);
+     free(batch.jobs[k].expression);
    }
+   free(batch.jobs);
 
-   /* plotting the expression */
-   if ( fxy_check == NULL ){                    /* if its of the form f(x) */
-     /* colouring background white */
-     for ( i=0; i<pngData->imgHeight; i++ )
-     {
-        png_byte *row = (*rowPointers)[i];
-        for ( j=0; j<pngData->imgWidth; j++ )
-        {
-          ptr = &(row[j*valuesPerPixel]);
-          ptr[0] = 255; ptr[1] = 255; ptr[2] = 255;
-        }
-     }
-
-     /* calculating and plotting y values (colouring over white background)*/
-     for (i=0; i<(pngData->imgWidth)*50; i++){
-       x = x_incr;
-       result = te_eval(n);
-
-       /* if coordinate is in range, plot it */
-       if ( result < 1 ){
-         x_pixel = x_incr*(pngData->imgWidth);
-         y_pixel = result*(pngData->imgHeight);
-
-         png_byte *ptr;
-         png_byte *current_row;
-
-         current_row = (*rowPointers)[((pngData->imgHeight)-1)-y_pixel];
-         ptr = &(current_row[x_pixel*valuesPerPixel]);
-         ptr[0] = 0; ptr[1] = 0; ptr[2] = 255;
-       }
-       x_incr += 1.0/((pngData->imgWidth)*50);
+   if ( skipped > 0 )
+      fprintf(stderr, "%ld manifest line(s) skipped.\n", skipped);
+   if ( failed > 0 )
+      fprintf(stderr, "%ld plot(s) failed.\n", failed);
+   return skipped + failed;
+}
+
+/*===========================================================================*/
+/* Function: readManifest                                                    */
+/* Reads one job per line: "<file_out> <width> <height> <math_expr>", the    */
+/* expression running to the end of the line.  Blank lines and lines that    */
+/* start with '#' are ignored; invalid lines are reported on stderr and      */
+/* counted in skipped.  Jobs take everything but their size from defaults.   */
+/* Expressions are checked by compiling them into the cache, so repeated     */
+/* ones are ready when the jobs run.  Returns the number of jobs stored.     */
+/*===========================================================================*/
+long int readManifest ( FILE          *manifest,
+                        PLOTOPTIONS   *defaults,
+                        EXPRCACHE     *cache,
+                        JOB          **jobs,
+                        long int      *skipped )
+{
+   char        *line = NULL;
+   size_t       space = 0;
+   long int     lineNumber = 0;
+   long int     count = 0;
+   long int     capacity = 0;
+   char        *fileName;
+   char        *expression;
+   char        *end;
+   long int     width;
+   long int     height;
+   const char  *error;
+   JOB         *grown;
+
+   *jobs    = NULL;
+   *skipped = 0;
+
+   while ( getline(&line, &space, manifest) != -1 ){
+     lineNumber++;
+     line[strcspn(line, "\r\n")] = '\0';
+
+     fileName = line + strspn(line, " 	");
+     if ( *fileName == '\0' || *fileName == '#' )
+        continue;
+
+     /* splitting the line into its fields */
+     end = fileName + strcspn(fileName, " 	");
+     width = height = 0;
+     if ( *end != '\0' ){
+       *end++ = '\0';
+       width  = strtol(end, &end, 10);
+       height = strtol(end, &end, 10);
      }
-     te_free(n);
+     expression = end + strspn(end, " 	");
+     error = checkJob(fileName,width,height,expression,cache);
+
+     if ( error ){
+       fprintf(stderr, "Error: Manifest line %ld: %s.\n", lineNumber, error);
+       (*skipped)++;
+       continue;
+     }
+
+     /* storing the job */
+     if ( count == capacity ){
+       capacity = capacity ? capacity*2 : 64;
+       grown = (JOB *)realloc(*jobs, sizeof(JOB)*capacity);
+       if ( !grown )
+          abortProgram("Fatal error: Failed to allocate batch jobs.\n");
+       *jobs = grown;
+     }
+     (*jobs)[count].plot        = *defaults;
+     (*jobs)[count].plot.width  = width;
+     (*jobs)[count].plot.height = height;
+     (*jobs)[count].plot.cache  = cache;
+     (*jobs)[count].status      = PLOT_OK;
+     memset(&(*jobs)[count].stats, 0, sizeof(PLOTSTATS));
+     (*jobs)[count].fileName   = strdup(fileName);
+     (*jobs)[count].expression = strdup(expression);
+     if ( !(*jobs)[count].fileName || !(*jobs)[count].expression )
+        abortProgram("Fatal error: Failed to allocate batch jobs.\n");
+     count++;
    }
 
-  else {                                    /* else its of the form f(x,y) */
-    /* calculating z values */
-    for (i=0; i<pngData->imgWidth; i++){
-      y_incr = 0.0;
-      for (j=0; j<pngData->imgHeight; j++){
-        x = x_incr;
-        y = y_incr;
-        result = te_eval(n);
-
-        /* initialising max and min values */
-        if ( i==0 && j==0 ){
-          max = result;
-          min = result;
-        }
-
-        /* updating max and min */
-        else if ( result > max ){
-          max = result;
-        } else if ( result < min ){
-          min = result;
-        }
-
-        /* storing the result */
-        z_values[i][j] = result;
-
-        y_incr += 1.0 / pngData->imgWidth;
-      }
-      x_incr += 1.0 / pngData->imgHeight;
-    }
-    te_free(n);
-
-    /* plotting colours */
-    for (i=0; i<pngData->imgWidth; i++){
-      for (j=0; j<pngData->imgHeight; j++){
-        png_byte *ptr;
-        png_byte *current_row;
-
-        p = (z_values[i][j] - min)/(max - min);
-
-        current_row = (*rowPointers)[((pngData->imgWidth)-1)-i];
-        ptr = &(current_row[j*valuesPerPixel]);
-        ptr[0] = 255 * (1 - p); ptr[1] = 0; ptr[2] = 255 * p;
-
-      }
-    }
-  }
+   free(line);
+   return count;
 }
 
+/*===========================================================================*/
+/* Function: checkJob                                                        */
+/* Checks a plot request before it is rendered, compiling its expression     */
+/* into the cache.  fileName is NULL when the plot goes to memory.  Returns  */
+/* NULL if the plot can be made, otherwise the reason it cannot.             */
+/*===========================================================================*/
+const char *checkJob ( const char   *fileName,
+                       long int      width,
+                       long int      height,
+                       char         *expression,
+                       EXPRCACHE    *cache )
+{
+   te_variable  vars[] = {{"x", 0, TE_VARIABLE, 0},
+                         {"y", 0, TE_VARIABLE, 0},
+                         {"t", 0, TE_VARIABLE, 0}};
+   CACHEDEXPR  *n;
+   int          err;
+   int          kind;
+
+   if ( width < 1 || width > PLOT_MAX_SIZE || height < 1 ||
+        height > PLOT_MAX_SIZE )
+      return "width and height must be whole numbers from 1 to 32767";
+   if ( *expression == '\0' )
+      return "no expression given";
+   if ( fileName != NULL && outputExtension(fileName,&kind) == NULL )
+      return "file name needs the \".png\", \".npy\" or \".raw\" extension";
+   if ( strchr(expression, '=') != NULL )
+      return "expressions should be written f(x) or f(x,y), not y=f(x)";
+   if ( (n = acquireExpr(cache, expression, vars, 3, &err)) == NULL )
+      return "expression does not compile";
+   releaseExpr(cache, n);
+   return NULL;
+}
 
 /*===========================================================================*/
-/* Function: allocateImageMemory                                             */
-/* Allocate memory into the image storage; the image is stored as rows in    */
-/* rowPointers, and each element in rowPointers is a pointer to a single     */
-/* pixel.  Each pixel is an RGB triple in the range 0 to 255.                */
+/* Function: renderJob                                                       */
+/* Parallel task: renders one batch job with the worker's image buffer.  A  */
+/* failure is reported and the batch carries on.                             */
 /*===========================================================================*/
-void allocateImageMemory ( PNG            *pngData,
-                           png_bytep     **rowPointers,
-                           png_structp    *pngPtr,
-                           png_infop      *infoPtr )
+void renderJob ( void       *context,
+                 long int    task,
+                 int         worker )
 {
-   short int   y;
-   *rowPointers = (png_bytep *)malloc(sizeof(png_bytep)*pngData->imgHeight);
-   for (y=0; y<pngData->imgHeight; y++)
-      (*rowPointers)[y] = (png_byte *)malloc(png_get_rowbytes(*pngPtr,*infoPtr));
+   BATCH      *batch = (BATCH *)context;
+   JOB        *job = &batch->jobs[task];
+   PLOTOPTIONS plot = job->plot;
+   PLOTSINK    sink;
+
+   plot.pool     = batch->pool;
+   plot.image    = &batch->images[worker];
+   plot.tiles    = batch->tiles;
+   plot.stats    = &job->stats;
+   sink.kind     = PLOT_SINK_FILE;
+   sink.fileName = job->fileName;
+   outputExtension(job->fileName,&sink.kind);
+
+   job->status = plotRender(job->expression,&plot,&sink);
+   if ( job->status == PLOT_OK )
+      fprintf(stdout, "File %s successfully created.\n", job->fileName);
+   else
+      fprintf(stderr, "Error: %s: %s.\n", job->fileName,
+              plotErrorString(job->status));
+   if ( batch->stats )
+      printStats(job->fileName,&job->stats);
 }
 
 /*===========================================================================*/
-/* Function: freeImageMemory                                                 */
-/* Free the memory used to store the image.                                  */
+/* Function: runServer                                                       */
+/* Listens on the --serve address and answers render requests until killed.  */
+/* Each request is one line, "<width> <height> <math_expr>", and is answered */
+/* with "OK <bytes>" and a newline followed by the PNG, or with "ERROR       */
+/* <reason>" and a newline.  A client may send any number of requests on one */
+/* connection.  Every connection has a thread of its own, and renders take   */
+/* turns on the thread pool, which stays warm along with the compile cache.  */
 /*===========================================================================*/
-void freeImageMemory ( PNG          *pngData,
-                       png_bytep   **rowPointers )
+void runServer ( OPTIONS       *options,
+                 PLOTOPTIONS   *defaults )
 {
-   short int   y;
-   for (y=0; y<pngData->imgHeight; y++)
-      free((*rowPointers)[y]);
-   free(*rowPointers);
+   SERVER          server;
+   CLIENT         *client;
+   pthread_t       thread;
+   pthread_attr_t  detached;
+   int             listener;
+   int             fd;
+
+   listener = openListener(options->serve);
+   if ( listener < 0 )
+      abortProgram("Error: Could not listen on %s: %s.\n", options->serve,
+                   strerror(errno));
+
+   memset(&server, 0, sizeof(server));
+   server.defaults = *defaults;
+   server.cache    = createExprCache(SERVE_CACHE_SIZE);
+   server.tiles    = createTileCache(SERVE_TILE_CACHE_SIZE);
+   server.defaults.cache = server.cache;
+   server.defaults.tiles = server.tiles;
+   server.defaults.image = &server.image;
+   server.stats    = options->stats;
+   if ( !server.cache || !server.tiles || pthread_mutex_init(&server.lock, NULL) != 0 ||
+        pthread_attr_init(&detached) != 0 )
+      abortProgram("Fatal error: Failed to start the render server.\n");
+   pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+
+   /* a client hanging up mid-reply must not end the server */
+   signal(SIGPIPE, SIG_IGN);
+
+   fprintf(stdout, "Serving plots on %s.\n", options->serve);
+   fflush(stdout);
+
+   for (;;){
+     fd = accept(listener, NULL, NULL);
+     if ( fd < 0 ){
+       if ( errno == EINTR || errno == ECONNABORTED || errno == EMFILE ||
+            errno == ENFILE )
+          continue;
+       abortProgram("Error: Could not accept a connection: %s.\n",
+                    strerror(errno));
+     }
+
+     client = (CLIENT *)malloc(sizeof(CLIENT));
+     if ( client ){
+       client->server = &server;
+       client->socket = fd;
+     }
+     if ( !client || pthread_create(&thread, &detached, serveClient,
+                                    client) != 0 ){
+       fprintf(stderr, "Warning: Dropped a connection; out of threads.\n");
+       close(fd);
+       free(client);
+     }
+   }
 }
 
 /*===========================================================================*/
-/* Function: writePngFileHeader                                              */
-/* Open the output file and intialise it as a PNG image file.`               */
+/* Function: serveClient                                                     */
+/* Thread: answers the requests on one connection until the client closes   */
+/* it.  The PNG is rendered into a buffer of the connection's own, so a      */
+/* slow client holds up no one else while its reply is sent.                 */
 /*===========================================================================*/
-void writePngFileHeader ( FILE         **fp,
-                          char          *fileName,
-                          PNG           *pngData,
-                          png_structp   *pngPtr,
-                          png_infop     *infoPtr )
+void *serveClient ( void   *context )
 {
-   /* create file */
-   *fp = fopen(fileName, "wb");
-   if ( !*fp )
-      abortProgram("[write_png_file] File %s could not be opened for writing", fileName);
+   CLIENT      *client = (CLIENT *)context;
+   SERVER      *server = client->server;
+   FILE        *in = fdopen(client->socket, "r");
+   PNGBUFFER    memory;
+   PLOTOPTIONS  plot;
+   PLOTSINK     sink;
+   PLOTSTATS    stats;
+   char        *line = NULL;
+   size_t       space = 0;
+   char        *expression;
+   char        *end;
+   char         reply[128];
+   const char  *error;
+   long int     width;
+   long int     height;
+   int          status;
+   int          open = in != NULL;
 
-   /* initialize stuff */
-   *pngPtr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+   memory.bytes  = NULL;
+   memory.length = 0;
+   memory.space  = 0;
+   sink.kind     = PLOT_SINK_STREAM;
+   sink.write    = appendPng;
+   sink.context  = &memory;
+
+   while ( open && getline(&line, &space, in) != -1 ){
+     line[strcspn(line, "\r\n")] = '\0';
+     width  = strtol(line, &end, 10);
+     height = strtol(end, &end, 10);
+     plot   = server->defaults;
+     expression = parseViewport(end,&plot);
+
+     error = expression ? checkJob(NULL,width,height,expression,server->cache)
+                        : "ranges should be written x=MIN,MAX with MIN below MAX";
+     if ( error ){
+       sprintf(reply, "ERROR %s\n", error);
+       open = sendAll(client->socket, reply, strlen(reply));
+       continue;
+     }
+
+     plot.width    = width;
+     plot.height   = height;
+     plot.stats    = &stats;
+     memory.length = 0;
+     memset(&stats, 0, sizeof(stats));
+
+     pthread_mutex_lock(&server->lock);
+     status = plotRender(expression,&plot,&sink);
+     pthread_mutex_unlock(&server->lock);
+
+     if ( server->stats )
+        printStats(line,&stats);
+
+     if ( status != PLOT_OK ){
+       sprintf(reply, "ERROR %s\n", plotErrorString(status));
+       open = sendAll(client->socket, reply, strlen(reply));
+       continue;
+     }
+
+     sprintf(reply, "OK %lu\n", (unsigned long int)memory.length);
+     open = sendAll(client->socket, reply, strlen(reply)) &&
+            sendAll(client->socket, memory.bytes, memory.length);
+   }
+
+   if ( in )
+      fclose(in);
+   else
+      close(client->socket);
+   free(line);
+   free(memory.bytes);
+   free(client);
+   return NULL;
+}
+
+/*===========================================================================*/
+/* Function: parseArguments                                                  */
+/* Read the command line: options first, then the file name and expression. */
+/*===========================================================================*/
+void parseArguments ( int        argc,
+                      char     **argv,
+                      OPTIONS   *options )
+{
+   int         i;
+   int         positional = 0;
+   int         value;
+   long int    count;
+   char       *end;
+   char       *name;
+   static const KEYWORD valued[] = {
+      {"--threads",     1},
+      {"--size",        1},
+      {"--x-range",     1},
+      {"--y-range",     1},
+      {"--z-range",     1},
+      {"--t-range",     1},
+      {"--frames",      1},
+      {"--colourmap",   1},
+      {"--batch",       1},
+      {"--serve",       1},
+      {"--compression", 1},
+      {"--strategy",    1},
+      {"--filter",      1},
+      {NULL,            -1}
+   };
+   static const KEYWORD strategies[] = {
+      {"default",  Z_DEFAULT_STRATEGY},
+      {"filtered", Z_FILTERED},
+      {"huffman",  Z_HUFFMAN_ONLY},
+      {"rle",      Z_RLE},
+      {"fixed",    Z_FIXED},
+      {NULL,       -1}
+   };
+   static const KEYWORD filters[] = {
+      {"none",     PNG_FILTER_NONE},
+      {"sub",      PNG_FILTER_SUB},
+      {"up",       PNG_FILTER_UP},
+      {"avg",      PNG_FILTER_AVG},
+      {"paeth",    PNG_FILTER_PAETH},
+      {"adaptive", PNG_ALL_FILTERS},
+      {NULL,       -1}
+   };
+   static const KEYWORD colourMaps[] = {
+      {"redblue",  COLOURMAP_REDBLUE},
+      {"grey",     COLOURMAP_GREY},
+      {"heat",     COLOURMAP_HEAT},
+      {"viridis",  COLOURMAP_VIRIDIS},
+      {NULL,       -1}
+   };
 
-   if ( !*pngPtr )
-      abortProgram("[write_png_file] png_create_write_struct failed");
+   options->threads     = 1;
+   options->stream      = 0;
+   options->batch       = NULL;
+   options->serve       = NULL;
+   options->palette     = 0;
+   options->jit         = 0;
+   options->gpu         = 0;
+   options->single      = 0;
+   options->stats       = 0;
+   options->frames      = 0;
+   options->tMin        = 0;
+   options->tMax        = 1;
+   options->width       = 300;
+   options->height      = 300;
+   options->xMin        = 0;
+   options->xMax        = 1;
+   options->yMin        = 0;
+   options->yMax        = 1;
+   options->zMin        = 0;
+   options->zMax        = 0;
+   options->colourMap   = COLOURMAP_REDBLUE;
+   options->compression = -1;
+   options->strategy    = -1;
+   options->filters     = -1;
+   options->fileName   = NULL;
+   options->expression = NULL;
 
-   *infoPtr = png_create_info_struct(*pngPtr);
-   if ( !*infoPtr )
-      abortProgram("[write_png_file] png_create_info_struct failed");
+   for (i=1; i<argc; i++){
+     if ( i+1 == argc && lookupKeyword(valued, argv[i]) > 0 ){
+       fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
+       abortProgram("Error: No value given after \"%s\".\n", argv[i]);
+     }
 
-   if ( setjmp(png_jmpbuf(*pngPtr)) )
-      abortProgram("[write_png_file] Error during init_io");
+     if ( strcmp(argv[i], "--threads") == 0 && i+1 < argc ){
+       errno = 0;
+       count = strtol(argv[++i], &end, 10);
+       if ( end == argv[i] || *end != '\0' || errno == ERANGE || count < 0 ||
+            count > INT_MAX ){
+         fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
+         abortProgram("Error: Invalid thread count \"%s\".\nUse a positive"
+                      " number, or 0 for one thread per processor.\n", argv[i]);
+       }
+       options->threads = (int)count;
+     }
+     else if ( strcmp(argv[i], "--size") == 0 && i+1 < argc ){
+       options->width  = strtol(argv[++i], &end, 10);
+       options->height = *end == 'x' ? strtol(end+1, &end, 10) : 0;
+       if ( *end != '\0' || options->width < 1 || options->width > PLOT_MAX_SIZE ||
+            options->height < 1 || options->height > PLOT_MAX_SIZE ){
+         fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
+         abortProgram("Error: Invalid image size \"%s\".\nUse WIDTHxHEIGHT in"
+                      " pixels, each from 1 to 32767, e.g. \"800x600\".\n",
+                      argv[i]);
+       }
+     }
+     else if ( strcmp(argv[i], "--x-range") == 0 && i+1 < argc ){
+       if ( !parseRange(argv[++i], &options->xMin, &options->xMax) ){
+         fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
+         abortProgram("Error: Invalid x range \"%s\".\nUse MIN,MAX with MIN"
+                      " below MAX, e.g. \"-3.14,3.14\".\n", argv[i]);
+       }
+     }
+     else if ( strcmp(argv[i], "--y-range") == 0 && i+1 < argc ){
+       if ( !parseRange(argv[++i], &options->yMin, &options->yMax) ){
+         fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
+         abortProgram("Error: Invalid y range \"%s\".\nUse MIN,MAX with MIN"
+                      " below MAX, e.g. \"-3.14,3.14\".\n", argv[i]);
+       }
+     }
+     else if ( strcmp(argv[i], "--z-range") == 0 && i+1 < argc ){
+       if ( !parseRange(argv[++i], &options->zMin, &options->zMax) ){
+         fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
+         abortProgram("Error: Invalid z range \"%s\".\nUse MIN,MAX with MIN"
+                      " below MAX, e.g. \"-1,1\".\n", argv[i]);
+       }
+     }
+     else if ( strcmp(argv[i], "--t-range") == 0 && i+1 < argc ){
+       if ( !parseRange(argv[++i], &options->tMin, &options->tMax) ){
+         fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
+         abortProgram("Error: Invalid t range \"%s\".\nUse MIN,MAX with MIN"
+                      " below MAX, e.g. \"0,6.28\".\n", argv[i]);
+       }
+     }
+     else if ( strcmp(argv[i], "--frames") == 0 && i+1 < argc ){
+       options->frames = strtol(argv[++i], &end, 10);
+       if ( *end != '\0' || options->frames < 1 ){
+         fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
+         abortProgram("Error: Invalid frame count \"%s\".\nUse a positive"
+                      " number of frames.\n", argv[i]);
+       }
+     }
+     else if ( strcmp(argv[i], "--colourmap") == 0 && i+1 < argc ){
+       options->colourMap = lookupKeyword(colourMaps, argv[++i]);
+       if ( options->colourMap < 0 ){
+         fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
+         abortProgram("Error: Invalid colour map \"%s\".\nUse one of"
+                      " redblue, grey, heat or viridis.\n", argv[i]);
+       }
+     }
+     else if ( strcmp(argv[i], "--stream") == 0 ){
+       options->stream = 1;
+     }
+     else if ( strcmp(argv[i], "--batch") == 0 && i+1 < argc ){
+       options->batch = argv[++i];
+     }
+     else if ( strcmp(argv[i], "--serve") == 0 && i+1 < argc ){
+       options->serve = argv[++i];
+     }
+     else if ( strcmp(argv[i], "--compression") == 0 && i+1 < argc ){
+       options->compression = strtol(argv[++i], &end, 10);
+       if ( *end != '\0' || options->compression < 0 || options->compression > 9 ){
+         fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
+         abortProgram("Error: Invalid compression level \"%s\".\nUse a level"
+                      " from 0 (fastest) to 9 (smallest).\n", argv[i]);
+       }
+     }
+     else if ( strcmp(argv[i], "--strategy") == 0 && i+1 < argc ){
+       options->strategy = lookupKeyword(strategies, argv[++i]);
+       if ( options->strategy < 0 ){
+         fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
+         abortProgram("Error: Invalid compression strategy \"%s\".\nUse one of"
+                      " default, filtered, huffman, rle or fixed.\n", argv[i]);
+       }
+     }
+     else if ( strcmp(argv[i], "--filter") == 0 && i+1 < argc ){
+       /* a comma separated list; libpng picks the best of them per row */
+       options->filters = 0;
+       for (name=strtok(argv[++i], ","); name; name=strtok(NULL, ",")){
+         value = lookupKeyword(filters, name);
+         if ( value < 0 ){
+           fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
+           abortProgram("Error: Invalid row filter \"%s\".\nUse none, sub, up,"
+                        " avg, paeth or adaptive, or a list such as"
+                        " \"sub,up\".\n", name);
+         }
+         options->filters |= value;
+       }
+       if ( options->filters == 0 )
+          options->filters = PNG_FILTER_NONE;
+     }
+     else if ( strcmp(argv[i], "--palette") == 0 ){
+       options->palette = 1;
+     }
+     else if ( strcmp(argv[i], "--jit") == 0 ){
+       options->jit = 1;
+     }
+     else if ( strcmp(argv[i], "--gpu") == 0 ){
+       options->gpu = 1;
+     }
+     else if ( strcmp(argv[i], "--float") == 0 ){
+       options->single = 1;
+     }
+     else if ( strcmp(argv[i], "--stats") == 0 ){
+       options->stats = 1;
+     }
+     else if ( strcmp(argv[i], "--fast") == 0 ){
+       options->compression = FAST_LEVEL;
+       options->strategy    = FAST_STRATEGY;
+       options->filters     = FAST_FILTERS;
+     }
+     else if ( positional == 0 ){
+       options->fileName = argv[i];
+       positional++;
+     }
+     else if ( positional == 1 ){
+       options->expression = argv[i];
+       positional++;
+     }
+     else {
+       positional++;
+     }
+   }
 
-   png_init_io(*pngPtr, *fp);
+   /* error trapping */
+   if ( positional != (options->batch || options->serve ? 0 : 2) ||
+        (options->batch && options->serve) ||
+        (options->frames && (options->batch || options->serve)) ){
+     fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
+     abortProgram("Error: Incorrect number of arguments given.\nUsage:"
+                  " <program_name> [options] <file_out> <math_expr>\n"
+                  "       <program_name> [options] --batch <manifest|->\n"
+                  "       <program_name> [options] --serve <address>\n"
+                  "--frames applies to a single plot only.\n"
+                  "See README.md for the options.\n");
+   }
+}
 
+/*===========================================================================*/
+/* Function: lookupKeyword                                                   */
+/* Find name in a table ending with a NULL name.  Returns its value, or -1.  */
+/*===========================================================================*/
+int lookupKeyword ( const KEYWORD   *table,
+                    const char      *name )
+{
+   for (; table->name; table++)
+      if ( strcmp(table->name, name) == 0 )
+         return table->value;
+   return -1;
+}
 
-   /* write header */
-   if ( setjmp(png_jmpbuf(*pngPtr)) )
-      abortProgram("[write_png_file] Error during writing header");
+/*===========================================================================*/
+/* Function: parseRange                                                      */
+/* Read "MIN,MAX" into min and max.  Returns 0 unless both are numbers and   */
+/* they make a valid viewport range.                                        */
+/*===========================================================================*/
+int parseRange ( const char   *text,
+                 double       *min,
+                 double       *max )
+{
+   char       *end;
+   double      low;
+   double      high;
 
-   /*png_set_compression_level(pngPtr,0);*/
-   png_set_IHDR(*pngPtr, *infoPtr, pngData->imgWidth, pngData->imgHeight,
-                pngData->bitDepth, pngData->colourType, PNG_INTERLACE_NONE,
-                PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+   low = strtod(text, &end);
+   if ( end == text || *end != ',' )
+      return 0;
+   text = end + 1;
+   high = strtod(text, &end);
+   if ( end == text || *end != '\0' || !validRange(low, high) )
+      return 0;
+   *min = low;
+   *max = high;
+   return 1;
 }
 
 /*===========================================================================*/
-/* Function: writePngFileData                                                */
-/* Output the image data to the output file.                                 */
+/* Function: parseViewport                                                   */
+/* Reads the optional "x=MIN,MAX", "y=MIN,MAX" and "z=MIN,MAX" words at the  */
+/* start of a server request into plot.  Returns the rest of the line, the  */
+/* expression, or NULL if a range is invalid.                                */
 /*===========================================================================*/
-void writePngFileData ( png_structp    *pngPtr,
-                        png_infop      *infoPtr,
-                        png_bytep     **rowPointers )
+char *parseViewport ( char          *text,
+                      PLOTOPTIONS   *plot )
 {
-   png_write_info(*pngPtr,*infoPtr);
+   char        range[RANGE_WORD_BYTES];
+   size_t      length;
+   int         valid;
 
-   if ( setjmp(png_jmpbuf(*pngPtr)) )
-      abortProgram("[write_png_file] Error during writing bytes");
+   for (;;){
+     text = text + strspn(text, " \t");
+     if ( (text[0] != 'x' && text[0] != 'y' && text[0] != 'z') ||
+          text[1] != '=' )
+        return text;
 
-   png_write_image(*pngPtr,*rowPointers);
+     /* expressions cannot hold '=', so the word is a range */
+     length = strcspn(text, " \t");
+     if ( length - 2 >= sizeof(range) )
+        return NULL;
+     memcpy(range, text+2, length-2);
+     range[length-2] = '\0';
+     if ( text[0] == 'x' )
+        valid = parseRange(range, &plot->xMin, &plot->xMax);
+     else if ( text[0] == 'y' )
+        valid = parseRange(range, &plot->yMin, &plot->yMax);
+     else
+        valid = parseRange(range, &plot->zMin, &plot->zMax);
+     if ( !valid )
+        return NULL;
+     text += length;
+   }
 }
 
 /*===========================================================================*/
-/* Function: writePngFileTrailer                                             */
-/* End the PNG file and close it.                                            */
+/* Function: appendPng                                                       */
+/* Stream sink for the render server: append the bytes to the PNGBUFFER,     */
+/* doubling it as it fills.  Returns 0 if memory runs out.                   */
 /*===========================================================================*/
-void writePngFileTrailer ( FILE          **fp,
-                           png_structp    *pngPtr )
+int appendPng ( void                  *context,
+                const unsigned char   *bytes,
+                size_t                 length )
 {
-   if ( setjmp(png_jmpbuf(*pngPtr)) )
-      abortProgram("[write_png_file] Error during end of write");
+   PNGBUFFER  *memory = (PNGBUFFER *)context;
+   png_byte   *grown;
+   size_t      space = memory->space ? memory->space : 4096;
 
-   png_write_end(*pngPtr,NULL);
+   while ( space - memory->length < length )
+      space *= 2;
+   if ( space != memory->space ){
+     grown = (png_byte *)realloc(memory->bytes, space);
+     if ( !grown )
+        return 0;
+     memory->bytes = grown;
+     memory->space = space;
+   }
 
-   fclose(*fp);
+   memcpy(memory->bytes + memory->length, bytes, length);
+   memory->length += length;
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: failRender                                                      */
+/* Explain why the plot could not be written to fileName and abort.          */
+/*===========================================================================*/
+void failRender ( int                  status,
+                  const char          *fileName,
+                  const PLOTOPTIONS   *plot )
+{
+   fprintf(stdout, "Program aborted. See stderr for more information.\n\n");
+   switch ( status ){
+     case PLOT_ERROR_EXPRESSION:
+       abortProgram("Fatal error: Failed to compile math expression.\n\nProbably"
+                    " invalid expression given in third argument:\n\n"
+                    "     Expressions should be written in terms of x and y,"
+                    " and optionally t in an animation.\n     x should be used"
+                    " for univariable expressions, or both x and y for"
+                    " multivariate expressions.\n     e.g. \"k^2\" is invalid,"
+                    " and should be written \"x^2\".\n\n     Equations of the"
+                    " form y=f(x) or z=f(x,y) are invalid, and should be"
+                    " written f(x) or f(x,y) respectively.\n     e.g. \"y=x^2\""
+                    " is invalid, and should be written \"x^2\".\n");
+       break;
+     case PLOT_ERROR_SIZE:
+       abortProgram("Error: Invalid dimensions %dx%d.\nWidth and height must"
+                    " be from 1 to 32767 pixels.\n", plot->width, plot->height);
+       break;
+     case PLOT_ERROR_RANGE:
+       abortProgram("Error: Invalid viewport.\nThe x and y ranges must be"
+                    " finite, each maximum above its minimum.\n");
+       break;
+     case PLOT_ERROR_MEMORY:
+       abortProgram("Fatal error: Failed to allocate %dx%d image.\n",
+                    plot->width, plot->height);
+       break;
+     case PLOT_ERROR_OUTPUT:
+       abortProgram("[write_png_file] File %s could not be written", fileName);
+       break;
+   }
+   abortProgram("Fatal error: %s.\n", plotErrorString(status));
+}
+
+/*===========================================================================*/
+/* Function: printStats                                                      */
+/* Report on stderr where the time of a render (or of a batch) went.         */
+/*===========================================================================*/
+void printStats ( const char        *label,
+                  const PLOTSTATS   *stats )
+{
+   fprintf(stderr, "Stats: %s: compile %.3f ms, evaluate %.3f ms, colour %.3f"
+                   " ms, encode %.3f ms, finish %.3f ms, total %.3f ms; %lu"
+                   " evaluations, %lu NaN or infinite, %lu bytes, %lu cached"
+                   " tiles.\n", label,
+           stats->compileSeconds*1e3, stats->evaluateSeconds*1e3,
+           stats->colourSeconds*1e3, stats->encodeSeconds*1e3,
+           stats->finishSeconds*1e3, stats->totalSeconds*1e3,
+           stats->evaluations, stats->nonFinite, stats->bytes,
+           stats->tilesReused);
 }
 
 /*===========================================================================*/
@@ -0,0 +1,292 @@
+/*===========================================================================*/
+/* A small work-stealing thread pool used to spread rendering over cores.    */
+/*                                                                           */
+/* Each call to runParallel splits its tasks into one contiguous range per   */
+/* worker.  A worker takes tasks from the front of its own range and, once   */
+/* that is empty, steals the back half of another worker's range.  The       */
+/* calling thread takes part as worker 0.                                    */
+/*===========================================================================*/
+#define _POSIX_C_SOURCE 200809L
+
+/*===========================================================================*/
+/* Includes                                                                  */
+/*===========================================================================*/
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "threadpool.h"
+
+/*===========================================================================*/
+/* Structure definitions                                                     */
+/*===========================================================================*/
+struct queue_struct
+   {
+      pthread_mutex_t   lock;
+      long int          next;       /* first task not yet taken */
+      long int          end;        /* one past the last task   */
+   };
+typedef struct queue_struct QUEUE;
+
+struct helper_struct
+   {
+      THREADPOOL       *pool;
+      int               worker;
+   };
+typedef struct helper_struct HELPER;
+
+struct threadpool_struct
+   {
+      int               threads;
+      pthread_t        *helpers;   /* threads-1 helper threads     */
+      HELPER           *helperArgs;
+      QUEUE            *queues;    /* one per worker               */
+
+      pthread_mutex_t   lock;
+      pthread_cond_t    start;
+      pthread_cond_t    done;
+      unsigned long     generation; /* bumped for every runParallel */
+      int               busy;       /* workers still in this round  */
+      int               quit;
+
+      TaskFunction      function;
+      void             *context;
+   };
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+static void *helperMain (void *);
+static void  workLoop   (THREADPOOL *,int);
+static int   takeTask   (THREADPOOL *,int,long int *);
+
+/*===========================================================================*/
+/* Function: createThreadPool                                                */
+/* Create a pool of the given number of workers; 0 means one per processor. */
+/* Returns NULL if the threads could not be started.                         */
+/*===========================================================================*/
+THREADPOOL *createThreadPool ( int   threads )
+{
+   THREADPOOL  *pool;
+   int          i;
+
+   if ( threads <= 0 )
+      threads = processorCount();
+
+   pool = (THREADPOOL *)calloc(1, sizeof(THREADPOOL));
+   if ( !pool )
+      return NULL;
+
+   pool->threads    = threads;
+   pool->queues     = (QUEUE *)calloc(threads, sizeof(QUEUE));
+   pool->helpers    = (pthread_t *)calloc(threads, sizeof(pthread_t));
+   pool->helperArgs = (HELPER *)calloc(threads, sizeof(HELPER));
+   if ( !pool->queues || !pool->helpers || !pool->helperArgs ){
+     free(pool->queues);
+     free(pool->helpers);
+     free(pool->helperArgs);
+     free(pool);
+     return NULL;
+   }
+
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->start, NULL);
+   pthread_cond_init(&pool->done, NULL);
+   for (i=0; i<threads; i++)
+      pthread_mutex_init(&pool->queues[i].lock, NULL);
+
+   for (i=1; i<threads; i++){
+     pool->helperArgs[i].pool   = pool;
+     pool->helperArgs[i].worker = i;
+     if ( pthread_create(&pool->helpers[i], NULL, helperMain,
+                         &pool->helperArgs[i]) != 0 ){
+       pool->threads = i;
+       destroyThreadPool(pool);
+       return NULL;
+     }
+   }
+
+   return pool;
+}
+
+/*===========================================================================*/
+/* Function: destroyThreadPool                                               */
+/* Stop the helper threads and free the pool.  Safe to call on NULL.         */
+/*===========================================================================*/
+void destroyThreadPool ( THREADPOOL  *pool )
+{
+   int   i;
+
+   if ( !pool )
+      return;
+
+   pthread_mutex_lock(&pool->lock);
+   pool->quit = 1;
+   pthread_cond_broadcast(&pool->start);
+   pthread_mutex_unlock(&pool->lock);
+
+   for (i=1; i<pool->threads; i++)
+      pthread_join(pool->helpers[i], NULL);
+
+   for (i=0; i<pool->threads; i++)
+      pthread_mutex_destroy(&pool->queues[i].lock);
+   pthread_mutex_destroy(&pool->lock);
+   pthread_cond_destroy(&pool->start);
+   pthread_cond_destroy(&pool->done);
+
+   free(pool->queues);
+   free(pool->helpers);
+   free(pool->helperArgs);
+   free(pool);
+}
+
+/*===========================================================================*/
+/* Function: threadPoolSize                                                  */
+/* Number of workers, including the calling thread.                          */
+/*===========================================================================*/
+int threadPoolSize ( const THREADPOOL  *pool )
+{
+   return pool ? pool->threads : 1;
+}
+
+/*===========================================================================*/
+/* Function: processorCount                                                  */
+/* Number of online processors, at least 1.                                  */
+/*===========================================================================*/
+int processorCount ( void )
+{
+   long int   count = sysconf(_SC_NPROCESSORS_ONLN);
+   return count > 0 ? (int)count : 1;
+}
+
+/*===========================================================================*/
+/* Function: runParallel                                                     */
+/* Run function(context, task, worker) for every task in [0, tasks) and      */
+/* return once all of them have finished.  A NULL pool runs them inline.     */
+/*===========================================================================*/
+void runParallel ( THREADPOOL    *pool,
+                   long int       tasks,
+                   TaskFunction   function,
+                   void          *context )
+{
+   long int   task;
+   long int   share;
+   int        i;
+
+   if ( !pool || pool->threads == 1 || tasks <= 1 ){
+     for (task=0; task<tasks; task++)
+        function(context, task, 0);
+     return;
+   }
+
+   /* hand each worker an even, contiguous share of the tasks */
+   share = tasks / pool->threads;
+   for (i=0; i<pool->threads; i++){
+     pool->queues[i].next = i*share + (i < tasks % pool->threads ? i : tasks % pool->threads);
+     pool->queues[i].end  = pool->queues[i].next + share + (i < tasks % pool->threads);
+   }
+
+   pthread_mutex_lock(&pool->lock);
+   pool->function = function;
+   pool->context  = context;
+   pool->busy     = pool->threads;
+   pool->generation++;
+   pthread_cond_broadcast(&pool->start);
+   pthread_mutex_unlock(&pool->lock);
+
+   workLoop(pool, 0);
+
+   pthread_mutex_lock(&pool->lock);
+   while ( pool->busy > 0 )
+      pthread_cond_wait(&pool->done, &pool->lock);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+/*===========================================================================*/
+/* Function: helperMain                                                      */
+/* Body of each helper thread: wait for a round of work, then run it.        */
+/*===========================================================================*/
+static void *helperMain ( void  *arg )
+{
+   HELPER          *helper = (HELPER *)arg;
+   THREADPOOL      *pool   = helper->pool;
+   unsigned long    seen   = 0;
+
+   for (;;){
+     pthread_mutex_lock(&pool->lock);
+     while ( !pool->quit && pool->generation == seen )
+        pthread_cond_wait(&pool->start, &pool->lock);
+     if ( pool->quit ){
+       pthread_mutex_unlock(&pool->lock);
+       return NULL;
+     }
+     seen = pool->generation;
+     pthread_mutex_unlock(&pool->lock);
+
+     workLoop(pool, helper->worker);
+   }
+}
+
+/*===========================================================================*/
+/* Function: workLoop                                                        */
+/* Run tasks until none are left anywhere, then check out of the round.      */
+/*===========================================================================*/
+static void workLoop ( THREADPOOL  *pool,
+                       int          worker )
+{
+   long int   task;
+
+   while ( takeTask(pool, worker, &task) )
+      pool->function(pool->context, task, worker);
+
+   pthread_mutex_lock(&pool->lock);
+   if ( --pool->busy == 0 )
+      pthread_cond_signal(&pool->done);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+/*===========================================================================*/
+/* Function: takeTask                                                        */
+/* Take the next task from the worker's own range, stealing the back half    */
+/* of another worker's range when it runs dry.  Returns 0 when there is no   */
+/* work left to take.                                                        */
+/*===========================================================================*/
+static int takeTask ( THREADPOOL  *pool,
+                      int          worker,
+                      long int    *task )
+{
+   QUEUE      *own = &pool->queues[worker];
+   QUEUE      *victim;
+   long int    first;
+   long int    last;
+   int         i;
+
+   pthread_mutex_lock(&own->lock);
+   if ( own->next < own->end ){
+     *task = own->next++;
+     pthread_mutex_unlock(&own->lock);
+     return 1;
+   }
+   pthread_mutex_unlock(&own->lock);
+
+   for (i=1; i<pool->threads; i++){
+     victim = &pool->queues[(worker+i) % pool->threads];
+
+     pthread_mutex_lock(&victim->lock);
+     last  = victim->end;
+     first = last - (last - victim->next + 1)/2;
+     if ( first < last )
+        victim->end = first;
+     pthread_mutex_unlock(&victim->lock);
+
+     if ( first < last ){
+       pthread_mutex_lock(&own->lock);
+       own->next = first + 1;
+       own->end  = last;
+       pthread_mutex_unlock(&own->lock);
+       *task = first;
+       return 1;
+     }
+   }
+
+   return 0;
+}
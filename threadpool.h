@@ -0,0 +1,25 @@
+/*===========================================================================*/
+/* A small work-stealing thread pool used to spread rendering over cores.    */
+/*===========================================================================*/
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+/*===========================================================================*/
+/* Type definitions                                                          */
+/*===========================================================================*/
+/* Runs one task; worker is in [0, threadPoolSize) and identifies the        */
+/* calling thread, so per-worker accumulators can be indexed by it.          */
+typedef void (*TaskFunction)(void *context, long int task, int worker);
+
+typedef struct threadpool_struct THREADPOOL;
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+THREADPOOL *createThreadPool  (int);
+void        destroyThreadPool (THREADPOOL *);
+int         threadPoolSize    (const THREADPOOL *);
+int         processorCount    (void);
+void        runParallel       (THREADPOOL *,long int,TaskFunction,void *);
+
+#endif
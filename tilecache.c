@@ -0,0 +1,338 @@
+/*===========================================================================*/
+/* A bounded cache of evaluated f(x,y) tiles, shared between plots.          */
+/*                                                                           */
+/* Views that pan or zoom by whole pixels on a power of two scale overlap    */
+/* the same tiles, so only the tiles they newly expose need evaluating.      */
+/* Entries are keyed by the expression text, the precision it was evaluated  */
+/* in, the level and the tile's place on the grid.  The least recently used  */
+/* tile is dropped once the cache is full.  Every operation takes the        */
+/* cache's lock.                                                             */
+/*===========================================================================*/
+#define _POSIX_C_SOURCE 200809L
+
+/*===========================================================================*/
+/* Includes                                                                  */
+/*===========================================================================*/
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "imagebuffer.h"
+#include "tilecache.h"
+
+/*===========================================================================*/
+/* Constants                                                                 */
+/*===========================================================================*/
+#define TILE_VALUES (TILE_SIZE*TILE_SIZE)
+
+/*===========================================================================*/
+/* Structure definitions                                                     */
+/*===========================================================================*/
+typedef struct cachedtile_struct CACHEDTILE;
+
+struct cachedtile_struct
+   {
+      char             *expression;
+      int               single;     /* evaluated in single precision      */
+      int               level;
+      long int          tx;
+      long int          ty;
+      unsigned long int hash;
+      float            *values;     /* TILE_VALUES, cache line aligned    */
+      CACHEDTILE       *chain;      /* next entry in the same bucket      */
+      CACHEDTILE       *newer;      /* neighbours in order of last use    */
+      CACHEDTILE       *older;
+   };
+
+struct tilecache_struct
+   {
+      pthread_mutex_t   lock;
+      CACHEDTILE      **buckets;
+      long int          bucketCount;
+      long int          entries;
+      long int          capacity;
+      CACHEDTILE       *newest;
+      CACHEDTILE       *oldest;
+      unsigned long int hits;
+      unsigned long int misses;
+   };
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+static unsigned long int hashTile   (const char *,int,int,long int,long int);
+static CACHEDTILE      **lookupTile (TILECACHE *,const char *,int,int,
+                                     long int,long int,unsigned long int);
+static void              unlinkTile (TILECACHE *,CACHEDTILE *);
+static void              pushNewest (TILECACHE *,CACHEDTILE *);
+static void              freeTile   (CACHEDTILE *);
+
+/*===========================================================================*/
+/* Function: createTileCache                                                 */
+/* Create a cache holding at most capacity tiles.  Returns NULL if memory   */
+/* runs out.                                                                 */
+/*===========================================================================*/
+TILECACHE *createTileCache ( long int   capacity )
+{
+   TILECACHE   *cache;
+
+   if ( capacity < 1 )
+      capacity = 1;
+
+   cache = (TILECACHE *)calloc(1, sizeof(TILECACHE));
+   if ( !cache )
+      return NULL;
+
+   cache->capacity    = capacity;
+   cache->bucketCount = 2*capacity;
+   cache->buckets = (CACHEDTILE **)calloc(cache->bucketCount,
+                                          sizeof(CACHEDTILE *));
+   if ( !cache->buckets || pthread_mutex_init(&cache->lock, NULL) != 0 ){
+     free(cache->buckets);
+     free(cache);
+     return NULL;
+   }
+   return cache;
+}
+
+/*===========================================================================*/
+/* Function: destroyTileCache                                                */
+/* Free the cache and its tiles.  Safe to call on NULL.                      */
+/*===========================================================================*/
+void destroyTileCache ( TILECACHE   *cache )
+{
+   CACHEDTILE  *entry;
+   CACHEDTILE  *older;
+
+   if ( !cache )
+      return;
+
+   for (entry=cache->newest; entry; entry=older){
+     older = entry->older;
+     freeTile(entry);
+   }
+   pthread_mutex_destroy(&cache->lock);
+   free(cache->buckets);
+   free(cache);
+}
+
+/*===========================================================================*/
+/* Function: findTile                                                        */
+/* Copy the cached z values of a tile into values.  Returns 1 on a hit and  */
+/* 0, leaving values alone, on a miss.                                       */
+/*===========================================================================*/
+int findTile ( TILECACHE    *cache,
+               const char   *expression,
+               int           single,
+               int           level,
+               long int      tx,
+               long int      ty,
+               float        *values )
+{
+   CACHEDTILE         **found;
+   unsigned long int    hash = hashTile(expression, single, level, tx, ty);
+
+   if ( !cache )
+      return 0;
+
+   pthread_mutex_lock(&cache->lock);
+   found = lookupTile(cache, expression, single, level, tx, ty, hash);
+   if ( !*found ){
+     cache->misses++;
+     pthread_mutex_unlock(&cache->lock);
+     return 0;
+   }
+
+   memcpy(values, (*found)->values, sizeof(float)*TILE_VALUES);
+   unlinkTile(cache, *found);
+   pushNewest(cache, *found);
+   cache->hits++;
+   pthread_mutex_unlock(&cache->lock);
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: storeTile                                                       */
+/* Add a copy of a tile's z values, replacing any held for the same tile.   */
+/* When memory runs out the tile is simply not cached.                       */
+/*===========================================================================*/
+void storeTile ( TILECACHE     *cache,
+                 const char    *expression,
+                 int            single,
+                 int            level,
+                 long int       tx,
+                 long int       ty,
+                 const float   *values )
+{
+   CACHEDTILE         **bucket;
+   CACHEDTILE          *entry;
+   CACHEDTILE          *oldest;
+   unsigned long int    hash = hashTile(expression, single, level, tx, ty);
+
+   if ( !cache )
+      return;
+
+   /* copying outside the lock */
+   entry = (CACHEDTILE *)calloc(1, sizeof(CACHEDTILE));
+   if ( !entry )
+      return;
+   entry->expression = (char *)malloc(strlen(expression) + 1);
+   entry->values     = (float *)alignedAlloc(sizeof(float)*TILE_VALUES);
+   if ( !entry->expression || !entry->values ){
+     freeTile(entry);
+     return;
+   }
+   strcpy(entry->expression, expression);
+   memcpy(entry->values, values, sizeof(float)*TILE_VALUES);
+   entry->single = single;
+   entry->level  = level;
+   entry->tx     = tx;
+   entry->ty     = ty;
+   entry->hash   = hash;
+
+   pthread_mutex_lock(&cache->lock);
+   bucket = lookupTile(cache, expression, single, level, tx, ty, hash);
+   if ( *bucket ){
+     /* another render got there first */
+     oldest = *bucket;
+     *bucket = oldest->chain;
+     unlinkTile(cache, oldest);
+     freeTile(oldest);
+     cache->entries--;
+   }
+   entry->chain = *bucket;
+   *bucket      = entry;
+   pushNewest(cache, entry);
+
+   if ( ++cache->entries > cache->capacity ){
+     /* drop the least recently used */
+     oldest = cache->oldest;
+     for (bucket=&cache->buckets[oldest->hash % cache->bucketCount];
+          *bucket != oldest; bucket=&(*bucket)->chain)
+        ;
+     *bucket = oldest->chain;
+     unlinkTile(cache, oldest);
+     freeTile(oldest);
+     cache->entries--;
+   }
+   pthread_mutex_unlock(&cache->lock);
+}
+
+/*===========================================================================*/
+/* Function: tileCacheCounts                                                 */
+/* The number of lookups that found a tile, and that had to evaluate one.    */
+/*===========================================================================*/
+void tileCacheCounts ( TILECACHE           *cache,
+                       unsigned long int   *hits,
+                       unsigned long int   *misses )
+{
+   *hits   = 0;
+   *misses = 0;
+   if ( !cache )
+      return;
+
+   pthread_mutex_lock(&cache->lock);
+   *hits   = cache->hits;
+   *misses = cache->misses;
+   pthread_mutex_unlock(&cache->lock);
+}
+
+/*===========================================================================*/
+/* Function: hashTile                                                        */
+/* FNV-1a hash of the expression, then of the precision, level and tile    */
+/* coordinates.                                                              */
+/*===========================================================================*/
+static unsigned long int hashTile ( const char   *expression,
+                                    int           single,
+                                    int           level,
+                                    long int      tx,
+                                    long int      ty )
+{
+   unsigned long int   hash = 2166136261UL;
+   unsigned long int   fields[4];
+   int                 k;
+   int                 b;
+
+   for (; *expression; expression++)
+      hash = ((hash ^ (unsigned char)*expression) * 16777619UL) & 0xFFFFFFFFUL;
+
+   fields[0] = (unsigned long int)single;
+   fields[1] = (unsigned long int)level;
+   fields[2] = (unsigned long int)tx;
+   fields[3] = (unsigned long int)ty;
+   for (k=0; k<4; k++)
+      for (b=0; b<4; b++)
+         hash = ((hash ^ ((fields[k] >> 8*b) & 0xFF)) * 16777619UL) &
+                0xFFFFFFFFUL;
+   return hash;
+}
+
+/*===========================================================================*/
+/* Function: lookupTile                                                      */
+/* The link in the tile's bucket pointing at it, or at NULL if it is not     */
+/* cached.  The caller holds the lock.                                       */
+/*===========================================================================*/
+static CACHEDTILE **lookupTile ( TILECACHE           *cache,
+                                 const char          *expression,
+                                 int                  single,
+                                 int                  level,
+                                 long int             tx,
+                                 long int             ty,
+                                 unsigned long int    hash )
+{
+   CACHEDTILE  **link;
+
+   for (link=&cache->buckets[hash % cache->bucketCount]; *link;
+        link=&(*link)->chain)
+      if ( (*link)->hash == hash && (*link)->single == single &&
+           (*link)->level == level &&
+           (*link)->tx == tx && (*link)->ty == ty &&
+           strcmp((*link)->expression, expression) == 0 )
+         break;
+   return link;
+}
+
+/*===========================================================================*/
+/* Function: unlinkTile                                                      */
+/* Take an entry out of the order of last use.                               */
+/*===========================================================================*/
+static void unlinkTile ( TILECACHE    *cache,
+                         CACHEDTILE   *entry )
+{
+   if ( entry->newer )
+      entry->newer->older = entry->older;
+   else
+      cache->newest = entry->older;
+   if ( entry->older )
+      entry->older->newer = entry->newer;
+   else
+      cache->oldest = entry->newer;
+   entry->newer = NULL;
+   entry->older = NULL;
+}
+
+/*===========================================================================*/
+/* Function: pushNewest                                                      */
+/* Put an entry at the front of the order of last use.                       */
+/*===========================================================================*/
+static void pushNewest ( TILECACHE    *cache,
+                         CACHEDTILE   *entry )
+{
+   entry->newer = NULL;
+   entry->older = cache->newest;
+   if ( cache->newest )
+      cache->newest->newer = entry;
+   else
+      cache->oldest = entry;
+   cache->newest = entry;
+}
+
+/*===========================================================================*/
+/* Function: freeTile                                                        */
+/* Free an entry and its values.                                             */
+/*===========================================================================*/
+static void freeTile ( CACHEDTILE   *entry )
+{
+   alignedFree(entry->values);
+   free(entry->expression);
+   free(entry);
+}
@@ -0,0 +1,30 @@
+/*===========================================================================*/
+/* A bounded cache of evaluated f(x,y) tiles, shared between plots.          */
+/*===========================================================================*/
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+/*===========================================================================*/
+/* Type definitions                                                          */
+/*===========================================================================*/
+typedef struct tilecache_struct TILECACHE;
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+/* A tile is TILE_SIZE rows of TILE_SIZE z values, as stored in a ZGRID, of  */
+/* one expression, evaluated in double or (single set) float precision, on  */
+/* the tile grid of a level: pixels 2^-level units wide, tile (tx,ty)       */
+/* starting at x = tx*TILE_SIZE and y = ty*TILE_SIZE pixels.                 */
+/* Tiles are copied in and out, so the cache may be shared between threads. */
+/* A NULL cache holds nothing.                                               */
+TILECACHE  *createTileCache  (long int);
+void        destroyTileCache (TILECACHE *);
+int         findTile         (TILECACHE *,const char *,int,int,long int,
+                              long int,float *);
+void        storeTile        (TILECACHE *,const char *,int,int,long int,
+                              long int,const float *);
+void        tileCacheCounts  (TILECACHE *,unsigned long int *,
+                              unsigned long int *);
+
+#endif
@@ -34,12 +34,20 @@ For log = base 10 log do nothing
 For log = natural log uncomment the next line. */
 /* #define TE_NAT_LOG */
 
+/* SIMD kernels
+Batch evaluation runs sin, cos, tan, exp, log and friends through
+vectorized kernels. With GCC on x86-64 these are cloned for AVX-512, AVX2
+and baseline SSE2 and the best one is picked at load time. To build the
+kernels for the baseline target only uncomment the next line. */
+/* #define TE_NO_SIMD */
+
 #include "tinyexpr.h"
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
 #include <stdio.h>
 #include <limits.h>
+#include <float.h>
 
 #ifndef NAN
 #define NAN (0.0/0.0)
@@ -70,22 +78,79 @@ typedef struct state {
 
     const te_variable *lookup;
     int lookup_len;
+    int *lookup_table; /* lookup indexed by name hash, or NULL to scan it */
+    unsigned int lookup_mask;
+
+    struct te_chunk *arena;
+    int out_of_memory;
+    union {te_expr node; void *space[TE_CLOSURE7 + 2];} scratch;
 } state;
 
 
+/* Parse trees are carved out of a chain of chunks owned by the state and */
+/* released all at once; te_compile then copies the finished tree into a */
+/* single block. */
+#define TE_CHUNK_SIZE 4096
+
+typedef struct te_chunk {
+    struct te_chunk *next;
+    size_t used, size;
+} te_chunk;
+
+
 #define TYPE_MASK(TYPE) ((TYPE)&0x0000001F)
 
 #define IS_PURE(TYPE) (((TYPE) & TE_FLAG_PURE) != 0)
 #define IS_FUNCTION(TYPE) (((TYPE) & TE_FUNCTION0) != 0)
 #define IS_CLOSURE(TYPE) (((TYPE) & TE_CLOSURE0) != 0)
 #define ARITY(TYPE) ( ((TYPE) & (TE_FUNCTION0 | TE_CLOSURE0)) ? ((TYPE) & 0x00000007) : 0 )
-#define NEW_EXPR(type, ...) new_expr((type), (const te_expr*[]){__VA_ARGS__})
+#define NEW_EXPR(type, ...) new_expr(s, (type), (const te_expr*[]){__VA_ARGS__})
+
+static int node_size(const int type) {
+    const int psize = sizeof(void*) * ARITY(type);
+    return (sizeof(te_expr) - sizeof(void*)) + psize + (IS_CLOSURE(type) ? sizeof(void*) : 0);
+}
+
+
+static void *arena_alloc(state *s, size_t size) {
+    te_chunk *c = s->arena;
+    void *ret;
+
+    if (!c || c->used + size > c->size) {
+        const size_t capacity = size > TE_CHUNK_SIZE ? size : TE_CHUNK_SIZE;
+        c = malloc(sizeof(te_chunk) + capacity);
+        if (!c) return 0;
+        c->next = s->arena;
+        c->used = 0;
+        c->size = capacity;
+        s->arena = c;
+    }
+
+    ret = (char*)(c + 1) + c->used;
+    c->used += size;
+    return ret;
+}
+
 
-static te_expr *new_expr(const int type, const te_expr *parameters[]) {
+static void arena_free(state *s) {
+    while (s->arena) {
+        te_chunk *next = s->arena->next;
+        free(s->arena);
+        s->arena = next;
+    }
+}
+
+
+static te_expr *new_expr(state *s, const int type, const te_expr *parameters[]) {
     const int arity = ARITY(type);
     const int psize = sizeof(void*) * arity;
-    const int size = (sizeof(te_expr) - sizeof(void*)) + psize + (IS_CLOSURE(type) ? sizeof(void*) : 0);
-    te_expr *ret = malloc(size);
+    const int size = node_size(type);
+    te_expr *ret = arena_alloc(s, size);
+    if (!ret) {
+        /* Out of memory: let the parse finish on scratch space, then fail it. */
+        s->out_of_memory = 1;
+        ret = &s->scratch.node;
+    }
     memset(ret, 0, size);
     if (arity && parameters) {
         memcpy(ret->parameters, parameters, psize);
@@ -96,23 +161,31 @@ static te_expr *new_expr(const int type, const te_expr *parameters[]) {
 }
 
 
-void te_free_parameters(te_expr *n) {
-    if (!n) return;
-    switch (TYPE_MASK(n->type)) {
-        case TE_FUNCTION7: case TE_CLOSURE7: te_free(n->parameters[6]);     /* Falls through. */
-        case TE_FUNCTION6: case TE_CLOSURE6: te_free(n->parameters[5]);     /* Falls through. */
-        case TE_FUNCTION5: case TE_CLOSURE5: te_free(n->parameters[4]);     /* Falls through. */
-        case TE_FUNCTION4: case TE_CLOSURE4: te_free(n->parameters[3]);     /* Falls through. */
-        case TE_FUNCTION3: case TE_CLOSURE3: te_free(n->parameters[2]);     /* Falls through. */
-        case TE_FUNCTION2: case TE_CLOSURE2: te_free(n->parameters[1]);     /* Falls through. */
-        case TE_FUNCTION1: case TE_CLOSURE1: te_free(n->parameters[0]);
+static size_t tree_size(const te_expr *n) {
+    size_t size = node_size(n->type);
+    int i;
+    for (i = 0; i < ARITY(n->type); ++i) {
+        size += tree_size(n->parameters[i]);
+    }
+    return size;
+}
+
+
+static te_expr *tree_copy(const te_expr *n, char **next) {
+    /* Nodes are laid out in the order te_eval visits them. */
+    te_expr *ret = (te_expr*)*next;
+    int i;
+    memcpy(ret, n, node_size(n->type));
+    *next += node_size(n->type);
+    for (i = 0; i < ARITY(n->type); ++i) {
+        ret->parameters[i] = tree_copy(n->parameters[i], next);
     }
+    return ret;
 }
 
 
 void te_free(te_expr *n) {
-    if (!n) return;
-    te_free_parameters(n);
+    /* The whole tree lives in the block that starts at its root. */
     free(n);
 }
 
@@ -150,7 +223,7 @@ static double ncr(double n, double r) {
 static double npr(double n, double r) {return ncr(n, r) * fac(r);}
 
 static const te_variable functions[] = {
-    /* must be in alphabetical order */
+    /* builtin_slots indexes this table; its order must not change */
     {"abs", fabs,     TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"acos", acos,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
     {"asin", asin,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
@@ -182,32 +255,78 @@ static const te_variable functions[] = {
     {0, 0, 0, 0}
 };
 
-static const te_variable *find_builtin(const char *name, int len) {
-    int imin = 0;
-    int imax = sizeof(functions) / sizeof(te_variable) - 2;
-
-    /*Binary search.*/
-    while (imax >= imin) {
-        const int i = (imin + ((imax-imin)/2));
-        int c = strncmp(name, functions[i].name, len);
-        if (!c) c = '\0' - functions[i].name[len];
-        if (c == 0) {
-            return functions + i;
-        } else if (c > 0) {
-            imin = i + 1;
-        } else {
-            imax = i - 1;
+/* Names are hashed with 32-bit FNV-1a, which next_token works out as it */
+/* reads each name. */
+#define TE_HASH_BASIS 2166136261u
+#define TE_HASH_PRIME 16777619u
+
+/* A perfect hash of the builtins: (hash * TE_BUILTIN_MULTIPLIER) >> 27 */
+/* puts each in its own one of 32 slots, which hold its index in functions; */
+/* -1 marks a slot no builtin takes. The multiplier was found by search, */
+/* and has to be searched for again if a builtin is added or renamed; */
+/* bench --check compiles each builtin and fails if one is not found. */
+#define TE_BUILTIN_MULTIPLIER 0x916f76fdu
+
+static const signed char builtin_slots[32] = {
+     8, 15,  2,  4, 10,  3, 13, -1, -1,  7,  9,  0, -1, -1, 21,  1,
+    20, 17, -1,  6, -1, 23, 19, 14,  5, -1, 18, -1, 12, 11, 16, 22
+};
+
+/* Variable lists at least this long are hashed rather than scanned. */
+#define TE_HASH_LOOKUP_MIN 16
+
+static unsigned int te_hash(const char *name) {
+    unsigned int hash = TE_HASH_BASIS;
+    while (*name) hash = (hash ^ (unsigned char)*name++) * TE_HASH_PRIME;
+    return hash & 0xffffffffu;
+}
+
+static const te_variable *find_builtin(const char *name, int len, unsigned int hash) {
+    const int i = builtin_slots[((hash * TE_BUILTIN_MULTIPLIER) & 0xffffffffu) >> 27];
+    if (i < 0 || strncmp(name, functions[i].name, len) != 0 || functions[i].name[len] != '\0') return 0;
+    return functions + i;
+}
+
+static void hash_lookup(state *s) {
+    /* Indexes a long variable list by hash in an open-addressed table of */
+    /* at least twice its length, allocated from the arena. The first of */
+    /* two variables with one name wins, as it does when scanning. Without */
+    /* the memory for the table the list is scanned. */
+    unsigned int size = 1, slot;
+    int *table;
+    int i, j;
+
+    s->lookup_table = 0;
+    if (!s->lookup || s->lookup_len < TE_HASH_LOOKUP_MIN) return;
+    while (size < 2u * (unsigned int)s->lookup_len) size <<= 1;
+    table = arena_alloc(s, sizeof(int) * size);
+    if (!table) return;
+
+    for (slot = 0; slot < size; ++slot) table[slot] = -1;
+    for (i = 0; i < s->lookup_len; ++i) {
+        for (slot = te_hash(s->lookup[i].name) & (size - 1); (j = table[slot]) >= 0; slot = (slot + 1) & (size - 1)) {
+            if (strcmp(s->lookup[j].name, s->lookup[i].name) == 0) break;
         }
+        if (j < 0) table[slot] = i;
     }
-
-    return 0;
+    s->lookup_table = table;
+    s->lookup_mask = size - 1;
 }
 
-static const te_variable *find_lookup(const state *s, const char *name, int len) {
+static const te_variable *find_lookup(const state *s, const char *name, int len, unsigned int hash) {
     int iters;
     const te_variable *var;
+    unsigned int slot;
     if (!s->lookup) return 0;
 
+    if (s->lookup_table) {
+        for (slot = hash & s->lookup_mask; s->lookup_table[slot] >= 0; slot = (slot + 1) & s->lookup_mask) {
+            var = s->lookup + s->lookup_table[slot];
+            if (strncmp(name, var->name, len) == 0 && var->name[len] == '\0') return var;
+        }
+        return 0;
+    }
+
     for (var = s->lookup, iters = s->lookup_len; iters; ++var, --iters) {
         if (strncmp(name, var->name, len) == 0 && var->name[len] == '\0') {
             return var;
@@ -244,11 +363,16 @@ void next_token(state *s) {
             /* Look for a variable or builtin function call. */
             if (s->next[0] >= 'a' && s->next[0] <= 'z') {
                 const char *start;
+                unsigned int hash = TE_HASH_BASIS;
                 start = s->next;
-                while ((s->next[0] >= 'a' && s->next[0] <= 'z') || (s->next[0] >= '0' && s->next[0] <= '9') || (s->next[0] == '_')) s->next++;
+                /* The name is hashed as it is read, for both lookups. */
+                while ((s->next[0] >= 'a' && s->next[0] <= 'z') || (s->next[0] >= '0' && s->next[0] <= '9') || (s->next[0] == '_')) {
+                    hash = (hash ^ (unsigned char)*s->next++) * TE_HASH_PRIME;
+                }
+                hash &= 0xffffffffu;
 
-                const te_variable *var = find_lookup(s, start, s->next - start);
-                if (!var) var = find_builtin(start, s->next - start);
+                const te_variable *var = find_lookup(s, start, s->next - start, hash);
+                if (!var) var = find_builtin(start, s->next - start, hash);
 
                 if (!var) {
                     s->type = TOK_ERROR;
@@ -304,20 +428,20 @@ static te_expr *base(state *s) {
 
     switch (TYPE_MASK(s->type)) {
         case TOK_NUMBER:
-            ret = new_expr(TE_CONSTANT, 0);
+            ret = new_expr(s, TE_CONSTANT, 0);
             ret->value = s->value;
             next_token(s);
             break;
 
         case TOK_VARIABLE:
-            ret = new_expr(TE_VARIABLE, 0);
+            ret = new_expr(s, TE_VARIABLE, 0);
             ret->bound = s->bound;
             next_token(s);
             break;
 
         case TE_FUNCTION0:
         case TE_CLOSURE0:
-            ret = new_expr(s->type, 0);
+            ret = new_expr(s, s->type, 0);
             ret->function = s->function;
             if (IS_CLOSURE(s->type)) ret->parameters[0] = s->context;
             next_token(s);
@@ -333,7 +457,7 @@ static te_expr *base(state *s) {
 
         case TE_FUNCTION1:
         case TE_CLOSURE1:
-            ret = new_expr(s->type, 0);
+            ret = new_expr(s, s->type, 0);
             ret->function = s->function;
             if (IS_CLOSURE(s->type)) ret->parameters[1] = s->context;
             next_token(s);
@@ -346,7 +470,7 @@ static te_expr *base(state *s) {
         case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:
             arity = ARITY(s->type);
 
-            ret = new_expr(s->type, 0);
+            ret = new_expr(s, s->type, 0);
             ret->function = s->function;
             if (IS_CLOSURE(s->type)) ret->parameters[arity] = s->context;
             next_token(s);
@@ -382,7 +506,7 @@ static te_expr *base(state *s) {
             break;
 
         default:
-            ret = new_expr(0, 0);
+            ret = new_expr(s, 0, 0);
             s->type = TOK_ERROR;
             ret->value = NAN;
             break;
@@ -421,9 +545,7 @@ static te_expr *factor(state *s) {
     te_expr *insertion = 0;
 
     if (ret->type == (TE_FUNCTION1 | TE_FLAG_PURE) && ret->function == negate) {
-        te_expr *se = ret->parameters[0];
-        free(ret);
-        ret = se;
+        ret = ret->parameters[0];
         neg = 1;
     }
 
@@ -578,7 +700,6 @@ static void optimize(te_expr *n) {
         }
         if (known) {
             const double value = te_eval(n);
-            te_free_parameters(n);
             n->type = TE_CONSTANT;
             n->value = value;
         }
@@ -586,30 +707,160 @@ static void optimize(te_expr *n) {
 }
 
 
-te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error) {
-    state s;
-    s.start = s.next = expression;
-    s.lookup = variables;
-    s.lookup_len = var_count;
+static int pure_tree(const te_expr *n) {
+    /* True if dropping n cannot skip a call with side effects. */
+    int i;
+    if (IS_FUNCTION(n->type) || IS_CLOSURE(n->type)) {
+        if (!IS_PURE(n->type)) return 0;
+        for (i = 0; i < ARITY(n->type); ++i) {
+            if (!pure_tree(n->parameters[i])) return 0;
+        }
+    }
+    return 1;
+}
+
+
+static int exact_scale(double c) {
+    /* True if c is a finite power of two, at least 1 in magnitude. */
+    int e;
+    return c - c == 0 && fabs(c) >= 1 && fabs(frexp(c, &e)) == 0.5;
+}
+
+
+#define IS_CALL2(N, F) (TYPE_MASK((N)->type) == TE_FUNCTION2 && IS_PURE((N)->type) && (N)->function == (F))
+#define IS_VALUE(N, V) (((te_expr*)(N))->type == TE_CONSTANT && ((te_expr*)(N))->value == (V))
 
-    next_token(&s);
-    te_expr *root = list(&s);
+static te_expr *simplify(te_expr *n) {
+    /* Rewrites what optimize() leaves behind, only where the result is the  */
+    /* same for every x: x-c becomes x+(-c), x*2^a*2^b becomes x*2^(a+b) for  */
+    /* a, b >= 0, and x*1, x+(-0), x/1, x^1, x^0 and -(-x) are removed. Other */
+    /* chains are not reassociated, as x+1e16-1e16 is 0 but x+(1e16-1e16) is */
+    /* x. Nodes are reused in place, so the result may be any node of the old */
+    /* tree. */
+    const int arity = ARITY(n->type);
+    te_expr *a, *b;
+    int i;
 
-    if (s.type != TOK_END) {
-        te_free(root);
+    for (i = 0; i < arity; ++i) {
+        n->parameters[i] = simplify(n->parameters[i]);
+    }
+    if (!IS_PURE(n->type)) return n;
+
+    if (TYPE_MASK(n->type) == TE_FUNCTION1 && n->function == negate) {
+        a = n->parameters[0];
+        if (TYPE_MASK(a->type) == TE_FUNCTION1 && IS_PURE(a->type) && a->function == negate) return a->parameters[0];
+        return n;
+    }
+    if (TYPE_MASK(n->type) != TE_FUNCTION2) return n;
+
+    a = n->parameters[0];
+    b = n->parameters[1];
+
+    /* x - c is exactly x + (-c), which can then join an addition chain. */
+    if (n->function == sub && b->type == TE_CONSTANT) {
+        b->value = -b->value;
+        n->function = add;
+    }
+
+    if (n->function == add || n->function == mul) {
+        const te_fun2 f = (te_fun2)n->function;
+
+        /* c op x -> x op c */
+        if (a->type == TE_CONSTANT) {
+            n->parameters[0] = b;
+            n->parameters[1] = a;
+            a = n->parameters[0];
+            b = n->parameters[1];
+        }
+
+        /* (x*c1)*c2 -> x*(c1*c2) when both scale exactly: x*c1 either is exact */
+        /* or overflows, and then so does x*(c1*c2). */
+        if (n->function == mul && b->type == TE_CONSTANT && IS_CALL2(a, f) &&
+            ((te_expr*)a->parameters[1])->type == TE_CONSTANT) {
+            te_expr *c = a->parameters[1];
+            const double folded = c->value * b->value;
+            if (exact_scale(c->value) && exact_scale(b->value) && folded - folded == 0) {
+                c->value = folded;
+                n = a;
+                a = n->parameters[0];
+                b = n->parameters[1];
+            }
+        }
+
+        /* x+0 is +0 for x = -0, but x+(-0) is always x. */
+        if (n->function == add && IS_VALUE(b, 0.0) && 1 / b->value < 0) return a;
+        if (n->function == mul && IS_VALUE(b, 1.0)) return a;
+        if (n->function == mul && IS_VALUE(b, -1.0)) {
+            n->type = TE_FUNCTION1 | TE_FLAG_PURE;
+            n->function = negate;
+            n->parameters[1] = 0;
+        }
+    } else if (n->function == divide && IS_VALUE(b, 1.0)) {
+        return a;
+    } else if (n->function == pow && IS_VALUE(b, 1.0)) {
+        return a;
+    } else if (n->function == pow && IS_VALUE(b, 0.0) && pure_tree(a)) {
+        /* pow(x, 0) is 1 for every x, NaN included. */
+        b->value = 1.0;
+        return b;
+    }
+
+    return n;
+}
+
+#undef IS_CALL2
+#undef IS_VALUE
+
+
+static te_expr *parse(state *s, const char *expression, const te_variable *variables, int var_count, int *error) {
+    /* The tree returned lives in s->arena; the caller frees it with arena_free. */
+    te_expr *root;
+    s->start = s->next = expression;
+    s->lookup = variables;
+    s->lookup_len = var_count;
+    s->arena = 0;
+    s->out_of_memory = 0;
+    hash_lookup(s);
+
+    next_token(s);
+    root = list(s);
+
+    if (s->type != TOK_END || s->out_of_memory) {
         if (error) {
-            *error = (s.next - s.start);
+            *error = (s->next - s->start);
             if (*error == 0) *error = 1;
         }
         return 0;
     } else {
         optimize(root);
+        root = simplify(root);
         if (error) *error = 0;
         return root;
     }
 }
 
 
+te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error) {
+    state s;
+    te_expr *root = parse(&s, expression, variables, var_count, error);
+    te_expr *ret = 0;
+    char *next;
+
+    if (root) {
+        ret = malloc(tree_size(root));
+        if (ret) {
+            next = (char*)ret;
+            tree_copy(root, &next);
+        } else if (error) {
+            *error = -1;
+        }
+    }
+
+    arena_free(&s);
+    return ret;
+}
+
+
 double te_interp(const char *expression, int *error) {
     te_expr *n = te_compile(expression, 0, 0, error);
     double ret;
@@ -622,6 +873,1425 @@ double te_interp(const char *expression, int *error) {
     return ret;
 }
 
+typedef struct flat {
+    te_program *p;
+    const te_variable *lookup;
+    int lookup_len;
+    int args;
+} flat;
+
+
+static void fl_count(const te_expr *n, int *length, int *args) {
+    const int arity = ARITY(n->type);
+    int i;
+
+    for (i = 0; i < arity; ++i) {
+        fl_count(n->parameters[i], length, args);
+    }
+
+    if (IS_FUNCTION(n->type) && arity == 2 && n->function == comma) return;
+    if (arity > 2) *args += arity;
+    ++*length;
+}
+
+
+static int fl_op(const te_expr *n) {
+    /* Ops the dispatch loop handles inline instead of through a call. */
+    switch (TYPE_MASK(n->type)) {
+        case TE_CONSTANT: return TE_OP_CONSTANT;
+        case TE_VARIABLE: return TE_OP_VARIABLE;
+        case TE_FUNCTION1:
+            if (n->function == negate) return TE_OP_NEG;
+            if (n->function == fabs) return TE_OP_ABS;
+            if (n->function == sqrt) return TE_OP_SQRT;
+            if (n->function == floor) return TE_OP_FLOOR;
+            if (n->function == ceil) return TE_OP_CEIL;
+            if (n->function == sin) return TE_OP_SIN;
+            if (n->function == cos) return TE_OP_COS;
+            if (n->function == tan) return TE_OP_TAN;
+            if (n->function == exp) return TE_OP_EXP;
+            if (n->function == log) return TE_OP_LN;
+            if (n->function == log10) return TE_OP_LOG10;
+            return TE_OP_FUNCTION1;
+        case TE_FUNCTION2:
+            if (n->function == add) return TE_OP_ADD;
+            if (n->function == sub) return TE_OP_SUB;
+            if (n->function == mul) return TE_OP_MUL;
+            if (n->function == divide) return TE_OP_DIV;
+            if (n->function == fmod) return TE_OP_MOD;
+            if (n->function == pow) return TE_OP_POW;
+            return TE_OP_FUNCTION2;
+    }
+    if (IS_CLOSURE(n->type)) return TE_OP_CLOSURE0 + ARITY(n->type);
+    return TE_OP_FUNCTION0 + ARITY(n->type);
+}
+
+
+static void fl_emit(flat *f, const te_expr *n, int dst) {
+    /* Children are evaluated into consecutive registers starting at dst. */
+    te_program *p = f->p;
+    const int arity = ARITY(n->type);
+    te_instr *ins;
+    int i;
+
+    if (IS_FUNCTION(n->type) && arity == 2 && n->function == comma) {
+        fl_emit(f, n->parameters[0], dst);
+        fl_emit(f, n->parameters[1], dst);
+        return;
+    }
+
+    for (i = 0; i < arity; ++i) {
+        fl_emit(f, n->parameters[i], dst + i);
+    }
+
+    ins = p->code + p->length++;
+    ins->op = fl_op(n);
+    ins->dst = dst;
+    ins->a = arity > 0 ? dst : 0;
+    ins->b = arity > 1 ? dst + 1 : 0;
+    ins->pure = !(IS_FUNCTION(n->type) || IS_CLOSURE(n->type)) || IS_PURE(n->type);
+    ins->context = 0;
+    if (dst + 1 > p->registers) p->registers = dst + 1;
+
+    switch (ins->op) {
+        case TE_OP_CONSTANT:
+            ins->value = n->value;
+            break;
+
+        case TE_OP_VARIABLE:
+            ins->bound = n->bound;
+            ins->a = -1;
+            for (i = 0; i < f->lookup_len; ++i) {
+                if (f->lookup[i].address == n->bound) {
+                    ins->a = i;
+                    break;
+                }
+            }
+            break;
+
+        default:
+            ins->function = n->function;
+            if (IS_CLOSURE(n->type)) ins->context = n->parameters[arity];
+            if (arity > 2) {
+                ins->a = f->args;
+                ins->b = 0;
+                for (i = 0; i < arity; ++i) {
+                    p->args[f->args++] = dst + i;
+                }
+            }
+            break;
+    }
+}
+
+
+static int fl_operands(te_program *p, te_instr *ip, int **slots) {
+    /* Points slots at the fields naming the registers ip reads and returns how many there are. */
+    int arity, i;
+    switch (ip->op) {
+        case TE_OP_CONSTANT: case TE_OP_VARIABLE: return 0;
+        case TE_OP_ADD: case TE_OP_SUB: case TE_OP_MUL: case TE_OP_DIV: case TE_OP_MOD: case TE_OP_POW:
+            slots[0] = &ip->a;
+            slots[1] = &ip->b;
+            return 2;
+        default:
+            if (ip->op < TE_OP_FUNCTION0) {
+                slots[0] = &ip->a;
+                return 1;
+            }
+            arity = (ip->op - TE_OP_FUNCTION0) & 7;
+            for (i = 0; i < arity; ++i) {
+                slots[i] = arity > 2 ? p->args + ip->a + i : (i ? &ip->b : &ip->a);
+            }
+            return arity;
+    }
+}
+
+
+static unsigned long fl_mix(unsigned long h, const void *data, size_t size) {
+    const unsigned char *c = data;
+    size_t i;
+    for (i = 0; i < size; ++i) h = (h ^ c[i]) * 16777619ul;
+    return h;
+}
+
+
+static unsigned long fl_hash(te_program *p, te_instr *ip, int epoch) {
+    int *slots[7];
+    const int count = fl_operands(p, ip, slots);
+    unsigned long h = fl_mix(2166136261ul, &ip->op, sizeof(int));
+    int i;
+
+    for (i = 0; i < count; ++i) h = fl_mix(h, slots[i], sizeof(int));
+    switch (ip->op) {
+        case TE_OP_CONSTANT: return fl_mix(h, &ip->value, sizeof(double));
+        case TE_OP_VARIABLE:
+            h = fl_mix(h, &ip->a, sizeof(int));
+            h = fl_mix(h, &ip->bound, sizeof(ip->bound));
+            return fl_mix(h, &epoch, sizeof(int));
+        default:
+            h = fl_mix(h, &ip->function, sizeof(ip->function));
+            return fl_mix(h, &ip->context, sizeof(ip->context));
+    }
+}
+
+
+static int fl_same(te_program *p, te_instr *x, te_instr *y) {
+    /* Nonzero if x and y compute the same value; operands must already be value numbers. */
+    int *xs[7], *ys[7];
+    int count, i;
+
+    if (x->op != y->op) return 0;
+    count = fl_operands(p, x, xs);
+    fl_operands(p, y, ys);
+    for (i = 0; i < count; ++i) {
+        if (*xs[i] != *ys[i]) return 0;
+    }
+    switch (x->op) {
+        case TE_OP_CONSTANT: return memcmp(&x->value, &y->value, sizeof(double)) == 0;
+        case TE_OP_VARIABLE: return x->a == y->a && x->bound == y->bound;
+        default: return x->function == y->function && x->context == y->context;
+    }
+}
+
+
+static void fl_share(te_program *p) {
+    /* Turns the tree-shaped program into a DAG: every distinct pure computation */
+    /* runs once, pure instructions whose values go unused are dropped, and */
+    /* registers are reassigned so each is reused as soon as its value is dead. */
+    /* Variables read on either side of an impure call are kept apart, since the */
+    /* call may change them. Leaves the program alone if memory runs out. */
+    const int n = p->length;
+    int *slots[7];
+    int *block, *cur, *rep, *last, *reg, *epoch, *spare, *table;
+    int size = 16, i, j, k, v, count, result, length = 0, registers = 0, spares = 0, now = 0;
+    unsigned long h;
+    te_instr *ip;
+
+    while (size < 2 * n) size *= 2;
+    block = malloc(sizeof(int) * (p->registers + 6 * n + size));
+    if (!block) return;
+    cur = block;
+    rep = cur + p->registers;
+    last = rep + n;
+    reg = last + n;
+    epoch = reg + n;
+    spare = epoch + n;
+    table = spare + n;
+    for (i = 0; i < size; ++i) table[i] = -1;
+
+    /* Value numbering: each operand is renamed to the first instruction */
+    /* that computed its value, and duplicates point at that instruction. */
+    for (i = 0; i < n; ++i) {
+        ip = p->code + i;
+        count = fl_operands(p, ip, slots);
+        for (j = 0; j < count; ++j) *slots[j] = rep[cur[*slots[j]]];
+        if ((ip->op == TE_OP_ADD || ip->op == TE_OP_MUL) && ip->a > ip->b) {
+            k = ip->a;
+            ip->a = ip->b;
+            ip->b = k;
+        }
+
+        rep[i] = i;
+        epoch[i] = now;
+        if (ip->pure) {
+            for (h = fl_hash(p, ip, now) & (size - 1); table[h] >= 0; h = (h + 1) & (size - 1)) {
+                k = table[h];
+                if ((ip->op != TE_OP_VARIABLE || epoch[k] == now) && fl_same(p, p->code + k, ip)) {
+                    rep[i] = k;
+                    break;
+                }
+            }
+            if (rep[i] == i) table[h] = i;
+        } else {
+            ++now;
+        }
+        cur[ip->dst] = i;
+    }
+    result = rep[cur[p->result]];
+
+    /* Liveness, backwards: last[i] is the last instruction reading value i, */
+    /* or -1 if it is unused. Impure instructions always run. */
+    for (i = 0; i < n; ++i) last[i] = -1;
+    last[result] = n;
+    for (i = n - 1; i >= 0; --i) {
+        ip = p->code + i;
+        if (rep[i] != i) continue;
+        if (last[i] < 0) {
+            if (ip->pure) continue;
+            last[i] = i;
+        }
+        count = fl_operands(p, ip, slots);
+        for (j = 0; j < count; ++j) {
+            if (last[*slots[j]] < i) last[*slots[j]] = i;
+        }
+    }
+
+    /* Registers: operands dying here are released before dst is chosen, */
+    /* so an instruction may overwrite its own input. */
+    for (i = 0; i < n; ++i) {
+        ip = p->code + i;
+        if (rep[i] != i || last[i] < 0) continue;
+        count = fl_operands(p, ip, slots);
+        for (j = 0; j < count; ++j) {
+            v = *slots[j];
+            *slots[j] = reg[v];
+            if (last[v] == i) {
+                spare[spares++] = reg[v];
+                last[v] = -1;
+            }
+        }
+        reg[i] = spares ? spare[--spares] : registers++;
+        ip->dst = reg[i];
+        if (last[i] == i) spare[spares++] = reg[i];
+        p->code[length++] = *ip;
+    }
+
+    p->length = length;
+    p->registers = registers;
+    p->result = reg[result];
+    free(block);
+}
+
+
+te_program *te_flatten(const te_expr *n, const te_variable *variables, int var_count) {
+    flat f;
+    te_program *p;
+    int length = 0, args = 0;
+
+    if (!n) return 0;
+    fl_count(n, &length, &args);
+
+    /* The header, code and argument lists share one allocation. */
+    p = malloc(sizeof(te_program) + sizeof(te_instr) * length + sizeof(int) * args);
+    if (!p) return 0;
+    p->code = (te_instr*)(p + 1);
+    p->args = (int*)(p->code + length);
+    p->length = 0;
+    p->registers = 1;
+    p->result = 0;
+    p->slots = var_count;
+
+    f.p = p;
+    f.lookup = variables;
+    f.lookup_len = var_count;
+    f.args = 0;
+    fl_emit(&f, n, 0);
+    fl_share(p);
+
+    return p;
+}
+
+
+te_program *te_compile_program(const char *expression, const te_variable *variables, int var_count, int *error) {
+    /* Flatten straight from the parse arena; the tree is never copied out. */
+    state s;
+    te_expr *n = parse(&s, expression, variables, var_count, error);
+    te_program *p = 0;
+    if (n) {
+        p = te_flatten(n, variables, var_count);
+        if (!p && error) *error = -1;
+    }
+    arena_free(&s);
+    return p;
+}
+
+
+te_program *te_compile_frame(const char *expression, const te_variable *variables, int var_count, int *error) {
+    /* Give every variable a distinct placeholder address so that flattening */
+    /* can tell them apart, then drop the addresses from the program. */
+    te_variable *lookup = malloc(sizeof(te_variable) * (var_count > 0 ? var_count : 1));
+    double *slots = malloc(sizeof(double) * (var_count > 0 ? var_count : 1));
+    te_program *p = 0;
+    int i;
+
+    if (lookup && slots) {
+        for (i = 0; i < var_count; ++i) {
+            lookup[i] = variables[i];
+            if (TYPE_MASK(lookup[i].type) == TE_VARIABLE) lookup[i].address = slots + i;
+        }
+        p = te_compile_program(expression, lookup, var_count, error);
+        for (i = 0; p && i < p->length; ++i) {
+            if (p->code[i].op == TE_OP_VARIABLE) p->code[i].bound = 0;
+        }
+    } else if (error) {
+        *error = -1;
+    }
+
+    free(lookup);
+    free(slots);
+    return p;
+}
+
+
+void te_program_free(te_program *p) {
+    free(p);
+}
+
+
+#define TE_LOCAL_REGISTERS 64
+#define TE_FUN(...) ((double(*)(__VA_ARGS__))ip->function)
+#define A r[ip->a]
+#define B r[ip->b]
+#define M(e) r[p->args[ip->a + (e)]]
+
+static double step(const te_program *p, const te_instr *ip, const double *r, const double *frame) {
+    /* The value instruction ip computes from the registers r. */
+    switch (ip->op) {
+        case TE_OP_CONSTANT: return ip->value;
+        case TE_OP_VARIABLE: return frame && ip->a >= 0 ? frame[ip->a] : *ip->bound;
+        case TE_OP_ADD: return A + B;
+        case TE_OP_SUB: return A - B;
+        case TE_OP_MUL: return A * B;
+        case TE_OP_DIV: return A / B;
+        case TE_OP_MOD: return fmod(A, B);
+        case TE_OP_POW: return pow(A, B);
+        case TE_OP_NEG: return -A;
+        case TE_OP_ABS: return fabs(A);
+        case TE_OP_SQRT: return sqrt(A);
+        case TE_OP_FLOOR: return floor(A);
+        case TE_OP_CEIL: return ceil(A);
+        case TE_OP_SIN: return sin(A);
+        case TE_OP_COS: return cos(A);
+        case TE_OP_TAN: return tan(A);
+        case TE_OP_EXP: return exp(A);
+        case TE_OP_LN: return log(A);
+        case TE_OP_LOG10: return log10(A);
+
+        case TE_OP_FUNCTION0: return TE_FUN(void)();
+        case TE_OP_FUNCTION1: return TE_FUN(double)(A);
+        case TE_OP_FUNCTION2: return TE_FUN(double, double)(A, B);
+        case TE_OP_FUNCTION3: return TE_FUN(double, double, double)(M(0), M(1), M(2));
+        case TE_OP_FUNCTION4: return TE_FUN(double, double, double, double)(M(0), M(1), M(2), M(3));
+        case TE_OP_FUNCTION5: return TE_FUN(double, double, double, double, double)(M(0), M(1), M(2), M(3), M(4));
+        case TE_OP_FUNCTION6: return TE_FUN(double, double, double, double, double, double)(M(0), M(1), M(2), M(3), M(4), M(5));
+        case TE_OP_FUNCTION7: return TE_FUN(double, double, double, double, double, double, double)(M(0), M(1), M(2), M(3), M(4), M(5), M(6));
+
+        case TE_OP_CLOSURE0: return TE_FUN(void*)(ip->context);
+        case TE_OP_CLOSURE1: return TE_FUN(void*, double)(ip->context, A);
+        case TE_OP_CLOSURE2: return TE_FUN(void*, double, double)(ip->context, A, B);
+        case TE_OP_CLOSURE3: return TE_FUN(void*, double, double, double)(ip->context, M(0), M(1), M(2));
+        case TE_OP_CLOSURE4: return TE_FUN(void*, double, double, double, double)(ip->context, M(0), M(1), M(2), M(3));
+        case TE_OP_CLOSURE5: return TE_FUN(void*, double, double, double, double, double)(ip->context, M(0), M(1), M(2), M(3), M(4));
+        case TE_OP_CLOSURE6: return TE_FUN(void*, double, double, double, double, double, double)(ip->context, M(0), M(1), M(2), M(3), M(4), M(5));
+        case TE_OP_CLOSURE7: return TE_FUN(void*, double, double, double, double, double, double, double)(ip->context, M(0), M(1), M(2), M(3), M(4), M(5), M(6));
+
+        default: return NAN;
+    }
+}
+
+
+double te_program_eval(const te_program *p) {
+    return te_program_eval_frame(p, 0);
+}
+
+
+double te_program_eval_frame(const te_program *p, const double *frame) {
+    double local[TE_LOCAL_REGISTERS];
+    double *r = local;
+    const te_instr *ip, *end;
+    double ret;
+
+    if (!p) return NAN;
+    if (p->registers > TE_LOCAL_REGISTERS) {
+        r = malloc(sizeof(double) * p->registers);
+        if (!r) return NAN;
+    }
+
+    for (ip = p->code, end = p->code + p->length; ip != end; ++ip) {
+        r[ip->dst] = step(p, ip, r, frame);
+    }
+
+    ret = r[p->result];
+    if (r != local) free(r);
+    return ret;
+}
+
+#undef TE_FUN
+#undef A
+#undef B
+#undef M
+
+/* Interval bounds of a program. Every result is widened by TE_SLACK of its */
+/* size, and trig results also by TE_SLACK of their argument, which covers the */
+/* rounding of the libm functions, the batch kernels and the JIT alike. */
+#define TE_SLACK 1.4210854715202004e-14 /* 2^-46 */
+#define TE_PI 3.14159265358979323846
+#define TE_FUN(...) ((double(*)(__VA_ARGS__))ip->function)
+#define A r[ip->a]
+#define B r[ip->b]
+
+static const te_interval te_entire = {-INFINITY, INFINITY, 1};
+static const te_interval te_empty = {INFINITY, -INFINITY, 1};
+
+static int iv_finite(double v) {return v - v == 0;}
+static int iv_is_empty(te_interval v) {return v.lo > v.hi;}
+static int iv_has_zero(te_interval v) {return v.lo <= 0 && v.hi >= 0;}
+static int iv_infinite(te_interval v) {return !iv_finite(v.lo) || !iv_finite(v.hi);}
+
+static te_interval iv_make(double lo, double hi, int nan) {
+    /* [lo, hi] widened outward; a NaN end means the bound is lost. */
+    te_interval v;
+    v.lo = lo != lo ? -INFINITY : iv_finite(lo) ? lo - (fabs(lo) * TE_SLACK + DBL_MIN) : lo;
+    v.hi = hi != hi ? INFINITY : iv_finite(hi) ? hi + (fabs(hi) * TE_SLACK + DBL_MIN) : hi;
+    v.nan = nan || lo != lo || hi != hi;
+    return v;
+}
+
+static te_interval iv_point(double value) {
+    te_interval v;
+    v.lo = v.hi = value;
+    v.nan = value != value;
+    if (v.nan) return te_empty;
+    return v;
+}
+
+static double iv_min(double a, double b) {return a < b ? a : b;}
+static double iv_max(double a, double b) {return a > b ? a : b;}
+
+static double iv_product(double a, double b) {
+    /* An end of a product; 0 * inf stands for the products of zero with large values. */
+    return (a == 0 || b == 0) ? 0 : a * b;
+}
+
+static te_interval iv_mul(te_interval a, te_interval b) {
+    const double p1 = iv_product(a.lo, b.lo), p2 = iv_product(a.lo, b.hi);
+    const double p3 = iv_product(a.hi, b.lo), p4 = iv_product(a.hi, b.hi);
+    const int nan = a.nan || b.nan || (iv_has_zero(a) && iv_infinite(b)) || (iv_has_zero(b) && iv_infinite(a));
+    if (iv_is_empty(a) || iv_is_empty(b)) return te_empty;
+    return iv_make(iv_min(iv_min(p1, p2), iv_min(p3, p4)), iv_max(iv_max(p1, p2), iv_max(p3, p4)), nan);
+}
+
+static te_interval iv_div(te_interval a, te_interval b) {
+    te_interval v;
+    if (iv_is_empty(a) || iv_is_empty(b)) return te_empty;
+    if (iv_has_zero(b)) return te_entire;
+    v.lo = 1 / b.hi;
+    v.hi = 1 / b.lo;
+    v.nan = b.nan;
+    return iv_mul(a, iv_make(v.lo, v.hi, v.nan));
+}
+
+static te_interval iv_monotone(double (*f)(double), te_interval a, double lo, double hi, int rising) {
+    /* f over a, where f is defined and monotone on [lo, hi] and NaN outside it. */
+    const int nan = a.nan || a.lo < lo || a.hi > hi;
+    if (iv_is_empty(a) || a.hi < lo || a.lo > hi) return te_empty;
+    a.lo = iv_max(a.lo, lo);
+    a.hi = iv_min(a.hi, hi);
+    return rising ? iv_make(f(a.lo), f(a.hi), nan) : iv_make(f(a.hi), f(a.lo), nan);
+}
+
+static int iv_reaches(te_interval a, double at, double period) {
+    /* Nonzero if a holds at + k*period for some integer k. */
+    return at + period * ceil((a.lo - at) / period) <= a.hi;
+}
+
+static double iv_trig_slack(double x, double slope) {
+    /* How far a trig kernel may stray at x, where the function has that slope, */
+    /* since the reduction of x by pi/2 is good to about TE_SLACK of x. */
+    return (1 + fabs(x)) * (1 + fabs(slope)) * TE_SLACK;
+}
+
+static te_interval iv_periodic(double (*f)(double), te_interval a, double maxAt, double minAt) {
+    /* sin or cos over a, given where in each period it peaks and troughs. */
+    double lo, hi, slack;
+
+    if (iv_is_empty(a)) return te_empty;
+    if (iv_infinite(a) || a.hi - a.lo >= 2 * TE_PI) return iv_make(-1, 1, a.nan || iv_infinite(a));
+    lo = iv_min(f(a.lo), f(a.hi));
+    hi = iv_max(f(a.lo), f(a.hi));
+    if (iv_reaches(a, maxAt, 2 * TE_PI)) hi = 1;
+    if (iv_reaches(a, minAt, 2 * TE_PI)) lo = -1;
+    slack = iv_trig_slack(iv_max(fabs(a.lo), fabs(a.hi)), 1);
+    return iv_make(lo - slack, hi + slack, a.nan);
+}
+
+static te_interval iv_tan(te_interval a) {
+    double lo, hi;
+    if (iv_is_empty(a)) return te_empty;
+    if (iv_infinite(a)) return te_entire;
+    if (a.hi - a.lo >= TE_PI || iv_reaches(a, TE_PI / 2, TE_PI)) return iv_make(-INFINITY, INFINITY, a.nan);
+    lo = tan(a.lo);
+    hi = tan(a.hi);
+    if (lo > hi) return iv_make(-INFINITY, INFINITY, a.nan);
+    return iv_make(lo - iv_trig_slack(a.lo, 1 + lo * lo), hi + iv_trig_slack(a.hi, 1 + hi * hi), a.nan);
+}
+
+static te_interval iv_exp(te_interval a) {
+    /* exp gains the relative error of a large argument's reduction by ln 2. */
+    /* An underflow has already been widened below 0 by iv_make. */
+    te_interval v = iv_monotone(exp, a, -INFINITY, INFINITY, 1);
+    if (iv_finite(a.lo) && iv_finite(v.lo)) v.lo -= fabs(v.lo) * fabs(a.lo) * TE_SLACK;
+    if (v.lo < 0) v.lo = 0;
+    if (iv_finite(a.hi) && iv_finite(v.hi)) v.hi += v.hi * fabs(a.hi) * TE_SLACK;
+    return v;
+}
+
+static te_interval iv_pow(te_interval a, te_interval b) {
+    const int nan = a.nan || b.nan;
+    const double n = b.lo;
+    double lo, hi;
+    te_interval v;
+
+    if (iv_is_empty(a) || iv_is_empty(b)) return te_entire; /* pow(NaN, 0) is 1 */
+    if (n == b.hi && n == floor(n)) {
+        if (n == 0) return iv_point(1);
+        if (!iv_finite(n) || fmod(n, 2) == 0) {
+            /* even powers fold the negatives over, as do infinite ones, a
+             * power of |a| that only steps from 0 through 1 to infinity */
+            lo = a.lo >= 0 ? a.lo : a.hi <= 0 ? -a.hi : 0;
+            hi = iv_max(-a.lo, a.hi);
+            return n > 0 ? iv_make(pow(lo, n), pow(hi, n), nan) : iv_make(pow(hi, n), pow(lo, n), nan);
+        }
+        if (n > 0) return iv_make(pow(a.lo, n), pow(a.hi, n), nan);
+        if (iv_has_zero(a)) return te_entire;
+        return iv_make(pow(a.hi, n), pow(a.lo, n), nan);
+    }
+    if (a.lo < 0) {
+        /* a negative base only has a power for an integer exponent, but */
+        /* pow(-inf, b) is 0 or inf */
+        if (n != b.hi) return te_entire;
+        if (a.lo == -INFINITY) return iv_make(0, INFINITY, 1);
+        if (a.hi < 0) return te_empty;
+        a.lo = 0;
+        a.nan = 1;
+        return iv_pow(a, b);
+    }
+
+    /* a^b = exp(b ln a) for a >= 0 */
+    v = iv_monotone(log, a, 0, INFINITY, 1);
+    v = iv_exp(iv_mul(v, b));
+    v.nan = nan;
+    return v;
+}
+
+static te_interval iv_step(const te_instr *ip, const te_interval *r, const te_interval *frame) {
+    /* The bounds of what instruction ip computes from the bounds in r. */
+    te_interval v;
+    double m;
+
+    switch (ip->op) {
+        case TE_OP_CONSTANT: return iv_point(ip->value);
+        case TE_OP_VARIABLE: return frame && ip->a >= 0 ? frame[ip->a] : iv_point(*ip->bound);
+        case TE_OP_ADD:
+            if (iv_is_empty(A) || iv_is_empty(B)) return te_empty;
+            return iv_make(A.lo + B.lo, A.hi + B.hi, A.nan || B.nan ||
+                           (A.hi == INFINITY && B.lo == -INFINITY) || (A.lo == -INFINITY && B.hi == INFINITY));
+        case TE_OP_SUB:
+            if (iv_is_empty(A) || iv_is_empty(B)) return te_empty;
+            return iv_make(A.lo - B.hi, A.hi - B.lo, A.nan || B.nan ||
+                           (A.hi == INFINITY && B.hi == INFINITY) || (A.lo == -INFINITY && B.lo == -INFINITY));
+        case TE_OP_MUL: return iv_mul(A, B);
+        case TE_OP_DIV: return iv_div(A, B);
+        case TE_OP_MOD:
+            if (iv_is_empty(A) || iv_is_empty(B)) return te_empty;
+            m = iv_max(fabs(B.lo), fabs(B.hi));
+            return iv_make(A.lo >= 0 ? 0 : iv_max(A.lo, -m), A.hi <= 0 ? 0 : iv_min(A.hi, m),
+                           A.nan || B.nan || iv_has_zero(B) || iv_infinite(A));
+        case TE_OP_POW: return iv_pow(A, B);
+        case TE_OP_NEG:
+            v.lo = -A.hi;
+            v.hi = -A.lo;
+            v.nan = A.nan;
+            return v;
+        case TE_OP_ABS:
+            if (iv_is_empty(A)) return te_empty;
+            v.lo = A.lo >= 0 ? A.lo : A.hi <= 0 ? -A.hi : 0;
+            v.hi = iv_max(-A.lo, A.hi);
+            v.nan = A.nan;
+            return v;
+        case TE_OP_SQRT: return iv_monotone(sqrt, A, 0, INFINITY, 1);
+        case TE_OP_FLOOR: return iv_monotone(floor, A, -INFINITY, INFINITY, 1);
+        case TE_OP_CEIL: return iv_monotone(ceil, A, -INFINITY, INFINITY, 1);
+        case TE_OP_SIN: return iv_periodic(sin, A, TE_PI / 2, -TE_PI / 2);
+        case TE_OP_COS: return iv_periodic(cos, A, 0, TE_PI);
+        case TE_OP_TAN: return iv_tan(A);
+        case TE_OP_EXP: return iv_exp(A);
+        case TE_OP_LN: return iv_monotone(log, A, 0, INFINITY, 1);
+        case TE_OP_LOG10: return iv_monotone(log10, A, 0, INFINITY, 1);
+
+        case TE_OP_FUNCTION0:
+            if (ip->pure) return iv_point(TE_FUN(void)());
+            return te_entire;
+        case TE_OP_FUNCTION1:
+            if (ip->function == atan) return iv_monotone(atan, A, -INFINITY, INFINITY, 1);
+            if (ip->function == asin) return iv_monotone(asin, A, -1, 1, 1);
+            if (ip->function == acos) return iv_monotone(acos, A, -1, 1, 0);
+            if (ip->function == sinh) return iv_monotone(sinh, A, -INFINITY, INFINITY, 1);
+            if (ip->function == tanh) return iv_monotone(tanh, A, -INFINITY, INFINITY, 1);
+            if (ip->function == cosh) {
+                v = A;
+                if (iv_is_empty(v)) return te_empty;
+                v.lo = A.lo >= 0 ? A.lo : A.hi <= 0 ? -A.hi : 0;
+                v.hi = iv_max(-A.lo, A.hi);
+                return iv_monotone(cosh, v, 0, INFINITY, 1);
+            }
+            if (ip->pure && A.lo == A.hi && !A.nan) return iv_make(TE_FUN(double)(A.lo), TE_FUN(double)(A.lo), 0);
+            return te_entire;
+        case TE_OP_FUNCTION2:
+            if (ip->function == atan2) {
+                if (iv_is_empty(A) || iv_is_empty(B)) return te_empty;
+                return iv_make(-TE_PI, TE_PI, A.nan || B.nan);
+            }
+            if (ip->pure && A.lo == A.hi && B.lo == B.hi && !A.nan && !B.nan)
+                return iv_make(TE_FUN(double, double)(A.lo, B.lo), TE_FUN(double, double)(A.lo, B.lo), 0);
+            return te_entire;
+
+        default: return te_entire;
+    }
+}
+
+
+te_interval te_program_bounds(const te_program *p, const te_interval *frame) {
+    te_interval local[TE_LOCAL_REGISTERS];
+    te_interval *r = local;
+    const te_instr *ip, *end;
+    te_interval ret;
+
+    if (!p) return te_empty;
+    if (p->registers > TE_LOCAL_REGISTERS) {
+        r = malloc(sizeof(te_interval) * p->registers);
+        if (!r) return te_entire;
+    }
+
+    for (ip = p->code, end = p->code + p->length; ip != end; ++ip) {
+        r[ip->dst] = iv_step(ip, r, frame);
+    }
+
+    ret = r[p->result];
+    if (r != local) free(r);
+    return ret;
+}
+
+#undef TE_FUN
+#undef A
+#undef B
+
+
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__) && !defined(TE_NO_SIMD)
+#define TE_SIMD __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define TE_SIMD
+#endif
+
+/* The kernel cores below are written branch-free on purpose so the compiler
+ * can vectorize each loop. Lanes outside a core's reduction range (including
+ * NaN and infinities) are patched afterwards with the libm function. Within
+ * the range they are within a few ulp but not bit-exact with libm. */
+
+typedef unsigned long long te_bits;
+
+static te_bits as_bits(double d) {te_bits b; memcpy(&b, &d, sizeof(b)); return b;}
+static double from_bits(te_bits b) {double d; memcpy(&d, &b, sizeof(d)); return d;}
+
+/* Adding and subtracting 1.5*2^52 rounds to the nearest integer, */
+/* which is left in the low bits of the sum. */
+#define TE_ROUND 6755399441055744.0
+#define TE_MAX_TRIG 1e5
+
+/* Reduces x to r in [-pi/4, pi/4] with x = q*pi/2 + r, returning sin(r) and cos(r). */
+#define TE_TRIG_REDUCE(x)                                                            \
+    const double t = (x) * 6.36619772367581382433e-01 + TE_ROUND;                    \
+    const double q = t - TE_ROUND;                                                   \
+    const te_bits qi = as_bits(t);                                                   \
+    const double r = (((x) - q * 1.57079632673412561417e+00)                         \
+                           - q * 6.07710050630396597660e-11)                         \
+                           - q * 2.02226624871116645580e-21                          \
+                           - q * 8.47842766036889956997e-32;                         \
+    const double z = r * r;                                                          \
+    const double s = r + r * z * (-1.66666666666666324348e-01 + z * (8.33333333332248946124e-03 \
+        + z * (-1.98412698298579493134e-04 + z * (2.75573137070700676789e-06        \
+        + z * (-2.50507602534068634195e-08 + z * 1.58969099521155010221e-10)))));   \
+    const double c = 1.0 - 0.5 * z + z * z * (4.16666666666666019037e-02            \
+        + z * (-1.38888888888741095749e-03 + z * (2.48015872894767294178e-05        \
+        + z * (-2.75573143513906633035e-07 + z * (2.08757232129817482790e-09        \
+        + z * -1.13596475577881948265e-11)))))
+
+#define TE_SELECT(mask, a, b) from_bits((as_bits(a) & (mask)) | (as_bits(b) & ~(mask)))
+
+TE_SIMD static void vsin_core(double *d, const double *a, size_t m) {
+    size_t k;
+    for (k = 0; k < m; ++k) {
+        TE_TRIG_REDUCE(a[k]);
+        const te_bits odd = 0 - (qi & 1);
+        d[k] = from_bits(as_bits(TE_SELECT(odd, c, s)) ^ ((qi & 2) << 62));
+    }
+}
+
+TE_SIMD static void vcos_core(double *d, const double *a, size_t m) {
+    size_t k;
+    for (k = 0; k < m; ++k) {
+        TE_TRIG_REDUCE(a[k]);
+        const te_bits odd = 0 - (qi & 1);
+        d[k] = from_bits(as_bits(TE_SELECT(odd, s, c)) ^ (((qi + 1) & 2) << 62));
+    }
+}
+
+TE_SIMD static void vtan_core(double *d, const double *a, size_t m) {
+    size_t k;
+    for (k = 0; k < m; ++k) {
+        TE_TRIG_REDUCE(a[k]);
+        const te_bits odd = 0 - (qi & 1);
+        d[k] = from_bits(as_bits(TE_SELECT(odd, c, s) / TE_SELECT(odd, s, c)) ^ ((qi & 1) << 63));
+    }
+}
+
+TE_SIMD static void vexp_core(double *d, const double *a, size_t m) {
+    size_t k;
+    for (k = 0; k < m; ++k) {
+        const double x = a[k];
+        const double t = x * 1.44269504088896338700e+00 + TE_ROUND;
+        const double q = t - TE_ROUND;
+        const double r = (x - q * 6.93147180369123816490e-01) - q * 1.90821492927058770002e-10;
+        /* Taylor series to r^13 is below an ulp on |r| <= ln(2)/2. */
+        const double p = 1.0 + r * (1.0 + r * (1.0/2 + r * (1.0/6 + r * (1.0/24 + r * (1.0/120
+            + r * (1.0/720 + r * (1.0/5040 + r * (1.0/40320 + r * (1.0/362880 + r * (1.0/3628800
+            + r * (1.0/39916800 + r * (1.0/479001600 + r * (1.0/6227020800.0)))))))))))));
+        d[k] = p * from_bits((as_bits(t) + 1023) << 52);
+    }
+}
+
+TE_SIMD static void vlog_core(double *d, const double *a, size_t m) {
+    size_t k;
+    for (k = 0; k < m; ++k) {
+        /* Split into 2^e * m with m in [sqrt(2)/2, sqrt(2)). */
+        const te_bits ib = as_bits(a[k]);
+        const double m0 = from_bits((ib & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL);
+        const te_bits big = as_bits(m0) > as_bits(1.41421356237309504880);
+        const double f = from_bits(as_bits(m0) - (big << 52)) - 1.0;
+        const double e = from_bits((ib >> 52) - 1023 + big + as_bits(TE_ROUND)) - TE_ROUND;
+        const double s = f / (2.0 + f);
+        const double z = s * s;
+        const double w = z * z;
+        const double R = z * (6.666666666666735130e-01 + w * (2.857142874366239149e-01
+                       + w * (1.818357216161805012e-01 + w * 1.479819860511658591e-01)))
+                       + w * (3.999999999940941908e-01 + w * (2.222219843214978396e-01
+                       + w * 1.531383769920937332e-01));
+        const double hfsq = 0.5 * f * f;
+        d[k] = e * 6.93147180369123816490e-01 - ((hfsq - (s * (hfsq + R) + e * 1.90821492927058770002e-10)) - f);
+    }
+}
+
+TE_SIMD static void vlog10_core(double *d, const double *a, size_t m) {
+    size_t k;
+    vlog_core(d, a, m);
+    for (k = 0; k < m; ++k) {
+        d[k] *= 4.34294481903251827651e-01;
+    }
+}
+
+#define TE_KERNEL_CHUNK 64
+
+static void kernel(void (*core)(double*, const double*, size_t), double (*fallback)(double),
+                   double lo, double hi, double *d, const double *a, size_t m) {
+    /* The core works on a copy of the input so that d may alias a. */
+    double in[TE_KERNEL_CHUNK];
+    size_t i, k, c;
+
+    for (i = 0; i < m; i += c) {
+        c = m - i < TE_KERNEL_CHUNK ? m - i : TE_KERNEL_CHUNK;
+        memcpy(in, a + i, sizeof(double) * c);
+        core(d + i, in, c);
+        for (k = 0; k < c; ++k) {
+            /* Zeros go to libm as well, which keeps the sign of sin(-0). */
+            if (!(in[k] >= lo && in[k] <= hi) || in[k] == 0) d[i + k] = fallback(in[k]);
+        }
+    }
+}
+
+#undef TE_TRIG_REDUCE
+#undef TE_SELECT
+
+
+void te_eval_builtin(int op, double *out, const double *in, size_t m) {
+    size_t i;
+    switch (op) {
+        case TE_OP_SIN: kernel(vsin_core, sin, -TE_MAX_TRIG, TE_MAX_TRIG, out, in, m); break;
+        case TE_OP_COS: kernel(vcos_core, cos, -TE_MAX_TRIG, TE_MAX_TRIG, out, in, m); break;
+        case TE_OP_TAN: kernel(vtan_core, tan, -TE_MAX_TRIG, TE_MAX_TRIG, out, in, m); break;
+        case TE_OP_EXP: kernel(vexp_core, exp, -708.0, 709.0, out, in, m); break;
+        case TE_OP_LN: kernel(vlog_core, log, DBL_MIN, DBL_MAX, out, in, m); break;
+        case TE_OP_LOG10: kernel(vlog10_core, log10, DBL_MIN, DBL_MAX, out, in, m); break;
+        default: for (i = 0; i < m; ++i) out[i] = NAN; break;
+    }
+}
+
+
+/* Single precision kernels for te_eval_batch_float, in the same manner: */
+/* the cores are branch-free and lanes outside their range are patched */
+/* with the double libm function, rounded. Each is within a few float ulp. */
+
+typedef unsigned int te_bits32; /* the bits of a float */
+
+static te_bits32 as_bits32(float f) {te_bits32 b; memcpy(&b, &f, sizeof(b)); return b;}
+static float from_bits32(te_bits32 b) {float f; memcpy(&f, &b, sizeof(f)); return f;}
+
+/* 1.5*2^23 rounds a float to an integer as TE_ROUND does a double. */
+#define TE_ROUND_F 12582912.0f
+
+/* The reduction is done in double, as a float's nearness to a multiple of */
+/* pi/2 can take more bits of pi/2 than three float constants hold. */
+#define TE_TRIG_REDUCE_F(x)                                                          \
+    const double t = (double)(x) * 6.36619772367581382433e-01 + TE_ROUND;            \
+    const double q = t - TE_ROUND;                                                   \
+    const te_bits32 qi = (te_bits32)as_bits(t);                                      \
+    const float r = (float)(((double)(x) - q * 1.57079632673412561417e+00)           \
+                                         - q * 6.07710050630396597660e-11);          \
+    const float z = r * r;                                                           \
+    const float s = r + r * z * (-1.6666654611e-1f + z * (8.3321608736e-3f           \
+        + z * -1.9515295891e-4f));                                                   \
+    const float c = 1.0f - 0.5f * z + z * z * (4.166664568298827e-2f                 \
+        + z * (-1.388731625493765e-3f + z * 2.443315711809948e-5f))
+
+#define TE_SELECT_F(mask, a, b) from_bits32((as_bits32(a) & (mask)) | (as_bits32(b) & ~(mask)))
+
+TE_SIMD static void vsinf_core(float *d, const float *a, size_t m) {
+    size_t k;
+    for (k = 0; k < m; ++k) {
+        TE_TRIG_REDUCE_F(a[k]);
+        const te_bits32 odd = 0 - (qi & 1);
+        d[k] = from_bits32(as_bits32(TE_SELECT_F(odd, c, s)) ^ ((qi & 2) << 30));
+    }
+}
+
+TE_SIMD static void vcosf_core(float *d, const float *a, size_t m) {
+    size_t k;
+    for (k = 0; k < m; ++k) {
+        TE_TRIG_REDUCE_F(a[k]);
+        const te_bits32 odd = 0 - (qi & 1);
+        d[k] = from_bits32(as_bits32(TE_SELECT_F(odd, s, c)) ^ (((qi + 1) & 2) << 30));
+    }
+}
+
+TE_SIMD static void vtanf_core(float *d, const float *a, size_t m) {
+    size_t k;
+    for (k = 0; k < m; ++k) {
+        TE_TRIG_REDUCE_F(a[k]);
+        const te_bits32 odd = 0 - (qi & 1);
+        d[k] = from_bits32(as_bits32(TE_SELECT_F(odd, c, s) / TE_SELECT_F(odd, s, c)) ^ ((qi & 1) << 31));
+    }
+}
+
+TE_SIMD static void vexpf_core(float *d, const float *a, size_t m) {
+    size_t k;
+    for (k = 0; k < m; ++k) {
+        const float x = a[k];
+        const float t = x * 1.44269504f + TE_ROUND_F;
+        const float q = t - TE_ROUND_F;
+        const float r = (x - q * 0.693359375f) + q * 2.12194440e-4f;
+        const float p = 1.0f + r + r * r * (5.0000001201e-1f + r * (1.6666665459e-1f + r * (4.1665795894e-2f
+            + r * (8.3334519073e-3f + r * (1.3981999507e-3f + r * 1.9875691500e-4f)))));
+        d[k] = p * from_bits32((as_bits32(t) + 127) << 23);
+    }
+}
+
+TE_SIMD static void vlogf_core(float *d, const float *a, size_t m) {
+    size_t k;
+    for (k = 0; k < m; ++k) {
+        /* Split into 2^e * m with m in [sqrt(2)/2, sqrt(2)). */
+        const te_bits32 ib = as_bits32(a[k]);
+        const float m0 = from_bits32((ib & 0x007fffffU) | 0x3f800000U);
+        const te_bits32 big = as_bits32(m0) > as_bits32(1.41421356f);
+        const float f = from_bits32(as_bits32(m0) - (big << 23)) - 1.0f;
+        const float e = from_bits32((ib >> 23) - 127 + big + as_bits32(TE_ROUND_F)) - TE_ROUND_F;
+        const float s = f / (2.0f + f);
+        const float z = s * s;
+        const float w = z * z;
+        const float R = z * (6.6666662693e-01f + w * 2.8498786688e-01f)
+                      + w * (4.0000972152e-01f + w * 2.4279078841e-01f);
+        const float hfsq = 0.5f * f * f;
+        d[k] = e * 6.9313812256e-01f - ((hfsq - (s * (hfsq + R) + e * 9.0580006145e-06f)) - f);
+    }
+}
+
+TE_SIMD static void vlog10f_core(float *d, const float *a, size_t m) {
+    size_t k;
+    vlogf_core(d, a, m);
+    for (k = 0; k < m; ++k) {
+        d[k] *= 4.34294481903e-01f;
+    }
+}
+
+static void kernel_float(void (*core)(float*, const float*, size_t), double (*fallback)(double),
+                         float lo, float hi, float *d, const float *a, size_t m) {
+    /* The core works on a copy of the input so that d may alias a. */
+    float in[TE_KERNEL_CHUNK];
+    size_t i, k, c;
+
+    for (i = 0; i < m; i += c) {
+        c = m - i < TE_KERNEL_CHUNK ? m - i : TE_KERNEL_CHUNK;
+        memcpy(in, a + i, sizeof(float) * c);
+        core(d + i, in, c);
+        for (k = 0; k < c; ++k) {
+            /* Zeros go to libm as well, which keeps the sign of sin(-0). */
+            if (!(in[k] >= lo && in[k] <= hi) || in[k] == 0) d[i + k] = (float)fallback(in[k]);
+        }
+    }
+}
+
+#undef TE_TRIG_REDUCE_F
+#undef TE_SELECT_F
+
+
+static void eval_builtin_float(int op, float *out, const float *in, size_t m) {
+    /* te_eval_builtin for floats. */
+    size_t i;
+    switch (op) {
+        case TE_OP_SIN: kernel_float(vsinf_core, sin, (float)-TE_MAX_TRIG, (float)TE_MAX_TRIG, out, in, m); break;
+        case TE_OP_COS: kernel_float(vcosf_core, cos, (float)-TE_MAX_TRIG, (float)TE_MAX_TRIG, out, in, m); break;
+        case TE_OP_TAN: kernel_float(vtanf_core, tan, (float)-TE_MAX_TRIG, (float)TE_MAX_TRIG, out, in, m); break;
+        case TE_OP_EXP: kernel_float(vexpf_core, exp, -87.0f, 88.0f, out, in, m); break;
+        case TE_OP_LN: kernel_float(vlogf_core, log, FLT_MIN, FLT_MAX, out, in, m); break;
+        case TE_OP_LOG10: kernel_float(vlog10f_core, log10, FLT_MIN, FLT_MAX, out, in, m); break;
+        default: for (i = 0; i < m; ++i) out[i] = NAN; break;
+    }
+}
+
+
+/* Points per block in te_eval_batch; each register holds one block. */
+#define TE_BATCH 256
+#define TE_LOCAL_BATCH_REGISTERS 8
+#define TE_FUN(...) ((double(*)(__VA_ARGS__))ip->function)
+#define LOOP(EXPR) for (k = 0; k < m; ++k) d[k] = (EXPR)
+#define M(e) (r[p->args[ip->a + (e)]][k])
+
+TE_SIMD static void batch_block(const te_program *p, const te_instr *code, int length,
+                                const double *frame, const double *const *columns, int column_count,
+                                size_t base, double *store, const double **r, size_t m) {
+    const te_instr *ip, *end;
+    size_t k;
+
+    for (ip = code, end = code + length; ip != end; ++ip) {
+        const double *a, *b;
+        double *d = store + (size_t)ip->dst * TE_BATCH;
+
+        /* Variables alias the caller's arrays; everything else owns a block. */
+        if (ip->op == TE_OP_VARIABLE) {
+            if (ip->a >= 0 && ip->a < column_count && columns[ip->a]) {
+                r[ip->dst] = columns[ip->a] + base;
+            } else {
+                const double v = frame && ip->a >= 0 ? frame[ip->a] : *ip->bound;
+                for (k = 0; k < m; ++k) d[k] = v;
+                r[ip->dst] = d;
+            }
+            continue;
+        }
+
+        /* Calls of arity > 2 keep an index into args in a. */
+        a = ip->op >= TE_OP_FUNCTION0 && ((ip->op - TE_OP_FUNCTION0) & 7) > 2 ? 0 : r[ip->a];
+        b = r[ip->b];
+
+        switch (ip->op) {
+            case TE_OP_CONSTANT: LOOP(ip->value); break;
+            case TE_OP_ADD: LOOP(a[k] + b[k]); break;
+            case TE_OP_SUB: LOOP(a[k] - b[k]); break;
+            case TE_OP_MUL: LOOP(a[k] * b[k]); break;
+            case TE_OP_DIV: LOOP(a[k] / b[k]); break;
+            case TE_OP_MOD: LOOP(fmod(a[k], b[k])); break;
+            case TE_OP_POW: LOOP(pow(a[k], b[k])); break;
+            case TE_OP_NEG: LOOP(-a[k]); break;
+            case TE_OP_ABS: LOOP(fabs(a[k])); break;
+            case TE_OP_SQRT: LOOP(sqrt(a[k])); break;
+            case TE_OP_FLOOR: LOOP(floor(a[k])); break;
+            case TE_OP_CEIL: LOOP(ceil(a[k])); break;
+            case TE_OP_SIN: case TE_OP_COS: case TE_OP_TAN:
+            case TE_OP_EXP: case TE_OP_LN: case TE_OP_LOG10:
+                te_eval_builtin(ip->op, d, a, m);
+                break;
+
+            case TE_OP_FUNCTION0: LOOP(TE_FUN(void)()); break;
+            case TE_OP_FUNCTION1: LOOP(TE_FUN(double)(a[k])); break;
+            case TE_OP_FUNCTION2: LOOP(TE_FUN(double, double)(a[k], b[k])); break;
+            case TE_OP_FUNCTION3: LOOP(TE_FUN(double, double, double)(M(0), M(1), M(2))); break;
+            case TE_OP_FUNCTION4: LOOP(TE_FUN(double, double, double, double)(M(0), M(1), M(2), M(3))); break;
+            case TE_OP_FUNCTION5: LOOP(TE_FUN(double, double, double, double, double)(M(0), M(1), M(2), M(3), M(4))); break;
+            case TE_OP_FUNCTION6: LOOP(TE_FUN(double, double, double, double, double, double)(M(0), M(1), M(2), M(3), M(4), M(5))); break;
+            case TE_OP_FUNCTION7: LOOP(TE_FUN(double, double, double, double, double, double, double)(M(0), M(1), M(2), M(3), M(4), M(5), M(6))); break;
+
+            case TE_OP_CLOSURE0: LOOP(TE_FUN(void*)(ip->context)); break;
+            case TE_OP_CLOSURE1: LOOP(TE_FUN(void*, double)(ip->context, a[k])); break;
+            case TE_OP_CLOSURE2: LOOP(TE_FUN(void*, double, double)(ip->context, a[k], b[k])); break;
+            case TE_OP_CLOSURE3: LOOP(TE_FUN(void*, double, double, double)(ip->context, M(0), M(1), M(2))); break;
+            case TE_OP_CLOSURE4: LOOP(TE_FUN(void*, double, double, double, double)(ip->context, M(0), M(1), M(2), M(3))); break;
+            case TE_OP_CLOSURE5: LOOP(TE_FUN(void*, double, double, double, double, double)(ip->context, M(0), M(1), M(2), M(3), M(4))); break;
+            case TE_OP_CLOSURE6: LOOP(TE_FUN(void*, double, double, double, double, double, double)(ip->context, M(0), M(1), M(2), M(3), M(4), M(5))); break;
+            case TE_OP_CLOSURE7: LOOP(TE_FUN(void*, double, double, double, double, double, double, double)(ip->context, M(0), M(1), M(2), M(3), M(4), M(5), M(6))); break;
+
+            default: LOOP(NAN); break;
+        }
+        r[ip->dst] = d;
+    }
+}
+
+#undef TE_FUN
+#undef LOOP
+#undef M
+
+
+static int op_reads(const te_program *p, const te_instr *ip, int *regs) {
+    /* Stores the registers ip reads in regs and returns how many there are. */
+    int *slots[7];
+    const int count = fl_operands((te_program*)p, (te_instr*)ip, slots);
+    int i;
+    for (i = 0; i < count; ++i) regs[i] = *slots[i];
+    return count;
+}
+
+
+static int hoist(const te_program *p, const double *frame, const double *const *columns,
+                 const float *const *fcolumns, int column_count,
+                 te_instr *plan, int *writer, char *uniform, char *needed, double *r) {
+    /* Instructions whose inputs all come from the frame have the same value */
+    /* at every point. They are run once here, and plan gets the program with */
+    /* each such value that the rest still reads turned into a constant. */
+    /* The columns are doubles, or floats if columns is NULL. */
+    /* Returns the plan's length, or -1 if there was nothing worth hoisting. */
+    const te_instr *ip;
+    int regs[7];
+    int i, j, count, length = 0, hoisted = 0;
+
+    for (i = 0; i < p->registers; ++i) writer[i] = -1;
+
+    for (i = 0; i < p->length; ++i) {
+        ip = p->code + i;
+        needed[i] = 0;
+        if (ip->op == TE_OP_VARIABLE) {
+            uniform[i] = !(ip->a >= 0 && ip->a < column_count &&
+                           (columns ? columns[ip->a] != 0 : fcolumns[ip->a] != 0));
+        } else {
+            uniform[i] = (char)ip->pure;
+            count = op_reads(p, ip, regs);
+            for (j = 0; j < count; ++j) {
+                if (writer[regs[j]] < 0 || !uniform[writer[regs[j]]]) uniform[i] = 0;
+            }
+            if (!uniform[i]) {
+                for (j = 0; j < count; ++j) {
+                    if (writer[regs[j]] >= 0) needed[writer[regs[j]]] = 1;
+                }
+            }
+            if (uniform[i] && ip->op != TE_OP_CONSTANT) ++hoisted;
+        }
+        writer[ip->dst] = i;
+    }
+    if (!hoisted) return -1;
+    needed[writer[p->result]] = 1;
+
+    for (i = 0; i < p->length; ++i) {
+        ip = p->code + i;
+        if (!uniform[i]) {
+            plan[length++] = *ip;
+            continue;
+        }
+        if (ip->op >= TE_OP_SIN && ip->op <= TE_OP_LOG10) {
+            /* The kernel a column goes through, so that the value does */
+            /* not depend on how the variable was passed. */
+            te_eval_builtin(ip->op, &r[ip->dst], &r[ip->a], 1);
+        } else {
+            r[ip->dst] = step(p, ip, r, frame);
+        }
+        if (needed[i]) {
+            plan[length] = *ip;
+            plan[length].op = TE_OP_CONSTANT;
+            plan[length].a = plan[length].b = 0;
+            plan[length].value = r[ip->dst];
+            ++length;
+        }
+    }
+    return length;
+}
+
+
+#define TE_LOCAL_PLAN 64
+
+static const te_instr *batch_plan(const te_program *p, const double *frame, const double *const *columns,
+                                  const float *const *fcolumns, int column_count,
+                                  te_instr *plan_local, void **scratch, int *length) {
+    /* The code to run over the points: a plan with the uniform part hoisted */
+    /* out, or the program itself. Hoisting needs scratch proportional to the */
+    /* program; large programs take it from the heap, left in *scratch for */
+    /* the caller to free, and fall back to running unhoisted without it. */
+    int writer_local[TE_LOCAL_PLAN];
+    char uniform_local[TE_LOCAL_PLAN], needed_local[TE_LOCAL_PLAN];
+    double scalar_local[TE_LOCAL_PLAN];
+    te_instr *plan = plan_local;
+
+    *scratch = 0;
+    if (p->length <= TE_LOCAL_PLAN && p->registers <= TE_LOCAL_PLAN) {
+        *length = hoist(p, frame, columns, fcolumns, column_count, plan_local, writer_local, uniform_local, needed_local, scalar_local);
+    } else {
+        *scratch = malloc((sizeof(te_instr) + 2) * p->length + (sizeof(int) + sizeof(double)) * p->registers);
+        plan = *scratch;
+        *length = -1;
+        if (plan) {
+            double *scalar = (double*)(plan + p->length);
+            int *writer = (int*)(scalar + p->registers);
+            char *uniform = (char*)(writer + p->registers);
+            *length = hoist(p, frame, columns, fcolumns, column_count, plan, writer, uniform, uniform + p->length, scalar);
+        }
+    }
+    if (*length >= 0) return plan;
+    *length = p->length;
+    return p->code;
+}
+
+
+static void batch_eval(const te_program *p, const double *frame, const double *const *columns, int column_count,
+                       double *out, size_t n) {
+    double local[TE_LOCAL_BATCH_REGISTERS * TE_BATCH];
+    const double *rlocal[TE_LOCAL_BATCH_REGISTERS];
+    te_instr plan_local[TE_LOCAL_PLAN];
+    double *store = local;
+    const double **r = rlocal;
+    const te_instr *code;
+    void *scratch;
+    int length;
+    size_t i, m;
+
+    if (!p) {
+        for (i = 0; i < n; ++i) out[i] = NAN;
+        return;
+    }
+
+    code = batch_plan(p, frame, columns, 0, column_count, plan_local, &scratch, &length);
+
+    if (p->registers > TE_LOCAL_BATCH_REGISTERS) {
+        store = malloc(sizeof(double) * TE_BATCH * p->registers);
+        r = malloc(sizeof(double*) * p->registers);
+        if (!store || !r) {
+            free(store);
+            free(r);
+            free(scratch);
+            for (i = 0; i < n; ++i) out[i] = NAN;
+            return;
+        }
+    }
+
+    for (i = 0; i < (size_t)p->registers; ++i) {
+        r[i] = store + i * TE_BATCH;
+    }
+
+    for (i = 0; i < n; i += m) {
+        m = n - i < TE_BATCH ? n - i : TE_BATCH;
+        batch_block(p, code, length, frame, columns, column_count, i, store, r, m);
+        memmove(out + i, r[p->result], sizeof(double) * m);
+    }
+
+    free(scratch);
+    if (store != local) {
+        free(store);
+        free(r);
+    }
+}
+
+
+void te_eval_batch(const te_program *p, const double *xs, const double *ys, double *out, size_t n) {
+    const double *columns[2];
+    columns[0] = xs;
+    columns[1] = ys;
+    batch_eval(p, 0, columns, 2, out, n);
+}
+
+
+void te_eval_batch_frame(const te_program *p, const double *frame, const double *const *columns, double *out, size_t n) {
+    batch_eval(p, frame, columns, columns && p ? p->slots : 0, out, n);
+}
+
+
+static int narrow_call(const te_instr *ip) {
+    /* Calls worked out lane by lane in double and rounded to float. The */
+    /* rest of the calls, fac, ncr, npr, sinh, cosh and the caller's own */
+    /* among them, can overflow or lose their digits in float, so */
+    /* te_eval_batch_float gives them, and everything after them, doubles. */
+    if (!ip->pure) return 0;
+    if (ip->op == TE_OP_FUNCTION1) {
+        return ip->function == (const void*)asin || ip->function == (const void*)acos ||
+               ip->function == (const void*)atan || ip->function == (const void*)tanh;
+    }
+    return ip->op == TE_OP_FUNCTION2 && ip->function == (const void*)atan2;
+}
+
+
+static int float_fits(double v) {
+    /* Nonzero unless v is finite and too large for a float. */
+    return !(v - v == 0 && fabs(v) > FLT_MAX);
+}
+
+
+static void mark_wide(const te_program *p, const te_instr *code, int length, const double *frame,
+                      const float *const *columns, int column_count, char *wide, char *register_wide) {
+    /* Marks the instructions te_eval_batch_float runs in double. */
+    int regs[7];
+    int i, j, count;
+
+    for (i = 0; i < p->registers; ++i) register_wide[i] = 0;
+
+    for (i = 0; i < length; ++i) {
+        const te_instr *ip = code + i;
+        int w;
+        switch (ip->op) {
+            case TE_OP_CONSTANT: w = !float_fits(ip->value); break;
+            case TE_OP_VARIABLE:
+                w = !(ip->a >= 0 && ip->a < column_count && columns[ip->a]) &&
+                    !float_fits(frame && ip->a >= 0 ? frame[ip->a] : *ip->bound);
+                break;
+            default: w = ip->op >= TE_OP_FUNCTION0 && !narrow_call(ip); break;
+        }
+        count = op_reads(p, ip, regs);
+        for (j = 0; j < count; ++j) w |= register_wide[regs[j]];
+        wide[i] = (char)w;
+        register_wide[ip->dst] = (char)w;
+    }
+}
+
+
+#define TE_FUN(...) ((double(*)(__VA_ARGS__))ip->function)
+#define LOOP(EXPR) for (k = 0; k < m; ++k) d[k] = (EXPR)
+
+TE_SIMD static void batch_block_float(const te_program *p, const te_instr *code, int length, const char *wide,
+                                      const double *frame, const float *const *columns, int column_count,
+                                      size_t base, float *store, const float **r,
+                                      double *wide_store, const double **wide_r, size_t m) {
+    /* batch_block in float. A register whose value is a float has a NULL */
+    /* wide_r; wide instructions widen such operands into their own */
+    /* register's double block before running through batch_block. */
+    const te_instr *ip, *end;
+    int regs[7];
+    size_t k;
+    int i, count;
+
+    for (ip = code, end = code + length; ip != end; ++ip) {
+        const float *a, *b;
+        float *d = store + (size_t)ip->dst * TE_BATCH;
+
+        if (wide[ip - code]) {
+            count = op_reads(p, ip, regs);
+            for (i = 0; i < count; ++i) {
+                if (!wide_r[regs[i]]) {
+                    double *w = wide_store + (size_t)regs[i] * TE_BATCH;
+                    a = r[regs[i]];
+                    for (k = 0; k < m; ++k) w[k] = a[k];
+                    wide_r[regs[i]] = w;
+                }
+            }
+            batch_block(p, ip, 1, frame, 0, 0, base, wide_store, wide_r, m);
+            continue;
+        }
+        wide_r[ip->dst] = 0;
+
+        if (ip->op == TE_OP_VARIABLE) {
+            if (ip->a >= 0 && ip->a < column_count && columns[ip->a]) {
+                r[ip->dst] = columns[ip->a] + base;
+            } else {
+                const float v = (float)(frame && ip->a >= 0 ? frame[ip->a] : *ip->bound);
+                for (k = 0; k < m; ++k) d[k] = v;
+                r[ip->dst] = d;
+            }
+            continue;
+        }
+
+        /* Narrow calls have at most two arguments. */
+        a = r[ip->a];
+        b = r[ip->b];
+
+        switch (ip->op) {
+            case TE_OP_CONSTANT: LOOP((float)ip->value); break;
+            case TE_OP_ADD: LOOP(a[k] + b[k]); break;
+            case TE_OP_SUB: LOOP(a[k] - b[k]); break;
+            case TE_OP_MUL: LOOP(a[k] * b[k]); break;
+            case TE_OP_DIV: LOOP(a[k] / b[k]); break;
+            case TE_OP_MOD: LOOP((float)fmod(a[k], b[k])); break;
+            case TE_OP_POW: LOOP((float)pow(a[k], b[k])); break;
+            case TE_OP_NEG: LOOP(-a[k]); break;
+            case TE_OP_ABS: LOOP((float)fabs(a[k])); break;
+            case TE_OP_SQRT: LOOP((float)sqrt(a[k])); break;
+            case TE_OP_FLOOR: LOOP((float)floor(a[k])); break;
+            case TE_OP_CEIL: LOOP((float)ceil(a[k])); break;
+            case TE_OP_SIN: case TE_OP_COS: case TE_OP_TAN:
+            case TE_OP_EXP: case TE_OP_LN: case TE_OP_LOG10:
+                eval_builtin_float(ip->op, d, a, m);
+                break;
+
+            case TE_OP_FUNCTION1: LOOP((float)TE_FUN(double)(a[k])); break;
+            case TE_OP_FUNCTION2: LOOP((float)TE_FUN(double, double)(a[k], b[k])); break;
+
+            default: LOOP(NAN); break;
+        }
+        r[ip->dst] = d;
+    }
+}
+
+#undef TE_FUN
+#undef LOOP
+
+
+void te_eval_batch_float(const te_program *p, const double *frame, const float *const *columns, float *out, size_t n) {
+    float local[TE_LOCAL_BATCH_REGISTERS * TE_BATCH];
+    double wide_local[TE_LOCAL_BATCH_REGISTERS * TE_BATCH];
+    const float *rlocal[TE_LOCAL_BATCH_REGISTERS];
+    const double *wide_rlocal[TE_LOCAL_BATCH_REGISTERS];
+    te_instr plan_local[TE_LOCAL_PLAN];
+    char marks_local[2 * TE_LOCAL_PLAN];
+    float *store = local;
+    double *wide_store = wide_local;
+    const float **r = rlocal;
+    const double **wide_r = wide_rlocal;
+    char *marks = marks_local;
+    const te_instr *code;
+    void *scratch;
+    int column_count, length, result_wide;
+    size_t i, k, m;
+
+    if (!p) {
+        for (i = 0; i < n; ++i) out[i] = NAN;
+        return;
+    }
+
+    column_count = columns ? p->slots : 0;
+    code = batch_plan(p, frame, 0, columns, column_count, plan_local, &scratch, &length);
+
+    if (length + p->registers > 2 * TE_LOCAL_PLAN) {
+        marks = malloc(length + p->registers);
+    }
+    if (p->registers > TE_LOCAL_BATCH_REGISTERS) {
+        store = malloc(sizeof(float) * TE_BATCH * p->registers);
+        wide_store = malloc(sizeof(double) * TE_BATCH * p->registers);
+        r = malloc(sizeof(float*) * p->registers);
+        wide_r = malloc(sizeof(double*) * p->registers);
+    }
+    if (!marks || !store || !wide_store || !r || !wide_r) {
+        for (i = 0; i < n; ++i) out[i] = NAN;
+        goto done;
+    }
+
+    mark_wide(p, code, length, frame, columns, column_count, marks, marks + length);
+    result_wide = marks[length + p->result];
+
+    for (i = 0; i < (size_t)p->registers; ++i) {
+        r[i] = store + i * TE_BATCH;
+        wide_r[i] = 0;
+    }
+
+    for (i = 0; i < n; i += m) {
+        m = n - i < TE_BATCH ? n - i : TE_BATCH;
+        batch_block_float(p, code, length, marks, frame, columns, column_count, i, store, r, wide_store, wide_r, m);
+        if (result_wide) {
+            for (k = 0; k < m; ++k) out[i + k] = (float)wide_r[p->result][k];
+        } else {
+            memmove(out + i, r[p->result], sizeof(float) * m);
+        }
+    }
+
+done:
+    free(scratch);
+    if (marks != marks_local) free(marks);
+    if (store != local) {
+        free(store);
+        free(wide_store);
+        free(r);
+        free(wide_r);
+    }
+}
+
+
 static void pn (const te_expr *n, int depth) {
     int i, arity;
     printf("%*s", depth, "");
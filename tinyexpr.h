@@ -26,6 +26,8 @@
 #define __TINYEXPR_H__
 
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -59,6 +61,48 @@ typedef struct te_variable {
 } te_variable;
 
 
+/* Flattened form of a compiled expression: a straight-line register program. */
+/* Each instruction reads its operand registers and writes register dst. */
+enum {
+    TE_OP_CONSTANT = 0, TE_OP_VARIABLE,
+    TE_OP_ADD, TE_OP_SUB, TE_OP_MUL, TE_OP_DIV, TE_OP_MOD, TE_OP_POW, TE_OP_NEG,
+
+    /* Builtins with vectorized batch kernels. */
+    TE_OP_ABS, TE_OP_SQRT, TE_OP_FLOOR, TE_OP_CEIL,
+    TE_OP_SIN, TE_OP_COS, TE_OP_TAN, TE_OP_EXP, TE_OP_LN, TE_OP_LOG10,
+
+    TE_OP_FUNCTION0 = 32, TE_OP_FUNCTION1, TE_OP_FUNCTION2, TE_OP_FUNCTION3,
+    TE_OP_FUNCTION4, TE_OP_FUNCTION5, TE_OP_FUNCTION6, TE_OP_FUNCTION7,
+
+    TE_OP_CLOSURE0 = 40, TE_OP_CLOSURE1, TE_OP_CLOSURE2, TE_OP_CLOSURE3,
+    TE_OP_CLOSURE4, TE_OP_CLOSURE5, TE_OP_CLOSURE6, TE_OP_CLOSURE7
+};
+
+typedef struct te_instr {
+    int op;
+    int dst;
+    int a, b; /* Operand registers; for calls of arity > 2, a indexes te_program.args. */
+              /* For TE_OP_VARIABLE, a is the variable's index in the lookup table. */
+    int pure; /* Nonzero if the instruction has no side effects. */
+    union {double value; const double *bound; const void *function;};
+    void *context;
+} te_instr;
+
+typedef struct te_program {
+    te_instr *code;
+    int length;
+    int *args;
+    int registers;
+    int result;
+    int slots; /* Size of the lookup table the program was flattened against. */
+} te_program;
+
+typedef struct te_interval {
+    double lo, hi; /* Bounds on every value that is not NaN; lo > hi if there are none. */
+    int nan; /* Nonzero if NaN may occur. */
+} te_interval;
+
+
 
 /* Parses the input expression, evaluates it, and frees it. */
 /* Returns NaN on error. */
@@ -78,6 +122,65 @@ void te_print(const te_expr *n);
 /* This is safe to call on NULL pointers. */
 void te_free(te_expr *n);
 
+/* Parses the input expression and flattens it into a register program. */
+/* Returns NULL on error. */
+te_program *te_compile_program(const char *expression, const te_variable *variables, int var_count, int *error);
+
+/* Flattens an already compiled expression. */
+/* Variables are numbered by their position in the lookup table. */
+te_program *te_flatten(const te_expr *n, const te_variable *variables, int var_count);
+
+/* Parses the input expression into a program whose variables are frame slots. */
+/* Each variable's slot is its position in the lookup table; addresses of */
+/* variables are ignored and the program must be evaluated with a frame. */
+/* Returns NULL on error. */
+te_program *te_compile_frame(const char *expression, const te_variable *variables, int var_count, int *error);
+
+/* Evaluates the program. */
+double te_program_eval(const te_program *p);
+
+/* Evaluates the program reading variable i from frame[i]. */
+/* Evaluation never writes to the program, so one program may be evaluated */
+/* from any number of threads at once, each with its own frame. */
+double te_program_eval_frame(const te_program *p, const double *frame);
+
+/* Bounds the program over a box, variable i ranging over frame[i]. */
+/* Every value te_program_eval_frame, the batch evaluators or the JIT could */
+/* give at a point of the box lies in the result. With a NULL frame, */
+/* variables are read through their addresses. Calls tinyexpr does not know */
+/* are unbounded and may be NaN. */
+te_interval te_program_bounds(const te_program *p, const te_interval *frame);
+
+/* Evaluates the program at n points, writing the results to out. */
+/* The batch evaluators take sin, cos, tan, exp, ln and log10 through the */
+/* kernels of te_eval_builtin, whether their argument varies or not. These */
+/* are not bit-exact with the C library, so results can differ in the last */
+/* bits from te_eval and te_program_eval, which call it. */
+/* xs and ys feed the first and second variables of the lookup table; */
+/* either may be NULL, in which case that variable is read through its address. */
+void te_eval_batch(const te_program *p, const double *xs, const double *ys, double *out, size_t n);
+
+/* Evaluates the program at n points, writing the results to out. */
+/* If columns is not NULL and columns[i] is not NULL, variable i takes its n */
+/* values from columns[i]; otherwise it takes the single value frame[i]. */
+/* columns, when given, has one entry per variable in the lookup table. */
+void te_eval_batch_frame(const te_program *p, const double *frame, const double *const *columns, double *out, size_t n);
+
+/* As te_eval_batch_frame, in single precision: columns and out are floats. */
+/* The part of the program that is the same at every point is still worked */
+/* out in double, as are calls float is not good enough for (fac, ncr, npr, */
+/* sinh, cosh and the caller's own functions), constants too large for a */
+/* float and everything computed from them; only the result is rounded. */
+void te_eval_batch_float(const te_program *p, const double *frame, const float *const *columns, float *out, size_t n);
+
+/* Evaluates one of the builtins with a vectorized kernel, TE_OP_SIN to TE_OP_LOG10, */
+/* at m points exactly as te_eval_batch does. out may alias in. */
+void te_eval_builtin(int op, double *out, const double *in, size_t m);
+
+/* Frees the program. */
+/* This is safe to call on NULL pointers. */
+void te_program_free(te_program *p);
+
 
 #ifdef __cplusplus
 }
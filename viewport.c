@@ -0,0 +1,141 @@
+/*===========================================================================*/
+/* The region of the plane an image shows, and the coordinates of its       */
+/* pixel columns and rows.                                                   */
+/*                                                                           */
+/* Each coordinate is computed from its index as min + (max - min)*k/n, so   */
+/* no error builds up across the image as it would adding a step at a time, */
+/* and the tables can be passed whole, or a stretch at a time, to the batch */
+/* evaluators.                                                               */
+/*===========================================================================*/
+#define _POSIX_C_SOURCE 200809L
+
+/*===========================================================================*/
+/* Includes                                                                  */
+/*===========================================================================*/
+#include <stdlib.h>
+#include <math.h>
+#include "viewport.h"
+
+/*===========================================================================*/
+/* Constants                                                                 */
+/*===========================================================================*/
+#define MAX_GRID_INDEX 1073741824.0  /* 2^30: pixel indices fit in a long   */
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+static void fillTable (double *,long int,double,double);
+
+/*===========================================================================*/
+/* Function: validRange                                                      */
+/* Returns 1 if min and max are finite and max is above min.                */
+/*===========================================================================*/
+int validRange ( double   min,
+                 double   max )
+{
+   return min - min == 0 && max - max == 0 && max > min &&
+          (max - min) - (max - min) == 0;
+}
+
+/*===========================================================================*/
+/* Function: createViewport                                                  */
+/* Sets up a width x height viewport onto [xMin,xMax] x [yMin,yMax] and its  */
+/* coordinate tables.  The ranges must satisfy validRange.  Returns 0, with  */
+/* nothing allocated, if memory runs out.                                    */
+/*===========================================================================*/
+int createViewport ( VIEWPORT   *view,
+                     long int    width,
+                     long int    height,
+                     double      xMin,
+                     double      xMax,
+                     double      yMin,
+                     double      yMax )
+{
+   view->xMin    = xMin;
+   view->xMax    = xMax;
+   view->yMin    = yMin;
+   view->yMax    = yMax;
+   view->width   = width;
+   view->height  = height;
+   view->xScale  = width/(xMax - xMin);
+   view->yScale  = height/(yMax - yMin);
+   view->columnX = (double *)malloc(sizeof(double)*(width+1));
+   view->rowY    = (double *)malloc(sizeof(double)*(height+1));
+   if ( !view->columnX || !view->rowY ){
+     destroyViewport(view);
+     return 0;
+   }
+
+   fillTable(view->columnX,width,xMin,xMax);
+   fillTable(view->rowY,height,yMin,yMax);
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: destroyViewport                                                 */
+/* Free the coordinate tables.                                               */
+/*===========================================================================*/
+void destroyViewport ( VIEWPORT   *view )
+{
+   free(view->columnX);
+   free(view->rowY);
+   view->columnX = NULL;
+   view->rowY    = NULL;
+}
+
+/*===========================================================================*/
+/* Function: viewportLevel                                                   */
+/* Returns 1 if the view lies on the pixel grid of a level: square pixels   */
+/* 2^-level units wide, every column edge at x = (column + k)*2^-level and  */
+/* every row edge at y = (row + k)*2^-level exactly.  Views that pan by      */
+/* whole pixels or zoom by powers of two then share their pixels' values.   */
+/*===========================================================================*/
+int viewportLevel ( const VIEWPORT   *view,
+                    int              *level,
+                    long int         *column,
+                    long int         *row )
+{
+   double      size = (view->xMax - view->xMin)/view->width;
+   double      cx;
+   double      cy;
+   long int    k;
+   int         exponent;
+
+   if ( frexp(size, &exponent) != 0.5 ||
+        size != (view->yMax - view->yMin)/view->height )
+      return 0;
+
+   cx = view->xMin/size;
+   cy = view->yMin/size;
+   if ( cx != floor(cx) || cy != floor(cy) || fabs(cx) > MAX_GRID_INDEX ||
+        fabs(cy) > MAX_GRID_INDEX )
+      return 0;
+
+   *level  = 1 - exponent;
+   *column = (long int)cx;
+   *row    = (long int)cy;
+   for (k=0; k<=view->width; k++)
+      if ( view->columnX[k] != ldexp((double)(*column + k), -*level) )
+         return 0;
+   for (k=0; k<=view->height; k++)
+      if ( view->rowY[k] != ldexp((double)(*row + k), -*level) )
+         return 0;
+   return 1;
+}
+
+/*===========================================================================*/
+/* Function: fillTable                                                       */
+/* Puts the n+1 edges of n equal steps from min to max into table; the last */
+/* is max exactly.                                                           */
+/*===========================================================================*/
+static void fillTable ( double     *table,
+                        long int    n,
+                        double      min,
+                        double      max )
+{
+   long int    k;
+
+   for (k=0; k<n; k++)
+      table[k] = min + (max - min)*k/n;
+   table[n] = max;
+}
@@ -0,0 +1,38 @@
+/*===========================================================================*/
+/* The region of the plane an image shows, and the coordinates of its       */
+/* pixel columns and rows.                                                   */
+/*===========================================================================*/
+#ifndef VIEWPORT_H
+#define VIEWPORT_H
+
+/*===========================================================================*/
+/* Structure definitions                                                     */
+/*===========================================================================*/
+/* x runs left to right across width columns and y bottom to top up height  */
+/* rows; the tables hold the coordinate of every pixel edge, so columnX[k]  */
+/* is the left edge of column k and columnX[width] is xMax                  */
+struct viewport_struct
+   {
+      double            xMin;
+      double            xMax;
+      double            yMin;
+      double            yMax;
+      long int          width;
+      long int          height;
+      double            xScale;      /* columns per unit of x       */
+      double            yScale;      /* rows per unit of y          */
+      double           *columnX;     /* width+1 entries             */
+      double           *rowY;        /* height+1 entries, bottom up */
+   };
+typedef struct viewport_struct VIEWPORT;
+
+/*===========================================================================*/
+/* Function prototypes                                                       */
+/*===========================================================================*/
+int     validRange       (double,double);
+int     createViewport   (VIEWPORT *,long int,long int,
+                          double,double,double,double);
+void    destroyViewport  (VIEWPORT *);
+int     viewportLevel    (const VIEWPORT *,int *,long int *,long int *);
+
+#endif